@@ -0,0 +1,653 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**	@file
+
+	Write-back block cache for the mass storage example.
+	
+	Sits between the SCSI layer and the block device. Single block writes
+	(FAT and directory sectors, typically rewritten many times during a
+	file copy) are kept in BLOCKCACHE_NUM_BLOCKS buffers and only written
+	to the block device when a buffer is needed for another block, when
+	BlockCacheFlush is called or after BLOCKCACHE_IDLE_MS without writes.
+	Writes of more than one block (file data) go straight through, as
+	they would only push the metadata out of the cache.
+	
+	Dirty blocks with adjacent block numbers are written together with
+	one multiple block write. To do so they are first moved next to each
+	other in the cache.
+	
+	Buffers are replaced in least recently used order.
+	
+	Reads and writes are submitted as block device requests with
+	BlockCacheSubmit. Requests that can be served from memory complete
+	right away, the others are passed on to the block device queue. The
+	cache writes back dirty blocks synchronously, which only happens for
+	single block writes and flushes.
+	
+	Reads are also watched for sequential streams: when a read starts at
+	the block following the previous read, BlockCachePoll speculatively
+	reads the next BLOCKCACHE_PREFETCH_BLOCKS blocks into a separate
+	prefetch buffer, in the background. It is called while the host is busy with the CSW and
+	the next CBW, so the next READ(10) of the stream finds its data there
+	instead of waiting for the card. A new window is only fetched when
+	the previous one was used up, so a stream that ends wastes at most
+	one window.
+*/
+
+#include <string.h>
+
+#include "type.h"
+#include "debug.h"
+
+#include "blockdev.h"
+#include "blockcache.h"
+
+
+#define BLOCKSIZE	512
+
+/** One cached block */
+typedef struct {
+	U32		dwBlock;		/**< block number */
+	U32		dwLastUse;		/**< value of dwUseCount at last access */
+	BOOL	fValid;			/**< buffer holds a block */
+	BOOL	fDirty;			/**< block must still be written */
+} TCacheEntry;
+
+static TCacheEntry	aEntries[BLOCKCACHE_NUM_BLOCKS];
+static U8			aabData[BLOCKCACHE_NUM_BLOCKS][BLOCKSIZE];
+
+static U32			dwUseCount;		/**< access counter for LRU replacement */
+static int			iNumDirty;		/**< number of dirty entries */
+static int			iIdleMs;		/**< time since the last write */
+
+static U8			abPrefetch[BLOCKCACHE_PREFETCH_BLOCKS * BLOCKSIZE] BLOCKDEV_BUF_ATTR;
+static U32			dwPrefetchFirst;	/**< first block in abPrefetch */
+static int			iPrefetchCount;		/**< number of blocks in abPrefetch */
+static U32			dwNextSeq;		/**< block following the last read */
+static BOOL			fStream;		/**< last read continued the previous one */
+static U32			dwNumBlocks;	/**< size of the device, in blocks */
+static TBlockDevReq	PrefetchReq;	/**< request filling abPrefetch */
+static BOOL			fPrefetchBusy;	/**< PrefetchReq is in the queue */
+static BOOL			fPrefetchStale;	/**< blocks of PrefetchReq were written since */
+
+static TBlockCacheStats	Stats;
+
+
+/**
+	Local function to find a block in the cache
+	
+	@param [in]	dwBlock		Block number
+	
+	@return index of the entry, or -1 if not cached
+ */
+static int CacheFind(U32 dwBlock)
+{
+	int i;
+	
+	for (i = 0; i < BLOCKCACHE_NUM_BLOCKS; i++) {
+		if (aEntries[i].fValid && (aEntries[i].dwBlock == dwBlock)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/**
+	Local function to find a dirty block in the cache
+	
+	@param [in]	dwBlock		Block number
+	
+	@return index of the entry, or -1 if not cached or clean
+ */
+static int CacheFindDirty(U32 dwBlock)
+{
+	int i;
+
+	i = CacheFind(dwBlock);
+	return ((i >= 0) && aEntries[i].fDirty) ? i : -1;
+}
+
+
+/**
+	Local function to exchange two cache entries, data included
+	
+	@param [in]	i, j		Entry indices
+ */
+static void CacheSwap(int i, int j)
+{
+	TCacheEntry	Entry;
+	U32			*pdwA, *pdwB, dw;
+	int			k;
+
+	if (i == j) {
+		return;
+	}
+	Entry = aEntries[i];
+	aEntries[i] = aEntries[j];
+	aEntries[j] = Entry;
+
+	pdwA = (U32 *)aabData[i];
+	pdwB = (U32 *)aabData[j];
+	for (k = 0; k < (BLOCKSIZE / 4); k++) {
+		dw = pdwA[k];
+		pdwA[k] = pdwB[k];
+		pdwB[k] = dw;
+	}
+}
+
+
+/**
+	Local function to check if two block ranges overlap
+	
+	@return TRUE if at least one block is in both ranges
+ */
+static BOOL Overlaps(U32 dwBlock1, int iCount1, U32 dwBlock2, int iCount2)
+{
+	return (dwBlock1 < (dwBlock2 + iCount2)) && (dwBlock2 < (dwBlock1 + iCount1));
+}
+
+
+/**
+	Local function to drop the prefetched blocks if they overlap with
+	blocks being written
+	
+	@param [in]	dwBlock		First block
+	@param [in]	iCount		Number of blocks
+ */
+static void PrefetchDrop(U32 dwBlock, int iCount)
+{
+	if (Overlaps(dwBlock, iCount, dwPrefetchFirst, iPrefetchCount)) {
+		iPrefetchCount = 0;
+	}
+	if (fPrefetchBusy && Overlaps(dwBlock, iCount, PrefetchReq.dwBlock, PrefetchReq.iCount)) {
+		fPrefetchStale = TRUE;
+	}
+}
+
+
+/**
+	Local function to write a dirty block together with the dirty blocks
+	adjacent to it
+	
+	@param [in]	iEntry		Index of a dirty entry
+	
+	@return TRUE if written successfully
+ */
+static BOOL CacheWriteRun(int iEntry)
+{
+	U32		dwFirst;
+	int		i, iCount, iStart;
+	BOOL	fOk;
+
+	// find the first and the number of blocks of the run
+	dwFirst = aEntries[iEntry].dwBlock;
+	while ((dwFirst > 0) && (CacheFindDirty(dwFirst - 1) >= 0)) {
+		dwFirst--;
+	}
+	iCount = 1;
+	while (CacheFindDirty(dwFirst + iCount) >= 0) {
+		iCount++;
+	}
+	
+	// line the blocks up in the first entries, in order
+	iStart = 0;
+	for (i = 0; i < iCount; i++) {
+		CacheSwap(iStart + i, CacheFind(dwFirst + i));
+	}
+	
+	DBG("w%d", iCount);
+	// a prefetch may have read the old data while the block was dirty
+	PrefetchDrop(dwFirst, iCount);
+	fOk = BlockDevWriteMulti(dwFirst, aabData[iStart], iCount);
+	if (fOk) {
+		for (i = 0; i < iCount; i++) {
+			aEntries[iStart + i].fDirty = FALSE;
+		}
+		iNumDirty -= iCount;
+	}
+	return fOk;
+}
+
+
+/**
+	Local function to find the entry to replace
+	
+	@return index of an unused entry, or else of the least recently used one
+ */
+static int CacheFindLRU(void)
+{
+	int i, iLRU;
+
+	iLRU = 0;
+	for (i = 0; i < BLOCKCACHE_NUM_BLOCKS; i++) {
+		if (!aEntries[i].fValid) {
+			return i;
+		}
+		if (aEntries[i].dwLastUse < aEntries[iLRU].dwLastUse) {
+			iLRU = i;
+		}
+	}
+	return iLRU;
+}
+
+
+/**
+	Local function to get a buffer for a block, the least recently used
+	one is written back if needed.
+	
+	@return index of the free entry, or -1 if write back failed
+ */
+static int CacheAlloc(void)
+{
+	int i;
+
+	i = CacheFindLRU();
+	if (aEntries[i].fValid && aEntries[i].fDirty) {
+		if (!CacheWriteRun(i)) {
+			return -1;
+		}
+		// entries were moved while lining up the run
+		i = CacheFindLRU();
+	}
+	aEntries[i].fValid = FALSE;
+	return i;
+}
+
+
+/**
+	Initialises the cache, all entries become invalid
+ */
+void BlockCacheInit(void)
+{
+	int i;
+
+	for (i = 0; i < BLOCKCACHE_NUM_BLOCKS; i++) {
+		aEntries[i].fValid = FALSE;
+		aEntries[i].fDirty = FALSE;
+	}
+	dwUseCount = 0;
+	iNumDirty = 0;
+	iIdleMs = 0;
+	
+	iPrefetchCount = 0;
+	fPrefetchBusy = FALSE;
+	dwNextSeq = 0;
+	fStream = FALSE;
+	memset(&Stats, 0, sizeof(Stats));
+	
+	// prefetching stops at the end of the device
+	if (BlockDevGetSize(&dwNumBlocks)) {
+		dwNumBlocks /= BLOCKSIZE;
+	}
+	else {
+		dwNumBlocks = 0;
+	}
+}
+
+
+/**
+	Local function to take blocks from the prefetch buffer
+	
+	@param [in]		dwBlock		First block
+	@param [out]	pbBuf		Buffer for iCount blocks
+	@param [in]		iCount		Number of blocks
+	
+	@return number of leading blocks copied from the prefetch buffer
+ */
+static int PrefetchTake(U32 dwBlock, U8 *pbBuf, int iCount)
+{
+	int iCopy;
+
+	if ((iPrefetchCount == 0) || (dwBlock < dwPrefetchFirst) ||
+		(dwBlock >= (dwPrefetchFirst + iPrefetchCount))) {
+		return 0;
+	}
+	iCopy = MIN(iCount, (int)(dwPrefetchFirst + iPrefetchCount - dwBlock));
+	memcpy(pbBuf, abPrefetch + (dwBlock - dwPrefetchFirst) * BLOCKSIZE,
+		iCopy * BLOCKSIZE);
+	return iCopy;
+}
+
+
+/**
+	Local function to copy the cached blocks of a range over the data read
+	from the device, cached blocks may be newer
+	
+	@param [in]	pReq		Request
+ */
+static void CacheOverlay(TBlockDevReq *pReq)
+{
+	int i, iEntry;
+
+	for (i = 0; i < pReq->iCount; i++) {
+		iEntry = CacheFind(pReq->dwBlock + i);
+		if (iEntry >= 0) {
+			memcpy(pReq->pbBuf + i * BLOCKSIZE, aabData[iEntry], BLOCKSIZE);
+			aEntries[iEntry].dwLastUse = ++dwUseCount;
+		}
+	}
+}
+
+
+/**
+	Local completion callback of device reads on behalf of a request
+	
+	@param [in]	pDevReq		Device request, pvContext is the request
+ */
+static void CacheReadDone(TBlockDevReq *pDevReq)
+{
+	TBlockDevReq	*pReq;
+	int				iEntry;
+
+	pReq = pDevReq->pvContext;
+	pReq->fOk = pDevReq->fOk;
+	BlockDevFreeReq(pDevReq);
+	
+	if (pReq->fOk) {
+		if ((pReq->iCount == 1) && (CacheFind(pReq->dwBlock) < 0)) {
+			// keep single blocks, they are probably file system metadata
+			iEntry = CacheAlloc();
+			if (iEntry >= 0) {
+				memcpy(aabData[iEntry], pReq->pbBuf, BLOCKSIZE);
+				aEntries[iEntry].dwBlock = pReq->dwBlock;
+				aEntries[iEntry].fDirty = FALSE;
+				aEntries[iEntry].fValid = TRUE;
+			}
+		}
+		CacheOverlay(pReq);
+	}
+	pReq->pfnDone(pReq);
+}
+
+
+/**
+	Local completion callback of device writes on behalf of a request
+	
+	@param [in]	pDevReq		Device request, pvContext is the request
+ */
+static void CacheWriteDone(TBlockDevReq *pDevReq)
+{
+	TBlockDevReq *pReq;
+
+	pReq = pDevReq->pvContext;
+	pReq->fOk = pDevReq->fOk;
+	BlockDevFreeReq(pDevReq);
+	pReq->pfnDone(pReq);
+}
+
+
+/**
+	Local function to submit a read request
+	
+	@param [in]	pReq		Request
+	
+	@return FALSE if the request has to be submitted again later
+ */
+static BOOL CacheSubmitRead(TBlockDevReq *pReq)
+{
+	TBlockDevReq	*pDevReq;
+	int				i, iPrefetched, iMissing, iLeft;
+	
+	// rather wait for a prefetch of these blocks than read them twice
+	if (fPrefetchBusy &&
+		Overlaps(pReq->dwBlock, pReq->iCount, PrefetchReq.dwBlock, PrefetchReq.iCount)) {
+		return FALSE;
+	}
+	
+	iPrefetched = PrefetchTake(pReq->dwBlock, pReq->pbBuf, pReq->iCount);
+	iLeft = pReq->iCount - iPrefetched;
+	iMissing = 0;
+	for (i = 0; i < iLeft; i++) {
+		if (CacheFind(pReq->dwBlock + iPrefetched + i) < 0) {
+			iMissing++;
+		}
+	}
+	pDevReq = NULL;
+	if (iMissing > 0) {
+		pDevReq = BlockDevAllocReq();
+		if (pDevReq == NULL) {
+			return FALSE;
+		}
+	}
+	
+	// sequential stream detection
+	fStream = (pReq->dwBlock == dwNextSeq);
+	dwNextSeq = pReq->dwBlock + pReq->iCount;
+	
+	Stats.dwPrefetchHits += iPrefetched;
+	Stats.dwCacheHits += iLeft - iMissing;
+	Stats.dwMisses += iMissing;
+	
+	if (pDevReq == NULL) {
+		// everything is in memory
+		CacheOverlay(pReq);
+		pReq->fOk = TRUE;
+		pReq->pfnDone(pReq);
+		return TRUE;
+	}
+	
+	// cached blocks in between are read too, and replaced when done
+	pDevReq->fWrite = FALSE;
+	pDevReq->dwBlock = pReq->dwBlock + iPrefetched;
+	pDevReq->pbBuf = pReq->pbBuf + iPrefetched * BLOCKSIZE;
+	pDevReq->iCount = iLeft;
+	pDevReq->pfnDone = CacheReadDone;
+	pDevReq->pvContext = pReq;
+	BlockDevSubmit(pDevReq);
+	return TRUE;
+}
+
+
+/**
+	Local function to submit a write request. A single block is kept in
+	the cache, more blocks are written to the device directly.
+	
+	@param [in]	pReq		Request
+	
+	@return FALSE if the request has to be submitted again later
+ */
+static BOOL CacheSubmitWrite(TBlockDevReq *pReq)
+{
+	TBlockDevReq	*pDevReq;
+	int				i, iEntry;
+	
+	if (pReq->iCount > 1) {
+		pDevReq = BlockDevAllocReq();
+		if (pDevReq == NULL) {
+			return FALSE;
+		}
+		iIdleMs = 0;
+		PrefetchDrop(pReq->dwBlock, pReq->iCount);
+		
+		// write through, cached copies become clean copies of the new data
+		for (i = 0; i < pReq->iCount; i++) {
+			iEntry = CacheFind(pReq->dwBlock + i);
+			if (iEntry >= 0) {
+				memcpy(aabData[iEntry], pReq->pbBuf + i * BLOCKSIZE, BLOCKSIZE);
+				if (aEntries[iEntry].fDirty) {
+					aEntries[iEntry].fDirty = FALSE;
+					iNumDirty--;
+				}
+			}
+		}
+		*pDevReq = *pReq;
+		pDevReq->pfnDone = CacheWriteDone;
+		pDevReq->pvContext = pReq;
+		BlockDevSubmit(pDevReq);
+		return TRUE;
+	}
+	
+	iIdleMs = 0;
+	PrefetchDrop(pReq->dwBlock, 1);
+	
+	pReq->fOk = FALSE;
+	iEntry = CacheFind(pReq->dwBlock);
+	if (iEntry < 0) {
+		iEntry = CacheAlloc();
+		if (iEntry >= 0) {
+			aEntries[iEntry].dwBlock = pReq->dwBlock;
+			aEntries[iEntry].fDirty = FALSE;
+			aEntries[iEntry].fValid = TRUE;
+		}
+	}
+	if (iEntry >= 0) {
+		memcpy(aabData[iEntry], pReq->pbBuf, BLOCKSIZE);
+		aEntries[iEntry].dwLastUse = ++dwUseCount;
+		if (!aEntries[iEntry].fDirty) {
+			aEntries[iEntry].fDirty = TRUE;
+			iNumDirty++;
+		}
+		pReq->fOk = TRUE;
+	}
+	pReq->pfnDone(pReq);
+	return TRUE;
+}
+
+
+/**
+	Submits a read or write request through the cache. The callback is
+	called from BlockDevPoll, or before returning if the request could be
+	handled in memory.
+	
+	@param [in]	pReq		Request, must stay valid until completion
+	
+	@return FALSE if the request was not accepted (no free request to pass
+	it on to the block device, or a prefetch of the same blocks is still
+	busy), submit it again later
+ */
+BOOL BlockCacheSubmit(TBlockDevReq *pReq)
+{
+	return pReq->fWrite ? CacheSubmitWrite(pReq) : CacheSubmitRead(pReq);
+}
+
+
+/**
+	Writes all dirty blocks to the block device
+	
+	@return TRUE if successful
+ */
+BOOL BlockCacheFlush(void)
+{
+	int i;
+
+	for (i = 0; (i < BLOCKCACHE_NUM_BLOCKS) && (iNumDirty > 0); i++) {
+		if (aEntries[i].fValid && aEntries[i].fDirty) {
+			if (!CacheWriteRun(i)) {
+				return FALSE;
+			}
+			// entries were moved, start over
+			i = -1;
+		}
+	}
+	return TRUE;
+}
+
+
+/**
+	Lets time pass for the idle flush, call this regularly from the
+	main loop.
+	
+	@param [in]	iMs			Milliseconds passed since the previous call
+ */
+void BlockCacheTick(int iMs)
+{
+	if (iNumDirty == 0) {
+		return;
+	}
+	iIdleMs += iMs;
+	if (iIdleMs >= BLOCKCACHE_IDLE_MS) {
+		DBG("idle flush\n");
+		BlockCacheFlush();
+		iIdleMs = 0;
+	}
+}
+
+
+/**
+	Local completion callback of the prefetch request
+	
+	@param [in]	pReq		PrefetchReq
+ */
+static void PrefetchDone(TBlockDevReq *pReq)
+{
+	fPrefetchBusy = FALSE;
+	if (!pReq->fOk) {
+		// the stream will be read on demand
+		fStream = FALSE;
+		return;
+	}
+	Stats.dwPrefetched += pReq->iCount;
+	if (!fPrefetchStale) {
+		dwPrefetchFirst = pReq->dwBlock;
+		iPrefetchCount = pReq->iCount;
+	}
+}
+
+
+/**
+	Reads ahead for a sequential read stream, the read is queued to the
+	block device. Call this from the main loop when no read is waiting
+	for the block device.
+	
+	@return TRUE if a read ahead was queued
+ */
+BOOL BlockCachePoll(void)
+{
+	if (fPrefetchBusy || !fStream || (dwNextSeq >= dwNumBlocks)) {
+		return FALSE;
+	}
+	// the current window is not used up yet
+	if ((iPrefetchCount > 0) && (dwNextSeq >= dwPrefetchFirst) &&
+		(dwNextSeq < (dwPrefetchFirst + iPrefetchCount))) {
+		return FALSE;
+	}
+	
+	iPrefetchCount = 0;
+	PrefetchReq.fWrite = FALSE;
+	PrefetchReq.dwBlock = dwNextSeq;
+	PrefetchReq.pbBuf = abPrefetch;
+	PrefetchReq.iCount = MIN(BLOCKCACHE_PREFETCH_BLOCKS, dwNumBlocks - dwNextSeq);
+	PrefetchReq.pfnDone = PrefetchDone;
+	DBG("p%d", PrefetchReq.iCount);
+	fPrefetchBusy = TRUE;
+	fPrefetchStale = FALSE;
+	BlockDevSubmit(&PrefetchReq);
+	return TRUE;
+}
+
+
+/**
+	Gets the read statistics since BlockCacheInit
+	
+	@param [out]	pStats		Statistics
+ */
+void BlockCacheGetStats(TBlockCacheStats *pStats)
+{
+	*pStats = Stats;
+}
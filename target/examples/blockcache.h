@@ -0,0 +1,55 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "type.h"
+#include "blockdev.h"
+
+#ifndef BLOCKCACHE_NUM_BLOCKS
+#define BLOCKCACHE_NUM_BLOCKS	8		/**< number of cached blocks */
+#endif
+#ifndef BLOCKCACHE_IDLE_MS
+#define BLOCKCACHE_IDLE_MS		500		/**< flush after this many ms without writes */
+#endif
+#ifndef BLOCKCACHE_PREFETCH_BLOCKS
+#define BLOCKCACHE_PREFETCH_BLOCKS	4	/**< blocks read ahead for sequential streams */
+#endif
+
+/** Read statistics, in blocks */
+typedef struct {
+	U32		dwPrefetchHits;	/**< taken from the prefetch buffer */
+	U32		dwCacheHits;	/**< taken from the cache */
+	U32		dwMisses;		/**< read from the device on demand */
+	U32		dwPrefetched;	/**< read ahead from the device */
+} TBlockCacheStats;
+
+void BlockCacheInit(void);
+BOOL BlockCacheSubmit(TBlockDevReq *pReq);
+BOOL BlockCacheFlush(void);
+void BlockCacheTick(int iMs);
+BOOL BlockCachePoll(void);
+void BlockCacheGetStats(TBlockCacheStats *pStats);
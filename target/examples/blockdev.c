@@ -0,0 +1,234 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2008 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**	@file
+
+	Request queue of the block device layer.
+	
+	Reads and writes are submitted as requests, which are handled one at
+	a time in submission order. BlockDevPoll, called from the main loop,
+	lets the device driver make progress through BlockDevStart and
+	BlockDevContinue, and calls the completion callback of a request when
+	the driver is done with it. The driver never blocks for long, so the
+	USB data phase can go on while the device is busy.
+	
+	Requests can be taken from a small pool, or be provided by the caller.
+	The synchronous functions are built on the same queue and wait for the
+	requests submitted before them.
+*/
+
+#include "type.h"
+#include "debug.h"
+
+#include "blockdev.h"
+
+
+static TBlockDevReq	aReqs[BLOCKDEV_NUM_REQS];
+static int			iReqsUsed;		/**< requests handed out at least once */
+static TBlockDevReq	*pReqFree;		/**< free list, linked through pNext */
+
+static TBlockDevReq	*pQueueHead;	/**< request being handled */
+static TBlockDevReq	*pQueueTail;
+static BOOL			fStarted;		/**< head request was started */
+
+
+/**
+	Allocates a request from the pool
+	
+	@return the request, or NULL if the pool is exhausted
+ */
+TBlockDevReq *BlockDevAllocReq(void)
+{
+	TBlockDevReq *pReq;
+
+	if (pReqFree != NULL) {
+		pReq = pReqFree;
+		pReqFree = pReq->pNext;
+	}
+	else if (iReqsUsed < BLOCKDEV_NUM_REQS) {
+		pReq = &aReqs[iReqsUsed++];
+	}
+	else {
+		return NULL;
+	}
+	return pReq;
+}
+
+
+/**
+	Returns a request to the pool
+	
+	@param [in]	pReq		Request, as returned by BlockDevAllocReq
+ */
+void BlockDevFreeReq(TBlockDevReq *pReq)
+{
+	ASSERT((pReq >= &aReqs[0]) && (pReq <= &aReqs[BLOCKDEV_NUM_REQS - 1]));
+
+	pReq->pNext = pReqFree;
+	pReqFree = pReq;
+}
+
+
+/**
+	Queues a request. Its callback is called from BlockDevPoll when the
+	request is done, with fOk set to the result.
+	
+	@param [in]	pReq		Request, must stay valid until completion
+ */
+void BlockDevSubmit(TBlockDevReq *pReq)
+{
+	pReq->pNext = NULL;
+	if (pQueueHead == NULL) {
+		pQueueHead = pReq;
+	}
+	else {
+		pQueueTail->pNext = pReq;
+	}
+	pQueueTail = pReq;
+}
+
+
+/**
+	Local function to take the head request off the queue and call its
+	callback. The callback may submit new requests.
+	
+	@param [in]	fOk			Result of the request
+ */
+static void BlockDevComplete(BOOL fOk)
+{
+	TBlockDevReq *pReq;
+
+	pReq = pQueueHead;
+	pQueueHead = pReq->pNext;
+	fStarted = FALSE;
+
+	pReq->fOk = fOk;
+	pReq->pfnDone(pReq);
+}
+
+
+/**
+	Lets the device handle queued requests and calls the callbacks of the
+	completed ones. Call this regularly from the main loop.
+ */
+void BlockDevPoll(void)
+{
+	while (pQueueHead != NULL) {
+		if (!fStarted) {
+			fStarted = TRUE;
+			if (!BlockDevStart(pQueueHead)) {
+				BlockDevComplete(FALSE);
+				continue;
+			}
+		}
+		switch (BlockDevContinue()) {
+		case BLOCKDEV_BUSY:
+			return;
+		case BLOCKDEV_DONE:
+			BlockDevComplete(TRUE);
+			break;
+		default:
+			BlockDevComplete(FALSE);
+			break;
+		}
+	}
+}
+
+
+/**
+	Checks if all submitted requests are done
+	
+	@return TRUE if the queue is empty
+ */
+BOOL BlockDevIsIdle(void)
+{
+	return (pQueueHead == NULL);
+}
+
+
+/**
+	Local completion callback of the synchronous functions
+ */
+static void BlockDevSyncDone(TBlockDevReq *pReq)
+{
+	*(BOOL *)pReq->pvContext = TRUE;
+}
+
+
+/**
+	Local function to submit a request and wait until it is done
+	
+	@return TRUE if successful
+ */
+static BOOL BlockDevTransfer(BOOL fWrite, U32 dwBlock, U8 *pbBuf, int iCount)
+{
+	TBlockDevReq	*pReq;
+	BOOL			fDone, fOk;
+
+	// completing queued requests frees pool entries
+	while ((pReq = BlockDevAllocReq()) == NULL) {
+		BlockDevPoll();
+	}
+	pReq->fWrite = fWrite;
+	pReq->dwBlock = dwBlock;
+	pReq->pbBuf = pbBuf;
+	pReq->iCount = iCount;
+	pReq->pfnDone = BlockDevSyncDone;
+	pReq->pvContext = &fDone;
+	fDone = FALSE;
+	BlockDevSubmit(pReq);
+	while (!fDone) {
+		BlockDevPoll();
+	}
+	fOk = pReq->fOk;
+	BlockDevFreeReq(pReq);
+	return fOk;
+}
+
+
+BOOL BlockDevWrite(U32 dwBlock, U8* pbBuf)
+{
+	return BlockDevTransfer(TRUE, dwBlock, pbBuf, 1);
+}
+
+
+BOOL BlockDevRead(U32 dwBlock, U8* pbBuf)
+{
+	return BlockDevTransfer(FALSE, dwBlock, pbBuf, 1);
+}
+
+
+BOOL BlockDevWriteMulti(U32 dwBlock, U8 *pbBuf, int iCount)
+{
+	return BlockDevTransfer(TRUE, dwBlock, pbBuf, iCount);
+}
+
+
+BOOL BlockDevReadMulti(U32 dwBlock, U8 *pbBuf, int iCount)
+{
+	return BlockDevTransfer(FALSE, dwBlock, pbBuf, iCount);
+}
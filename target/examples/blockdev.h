@@ -25,12 +25,62 @@
 	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef _BLOCKDEV_H_
+#define _BLOCKDEV_H_
+
 #include "type.h"
 
+#ifndef BLOCKDEV_NUM_REQS
+#define BLOCKDEV_NUM_REQS	8		/**< number of requests in the pool */
+#endif
+
+/** placement of the block buffers, the GPDMA can only reach AHB RAM */
+#ifdef BLOCKDEV_DMA
+#define BLOCKDEV_BUF_ATTR	__attribute__ ((section(".usbdma"), aligned(4)))
+#else
+#define BLOCKDEV_BUF_ATTR
+#endif
+
+/** return values of BlockDevContinue */
+#define BLOCKDEV_BUSY		0		/**< request still in progress */
+#define BLOCKDEV_DONE		1		/**< request completed */
+#define BLOCKDEV_ERROR		2		/**< request failed */
+
+typedef struct TBlockDevReq TBlockDevReq;
+
+/** completion callback, called from BlockDevPoll */
+typedef void (TFnBlockDevDone)(TBlockDevReq *pReq);
+
+/** Block device request */
+struct TBlockDevReq {
+	TBlockDevReq	*pNext;		/**< queue link, owned by the block device */
+	BOOL			fWrite;		/**< TRUE to write, FALSE to read */
+	U32				dwBlock;	/**< first block */
+	U8				*pbBuf;		/**< data of iCount blocks */
+	int				iCount;		/**< number of blocks */
+	BOOL			fOk;		/**< result, valid in the callback */
+	TFnBlockDevDone	*pfnDone;	/**< completion callback */
+	void			*pvContext;	/**< for use by the submitter */
+};
 
 BOOL BlockDevInit(void);
+BOOL BlockDevGetSize(U32 *pdwDriveSize);
+
+// asynchronous interface
+TBlockDevReq *BlockDevAllocReq(void);
+void BlockDevFreeReq(TBlockDevReq *pReq);
+void BlockDevSubmit(TBlockDevReq *pReq);
+void BlockDevPoll(void);
+BOOL BlockDevIsIdle(void);
 
+// synchronous interface, waits for the queued requests too
 BOOL BlockDevWrite(U32 dwBlock, U8* pbBuf);
 BOOL BlockDevRead(U32 dwBlock, U8* pbBuf);
+BOOL BlockDevWriteMulti(U32 dwBlock, U8 *pbBuf, int iCount);
+BOOL BlockDevReadMulti(U32 dwBlock, U8 *pbBuf, int iCount);
 
-BOOL BlockDevGetSize(U32 *pdwDriveSize);
+// implemented by the device driver, for use by blockdev.c only
+BOOL BlockDevStart(TBlockDevReq *pReq);
+int  BlockDevContinue(void);
+
+#endif /* _BLOCKDEV_H_ */
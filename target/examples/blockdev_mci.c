@@ -0,0 +1,610 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2008 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+	Block device on the MCI of the LPC23xx, for SD cards on a 4 bit bus.
+	
+	Data moves between the MCI FIFO and memory by GPDMA, which can only
+	reach AHB RAM. Transfers to buffers in AHB RAM (see BLOCKDEV_BUF_ATTR)
+	use one multiple block command, other buffers are transferred one
+	block at a time through a bounce buffer.
+	
+	Select it with BLOCKDEV=mci in the Makefile.
+*/
+
+#include <string.h>			// memcpy
+
+#include "type.h"
+#include "debug.h"
+
+#include "lpc23xx.h"
+#include "hal.h"
+
+#include "blockdev.h"
+
+#define BLOCKSIZE		512
+#define MCI_MAX_BLOCKS	16		// blocks per command, limited by the DMA transfer size
+
+#define MCI_INIT_HZ		400000
+#define MCI_MAX_HZ		25000000	// MCI limit, also the card default speed
+#define MCI_INIT_TRIES	10000		// ACMD41 polls until the card is ready
+
+// PCONP bits
+#define PCSDC				(1 << 28)
+#define PCGPDMA				(1 << 29)
+
+// MCI_POWER
+#define MCI_PWR_UP			0x02
+#define MCI_PWR_ON			0x03
+
+// MCI_CLOCK
+#define MCI_CLK_ENABLE		(1 << 8)
+#define MCI_CLK_BYPASS		(1 << 10)
+#define MCI_CLK_WIDEBUS		(1 << 11)
+
+// MCI_COMMAND
+#define MCI_CMD_RESP		(1 << 6)
+#define MCI_CMD_LONGRSP		(1 << 7)
+#define MCI_CMD_ENABLE		(1 << 10)
+
+// MCI_STATUS
+#define MCI_CMD_CRC_FAIL	(1 << 0)
+#define MCI_DATA_CRC_FAIL	(1 << 1)
+#define MCI_CMD_TIMEOUT		(1 << 2)
+#define MCI_DATA_TIMEOUT	(1 << 3)
+#define MCI_TX_UNDERRUN		(1 << 4)
+#define MCI_RX_OVERRUN		(1 << 5)
+#define MCI_CMD_RESP_END	(1 << 6)
+#define MCI_CMD_SENT		(1 << 7)
+#define MCI_DATA_END		(1 << 8)
+#define MCI_START_BIT_ERR	(1 << 9)
+#define MCI_RX_DATA_AVLBL	(1 << 21)
+
+#define MCI_CMD_FLAGS		(MCI_CMD_CRC_FAIL | MCI_CMD_TIMEOUT | MCI_CMD_RESP_END | MCI_CMD_SENT)
+#define MCI_DATA_ERRORS		(MCI_DATA_CRC_FAIL | MCI_DATA_TIMEOUT | MCI_TX_UNDERRUN | \
+							 MCI_RX_OVERRUN | MCI_START_BIT_ERR)
+#define MCI_CLEAR_ALL		0x7FF
+
+// MCI_DATA_CTRL
+#define MCI_DATA_ENABLE		(1 << 0)
+#define MCI_DATA_FROM_CARD	(1 << 1)
+#define MCI_DATA_DMA		(1 << 3)
+#define MCI_DATA_BLOCK(x)	((x) << 4)	// log2 of the block size
+
+// GPDMA channel control
+#define DMA_SBSIZE_8		(2 << 12)	// bursts of 8 words, half the MCI FIFO
+#define DMA_DBSIZE_8		(2 << 15)
+#define DMA_SWIDTH_32		(2 << 18)
+#define DMA_DWIDTH_32		(2 << 21)
+#define DMA_SI				(1 << 26)
+#define DMA_DI				(1 << 27)
+
+// GPDMA channel configuration
+#define DMA_E				(1 << 0)
+#define DMA_SRC_PERIPH(x)	((x) << 1)
+#define DMA_DEST_PERIPH(x)	((x) << 6)
+#define DMA_M2P_PERIPH		(5 << 11)	// memory to MCI, the MCI ends the transfer
+#define DMA_P2M_PERIPH		(6 << 11)	// MCI to memory, the MCI ends the transfer
+
+#define DMA_MCI				4			// GPDMA request line
+#define DMA_CH0				(1 << 0)
+
+// the GPDMA can only access the AHB RAMs (USB and ethernet RAM)
+#define IS_AHB_RAM(p)		((((U32)(p) - 0x7FD00000) < 0x2000) || \
+							 (((U32)(p) - 0x7FE00000) < 0x4000))
+
+// commands
+#define CMD_GO_IDLE_STATE			0
+#define CMD_ALL_SEND_CID			2
+#define CMD_SEND_RELATIVE_ADDR		3
+#define CMD_SWITCH_FUNC				6			// ACMD6 is SET_BUS_WIDTH
+#define CMD_SELECT_CARD				7
+#define CMD_SEND_IF_COND			8
+#define CMD_SEND_CSD				9
+#define CMD_STOP_TRANSMISSION		12
+#define CMD_SEND_STATUS				13
+#define CMD_SET_BLOCKLEN			16
+#define CMD_READ_SINGLE_BLOCK		17
+#define CMD_READ_MULTIPLE_BLOCK		18
+#define CMD_SET_WR_BLK_ERASE_COUNT	23			// ACMD23
+#define CMD_WRITE_BLOCK				24
+#define CMD_WRITE_MULTIPLE_BLOCK	25
+#define CMD_SD_SEND_OP_COND			41			// ACMD41
+#define CMD_APP_CMD					55
+
+// response types
+#define RESP_NONE		0
+#define RESP_SHORT		1
+#define RESP_LONG		2
+
+// card status (R1), errors of the command itself
+#define STATUS_ERRORS			0xFD380000
+#define STATUS_READY_FOR_DATA	(1 << 8)
+#define STATUS_STATE(x)			(((x) >> 9) & 0xF)
+#define STATE_TRAN				4
+
+#define OCR_BUSY		0x80000000		// set when power up is done
+#define OCR_HCS			(1 << 30)
+#define OCR_VOLTAGES	0x00FF8000		// 2.7 - 3.6 V
+
+// state of the block transfer driven by BlockDevContinue
+typedef enum {
+	eMciIdle,
+	eMciData,			// data transfer in progress
+	eMciProgram			// card is programming written blocks
+} EMciState;
+
+static EMciState	eState;
+static BOOL			fHighCap;		// block addressing
+static U32			dwRCA;			// relative card address, in bits 31:16
+static int			iMciHz;			// bus clock
+
+// size of the card in bytes
+static U32			dwCardSize;
+
+// request in progress
+static BOOL			fXferWrite;
+static U32			dwXferBlock;	// next block
+static U8			*pbXferData;	// data of the next block
+static int			iXferLeft;		// blocks still to transfer
+static int			iXferCount;		// blocks of the command in progress
+static BOOL			fXferBounce;	// data goes through abBounce
+
+static U8			abBounce[BLOCKSIZE] __attribute__ ((section(".usbdma"), aligned(4)));
+
+
+// busy waits a little, for power and clock changes
+static void MCIDelay(int iCount)
+{
+	volatile int i;
+	
+	for (i = 0; i < iCount; i++);
+}
+
+
+// sets the bus clock to at most iHz and the MCI limit, returns the actual clock
+static int MCISetClock(int iHz)
+{
+	int		iClock, iDivider;
+	U32		dwClock;
+
+	// MCI runs on cclk, see BlockDevInit
+	iClock = HalSysGetCCLK();
+	iHz = MIN(iHz, MCI_MAX_HZ);
+	dwClock = (MCI_CLOCK & MCI_CLK_WIDEBUS) | MCI_CLK_ENABLE;
+	if (iHz >= iClock) {
+		dwClock |= MCI_CLK_BYPASS;
+	}
+	else {
+		// MCLK = PCLK / (2 * (ClkDiv + 1)), strictly round up
+		iDivider = (iClock + 2 * iHz - 1) / (2 * iHz);
+		iDivider = MIN(256, iDivider);
+		dwClock |= iDivider - 1;
+		iClock /= 2 * iDivider;
+	}
+	MCI_CLOCK = dwClock;
+	MCIDelay(100);
+	return iClock;
+}
+
+
+// sends a command and waits for its response, pdwResp gets 1 or 4 words.
+// Returns FALSE on timeout or CRC error.
+static BOOL MCICommand(int iCmd, U32 dwArg, int iResp, U32 *pdwResp)
+{
+	U32 dwCmd, dwStatus, dwDone;
+
+	MCI_CLEAR = MCI_CMD_FLAGS;
+	MCI_ARGUMENT = dwArg;
+	dwCmd = iCmd | MCI_CMD_ENABLE;
+	dwDone = MCI_CMD_SENT;
+	if (iResp != RESP_NONE) {
+		dwCmd |= MCI_CMD_RESP;
+		dwDone = MCI_CMD_RESP_END | MCI_CMD_TIMEOUT | MCI_CMD_CRC_FAIL;
+	}
+	if (iResp == RESP_LONG) {
+		dwCmd |= MCI_CMD_LONGRSP;
+	}
+	MCI_COMMAND = dwCmd;
+	
+	while (((dwStatus = MCI_STATUS) & dwDone) == 0);
+	MCI_COMMAND = 0;
+	MCI_CLEAR = MCI_CMD_FLAGS;
+	
+	if (dwStatus & MCI_CMD_TIMEOUT) {
+		return FALSE;
+	}
+	// the OCR response (R3) has no CRC
+	if ((dwStatus & MCI_CMD_CRC_FAIL) && (iCmd != CMD_SD_SEND_OP_COND)) {
+		DBG("CMD%d CRC error\n", iCmd);
+		return FALSE;
+	}
+	
+	if (pdwResp != NULL) {
+		pdwResp[0] = MCI_RESP0;
+		if (iResp == RESP_LONG) {
+			pdwResp[1] = MCI_RESP1;
+			pdwResp[2] = MCI_RESP2;
+			pdwResp[3] = MCI_RESP3;
+		}
+	}
+	return TRUE;
+}
+
+
+// sends an application specific command
+static BOOL MCIAppCommand(int iCmd, U32 dwArg, int iResp, U32 *pdwResp)
+{
+	return MCICommand(CMD_APP_CMD, dwRCA, RESP_SHORT, NULL) &&
+		   MCICommand(iCmd, dwArg, iResp, pdwResp);
+}
+
+
+// asks the card if it is ready for the next transfer,
+// returns BLOCKDEV_BUSY, BLOCKDEV_DONE or BLOCKDEV_ERROR
+static int MCIPollReady(void)
+{
+	U32 dwStatus;
+	
+	if (!MCICommand(CMD_SEND_STATUS, dwRCA, RESP_SHORT, &dwStatus)) {
+		DBG("CMD_SEND_STATUS failed\n");
+		return BLOCKDEV_ERROR;
+	}
+	if (dwStatus & STATUS_ERRORS) {
+		DBG("Card status error (0x%08X)\n", dwStatus);
+		return BLOCKDEV_ERROR;
+	}
+	if ((dwStatus & STATUS_READY_FOR_DATA) && (STATUS_STATE(dwStatus) == STATE_TRAN)) {
+		return BLOCKDEV_DONE;
+	}
+	return BLOCKDEV_BUSY;
+}
+
+
+static BOOL MCIWaitReady(void)
+{
+	int iRes;
+	
+	do {
+		iRes = MCIPollReady();
+	} while (iRes == BLOCKDEV_BUSY);
+	return (iRes == BLOCKDEV_DONE);
+}
+
+
+// gets iLen bits of a 128 bit response, starting at bit iMsb downwards
+static U32 MCIGetBits(const U32 *pdwResp, int iMsb, int iLen)
+{
+	U32 dwData;
+	int i;
+	
+	dwData = 0;
+	for (i = iMsb; i > (iMsb - iLen); i--) {
+		dwData = (dwData << 1) | ((pdwResp[(127 - i) / 32] >> (i % 32)) & 1);
+	}
+	return dwData;
+}
+
+
+// calculates the card size from the CSD
+static BOOL MCIGetSize(const U32 *pdwCSD)
+{
+	U32	c_size, num_blocks, block_size;
+	U8	csd_structure, c_size_mult, read_bl_len;
+
+	csd_structure =	MCIGetBits(pdwCSD, 127, 2);
+	switch (csd_structure) {
+	
+	case 0:
+		read_bl_len =	MCIGetBits(pdwCSD, 83, 4);
+		c_size =		MCIGetBits(pdwCSD, 73, 12);
+		c_size_mult =	MCIGetBits(pdwCSD, 49, 3);
+		num_blocks = (c_size + 1) * (4 << c_size_mult);
+		block_size = 1 << read_bl_len;
+		break;
+
+	case 1:
+		c_size =		MCIGetBits(pdwCSD, 69, 22);
+		num_blocks = (c_size + 1) * 512 * 1024;
+		block_size = 512;
+		break;
+		
+	default:
+		DBG("Invalid CSD structure (%d)!\n", csd_structure);
+		return FALSE;
+	}
+
+	dwCardSize = num_blocks * block_size;
+	return TRUE;
+}
+
+
+BOOL BlockDevInit(void)
+{
+	U32		adwResp[4], dwArg;
+	int		i;
+	BOOL	fV2;
+
+	// power up MCI and GPDMA, MCI runs on cclk
+	PCONP |= PCSDC | PCGPDMA;
+	PCLKSEL1 = (PCLKSEL1 & ~(3 << 24)) | (1 << 24);
+	GPDMA_CONFIG = 1;
+
+	// CLK P0.19, CMD P0.20, PWR P0.21, DAT0 P0.22, DAT1..3 P2.11..13
+	HalPinSelect(19, 2);
+	HalPinSelect(20, 2);
+	HalPinSelect(21, 2);
+	HalPinSelect(22, 2);
+	PINSEL4 = (PINSEL4 & ~(0x3F << 22)) | (0x2A << 22);
+
+	// polled, no interrupts
+	MCI_MASK0 = 0;
+	MCI_MASK1 = 0;
+	MCI_CLEAR = MCI_CLEAR_ALL;
+	MCI_DATA_CTRL = 0;
+	MCI_CLOCK = 0;
+	MCI_POWER = MCI_PWR_UP;
+	MCIDelay(10000);
+	MCI_POWER = MCI_PWR_ON;
+	
+	eState = eMciIdle;
+	dwRCA = 0;
+	iMciHz = MCISetClock(MCI_INIT_HZ);
+	// let the card see its 74 clocks
+	MCIDelay(10000);
+
+	MCICommand(CMD_GO_IDLE_STATE, 0, RESP_NONE, NULL);
+
+	// version 2 cards answer CMD8, they may be high capacity
+	dwArg = OCR_VOLTAGES;
+	fV2 = MCICommand(CMD_SEND_IF_COND, 0x1AA, RESP_SHORT, adwResp);
+	if (fV2) {
+		if ((adwResp[0] & 0xFFF) != 0x1AA) {
+			DBG("CMD_SEND_IF_COND bad response (0x%08X)\n", adwResp[0]);
+			return FALSE;
+		}
+		dwArg |= OCR_HCS;
+	}
+	
+	// wait until the card has powered up
+	for (i = 0; i < MCI_INIT_TRIES; i++) {
+		if (!MCIAppCommand(CMD_SD_SEND_OP_COND, dwArg, RESP_SHORT, adwResp)) {
+			DBG("ACMD41 failed, no SD card?\n");
+			return FALSE;
+		}
+		if (adwResp[0] & OCR_BUSY) {
+			break;
+		}
+	}
+	if (i == MCI_INIT_TRIES) {
+		DBG("Card does not power up\n");
+		return FALSE;
+	}
+	fHighCap = ((adwResp[0] & OCR_HCS) != 0);
+	
+	// identify, get the relative address and the size
+	if (!MCICommand(CMD_ALL_SEND_CID, 0, RESP_LONG, adwResp) ||
+		!MCICommand(CMD_SEND_RELATIVE_ADDR, 0, RESP_SHORT, adwResp)) {
+		DBG("Card identification failed\n");
+		return FALSE;
+	}
+	dwRCA = adwResp[0] & 0xFFFF0000;
+	if (!MCICommand(CMD_SEND_CSD, dwRCA, RESP_LONG, adwResp) ||
+		!MCIGetSize(adwResp)) {
+		DBG("CMD_SEND_CSD failed\n");
+		return FALSE;
+	}
+	
+	// select the card, switch to the 4 bit bus
+	if (!MCICommand(CMD_SELECT_CARD, dwRCA, RESP_SHORT, NULL) || !MCIWaitReady()) {
+		DBG("CMD_SELECT_CARD failed\n");
+		return FALSE;
+	}
+	if (!MCIAppCommand(CMD_SWITCH_FUNC, 2, RESP_SHORT, NULL)) {
+		DBG("ACMD6 failed\n");
+		return FALSE;
+	}
+	MCI_CLOCK |= MCI_CLK_WIDEBUS;
+	if (!fHighCap && !MCICommand(CMD_SET_BLOCKLEN, BLOCKSIZE, RESP_SHORT, NULL)) {
+		DBG("CMD_SET_BLOCKLEN failed\n");
+		return FALSE;
+	}
+	
+	// no high speed switch (CMD6), the MCI cannot clock the card faster
+	// than the 25 MHz of the default speed anyway
+	iMciHz = MCISetClock(MCI_MAX_HZ);
+
+	DBG("MCI: %d kB card, 4 bit bus at %d kHz\n", dwCardSize / 1024, iMciHz / 1000);
+	return TRUE;
+}
+
+
+BOOL BlockDevGetSize(U32 *pdwDriveSize)
+{
+	*pdwDriveSize = dwCardSize;
+	return TRUE;
+}
+
+
+// ends a failed data transfer
+static void MCIAbort(void)
+{
+	GPDMA_CH0_CFG = 0;
+	MCI_DATA_CTRL = 0;
+	MCI_CLEAR = MCI_CLEAR_ALL;
+	MCICommand(CMD_STOP_TRANSMISSION, 0, RESP_SHORT, NULL);
+	MCIWaitReady();
+	eState = eMciIdle;
+}
+
+
+// starts the command and data transfer of the next blocks of the request
+static BOOL MCIStartXfer(void)
+{
+	U32		dwResp, dwAddr, dwCtrl;
+	int		iCmd;
+	U8		*pbDMA;
+
+	fXferBounce = !IS_AHB_RAM(pbXferData);
+	iXferCount = fXferBounce ? 1 : MIN(iXferLeft, MCI_MAX_BLOCKS);
+	pbDMA = fXferBounce ? abBounce : pbXferData;
+	dwAddr = fHighCap ? dwXferBlock : dwXferBlock * BLOCKSIZE;
+	dwCtrl = ((iXferCount * BLOCKSIZE) / 4) | DMA_SBSIZE_8 | DMA_DBSIZE_8 |
+			 DMA_SWIDTH_32 | DMA_DWIDTH_32;
+
+	MCI_CLEAR = MCI_CLEAR_ALL;
+	MCI_DATA_LEN = iXferCount * BLOCKSIZE;
+	GPDMA_INT_TCCLR = DMA_CH0;
+	GPDMA_INT_ERR_CLR = DMA_CH0;
+	
+	if (fXferWrite) {
+		if (fXferBounce) {
+			memcpy(abBounce, pbXferData, BLOCKSIZE);
+		}
+		// 250 ms
+		MCI_DATA_TMR = iMciHz / 4;
+		GPDMA_CH0_SRC = (U32)pbDMA;
+		GPDMA_CH0_DEST = (U32)&MCI_FIFO;
+		GPDMA_CH0_LLI = 0;
+		GPDMA_CH0_CTRL = dwCtrl | DMA_SI;
+		GPDMA_CH0_CFG = DMA_E | DMA_DEST_PERIPH(DMA_MCI) | DMA_M2P_PERIPH;
+		if (iXferCount > 1) {
+			// pre-erase, only a hint so failures are ignored
+			MCIAppCommand(CMD_SET_WR_BLK_ERASE_COUNT, iXferCount, RESP_SHORT, NULL);
+		}
+		iCmd = (iXferCount > 1) ? CMD_WRITE_MULTIPLE_BLOCK : CMD_WRITE_BLOCK;
+	}
+	else {
+		// 100 ms
+		MCI_DATA_TMR = iMciHz / 10;
+		GPDMA_CH0_SRC = (U32)&MCI_FIFO;
+		GPDMA_CH0_DEST = (U32)pbDMA;
+		GPDMA_CH0_LLI = 0;
+		GPDMA_CH0_CTRL = dwCtrl | DMA_DI;
+		GPDMA_CH0_CFG = DMA_E | DMA_SRC_PERIPH(DMA_MCI) | DMA_P2M_PERIPH;
+		// the data path must be ready before the card starts sending
+		MCI_DATA_CTRL = MCI_DATA_ENABLE | MCI_DATA_FROM_CARD | MCI_DATA_DMA | MCI_DATA_BLOCK(9);
+		iCmd = (iXferCount > 1) ? CMD_READ_MULTIPLE_BLOCK : CMD_READ_SINGLE_BLOCK;
+	}
+	
+	if (!MCICommand(iCmd, dwAddr, RESP_SHORT, &dwResp) || (dwResp & STATUS_ERRORS)) {
+		DBG("CMD%d failed\n", iCmd);
+		GPDMA_CH0_CFG = 0;
+		MCI_DATA_CTRL = 0;
+		return FALSE;
+	}
+	if (fXferWrite) {
+		MCI_DATA_CTRL = MCI_DATA_ENABLE | MCI_DATA_DMA | MCI_DATA_BLOCK(9);
+	}
+	eState = eMciData;
+	return TRUE;
+}
+
+
+// starts the next blocks of the request, or ends it
+static int MCINext(void)
+{
+	if (iXferLeft == 0) {
+		eState = eMciIdle;
+		return BLOCKDEV_DONE;
+	}
+	if (!MCIStartXfer()) {
+		eState = eMciIdle;
+		return BLOCKDEV_ERROR;
+	}
+	return BLOCKDEV_BUSY;
+}
+
+
+BOOL BlockDevStart(TBlockDevReq *pReq)
+{
+	ASSERT(eState == eMciIdle);
+	
+	fXferWrite = pReq->fWrite;
+	dwXferBlock = pReq->dwBlock;
+	pbXferData = pReq->pbBuf;
+	iXferLeft = pReq->iCount;
+	return (iXferLeft == 0) || MCIStartXfer();
+}
+
+
+int BlockDevContinue(void)
+{
+	U32	dwStatus;
+	int	iRes;
+
+	switch (eState) {
+	
+	case eMciData:
+		dwStatus = MCI_STATUS;
+		if (dwStatus & MCI_DATA_ERRORS) {
+			DBG("MCI data error (0x%X)\n", dwStatus);
+			MCIAbort();
+			return BLOCKDEV_ERROR;
+		}
+		// data is done when the DMA has emptied the FIFO too
+		if (((dwStatus & MCI_DATA_END) == 0) || (GPDMA_ENABLED_CHNS & DMA_CH0)) {
+			return BLOCKDEV_BUSY;
+		}
+		MCI_DATA_CTRL = 0;
+		
+		if (fXferBounce && !fXferWrite) {
+			memcpy(pbXferData, abBounce, BLOCKSIZE);
+		}
+		pbXferData += iXferCount * BLOCKSIZE;
+		dwXferBlock += iXferCount;
+		iXferLeft -= iXferCount;
+		
+		if ((iXferCount > 1) && !MCICommand(CMD_STOP_TRANSMISSION, 0, RESP_SHORT, NULL)) {
+			DBG("CMD_STOP_TRANSMISSION failed\n");
+			MCIWaitReady();
+			eState = eMciIdle;
+			return BLOCKDEV_ERROR;
+		}
+		if (fXferWrite) {
+			// the card is busy programming, poll its status
+			eState = eMciProgram;
+			return BLOCKDEV_BUSY;
+		}
+		return MCINext();
+	
+	case eMciProgram:
+		iRes = MCIPollReady();
+		if (iRes == BLOCKDEV_BUSY) {
+			return BLOCKDEV_BUSY;
+		}
+		if (iRes == BLOCKDEV_ERROR) {
+			eState = eMciIdle;
+			return BLOCKDEV_ERROR;
+		}
+		return MCINext();
+	
+	default:
+		return BLOCKDEV_DONE;
+	}
+}
+
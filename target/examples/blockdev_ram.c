@@ -0,0 +1,101 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2008 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**	@file
+
+	RAM disk block device, lets the mass storage stack be measured without
+	the latency of a memory card.
+	
+	By default the disk is an array of RAMDISK_SIZE bytes in internal RAM.
+	On parts with SDRAM on the external memory controller, define
+	RAMDISK_BASE as the address of the SDRAM (0xA0000000 for dynamic chip
+	select 0) and RAMDISK_SIZE as its size. The EMC and the SDRAM have to
+	be set up by the board startup code before BlockDevInit is called.
+	
+	The contents are lost at reset, the host has to format the disk.
+*/
+
+#include <string.h>
+
+#include "type.h"
+#include "debug.h"
+
+#include "blockdev.h"
+
+#define BLOCKSIZE	512
+
+#ifndef RAMDISK_SIZE
+#define RAMDISK_SIZE	(16 * 1024)		/**< disk size in bytes */
+#endif
+
+#ifdef RAMDISK_BASE
+#define pbRamDisk	((U8 *)RAMDISK_BASE)
+#else
+static U8	pbRamDisk[RAMDISK_SIZE] __attribute__ ((aligned(4)));
+#endif
+
+#define RAMDISK_BLOCKS	(RAMDISK_SIZE / BLOCKSIZE)
+
+
+BOOL BlockDevInit(void)
+{
+	DBG("RAM disk of %d blocks at %X\n", RAMDISK_BLOCKS, (U32)pbRamDisk);
+	return TRUE;
+}
+
+
+BOOL BlockDevStart(TBlockDevReq *pReq)
+{
+	U8 *pbDisk;
+
+	if ((pReq->dwBlock >= RAMDISK_BLOCKS) ||
+		(pReq->iCount > (int)(RAMDISK_BLOCKS - pReq->dwBlock))) {
+		return FALSE;
+	}
+	// memory is fast enough to do it right away
+	pbDisk = pbRamDisk + pReq->dwBlock * BLOCKSIZE;
+	if (pReq->fWrite) {
+		memcpy(pbDisk, pReq->pbBuf, pReq->iCount * BLOCKSIZE);
+	}
+	else {
+		memcpy(pReq->pbBuf, pbDisk, pReq->iCount * BLOCKSIZE);
+	}
+	return TRUE;
+}
+
+
+int BlockDevContinue(void)
+{
+	return BLOCKDEV_DONE;
+}
+
+
+BOOL BlockDevGetSize(U32 *pdwDriveSize)
+{
+	*pdwDriveSize = RAMDISK_SIZE;
+	return TRUE;
+}
@@ -31,44 +31,11 @@
 #include "sdcard.h"
 #include "blockdev.h"
 
-static U32 getsdbits(U8 *buf, int offset, int len)
-{
-	U32		mask, data;
-	int		bytepos, bitpos;
-	int		shift;
-	
-	offset = 127 - offset;
-	bytepos = offset / 8;
-	bitpos = offset % 8;
-	mask = (1 << len) - 1;
-
-	data = 0;
-	for (shift = -(len + bitpos); shift < 0; shift += 8) {
-		data = (data << 8) | buf[bytepos++];
-	}
-	return (data >> shift) & mask;
-}
-
-
-BOOL BlockDevInit(void)
-{
-	return SDInit();
-}
-
-
-BOOL BlockDevWrite(U32 dwBlock, U8* pbBuf)
-{
-	return SDWriteBlock(pbBuf, dwBlock);
-}
-
-
-BOOL BlockDevRead(U32 dwBlock, U8* pbBuf)
-{
-	return SDReadBlock(pbBuf, dwBlock);
-}
+// size of the card in bytes, from the CSD that SDInit read
+static U32 dwCardSize;
 
 
-BOOL BlockDevGetSize(U32 *pdwDriveSize)
+static BOOL SDGetSize(U32 *pdwDriveSize)
 {
 	U8	abBuf[16];
 	U32	c_size, num_blocks, block_size;
@@ -79,19 +46,19 @@ BOOL BlockDevGetSize(U32 *pdwDriveSize)
 	if (!SDReadCSD(abBuf)) {
 		return FALSE;
 	}
-	csd_structure =	getsdbits(abBuf, 127, 2);
+	csd_structure =	SDGetBits(abBuf, 127, 2);
 	switch (csd_structure) {
 	
 	case 0:
-		read_bl_len =	getsdbits(abBuf, 83, 4);
-		c_size =		getsdbits(abBuf, 73, 12);
-		c_size_mult =	getsdbits(abBuf, 49, 3);
+		read_bl_len =	SDGetBits(abBuf, 83, 4);
+		c_size =		SDGetBits(abBuf, 73, 12);
+		c_size_mult =	SDGetBits(abBuf, 49, 3);
 		num_blocks = (c_size + 1) * (4 << c_size_mult);
 		block_size = 1 << read_bl_len;
 		break;
 
 	case 1:
-		c_size =		getsdbits(abBuf, 69, 22);
+		c_size =		SDGetBits(abBuf, 69, 22);
 		num_blocks = (c_size + 1) * 512 * 1024;
 		block_size = 512;
 		break;
@@ -105,3 +72,35 @@ BOOL BlockDevGetSize(U32 *pdwDriveSize)
 	return TRUE;
 }
 
+
+
+BOOL BlockDevInit(void)
+{
+	return SDInit() && SDGetSize(&dwCardSize);
+}
+
+
+BOOL BlockDevGetSize(U32 *pdwDriveSize)
+{
+	*pdwDriveSize = dwCardSize;
+	return TRUE;
+}
+
+
+BOOL BlockDevStart(TBlockDevReq *pReq)
+{
+	if (pReq->fWrite) {
+		return SDStartWrite(pReq->pbBuf, pReq->dwBlock, pReq->iCount);
+	}
+	return SDStartRead(pReq->pbBuf, pReq->dwBlock, pReq->iCount);
+}
+
+
+int BlockDevContinue(void)
+{
+	switch (SDPoll()) {
+	case SD_BUSY:	return BLOCKDEV_BUSY;
+	case SD_DONE:	return BLOCKDEV_DONE;
+	default:		return BLOCKDEV_ERROR;
+	}
+}
@@ -70,32 +70,26 @@ second, as well as receive the incrementing output counter.
 #define LE_WORD(x)		((x)&0xFF),((x)>>8)
 
 
-#define NUM_ISOC_FRAMES 4
-#define BYTES_PER_ISOC_FRAME 128
-#define ISOC_INPUT_DATA_BUFFER_SIZE (BYTES_PER_ISOC_FRAME * NUM_ISOC_FRAMES)
-#define ISOC_OUTPUT_DATA_BUFFER_SIZE (BYTES_PER_ISOC_FRAME * NUM_ISOC_FRAMES)
+#define ISOC_IN_FRAME_SIZE	4		// bytes per isoc IN frame
+#define ISOC_OUT_FRAME_SIZE	128		// bytes per isoc OUT frame
+#define ISOC_FRAMES			2		// isoc frames per DMA descriptor
+#define ISOC_DESCS			2		// DMA descriptors in a stream ring
 
-
-volatile U8 outputIsocDataBuffer[ISOC_OUTPUT_DATA_BUFFER_SIZE];
-
-
-__attribute__ ((section (".usbdma"), aligned(4))) volatile U32* udcaHeadArray[32];
-__attribute__ ((section (".usbdma"), aligned(4))) volatile U32 inputDmaDescriptor[5];
-__attribute__ ((section (".usbdma"), aligned(4))) U32 inputIsocFrameArray[NUM_ISOC_FRAMES];
-__attribute__ ((section (".usbdma"), aligned(4))) U8 inputIsocDataBuffer[ISOC_INPUT_DATA_BUFFER_SIZE];
-
-
-__attribute__ ((section (".usbdma"), aligned(4))) volatile U32 outputDmaDescriptor[5];
-__attribute__ ((section (".usbdma"), aligned(128))) U32 outputIsocFrameArray[NUM_ISOC_FRAMES];
-__attribute__ ((section (".usbdma"), aligned(128))) volatile U8 outputIsocDataBuffer[ISOC_OUTPUT_DATA_BUFFER_SIZE];
+#if (ISOC_DESCS * ISOC_FRAMES * ISOC_OUT_FRAME_SIZE) > USB_DMA_BUF_SIZE
+#error "isoc data buffers do not fit in a USB DMA pool buffer"
+#endif
 
 
+__attribute__ ((section (".usbdma"), aligned(4))) volatile U32 udcaHeadArray[32];
 
-U16 commonIsocFrameNumber = 1;
+// data buffers of the isoc streams, allocated from the USB DMA pool
+U8 *inputIsocDataBuffer;
+U8 *outputIsocDataBuffer;
 
 
 
 int isConnectedFlag = 0;
+int isStreamingFlag = 0;
 
 U8 bDevStat = 0;
 
@@ -263,37 +257,46 @@ void USBIntHandler(void)
 
 
 
-void resetDMATransfer(
-		const U8 endpointNumber,
-		volatile U32 *dmaDescriptor,
-		U32 *isocFrameArray,
-		const U32 numIsocFrames, 
-		const U32 bytesPerIsocFrame,
-		U16 *isocFrameNumber,
-		const U32 maxPacketSize,
-		void *dataBuffer
-		) 
-{
-	USBDisableDMAForEndpoint(endpointNumber);
+unsigned int incrementingNumberCounter = 0;
 
-	USBInitializeISOCFrameArray(isocFrameArray, numIsocFrames, *isocFrameNumber, bytesPerIsocFrame);
-	*isocFrameNumber += numIsocFrames;
 
-	USBSetupDMADescriptor(dmaDescriptor, NULL, 1, maxPacketSize, numIsocFrames, dataBuffer, isocFrameArray);
+/**
+	Isochronous IN descriptor handler
 	
-	//set DDP pointer for endpoint so it knows where first DD is located, manual section 13.1
-	//set index of isoc DDP to point to start DD
-	USBSetHeadDDForDMA(endpointNumber, udcaHeadArray, dmaDescriptor);
-
-	USBEnableDMAForEndpoint(endpointNumber);
+	Called from the USB interrupt each time a DMA descriptor of the IN
+	stream can be filled with new data.
+ */
+static void IsocInHandler(U8 bEP, U8 *pbBuf, U32 *pdwFrames, int iFrames)
+{
+	int i;
+	
+	//Always write whatever is in our most recent isoc output data buffer, you may want to pust somthing interesting in there....
+	for (i = 0; i < iFrames; i++) {
+		incrementingNumberCounter++;
+		memcpy(pbBuf + i * ISOC_IN_FRAME_SIZE, &incrementingNumberCounter, sizeof(incrementingNumberCounter));
+	}
 }
 
 
-
-
-
-
-
+/**
+	Isochronous OUT descriptor handler
+	
+	Called from the USB interrupt each time a DMA descriptor of the OUT
+	stream has been filled.
+ */
+static void IsocOutHandler(U8 bEP, U8 *pbBuf, U32 *pdwFrames, int iFrames)
+{
+	//The host sample code will send a byte indicating if the sample LED on olimex 2148 dev board should be on of off.
+	//Note: were only inspecting the first isoc frame, this is just for the blinky light example
+	if (ISOC_FRAME_LEN(pdwFrames[0]) == 0) {
+		return;
+	}
+	if( pbBuf[0] ) {
+		IOSET0 = (1<<10);//turn on led on olimex dev board
+	} else {
+		IOCLR0 = (1<<10);//turn off led on olimex dev board
+	}
+}
 
 
 /**
@@ -301,74 +304,26 @@ void resetDMATransfer(
 	
 	Called every milisecond by the hardware driver.
 	
-	This function is responsible for sending the first of a chain of packets
-	to the host. A chain is always terminated by a short packet, either a
-	packet shorter than the maximum packet size or a zero-length packet
-	(as required by the windows usbser.sys driver).
-
+	Starts the isochronous streams some time after the device got
+	connected. From then on, the DMA engine runs through the descriptor
+	rings by itself and the stream handlers are called from the DMA
+	interrupt, so there is no per-frame work left here.
  */
 
 int delay = 0;
-int didInputInit = 0;
-int resetCount = 0;
-int didOutputInit = 0;
-unsigned int incrementingNumberCounter = 0;
 
 void USBFrameHandler(U16 wFrame)
 {
-    // send over USB
-	if( isConnectedFlag ) {
+	if( isConnectedFlag && !isStreamingFlag ) {
 		if( delay < 4000 ) {
 			//FIXME need to delay a few seconds before doing isoc writes, impliment more elegant solution, status or event driven....
 			delay++;
 		} else {
-			
-			//Check to see if the DMA descriptor is marked in the normal-completion status and ready for reset
-			int needToResetInputDMADescriptorFlag = (((inputDmaDescriptor[3] >> 1) & 0x0F ) == 2);
-			
-			if (needToResetInputDMADescriptorFlag || !didInputInit) {
-				//normal completion
-				if ( !didInputInit) {
-					didInputInit = 1;
-				}
-				
-				//Always write whatever is in our most recent isoc output data buffer, you may want to pust somthing interesting in there....
-				incrementingNumberCounter++;
-				memcpy(inputIsocDataBuffer, &incrementingNumberCounter, sizeof(incrementingNumberCounter));
-				
-				resetDMATransfer(ISOC_IN_EP, inputDmaDescriptor, inputIsocFrameArray,
-								1, 4, &commonIsocFrameNumber, MAX_PACKET_SIZE, inputIsocDataBuffer);
-				
-			}
-			
-			
-			
-			
-			//Check to see if the DMA descriptor is marked in the normal-completion status and ready for reset
-			int needToResetOutputDMADescriptorFlag = (((outputDmaDescriptor[3] >> 1) & 0x0F ) == 2);
-				
-			if (needToResetOutputDMADescriptorFlag || !didOutputInit) {
-				//normal completion
-				if ( !didOutputInit) {
-					didOutputInit = 1;
-					
-				} else { 
-					//The host sample code will send a byte indicating if the sample LED on olimex 2148 dev board should be on of off.
-					if( outputIsocDataBuffer[0] ) {//Note: were only inspecting the first of 4 isoc frames, this is just for the blinky light example
-						IOSET0 = (1<<10);//turn on led on olimex dev board
-	
-					} else {
-						IOCLR0 = (1<<10);//turn off led on olimex dev board
-	
-					}
-				}
-				
-				resetCount++;
-				resetDMATransfer(ISOC_OUT_EP, outputDmaDescriptor, outputIsocFrameArray,
-						NUM_ISOC_FRAMES, BYTES_PER_ISOC_FRAME, &commonIsocFrameNumber, MAX_PACKET_SIZE, outputIsocDataBuffer);
-			
-			}
-			
+			USBIsocStart(ISOC_IN_EP, inputIsocDataBuffer, ISOC_IN_FRAME_SIZE,
+						 ISOC_FRAMES, ISOC_DESCS, IsocInHandler);
+			USBIsocStart(ISOC_OUT_EP, outputIsocDataBuffer, ISOC_OUT_FRAME_SIZE,
+						 ISOC_FRAMES, ISOC_DESCS, IsocOutHandler);
+			isStreamingFlag = 1;
 		}
 	}
 }
@@ -394,6 +349,12 @@ static void USBDevIntHandler(U8 bDevStatus)
 	case DEV_STATUS_RESET:
 	case DEV_STATUS_SUSPEND:
 		isConnectedFlag= 0;
+		if( isStreamingFlag ) {
+			USBIsocStop(ISOC_IN_EP);
+			USBIsocStop(ISOC_OUT_EP);
+			isStreamingFlag = 0;
+			delay = 0;
+		}
 		break;
 	}
 }
@@ -441,10 +402,11 @@ int main(void)
 	// register device event handler
 	USBHwRegisterDevIntHandler(USBDevIntHandler);
 	
-	inputIsocDataBuffer[0] = 0;
+	// get DMA memory, the data buffers hold all isoc frames of a stream ring
+	inputIsocDataBuffer = USBDMAAllocBuf();
+	outputIsocDataBuffer = USBDMAAllocBuf();
 	
 	USBInitializeUSBDMA(udcaHeadArray);
-	USBEnableDMAForEndpoint(ISOC_IN_EP);
 	
 	DBG("Starting USB communication\n");
 
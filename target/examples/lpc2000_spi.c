@@ -55,7 +55,8 @@
 /*****************************************************************************/
 
 
-void SPISetSpeed(int iFrequency)
+// sets the clock to at most iFrequency, returns the actual clock
+int SPISetSpeed(int iFrequency)
 {
 	int iClock, iDivider;
 
@@ -69,6 +70,7 @@ void SPISetSpeed(int iFrequency)
 	S0SPCCR = iDivider << 1;
 	
 	DBG("Configured SPI0 for %d kHz\n", iClock / (1000 * iDivider));
+	return iClock / iDivider;
 }
 
 
@@ -93,26 +95,50 @@ void SPIInit(void)
 
 /*****************************************************************************/
 
+/*
+	SPI0 has no FIFO, so each byte is written as soon as the previous one
+	is done. The loops for the common transmit only and receive only
+	cases do nothing else between the bytes.
+*/
 void SPITransfer(int iCount, U8 *pbTxData, U8 *pbRxData)
 {
 	int i;
+	U8 bData;
 
 	SELECT_CARD();
-	for (i = 0; i < iCount; i++) {
-		// send byte
-		if (pbTxData != NULL) {
+	if ((pbTxData != NULL) && (pbRxData == NULL)) {
+		// transmit only, reading the status and writing the next byte
+		// clears SPIF
+		for (i = 0; i < iCount; i++) {
 			S0SPDR = *pbTxData++;
+			while (!(S0SPSR & SPIF));
 		}
-		else {
+	}
+	else if ((pbTxData == NULL) && (pbRxData != NULL)) {
+		// receive only
+		for (i = 0; i < iCount; i++) {
 			S0SPDR = SPI_IDLE_CHAR;
-		}
-		// wait until done
-		while( !(S0SPSR & SPIF) ) ;
-		// store received byte
-		if (pbRxData != NULL) {
+			while (!(S0SPSR & SPIF));
 			*pbRxData++ = S0SPDR;
 		}
 	}
+	else {
+		for (i = 0; i < iCount; i++) {
+			// send byte
+			bData = SPI_IDLE_CHAR;
+			if (pbTxData != NULL) {
+				bData = *pbTxData++;
+			}
+			S0SPDR = bData;
+			// wait until done
+			while (!(S0SPSR & SPIF));
+			// store received byte
+			bData = S0SPDR;
+			if (pbRxData != NULL) {
+				*pbRxData++ = bData;
+			}
+		}
+	}
 	UNSELECT_CARD();
 }
 
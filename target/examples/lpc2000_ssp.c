@@ -28,23 +28,63 @@
 /**
  * Driver for SSP port
  *
+ * On the LPC214x this is the SSP (SPI1), on the LPC23xx it is SSP0.
+ * With SPI_DMA defined (LPC23xx only), SPIStartDMA moves data blocks
+ * with two GPDMA channels while the CPU does other work.
  */
  
+#include <string.h>			// memcpy
+
 #include "type.h"
 #include "debug.h"
 
+#ifdef LPC23xx
+#include "lpc23xx.h"
+#else
 #include "lpc214x.h"
+#endif
 #include "hal.h"
 
 #include "spi.h"
 
 /*****************************************************************************/
 
+#ifdef LPC23xx
+// SSP0 has the same layout as the LPC214x SSP
+#define SSPCR0			SSP0CR0
+#define SSPCR1			SSP0CR1
+#define SSPDR			SSP0DR
+#define SSPSR			SSP0SR
+#define SSPCPSR			SSP0CPSR
+#define SSPDMACR		SSP0DMACR
+
+#define PCSSP			(1 << 21)
+#define PCGPDMA			(1 << 29)
+
+#define SPI_SCK_PIN    15
+#define SPI_MISO_PIN   17
+#define SPI_MOSI_PIN   18
+#define SPI_SS_PIN	   16
+
+// fast GPIO is enabled by HalSysInit
+#define SPI_SS_DIR		FIO0DIR
+#define SPI_SS_SET		FIO0SET
+#else
+#ifdef SPI_DMA
+#error "SPI_DMA needs the GPDMA of the LPC23xx"
+#endif
+
+#define PCSSP			PCSPI1
+
 #define SPI_SCK_PIN    17
 #define SPI_MISO_PIN   18
 #define SPI_MOSI_PIN   19
 #define SPI_SS_PIN	   20
 
+#define SPI_SS_DIR		IODIR0
+#define SPI_SS_SET		IOSET0
+#endif
+
 // SSPSR  Bit-Definitions
 #define TNF     (1<<1)
 #define RNE     (1<<2)
@@ -52,10 +92,54 @@
 
 #define IDLE_CHAR	0xFF
 
+// depth of the TX and RX FIFOs, in frames
+#define SSP_FIFO_SIZE	8
+
+#ifdef SPI_DMA
+// SSPDMACR Bit-Definitions
+#define RXDMAE	(1<<0)
+#define TXDMAE	(1<<1)
+
+// GPDMA channel control
+#define DMA_SBSIZE_4		(1 << 12)	// bursts of 4, half the SSP FIFO
+#define DMA_DBSIZE_4		(1 << 15)
+#define DMA_SI				(1 << 26)	// source increment
+#define DMA_DI				(1 << 27)	// destination increment
+
+// GPDMA channel configuration
+#define DMA_E				(1 << 0)
+#define DMA_SRC_PERIPH(x)	((x) << 1)
+#define DMA_DEST_PERIPH(x)	((x) << 6)
+#define DMA_M2P				(1 << 11)
+#define DMA_P2M				(2 << 11)
+
+// GPDMA request lines
+#define DMA_SSP0_TX			0
+#define DMA_SSP0_RX			1
+
+// channel 0 transmits, channel 1 receives
+#define DMA_CH_RX			(1 << 1)
+
+// the GPDMA can only access the AHB RAMs (USB and ethernet RAM)
+#define IS_AHB_RAM(p)		((((U32)(p) - 0x7FD00000) < 0x2000) || \
+							 (((U32)(p) - 0x7FE00000) < 0x4000))
+#endif
+
 /*****************************************************************************/
 
 static BOOL	fInit = FALSE;
 
+#ifdef SPI_DMA
+// bounce buffer for data outside AHB RAM, idle char source and dummy sink
+static U8	abDMABuf[SPI_DMA_MAX] __attribute__ ((section(".usbdma"), aligned(4)));
+static U8	bDMAIdle __attribute__ ((section(".usbdma")));
+static U8	bDMADummy __attribute__ ((section(".usbdma")));
+
+static BOOL	fDMABusy = FALSE;
+static U8	*pbDMACopy;		// receive buffer to copy the bounce buffer to
+static int	iDMACount;
+#endif
+
 
 /*****************************************************************************/
 
@@ -83,7 +167,8 @@ void SPITick(int iCount)
 }
 
 
-void SPISetSpeed(int iFrequency)
+// sets the clock to at most iFrequency, returns the actual clock
+int SPISetSpeed(int iFrequency)
 {
 	int iClock, iDivider;
 
@@ -95,21 +180,67 @@ void SPISetSpeed(int iFrequency)
 	iDivider = (iClock + iFrequency - 1) / iFrequency;
 	// set it
 	SSPCR0 = ((iDivider - 1) << 8) | (SSPCR0 & 0x0F);
+	return iClock / iDivider;
 }
 
 
-void SPITransfer(int iCount, U8 *pbTxData, U8 *pbRxData)
+/*
+	The transfer loops below keep the TX FIFO primed while they drain the
+	RX FIFO, so the SSP clocks out frames back to back. No more than
+	SSP_FIFO_SIZE frames are in flight, so the RX FIFO cannot overrun
+	even if the loop gets interrupted.
+*/
+
+// transmit only, received frames are discarded
+static void SPIBurstTx(int iCount, const U8 *pbTxData)
 {
-	int iRecv;
-	int iXmit;
-	U8 bData;
+	int iXmit, iRecv;
+	
+	iXmit = iCount;
+	iRecv = iCount;
+	while (iRecv > 0) {
+		while ((iXmit > 0) && ((iRecv - iXmit) < SSP_FIFO_SIZE) && (SSPSR & TNF)) {
+			SSPDR = *pbTxData++;
+			iXmit--;
+		}
+		while (SSPSR & RNE) {
+			(void)SSPDR;
+			iRecv--;
+		}
+	}
+}
 
-	ASSERT(fInit);
 
+// receive only, sends idle chars
+static void SPIBurstRx(int iCount, U8 *pbRxData)
+{
+	int iXmit, iRecv;
+	
+	iXmit = iCount;
 	iRecv = iCount;
+	while (iRecv > 0) {
+		while ((iXmit > 0) && ((iRecv - iXmit) < SSP_FIFO_SIZE) && (SSPSR & TNF)) {
+			SSPDR = IDLE_CHAR;
+			iXmit--;
+		}
+		while (SSPSR & RNE) {
+			*pbRxData++ = SSPDR;
+			iRecv--;
+		}
+	}
+}
+
+
+// any combination of buffers
+static void SPIBurst(int iCount, const U8 *pbTxData, U8 *pbRxData)
+{
+	int iXmit, iRecv;
+	U8 bData;
+	
 	iXmit = iCount;
-	while ((iXmit != 0) || (iRecv != 0)) {
-		if ((SSPSR & TNF) && (iXmit > 0)) {
+	iRecv = iCount;
+	while (iRecv > 0) {
+		while ((iXmit > 0) && ((iRecv - iXmit) < SSP_FIFO_SIZE) && (SSPSR & TNF)) {
 			bData = IDLE_CHAR;
 			if (pbTxData != NULL) {
 				bData = *pbTxData++;
@@ -117,7 +248,7 @@ void SPITransfer(int iCount, U8 *pbTxData, U8 *pbRxData)
 			SSPDR = bData;
 			iXmit--;
 		}
-		if ((SSPSR & RNE) && (iRecv > 0)) {
+		while (SSPSR & RNE) {
 			bData = SSPDR;
 			if (pbRxData != NULL) {
 				*pbRxData++ = bData;
@@ -128,10 +259,104 @@ void SPITransfer(int iCount, U8 *pbTxData, U8 *pbRxData)
 }
 
 
+void SPITransfer(int iCount, U8 *pbTxData, U8 *pbRxData)
+{
+	ASSERT(fInit);
+
+	if ((pbTxData != NULL) && (pbRxData == NULL)) {
+		SPIBurstTx(iCount, pbTxData);
+	}
+	else if ((pbTxData == NULL) && (pbRxData != NULL)) {
+		SPIBurstRx(iCount, pbRxData);
+	}
+	else {
+		SPIBurst(iCount, pbTxData, pbRxData);
+	}
+}
+
+
+#ifdef SPI_DMA
+/**
+	Starts a transfer of iCount bytes by GPDMA. pbTxData NULL sends idle
+	chars, pbRxData NULL discards the received data. Buffers outside AHB
+	RAM go through a bounce buffer.
+	
+	Poll SPIIsDMADone until the transfer is done, SPITransfer must not be
+	called meanwhile.
+ */
+void SPIStartDMA(int iCount, const U8 *pbTxData, U8 *pbRxData)
+{
+	ASSERT(fInit && !fDMABusy);
+	ASSERT(iCount <= SPI_DMA_MAX);
+
+	pbDMACopy = NULL;
+	if ((pbTxData != NULL) && !IS_AHB_RAM(pbTxData)) {
+		if ((pbRxData != NULL) && !IS_AHB_RAM(pbRxData)) {
+			// only one bounce buffer, do it the slow way
+			SPITransfer(iCount, (U8 *)pbTxData, pbRxData);
+			return;
+		}
+		memcpy(abDMABuf, pbTxData, iCount);
+		pbTxData = abDMABuf;
+	}
+	else if ((pbRxData != NULL) && !IS_AHB_RAM(pbRxData)) {
+		pbDMACopy = pbRxData;
+		iDMACount = iCount;
+		pbRxData = abDMABuf;
+	}
+
+	GPDMA_INT_TCCLR = 3;
+	GPDMA_INT_ERR_CLR = 3;
+	
+	// receive channel first, so it is ready for the first frame
+	GPDMA_CH1_SRC = (U32)&SSPDR;
+	GPDMA_CH1_DEST = (U32)((pbRxData != NULL) ? pbRxData : &bDMADummy);
+	GPDMA_CH1_LLI = 0;
+	GPDMA_CH1_CTRL = iCount | DMA_SBSIZE_4 | DMA_DBSIZE_4 |
+					 ((pbRxData != NULL) ? DMA_DI : 0);
+	GPDMA_CH1_CFG = DMA_E | DMA_SRC_PERIPH(DMA_SSP0_RX) | DMA_P2M;
+	
+	GPDMA_CH0_SRC = (U32)((pbTxData != NULL) ? pbTxData : &bDMAIdle);
+	GPDMA_CH0_DEST = (U32)&SSPDR;
+	GPDMA_CH0_LLI = 0;
+	GPDMA_CH0_CTRL = iCount | DMA_SBSIZE_4 | DMA_DBSIZE_4 |
+					 ((pbTxData != NULL) ? DMA_SI : 0);
+	GPDMA_CH0_CFG = DMA_E | DMA_DEST_PERIPH(DMA_SSP0_TX) | DMA_M2P;
+	
+	// let the SSP request data
+	SSPDMACR = RXDMAE | TXDMAE;
+	fDMABusy = TRUE;
+}
+
+
+/**
+	Checks if the transfer started with SPIStartDMA is done
+	
+	@return TRUE if done, the received data is in place then
+ */
+BOOL SPIIsDMADone(void)
+{
+	if (!fDMABusy) {
+		return TRUE;
+	}
+	// the receive channel finishes last, it disables itself
+	if (GPDMA_ENABLED_CHNS & DMA_CH_RX) {
+		return FALSE;
+	}
+	SSPDMACR = 0;
+	fDMABusy = FALSE;
+	if (pbDMACopy != NULL) {
+		memcpy(pbDMACopy, abDMABuf, iDMACount);
+	}
+	return TRUE;
+}
+#endif
+
+
 void SPIInit(void)
 {
-	// enable SPI1 power
-	PCONP |= PCSPI1;
+	// enable SSP power
+	PCONP |= PCSSP;
 
 	// disable SPI1 during initialisation
 	SSPCR1 = 0;
@@ -151,12 +376,20 @@ void SPIInit(void)
 	HalPinSelect(SPI_SS_PIN,	0);	// GPIO until fully initialised
 
 	// set select as high output
-	IODIR0 |= (1 << SPI_SS_PIN);
-	IOSET0 = (1 << SPI_SS_PIN);
+	SPI_SS_DIR |= (1 << SPI_SS_PIN);
+	SPI_SS_SET = (1 << SPI_SS_PIN);
 
-	// enable SPI1
+	// enable SSP
 	SSPCR1 |= (1 << 1);		// SSP_SSE;
 
+#ifdef SPI_DMA
+	// enable GPDMA, little endian
+	PCONP |= PCGPDMA;
+	GPDMA_CONFIG = 1;
+	// USB RAM is not initialised by the startup code
+	bDMAIdle = IDLE_CHAR;
+#endif
+
 	fInit = TRUE;
 }
 
@@ -145,22 +145,25 @@ static U8			abVendorReqData[sizeof(TMemoryCmd)];
 
 static void _HandleBulkIn(U8 bEP, U8 bEPStatus)
 {
-	int iChunk;
-	
-	iChunk = MIN(MAX_PACKET_SIZE, MemoryCmd.dwLength);
-	if (iChunk == 0) {
-		DBG("done\n");
-		return;
-	}
-	
-	// send next part
-	USBHwEPWrite(bEP, (U8 *)MemoryCmd.dwAddress, iChunk);
+	int iChunk, iFree;
 	
-	MemoryCmd.dwAddress += iChunk;
-	MemoryCmd.dwLength -= iChunk;
+	// keep both packet buffers of the endpoint filled
+	for (iFree = USBHwEPGetFreeBuffers(bEP); iFree > 0; iFree--) {
+		iChunk = MIN(MAX_PACKET_SIZE, MemoryCmd.dwLength);
+		if (iChunk == 0) {
+			DBG("done\n");
+			return;
+		}
+		
+		// send next part
+		USBHwEPWrite(bEP, (U8 *)MemoryCmd.dwAddress, iChunk);
+		
+		MemoryCmd.dwAddress += iChunk;
+		MemoryCmd.dwLength -= iChunk;
 
-	// limit address range to prevent abort
-	MemoryCmd.dwAddress &= ~(-512 * 1024);
+		// limit address range to prevent abort
+		MemoryCmd.dwAddress &= ~(-512 * 1024);
+	}
 }
 
 
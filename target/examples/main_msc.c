@@ -28,12 +28,23 @@
 #include "type.h"
 #include "debug.h"
 
+#ifdef LPC214x
+#include "lpc214x.h"
+#endif
+#ifdef LPC23xx
+#include "lpc23xx.h"
+#endif
+
+#include "armVIC.h"
+
 #include "hal.h"
 #include "console.h"
 #include "usbapi.h"
 
 #include "msc_bot.h"
+#include "msc_scsi.h"
 #include "blockdev.h"
+#include "blockcache.h"
 
 #define BAUD_RATE	115200
 
@@ -41,9 +52,19 @@
 
 #define LE_WORD(x)		((x)&0xFF),((x)>>8)
 
+#define	INT_VECT_NUM	0
+
 
 static U8 abClassReqData[4];
 
+// throughput report, measured in USB frames (1 ms)
+static U16	wLastFrame;
+static U16	wFrameCount;
+static BOOL	fReport;
+
+// forward declaration of interrupt handler
+static void USBIntHandler(void) __attribute__ ((interrupt("IRQ")));
+
 static const U8 abDescriptors[] = {
 
 // device descriptor	
@@ -160,6 +181,67 @@ static BOOL HandleClassRequest(TSetupPacket *pSetup, int *piLen, U8 **ppbData)
 }
 
 
+/**
+	USB frame handler, counts frames to time the throughput report and
+	the idle flush of the block cache
+	
+	In deferred mode frame events are merged, so the frame number is used
+	to find out how much time passed.
+	
+	@param [in]	wFrame	Frame number
+ */
+static void USBFrameHandler(U16 wFrame)
+{
+	U16 wDelta;
+	
+	wDelta = (wFrame - wLastFrame) & 0x7FF;
+	wLastFrame = wFrame;
+	BlockCacheTick(wDelta);
+	
+	wFrameCount += wDelta;
+	if (wFrameCount >= 1000) {
+		wFrameCount -= 1000;
+		fReport = TRUE;
+	}
+}
+
+
+/**
+	Prints the block device throughput of the last second
+ */
+static void ReportThroughput(void)
+{
+	static U32 dwLastRead = 0, dwLastWritten = 0;
+	U32 dwRead, dwWritten;
+	TBlockCacheStats Stats;
+
+	SCSIGetCounters(&dwRead, &dwWritten);
+	if ((dwRead != dwLastRead) || (dwWritten != dwLastWritten)) {
+		BlockCacheGetStats(&Stats);
+		printf("read %u kB/s, write %u kB/s\n",
+			(dwRead - dwLastRead) / 1024, (dwWritten - dwLastWritten) / 1024);
+		printf("blocks: %u prefetch hits, %u cache hits, %u misses, %u prefetched\n",
+			Stats.dwPrefetchHits, Stats.dwCacheHits, Stats.dwMisses,
+			Stats.dwPrefetched);
+	}
+	dwLastRead = dwRead;
+	dwLastWritten = dwWritten;
+}
+
+
+/**
+	Interrupt handler
+	
+	Calls the USB ISR, which only records the USB events in deferred mode,
+	then signals end of interrupt to VIC
+ */
+static void USBIntHandler(void)
+{
+	USBHwISR();
+	VICVectAddr = 0x00;    // dummy write to VIC to signal end of ISR 	
+}
+
+
 /*************************************************************************
 	main
 	====
@@ -174,6 +256,7 @@ int main(void)
 
 	// initialise the SD card
 	BlockDevInit();
+	BlockCacheInit();
 
 	DBG("Initialising USB stack\n");
 
@@ -194,14 +277,40 @@ int main(void)
 	USBHwRegisterEPIntHandler(MSC_BULK_IN_EP, MSCBotBulkIn);
 	USBHwRegisterEPIntHandler(MSC_BULK_OUT_EP, MSCBotBulkOut);
 
+	// register frame handler for the throughput report
+	USBHwRegisterFrameHandler(USBFrameHandler);
+
+	// handle the (slow) mass storage work in the main loop,
+	// the USB interrupt only queues the events
+	USBHwSetDeferred(TRUE);
+
 	DBG("Starting USB communication\n");
 
+#ifdef LPC214x
+	(*(&VICVectCntl0+INT_VECT_NUM)) = 0x20 | 22; // choose highest priority ISR slot 	
+	(*(&VICVectAddr0+INT_VECT_NUM)) = (int)USBIntHandler;
+#else
+	VICVectCntl22 = 0x01;
+	VICVectAddr22 = (int)USBIntHandler;
+#endif
+
+	// set up USB interrupt
+	VICIntSelect &= ~(1<<22);               // select IRQ for USB
+	VICIntEnable |= (1<<22);
+
+	enableIRQ();
+
 	// connect to bus
 	USBHwConnect(TRUE);
 
-	// call USB interrupt handler continuously
+	// process USB events as they come in, read ahead in between
 	while (1) {
-		USBHwISR();
+		USBHwProcessEvents();
+		MSCBotPoll();
+		if (fReport) {
+			fReport = FALSE;
+			ReportThroughput();
+		}
 	}
 	
 	return 0;
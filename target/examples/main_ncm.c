@@ -0,0 +1,330 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+	USB network adapter, using the CDC-NCM (Network Control Model) class.
+	
+	Ethernet frames travel in NCM Transfer Blocks, one bulk transfer holds
+	many frames. Behind the adapter is a tiny network stack (netecho.c),
+	which answers ARP, ping and UDP echo for the address NET_IP.
+	
+	Linux:
+	The cdc_ncm driver creates a network interface for the device, e.g.
+	usb0. Then:
+		ip addr add 192.168.7.1/24 dev usb0
+		ip link set usb0 up
+		ping -f -s 18 192.168.7.2
+*/
+
+#include "type.h"
+#include "debug.h"
+
+#ifdef LPC214x
+#include "lpc214x.h"
+#endif
+#ifdef LPC23xx
+#include "lpc23xx.h"
+#endif
+
+#include "armVIC.h"
+
+#include "hal.h"
+#include "console.h"
+#include "usbapi.h"
+
+#include "ncm.h"
+#include "netecho.h"
+
+#define BAUD_RATE	115200
+
+#define MAX_PACKET_SIZE	64
+
+#define LE_WORD(x)		((x)&0xFF),((x)>>8)
+
+// CDC definitions
+#define CS_INTERFACE			0x24
+
+#define	INT_VECT_NUM	0
+
+// our side of the link, the host interface gets the address in string 4
+static const U8 abNetMac[6] = {0x02, 0x4C, 0x50, 0x43, 0x00, 0x01};
+static const U8 abNetIp[4] = {192, 168, 7, 2};
+
+static U8 abClassReqData[8];
+
+// statistics report, every second
+static U16	wFrameCount;
+static BOOL	fReport;
+
+// forward declaration of interrupt handler
+static void USBIntHandler(void) __attribute__ ((interrupt("IRQ")));
+
+static const U8 abDescriptors[] = {
+
+// device descriptor
+	0x12,
+	DESC_DEVICE,
+	LE_WORD(0x0200),			// bcdUSB
+	0x02,						// bDeviceClass
+	0x00,						// bDeviceSubClass
+	0x00,						// bDeviceProtocol
+	MAX_PACKET_SIZE0,			// bMaxPacketSize
+	LE_WORD(0xFFFF),			// idVendor
+	LE_WORD(0x0006),			// idProduct
+	LE_WORD(0x0100),			// bcdDevice
+	0x01,						// iManufacturer
+	0x02,						// iProduct
+	0x03,						// iSerialNumber
+	0x01,						// bNumConfigurations
+
+// configuration descriptor
+	0x09,
+	DESC_CONFIGURATION,
+	LE_WORD(86),				// wTotalLength
+	0x02,						// bNumInterfaces
+	0x01,						// bConfigurationValue
+	0x00,						// iConfiguration
+	0xC0,						// bmAttributes
+	0x32,						// bMaxPower
+// communication class interface
+	0x09,
+	DESC_INTERFACE,
+	NCM_COMM_IF,				// bInterfaceNumber
+	0x00,						// bAlternateSetting
+	0x01,						// bNumEndPoints
+	0x02,						// bInterfaceClass = communication
+	0x0D,						// bInterfaceSubClass = NCM
+	0x00,						// bInterfaceProtocol
+	0x00,						// iInterface
+// header functional descriptor
+	0x05,
+	CS_INTERFACE,
+	0x00,
+	LE_WORD(0x0110),			// bcdCDC
+// union functional descriptor
+	0x05,
+	CS_INTERFACE,
+	0x06,
+	NCM_COMM_IF,				// bMasterInterface
+	NCM_DATA_IF,				// bSlaveInterface0
+// ethernet networking functional descriptor
+	0x0D,
+	CS_INTERFACE,
+	0x0F,
+	0x04,						// iMACAddress
+	0x00, 0x00, 0x00, 0x00,		// bmEthernetStatistics
+	LE_WORD(NCM_MAX_DATAGRAM),	// wMaxSegmentSize
+	LE_WORD(0),					// wNumberMCFilters
+	0x00,						// bNumberPowerFilters
+// NCM functional descriptor
+	0x06,
+	CS_INTERFACE,
+	0x1A,
+	LE_WORD(0x0100),			// bcdNcmVersion
+	0x00,						// bmNetworkCapabilities
+// notification EP
+	0x07,
+	DESC_ENDPOINT,
+	NCM_INT_IN_EP,				// bEndpointAddress
+	0x03,						// bmAttributes = intr
+	LE_WORD(16),				// wMaxPacketSize
+	0x0A,						// bInterval
+// data class interface, no endpoints
+	0x09,
+	DESC_INTERFACE,
+	NCM_DATA_IF,				// bInterfaceNumber
+	0x00,						// bAlternateSetting
+	0x00,						// bNumEndPoints
+	0x0A,						// bInterfaceClass = data
+	0x00,						// bInterfaceSubClass
+	0x01,						// bInterfaceProtocol = NTB
+	0x00,						// iInterface
+// data class interface, NTBs
+	0x09,
+	DESC_INTERFACE,
+	NCM_DATA_IF,				// bInterfaceNumber
+	0x01,						// bAlternateSetting
+	0x02,						// bNumEndPoints
+	0x0A,						// bInterfaceClass = data
+	0x00,						// bInterfaceSubClass
+	0x01,						// bInterfaceProtocol = NTB
+	0x00,						// iInterface
+// data EP OUT
+	0x07,
+	DESC_ENDPOINT,
+	NCM_BULK_OUT_EP,			// bEndpointAddress
+	0x02,						// bmAttributes = bulk
+	LE_WORD(MAX_PACKET_SIZE),	// wMaxPacketSize
+	0x00,						// bInterval
+// data EP IN
+	0x07,
+	DESC_ENDPOINT,
+	NCM_BULK_IN_EP,				// bEndpointAddress
+	0x02,						// bmAttributes = bulk
+	LE_WORD(MAX_PACKET_SIZE),	// wMaxPacketSize
+	0x00,						// bInterval
+
+	// string descriptors
+	0x04,
+	DESC_STRING,
+	LE_WORD(0x0409),
+
+	0x0E,
+	DESC_STRING,
+	'L', 0, 'P', 0, 'C', 0, 'U', 0, 'S', 0, 'B', 0,
+
+	0x0E,
+	DESC_STRING,
+	'U', 0, 'S', 0, 'B', 0, 'N', 0, 'C', 0, 'M', 0,
+
+	0x12,
+	DESC_STRING,
+	'D', 0, 'E', 0, 'A', 0, 'D', 0, 'C', 0, '0', 0, 'D', 0, 'E', 0,
+
+	// MAC address of the host interface
+	0x1A,
+	DESC_STRING,
+	'0', 0, '2', 0, '4', 0, 'C', 0, '5', 0, '0', 0,
+	'4', 0, '3', 0, '0', 0, '0', 0, '0', 0, '2', 0,
+
+// terminating zero
+	0
+};
+
+
+/**
+	USB frame handler, times the statistics report
+	
+	@param [in]	wFrame	Frame number
+ */
+static void USBFrameHandler(U16 wFrame)
+{
+	if (++wFrameCount >= 1000) {
+		wFrameCount = 0;
+		fReport = TRUE;
+	}
+}
+
+
+/**
+	Prints the NCM traffic of the last second
+ */
+static void ReportStats(void)
+{
+	static TNcmStats Last;
+	TNcmStats Stats;
+
+	NcmGetStats(&Stats);
+	if ((Stats.dwNtbOut != Last.dwNtbOut) || (Stats.dwNtbIn != Last.dwNtbIn)) {
+		printf("out: %u NTBs, %u frames  in: %u NTBs, %u frames  errors: %u\n",
+			Stats.dwNtbOut - Last.dwNtbOut, Stats.dwDatagramsOut - Last.dwDatagramsOut,
+			Stats.dwNtbIn - Last.dwNtbIn, Stats.dwDatagramsIn - Last.dwDatagramsIn,
+			Stats.dwErrors);
+	}
+	Last = Stats;
+}
+
+
+/**
+	Interrupt handler
+	
+	Simply calls the USB ISR, then signals end of interrupt to VIC
+ */
+static void USBIntHandler(void)
+{
+	USBHwISR();
+	VICVectAddr = 0x00;    // dummy write to VIC to signal end of ISR 	
+}
+
+
+/*************************************************************************
+	main
+	====
+**************************************************************************/
+int main(void)
+{
+	// PLL and MAM
+	HalSysInit();
+
+	// init DBG
+	ConsoleInit(60000000 / (16 * BAUD_RATE));
+
+	DBG("Initialising USB stack\n");
+
+	// initialise stack
+	USBInit();
+
+	// register descriptors
+	USBRegisterDescriptors(abDescriptors);
+
+	// register class request handler, and a handler for the alternate
+	// settings of the data interface
+	USBRegisterRequestHandler(REQTYPE_TYPE_CLASS, NcmHandleClassRequest, abClassReqData);
+	USBRegisterCustomReqHandler(NcmHandleStdRequest);
+
+	// register endpoint handlers
+	USBHwRegisterEPIntHandler(NCM_INT_IN_EP, NcmIntIn);
+	USBHwRegisterEPIntHandler(NCM_BULK_IN_EP, NcmBulkIn);
+	USBHwRegisterEPIntHandler(NCM_BULK_OUT_EP, NcmBulkOut);
+
+	// register frame handler for the statistics report
+	USBHwRegisterFrameHandler(USBFrameHandler);
+
+	// frames from the host go to the echo stack
+	NetEchoInit(abNetMac, abNetIp);
+	NcmInit(NetEchoFrame);
+
+	DBG("Starting USB communication\n");
+
+#ifdef LPC214x
+	(*(&VICVectCntl0+INT_VECT_NUM)) = 0x20 | 22; // choose highest priority ISR slot 	
+	(*(&VICVectAddr0+INT_VECT_NUM)) = (int)USBIntHandler;
+#else
+	VICVectCntl22 = 0x01;
+	VICVectAddr22 = (int)USBIntHandler;
+#endif
+
+	// set up USB interrupt
+	VICIntSelect &= ~(1<<22);               // select IRQ for USB
+	VICIntEnable |= (1<<22);
+
+	enableIRQ();
+
+	// connect to bus
+	USBHwConnect(TRUE);
+
+	// the interrupt moves the NTBs, the frames are handled here
+	while (1) {
+		NcmPoll();
+		if (fReport) {
+			fReport = FALSE;
+			ReportStats();
+		}
+	}
+
+	return 0;
+}
@@ -29,6 +29,11 @@
 	Minimal implementation of a USB serial port, using the CDC class.
 	This example application simply echoes everything it receives right back
 	to the host.
+	
+	Built with VCOM_BRIDGE defined (the 'bridge' target), it is a USB to
+	serial converter instead: data is passed between the USB port and
+	UART1 (with RTS/CTS) by interrupts, and the line coding set by the
+	host is applied to the UART.
 
 	Windows:
 	Extract the usbser.sys file from .cab file in C:\WINDOWS\Driver Cache\i386
@@ -64,6 +69,9 @@
 #include "usbapi.h"
 
 #include "serial_fifo.h"
+#ifdef VCOM_BRIDGE
+#include "uart_bridge.h"
+#endif
 
 
 #define BAUD_RATE	115200
@@ -102,9 +110,17 @@ static U8 abClassReqData[8];
 static volatile BOOL fBulkInBusy;
 static volatile BOOL fChainDone;
 
+// set while a bulk OUT packet waits in the endpoint for room in rxfifo,
+// the host gets NAKed meanwhile
+static volatile BOOL fRxBlocked;
+// backpressure statistics
+static volatile U32 dwRxStalls;		// times a packet had to wait
+static volatile U32 dwRxStallMs;	// total waiting time
+
 static U8 txdata[VCOM_FIFO_SIZE];
 static U8 rxdata[VCOM_FIFO_SIZE];
 
+// txfifo: main loop -> USB interrupt, rxfifo: USB interrupt -> main loop
 static fifo_t txfifo;
 static fifo_t rxfifo;
 
@@ -233,22 +249,46 @@ static const U8 abDescriptors[] = {
  */
 static void BulkOut(U8 bEP, U8 bEPStatus)
 {
-	int i, iLen;
+	int iLen;
 
+	if ((bEPStatus & EP_STATUS_DATA) == 0) {
+		// no packet, e.g. raised again after it was read
+		return;
+	}
 	if (fifo_free(&rxfifo) < MAX_PACKET_SIZE) {
-		// may not fit into fifo
+		// may not fit into fifo, leave it in the endpoint until
+		// VCOM_getchar has made room and raises the interrupt again
+		if (!fRxBlocked) {
+			fRxBlocked = TRUE;
+			dwRxStalls++;
+		}
 		return;
 	}
+	fRxBlocked = FALSE;
 
 	// get data from USB into intermediate buffer
 	iLen = USBHwEPRead(bEP, abBulkBuf, sizeof(abBulkBuf));
-	for (i = 0; i < iLen; i++) {
-		// put into FIFO
-		if (!fifo_put(&rxfifo, abBulkBuf[i])) {
-			// overflow... :(
-			ASSERT(FALSE);
-			break;
-		}
+	// put into FIFO
+	if (fifo_put_block(&rxfifo, abBulkBuf, iLen) != iLen) {
+		// overflow... :(
+		ASSERT(FALSE);
+	}
+#ifdef VCOM_BRIDGE
+	BridgeKick();
+#endif
+}
+
+
+/**
+	Continues with a bulk OUT packet left in the endpoint, if rxfifo has
+	room for it now. Call this after taking data from rxfifo.
+ */
+static void RxResume(void)
+{
+	// fRxBlocked is checked after the data was taken, so a packet blocked
+	// by the interrupt in the meantime is not missed
+	if (fRxBlocked && (fifo_free(&rxfifo) >= MAX_PACKET_SIZE)) {
+		USBHwEPRaiseInt(BULK_OUT_EP);
 	}
 }
 
@@ -261,7 +301,8 @@ static void BulkOut(U8 bEP, U8 bEPStatus)
  */
 static void SendNextBulkIn(U8 bEP, BOOL fFirstPacket)
 {
-	int iLen;
+	int iLen, iFree;
+	U8	*pbData;
 
 	// this transfer is done
 	fBulkInBusy = FALSE;
@@ -271,25 +312,33 @@ static void SendNextBulkIn(U8 bEP, BOOL fFirstPacket)
 		fChainDone = FALSE;
 	}
 
-	// last packet?
-	if (fChainDone) {
-		return;
-	}
-	
-	// get up to MAX_PACKET_SIZE bytes from transmit FIFO into intermediate buffer
-	for (iLen = 0; iLen < MAX_PACKET_SIZE; iLen++) {
-		if (!fifo_get(&txfifo, &abBulkBuf[iLen])) {
-			break;
+	// keep both packet buffers filled, but only queue an extra packet
+	// when there is data for it
+	for (iFree = USBHwEPGetFreeBuffers(bEP); iFree > 0; iFree--) {
+		// last packet?
+		if (fChainDone || (fBulkInBusy && (fifo_avail(&txfifo) == 0))) {
+			return;
 		}
-	}
 	
-	// send over USB
-	USBHwEPWrite(bEP, abBulkBuf, iLen);
-	fBulkInBusy = TRUE;
+		// send up to MAX_PACKET_SIZE bytes straight from the transmit FIFO,
+		// unless they wrap around its end
+		iLen = fifo_peek(&txfifo, &pbData);
+		if (iLen < MIN(fifo_avail(&txfifo), MAX_PACKET_SIZE)) {
+			// collect them in the intermediate buffer
+			iLen = fifo_get_block(&txfifo, abBulkBuf, MAX_PACKET_SIZE);
+			USBHwEPWrite(bEP, abBulkBuf, iLen);
+		}
+		else {
+			iLen = MIN(iLen, MAX_PACKET_SIZE);
+			USBHwEPWrite(bEP, pbData, iLen);
+			fifo_skip(&txfifo, iLen);
+		}
+		fBulkInBusy = TRUE;
 
-	// was this a short packet?
-	if (iLen < MAX_PACKET_SIZE) {
-		fChainDone = TRUE;
+		// was this a short packet?
+		if (iLen < MAX_PACKET_SIZE) {
+			fChainDone = TRUE;
+		}
 	}
 }
 
@@ -303,6 +352,10 @@ static void SendNextBulkIn(U8 bEP, BOOL fFirstPacket)
 static void BulkIn(U8 bEP, U8 bEPStatus)
 {
 	SendNextBulkIn(bEP, FALSE);
+#ifdef VCOM_BRIDGE
+	// resume the UART receiver if it waited for room in txfifo
+	BridgeKick();
+#endif
 }
 
 
@@ -315,6 +368,10 @@ static void BulkIn(U8 bEP, U8 bEPStatus)
  */
 static BOOL HandleClassRequest(TSetupPacket *pSetup, int *piLen, U8 **ppbData)
 {
+#ifdef VCOM_BRIDGE
+	int iBaud;
+#endif
+
 	switch (pSetup->bRequest) {
 
 	// set line coding
@@ -327,6 +384,15 @@ DBG("dwDTERate=%u, bCharFormat=%u, bParityType=%u, bDataBits=%u\n",
 	LineCoding.bCharFormat,
 	LineCoding.bParityType,
 	LineCoding.bDataBits);
+#ifdef VCOM_BRIDGE
+		iBaud = BridgeSetLineCoding(LineCoding.dwDTERate, LineCoding.bCharFormat,
+									LineCoding.bParityType, LineCoding.bDataBits);
+		if (iBaud == 0) {
+			// not supported by the UART
+			return FALSE;
+		}
+DBG("UART at %d baud\n", iBaud);
+#endif
 		break;
 
 	// get line coding
@@ -383,7 +449,24 @@ int VCOM_getchar(void)
 {
 	U8 c;
 	
-	return fifo_get(&rxfifo, &c) ? c : EOF;
+	if (!fifo_get(&rxfifo, &c)) {
+		return EOF;
+	}
+	RxResume();
+	return c;
+}
+
+
+/**
+	Gets the receive backpressure statistics of the VCOM port
+	
+	@param [out] pdwStalls	number of times a packet had to wait for room
+	@param [out] pdwStallMs	total time packets waited, in ms
+ */
+void VCOM_getstats(U32 *pdwStalls, U32 *pdwStallMs)
+{
+	*pdwStalls = dwRxStalls;
+	*pdwStallMs = dwRxStallMs;
 }
 
 
@@ -411,6 +494,12 @@ static void USBIntHandler(void)
  */
 static void USBFrameHandler(U16 wFrame)
 {
+	if (fRxBlocked) {
+		dwRxStallMs++;
+	}
+#ifdef VCOM_BRIDGE
+	BridgeKick();
+#endif
 	if (!fBulkInBusy && (fifo_avail(&txfifo) != 0)) {
 		// send first packet
 		SendNextBulkIn(BULK_IN_EP, TRUE);
@@ -427,6 +516,7 @@ static void USBDevIntHandler(U8 bDevStatus)
 {
 	if ((bDevStatus & DEV_STATUS_RESET) != 0) {
 		fBulkInBusy = FALSE;
+		fRxBlocked = FALSE;
 	}
 }
 
@@ -437,7 +527,12 @@ static void USBDevIntHandler(U8 bDevStatus)
 **************************************************************************/
 int main(void)
 {
+#ifdef VCOM_BRIDGE
+	U32 dwOverruns, dwReported;
+#else
 	int c;
+	U32 dwStalls, dwStallMs, dwReported;
+#endif
 	
 	// PLL and MAM
 	HalSysInit();
@@ -474,6 +569,10 @@ int main(void)
 
 	// initialise VCOM
 	VCOM_init();
+#ifdef VCOM_BRIDGE
+	// USB -> rxfifo -> UART1, UART1 -> txfifo -> USB
+	BridgeInit(&rxfifo, &txfifo, RxResume);
+#endif
 
 	DBG("Starting USB communication\n");
 
@@ -494,10 +593,31 @@ int main(void)
 	// connect to bus
 	USBHwConnect(TRUE);
 
+#ifdef VCOM_BRIDGE
+	// the interrupts move all data, bulk OUT stalls are the normal way of
+	// pacing the host to the baud rate, so only report lost data
+	dwReported = 0;
+	while (1) {
+		dwOverruns = BridgeGetOverruns();
+		if (dwOverruns != dwReported) {
+			DBG("\nUART overruns: %d\n", dwOverruns);
+			dwReported = dwOverruns;
+		}
+	}
+#else
 	// echo any character received (do USB stuff in interrupt)
+	dwReported = 0;
 	while (1) {
 		c = VCOM_getchar();
-		if (c != EOF) {
+		if (c == EOF) {
+			// report backpressure when idle
+			VCOM_getstats(&dwStalls, &dwStallMs);
+			if (dwStalls != dwReported) {
+				DBG("\nRX stalls: %d, %d ms\n", dwStalls, dwStallMs);
+				dwReported = dwStalls;
+			}
+		}
+		else {
 			// show on console
 			if ((c == 9) || (c == 10) || (c == 13) || ((c >= 32) && (c <= 126))) {
 				DBG("%c", c);
@@ -505,9 +625,12 @@ int main(void)
 			else {
 				DBG(".");
 			}
-			VCOM_putchar(c);
+			// wait for room rather than drop the character, the USB
+			// interrupt empties the transmit FIFO
+			while (VCOM_putchar(c) == EOF);
 		}
 	}
+#endif
 
 	return 0;
 }
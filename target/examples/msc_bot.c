@@ -90,6 +90,8 @@ static EBotState	eState;
 
 static U8			*pbData;
 
+static BOOL			fDataWait;			/**< data phase waits for the SCSI layer */
+
 
 
 /**
@@ -100,6 +102,7 @@ void MSCBotReset(void)
 	DBG("BOT reset in state %d\n", eState);
 	// reset BOT state
 	eState = eCBW;
+	fDataWait = FALSE;
 	// reset SCSI
 	SCSIReset();
 }
@@ -192,32 +195,42 @@ static void BOTStall(void)
 **************************************************************************/
 static void HandleDataIn(void)
 {
-	int iChunk;
+	int iChunk, iFree;
 	
-	// process data for host in SCSI layer
-	pbData = SCSIHandleData(CBW.CBWCB, CBW.bCBWCBLength, pbData, dwOffset);
-	if (pbData == NULL) {
-		BOTStall();
-		SendCSW(STATUS_FAILED);
-		return;
-	}
+	// keep both packet buffers of the endpoint filled
+	for (iFree = USBHwEPGetFreeBuffers(MSC_BULK_IN_EP); iFree > 0; iFree--) {
+		// data still being read? MSCBotPoll resumes when it is there
+		fDataWait = !SCSIIsDataReady(CBW.CBWCB, dwOffset);
+		if (fDataWait) {
+			return;
+		}
 
-	// send data to host?
-	if (dwOffset < dwTransferSize) {
-		iChunk = MIN(64, dwTransferSize - dwOffset);
-		USBHwEPWrite(MSC_BULK_IN_EP, pbData, iChunk);
-		dwOffset += iChunk;
-	}
-	
-	// are we done now?
-	if (dwOffset == dwTransferSize) {
-		if (dwOffset != CBW.dwCBWDataTransferLength) {
-			// stall pipe
-			DBG("stalling DIN");
+		// process data for host in SCSI layer
+		pbData = SCSIHandleData(CBW.CBWCB, CBW.bCBWCBLength, pbData, dwOffset);
+		if (pbData == NULL) {
 			BOTStall();
+			SendCSW(STATUS_FAILED);
+			return;
+		}
+
+		// send data to host?
+		if (dwOffset < dwTransferSize) {
+			iChunk = MIN(64, dwTransferSize - dwOffset);
+			USBHwEPWrite(MSC_BULK_IN_EP, pbData, iChunk);
+			dwOffset += iChunk;
+		}
+		
+		// are we done now?
+		if (dwOffset == dwTransferSize) {
+			if (dwOffset != CBW.dwCBWDataTransferLength) {
+				// stall pipe
+				DBG("stalling DIN");
+				BOTStall();
+			}
+			// done
+			SendCSW(STATUS_PASSED);
+			return;
 		}
-		// done
-		SendCSW(STATUS_PASSED);
 	}
 }
 
@@ -233,6 +246,13 @@ static void HandleDataOut(void)
 	int iChunk;
 	
 	if (dwOffset < dwTransferSize) {
+		// buffer still being written? leave the packet in the endpoint,
+		// the host gets NAKed until MSCBotPoll resumes
+		fDataWait = !SCSIIsDataReady(CBW.CBWCB, dwOffset);
+		if (fDataWait) {
+			return;
+		}
+		
 		// get data from host
 		iChunk = USBHwEPRead(MSC_BULK_OUT_EP, pbData, dwTransferSize - dwOffset);
 		// process data in SCSI layer
@@ -247,12 +267,17 @@ static void HandleDataOut(void)
 	
 	// are we done now?
 	if (dwOffset == dwTransferSize) {
+		// report the status only when all data is written
+		fDataWait = !SCSIIsDataReady(CBW.CBWCB, dwOffset);
+		if (fDataWait) {
+			return;
+		}
 		if (dwOffset != CBW.dwCBWDataTransferLength) {
 			// stall pipe
 			DBG("stalling DOUT");
 			BOTStall();
 		}
-		SendCSW(STATUS_PASSED);
+		SendCSW(SCSIIsDataFailed() ? STATUS_FAILED : STATUS_PASSED);
 	}
 }
 		
@@ -273,6 +298,10 @@ void MSCBotBulkOut(U8 bEP, U8 bEPStatus)
 	if (bEPStatus & EP_STATUS_STALLED) {
 		return;
 	}
+	// ignore events for packets that MSCBotPoll already read
+	if ((bEPStatus & EP_STATUS_DATA) == 0) {
+		return;
+	}
 
 	switch (eState) {
 
@@ -358,6 +387,50 @@ void MSCBotBulkOut(U8 bEP, U8 bEPStatus)
 }
 
 
+/**
+	Local function to continue a data phase that waits for the SCSI layer
+ */
+static void ResumeData(void)
+{
+	if (!fDataWait || !SCSIIsDataReady(CBW.CBWCB, dwOffset)) {
+		return;
+	}
+	
+	if (eState == eDataIn) {
+		HandleDataIn();
+	}
+	else if (eState == eDataOut) {
+		// handle the packets that were left in the endpoint, their
+		// interrupts have passed already
+		fDataWait = FALSE;
+		while (!fDataWait && (eState == eDataOut)) {
+			if ((dwOffset < dwTransferSize) &&
+				(USBHwEPGetFreeBuffers(MSC_BULK_OUT_EP) == 2)) {
+				// no packet yet, the next one raises an interrupt
+				break;
+			}
+			HandleDataOut();
+		}
+	}
+}
+
+
+/**
+	Performs background work of the BOT layer, call this regularly from
+	the main loop (in the same context as the endpoint handlers).
+	
+	Lets the SCSI layer work with the block device and resumes a data
+	phase that was waiting for it.
+ */
+void MSCBotPoll(void)
+{
+	// keep the endpoints busy while the block device works
+	ResumeData();
+	SCSIPoll();
+	ResumeData();
+}
+
+
 /**
 	Handles the BOT bulk IN endpoint
 		
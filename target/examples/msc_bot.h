@@ -33,4 +33,5 @@
 void MSCBotReset(void);
 void MSCBotBulkOut(U8 bEP, U8 bEPStatus);
 void MSCBotBulkIn(U8 bEP, U8 bEPStatus);
+void MSCBotPoll(void);
 
@@ -29,12 +29,24 @@
 	@file
 
 	This is the SCSI layer of the USB mass storage application example.
-	This layer depends directly on the blockdev layer.
+	This layer accesses the blockdev layer through the write-back block
+	cache.
 	
 	Windows peculiarities:
 	* Size of REQUEST SENSE CDB is 12 bytes instead of expected 6
 	* Windows requires VERIFY(10) command to do a format.
 	  This command is not mandatory in the SBC/SBC-2 specification.
+
+	READ(10) data is staged in a ring of SCSI_NUM_BLOCKBUFS block buffers.
+	SCSIPoll submits reads of free buffers to the block device from the
+	main loop, so the block device is read while previous blocks are
+	still being sent. Consecutive free buffers are filled with one
+	multiple block read.
+	WRITE(10) data is collected in the same buffers, each half of them is
+	written with one multiple block write when it is full or the transfer
+	ends. The other half takes the next data meanwhile.
+	SCSIIsDataReady tells the BOT layer when it has to wait for the block
+	device, SCSIPoll handles the block device completions.
 */
 
 
@@ -44,17 +56,25 @@
 #include "debug.h"
 
 #include "blockdev.h"
+#include "blockcache.h"
 #include "msc_scsi.h"
 
 
 #define BLOCKSIZE		512
 
+#ifndef SCSI_NUM_BLOCKBUFS
+#define SCSI_NUM_BLOCKBUFS	4		// number of block buffers for READ(10)/WRITE(10)
+#endif
+#define SCSI_WRITE_BATCH	(SCSI_NUM_BLOCKBUFS / 2)	// blocks per WRITE(10) request
+
 // SBC2 mandatory SCSI commands
 #define	SCSI_CMD_TEST_UNIT_READY	0x00
 #define SCSI_CMD_REQUEST_SENSE		0x03
 #define SCSI_CMD_FORMAT_UNIT		0x04
 #define SCSI_CMD_READ_6				0x08	/* not implemented yet */
 #define SCSI_CMD_INQUIRY			0x12
+#define SCSI_CMD_MODE_SENSE_6		0x1A
+#define SCSI_CMD_START_STOP_UNIT	0x1B
 #define SCSI_CMD_SEND_DIAGNOSTIC	0x1D	/* not implemented yet */
 #define SCSI_CMD_READ_CAPACITY_10	0x25
 #define SCSI_CMD_READ_10			0x28
@@ -64,6 +84,12 @@
 #define SCSI_CMD_WRITE_6			0x0A	/* not implemented yet */
 #define SCSI_CMD_WRITE_10			0x2A
 #define SCSI_CMD_VERIFY_10			0x2F	/* required for windows format */
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10	0x35
+#define SCSI_CMD_MODE_SENSE_10		0x5A
+
+// mode pages
+#define MODE_PAGE_CACHING			0x08
+#define MODE_PAGE_ALL				0x3F
 
 // sense codes
 #define WRITE_ERROR				0x030C00
@@ -89,13 +115,47 @@ static const U8		abInquiry[] = {
 	'0','.','1',' '						// revision
 };
 
+//	Caching mode page, reports the write-back cache (WCE bit)
+static const U8 abCachingPage[] = {
+	MODE_PAGE_CACHING,
+	0x12,		// page length
+	0x04,		// WCE = write cache enabled, RCD = 0
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
 //	Data for "request sense" command. The 0xFF are filled in later
 static const U8 abSense[] = { 0x70, 0x00, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x0A, 
 							  0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00,
 							  0x00, 0x00 };
 
-//	Buffer for holding one block of disk data
-static U8 abBlockBuf[BLOCKSIZE];
+//	Buffers for holding blocks of disk data, commands other than READ(10)
+//	only use the first one
+static U8 aabBlockBuf[SCSI_NUM_BLOCKBUFS][BLOCKSIZE] BLOCKDEV_BUF_ATTR;
+#define abBlockBuf	aabBlockBuf[0]
+
+//	READ(10) staging state, block i of the transfer is held in buffer
+//	i % SCSI_NUM_BLOCKBUFS
+static BOOL			fReadActive;	// READ(10) in progress
+static BOOL			fReadError;		// read ahead failed
+static U32			dwReadLBA;		// first block of the transfer
+static U32			dwReadBlocks;	// number of blocks in the transfer
+static U32			dwReadFetched;	// number of blocks read from the device
+static U32			dwReadSubmitted;// number of blocks requested from the device
+static U32			dwReadConsumed;	// number of blocks handed out completely
+static TBlockDevReq	ReadReq;
+
+//	WRITE(10) state, one request per half of the buffers
+static TBlockDevReq	aWriteReq[2];
+static BOOL			afWriteBusy[2];	// request of this half is in progress
+static BOOL			fWriteError;	// a write failed
+
+//	Number of block device requests in progress
+static int			iReqPending;
+
+//	Throughput counters
+static U32			dwBytesRead;
+static U32			dwBytesWritten;
 
 
 typedef struct {
@@ -106,6 +166,21 @@ typedef struct {
 } TCDB6;
 
 
+/*************************************************************************
+	SCSIWaitIdle
+	============
+		Waits until all block device requests of the current command are
+		done, so their buffers can be used for something else
+		
+**************************************************************************/
+static void SCSIWaitIdle(void)
+{
+	while (iReqPending > 0) {
+		BlockDevPoll();
+	}
+}
+
+
 /*************************************************************************
 	SCSIReset
 	=========
@@ -114,7 +189,204 @@ typedef struct {
 **************************************************************************/
 void SCSIReset(void)
 {
+	SCSIWaitIdle();
 	dwSense = 0;
+	fReadActive = FALSE;
+}
+
+
+/*************************************************************************
+	SCSIReadDone
+	============
+		Completion callback of READ(10) block device requests
+		
+	IN		pReq		ReadReq
+**************************************************************************/
+static void SCSIReadDone(TBlockDevReq *pReq)
+{
+	iReqPending--;
+	if (!pReq->fOk) {
+		DBG("Block read failed\n");
+		fReadError = TRUE;
+		return;
+	}
+	dwReadFetched += pReq->iCount;
+	dwBytesRead += pReq->iCount * BLOCKSIZE;
+}
+
+
+/*************************************************************************
+	SCSIReadAhead
+	=============
+		Submits a read of the next blocks of a READ(10) transfer into
+		free buffers
+		
+	Unless the data is needed right away, this waits until half of the
+	buffers can be filled with one multiple block read. Only one read
+	is in progress at a time.
+	
+	IN		fNow		TRUE if the data is needed right away
+	
+	Returns TRUE if a read was submitted
+**************************************************************************/
+static BOOL SCSIReadAhead(BOOL fNow)
+{
+	int		iSlot, iCount, iMin, iLeft;
+	
+	if (!fReadActive || fReadError || (dwReadSubmitted != dwReadFetched) ||
+		(dwReadFetched == dwReadBlocks)) {
+		return FALSE;
+	}
+	
+	// free buffers up to the end of the ring, limited by the transfer
+	iLeft = dwReadBlocks - dwReadFetched;
+	iSlot = dwReadFetched % SCSI_NUM_BLOCKBUFS;
+	iCount = SCSI_NUM_BLOCKBUFS - (dwReadFetched - dwReadConsumed);
+	iCount = MIN(iCount, SCSI_NUM_BLOCKBUFS - iSlot);
+	iCount = MIN(iCount, iLeft);
+	
+	iMin = fNow ? 1 : MIN(SCSI_NUM_BLOCKBUFS / 2, SCSI_NUM_BLOCKBUFS - iSlot);
+	iMin = MIN(iMin, iLeft);
+	if ((iCount == 0) || (iCount < iMin)) {
+		return FALSE;
+	}
+	
+	DBG("R");
+	ReadReq.fWrite = FALSE;
+	ReadReq.dwBlock = dwReadLBA + dwReadFetched;
+	ReadReq.pbBuf = aabBlockBuf[iSlot];
+	ReadReq.iCount = iCount;
+	ReadReq.pfnDone = SCSIReadDone;
+	dwReadSubmitted += iCount;
+	iReqPending++;
+	if (!BlockCacheSubmit(&ReadReq)) {
+		// try again on the next poll
+		dwReadSubmitted -= iCount;
+		iReqPending--;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/*************************************************************************
+	SCSIWriteDone
+	=============
+		Completion callback of WRITE(10) block device requests
+		
+	IN		pReq		One of aWriteReq
+**************************************************************************/
+static void SCSIWriteDone(TBlockDevReq *pReq)
+{
+	iReqPending--;
+	afWriteBusy[pReq - aWriteReq] = FALSE;
+	if (!pReq->fOk) {
+		DBG("Block write failed\n");
+		fWriteError = TRUE;
+		dwSense = WRITE_ERROR;
+		return;
+	}
+	dwBytesWritten += pReq->iCount * BLOCKSIZE;
+}
+
+
+/*************************************************************************
+	SCSIPoll
+	========
+		Performs background work of the SCSI layer, call this regularly
+		from the main loop.
+		
+	Reads ahead blocks of an ongoing READ(10) transfer if buffers are
+	free. Once all blocks of the transfer are requested, the block cache
+	may read ahead for the next READ(10) of a sequential stream. Then the
+	block device gets to work on the requests.
+**************************************************************************/
+void SCSIPoll(void)
+{
+	if (fReadActive && !fReadError && (dwReadSubmitted < dwReadBlocks)) {
+		// hurry if the block being sent is not there yet
+		SCSIReadAhead(dwReadFetched <= dwReadConsumed);
+	}
+	else {
+		BlockCachePoll();
+	}
+	BlockDevPoll();
+}
+
+
+/*************************************************************************
+	SCSIIsDataReady
+	===============
+		Checks if SCSIHandleData can handle the data at an offset without
+		waiting for the block device.
+		
+	IN		pbCDB		Command data block
+			dwOffset	Offset in data
+	
+	For READ(10), the block at dwOffset must have been read. For
+	WRITE(10), the buffer at dwOffset must not be in use by a write and
+	at the end of the data all writes must be done.
+	
+	Returns FALSE if the block device is still busy with the data
+**************************************************************************/
+BOOL SCSIIsDataReady(U8 *pbCDB, U32 dwOffset)
+{
+	U32 dwLen;
+
+	switch (pbCDB[0]) {
+	
+	case SCSI_CMD_READ_10:
+		if (!fReadActive || fReadError) {
+			return TRUE;
+		}
+		return ((dwOffset / BLOCKSIZE) < dwReadFetched) ||
+			   ((dwOffset / BLOCKSIZE) >= dwReadBlocks);
+	
+	case SCSI_CMD_WRITE_10:
+		dwLen = (pbCDB[7] << 8) | pbCDB[8];
+		if (fWriteError) {
+			return TRUE;
+		}
+		if (dwOffset >= (dwLen * BLOCKSIZE)) {
+			return !afWriteBusy[0] && !afWriteBusy[1];
+		}
+		return !afWriteBusy[(dwOffset % (SCSI_NUM_BLOCKBUFS * BLOCKSIZE)) /
+							(SCSI_WRITE_BATCH * BLOCKSIZE)];
+	
+	default:
+		return TRUE;
+	}
+}
+
+
+/*************************************************************************
+	SCSIIsDataFailed
+	================
+		Checks if the block device failed on the data of the current
+		command. Writes only fail after SCSIHandleData accepted the data,
+		so the BOT layer checks this before it reports success.
+	
+	Returns TRUE if a block device request failed, a sense code is set
+**************************************************************************/
+BOOL SCSIIsDataFailed(void)
+{
+	return fWriteError;
+}
+
+
+/*************************************************************************
+	SCSIGetCounters
+	===============
+		Gets the number of bytes read from and written to the block device
+		since startup. The counters wrap around.
+		
+	OUT		*pdwRead	Bytes read
+			*pdwWritten	Bytes written
+**************************************************************************/
+void SCSIGetCounters(U32 *pdwRead, U32 *pdwWritten)
+{
+	*pdwRead = dwBytesRead;
+	*pdwWritten = dwBytesWritten;
 }
 
 
@@ -147,6 +419,11 @@ U8 * SCSIHandleCmd(U8 *pbCDB, U8 iCDBLen, int *piRspLen, BOOL *pfDevIn)
 	// default direction is from device to host
 	*pfDevIn = TRUE;
 	
+	// a new command ends any read ahead, and may reuse its buffers
+	SCSIWaitIdle();
+	fReadActive = FALSE;
+	fWriteError = FALSE;
+	
 	// check CDB length
 	bGroupCode = (pCDB->bOperationCode >> 5) & 0x7;
 	if (iCDBLen < aiCDBLen[bGroupCode]) {
@@ -186,6 +463,36 @@ U8 * SCSIHandleCmd(U8 *pbCDB, U8 iCDBLen, int *piRspLen, BOOL *pfDevIn)
 		DBG("READ CAPACITY\n");
 		*piRspLen = 8;
 		break;
+	
+	// mode sense (6)/(10), only the caching page
+	case SCSI_CMD_MODE_SENSE_6:
+	case SCSI_CMD_MODE_SENSE_10:
+		DBG("MODE SENSE page %02X\n", pbCDB[2]);
+		if (((pbCDB[2] & 0x3F) != MODE_PAGE_CACHING) &&
+			((pbCDB[2] & 0x3F) != MODE_PAGE_ALL)) {
+			dwSense = INVALID_FIELD_IN_CDB;
+			*piRspLen = 0;
+			return NULL;
+		}
+		if (pCDB->bOperationCode == SCSI_CMD_MODE_SENSE_6) {
+			*piRspLen = MIN(4 + sizeof(abCachingPage), pCDB->bLength);
+		}
+		else {
+			dwLen = (pbCDB[7] << 8) | pbCDB[8];
+			*piRspLen = MIN(8 + sizeof(abCachingPage), dwLen);
+		}
+		break;
+	
+	// synchronize cache (10), start stop unit (6)
+	case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+	case SCSI_CMD_START_STOP_UNIT:
+		DBG("SYNC CACHE/START STOP %02X\n", pCDB->bOperationCode);
+		*piRspLen = 0;
+		if (!BlockCacheFlush()) {
+			dwSense = WRITE_ERROR;
+			return NULL;
+		}
+		break;
 		
 	// read (10)
 	case SCSI_CMD_READ_10:
@@ -193,6 +500,14 @@ U8 * SCSIHandleCmd(U8 *pbCDB, U8 iCDBLen, int *piRspLen, BOOL *pfDevIn)
 		dwLen = (pbCDB[7] << 8) | pbCDB[8];
 		DBG("READ10, LBA=%d, len=%d\n", dwLBA, dwLen);
 		*piRspLen = dwLen * BLOCKSIZE;
+		// start staging blocks
+		dwReadLBA = dwLBA;
+		dwReadBlocks = dwLen;
+		dwReadFetched = 0;
+		dwReadSubmitted = 0;
+		dwReadConsumed = 0;
+		fReadError = FALSE;
+		fReadActive = TRUE;
 		break;
 
 	// write (10)
@@ -249,7 +564,9 @@ U8 * SCSIHandleCmd(U8 *pbCDB, U8 iCDBLen, int *piRspLen, BOOL *pfDevIn)
 U8 * SCSIHandleData(U8 *pbCDB, U8 iCDBLen, U8 *pbData, U32 dwOffset)
 {
 	TCDB6	*pCDB;
-	U32		dwLBA;
+	U32		dwLBA, dwLen;
+	int		iCount, iHalf;
+	TBlockDevReq	*pReq;
 	U32		dwBufPos, dwBlockNr;
 	U32		dwDevSize, dwMaxBlock;
 	
@@ -301,41 +618,84 @@ U8 * SCSIHandleData(U8 *pbCDB, U8 iCDBLen, U8 *pbData, U32 dwOffset)
 		pbData[6] = (BLOCKSIZE >> 8) & 0xFF;
 		pbData[7] = (BLOCKSIZE >> 0) & 0xFF;
 		break;
+	
+	// mode sense: header without block descriptors and the caching page
+	case SCSI_CMD_MODE_SENSE_6:
+		pbData[0] = 3 + sizeof(abCachingPage);	// mode data length
+		pbData[1] = 0;							// medium type
+		pbData[2] = 0;							// device specific, no WP
+		pbData[3] = 0;							// block descriptor length
+		memcpy(pbData + 4, abCachingPage, sizeof(abCachingPage));
+		break;
+		
+	case SCSI_CMD_MODE_SENSE_10:
+		memset(pbData, 0, 8);
+		pbData[1] = 6 + sizeof(abCachingPage);	// mode data length
+		memcpy(pbData + 8, abCachingPage, sizeof(abCachingPage));
+		break;
+	
+	case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+	case SCSI_CMD_START_STOP_UNIT:
+		// already done
+		break;
 		
 	// read10
 	case SCSI_CMD_READ_10:
-		dwLBA = (pbCDB[2] << 24) | (pbCDB[3] << 16) | (pbCDB[4] << 8) | (pbCDB[5]);
-
-		// copy data from block buffer
+		// block of the transfer that holds the data
+		dwBlockNr = dwOffset / BLOCKSIZE;
 		dwBufPos = (dwOffset & (BLOCKSIZE - 1));
+		if (dwBlockNr >= dwReadBlocks) {
+			// all data sent
+			return abBlockBuf;
+		}
 		if (dwBufPos == 0) {
-			// read new block
-			dwBlockNr = dwLBA + (dwOffset / BLOCKSIZE);
-			DBG("R");
-			if (BlockDevRead(dwBlockNr, abBlockBuf) < 0) {
-				dwSense = READ_ERROR;
-				DBG("BlockDevRead failed\n");
-				return NULL;
-			}
+			// previous block is done, its buffer can be reused
+			dwReadConsumed = dwBlockNr;
+		}
+		// the BOT layer waits for SCSIIsDataReady, so the block is there
+		// unless reading failed
+		if (fReadError || (dwBlockNr >= dwReadFetched)) {
+			dwSense = READ_ERROR;
+			return NULL;
 		}
 		// return pointer to data
-		return abBlockBuf + dwBufPos;
+		return aabBlockBuf[dwBlockNr % SCSI_NUM_BLOCKBUFS] + dwBufPos;
 
 	// write10
 	case SCSI_CMD_WRITE_10:
 		dwLBA = (pbCDB[2] << 24) | (pbCDB[3] << 16) | (pbCDB[4] << 8) | (pbCDB[5]);
+		dwLen = (pbCDB[7] << 8) | pbCDB[8];
 		
-		// copy data to block buffer
-		dwBufPos = ((dwOffset + 64) & (BLOCKSIZE - 1));
-		if (dwBufPos == 0) {
-			// write new block
-			dwBlockNr = dwLBA + (dwOffset / BLOCKSIZE);
+		if (fWriteError) {
+			return NULL;
+		}
+		
+		// copy data to block buffers
+		dwBufPos = ((dwOffset + 64) % (SCSI_NUM_BLOCKBUFS * BLOCKSIZE));
+		dwBlockNr = dwOffset / BLOCKSIZE;
+		if ((((dwOffset + 64) & (BLOCKSIZE - 1)) == 0) &&
+			(((dwBufPos % (SCSI_WRITE_BATCH * BLOCKSIZE)) == 0) || (dwBlockNr == (dwLen - 1)))) {
+			// half of the buffers full or last block: write the collected blocks
+			iCount = (dwBlockNr % SCSI_WRITE_BATCH) + 1;
+			iHalf = (dwBlockNr % SCSI_NUM_BLOCKBUFS) / SCSI_WRITE_BATCH;
+			pReq = &aWriteReq[iHalf];
+			pReq->fWrite = TRUE;
+			pReq->dwBlock = dwLBA + dwBlockNr + 1 - iCount;
+			pReq->pbBuf = aabBlockBuf[iHalf * SCSI_WRITE_BATCH];
+			pReq->iCount = iCount;
+			pReq->pfnDone = SCSIWriteDone;
 			DBG("W");
-			if (BlockDevWrite(dwBlockNr, abBlockBuf) < 0) {
+			afWriteBusy[iHalf] = TRUE;
+			iReqPending++;
+			if (!BlockCacheSubmit(pReq)) {
+				afWriteBusy[iHalf] = FALSE;
+				iReqPending--;
 				dwSense = WRITE_ERROR;
-				DBG("BlockDevWrite failed\n");
+				DBG("BlockCacheSubmit failed\n");
 				return NULL;
 			}
+			// get the device going right away
+			BlockDevPoll();
 		}
 		// return pointer to next data
 		return abBlockBuf + dwBufPos;
@@ -30,3 +30,7 @@
 void	SCSIReset(void);
 U8 *	SCSIHandleCmd(U8 *pbCDB, U8 bCDBLen, int *piRspLen, BOOL *pfDevIn);
 U8 *	SCSIHandleData(U8 *pbCDB, U8 bCDBLen, U8 *pbData, U32 dwOffset);
+BOOL	SCSIIsDataReady(U8 *pbCDB, U32 dwOffset);
+BOOL	SCSIIsDataFailed(void);
+void	SCSIPoll(void);
+void	SCSIGetCounters(U32 *pdwRead, U32 *pdwWritten);
@@ -0,0 +1,655 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+	CDC-NCM (Network Control Model) function
+	
+	Ethernet frames (datagrams) are exchanged with the host in NCM
+	Transfer Blocks (NTBs), so one bulk transfer carries many datagrams
+	and the per transfer USB overhead is shared by all of them. Only the
+	16-bit NTB format is supported, without CRCs.
+	
+	OUT: NcmBulkOut collects an NTB into one of two buffers, NcmPoll walks
+	its datagram pointer tables and hands every datagram to the receive
+	callback. When both buffers still wait for NcmPoll, the packet is left
+	in the endpoint (the host gets NAKed) until NcmPoll frees one.
+	
+	IN: datagrams are built in the NTB being filled, with NcmAllocDatagram
+	and NcmSendDatagram. NcmPoll closes it as soon as the bulk IN pipe is
+	idle and NcmBulkIn sends it, while the next datagrams are collected
+	in the other buffer. So a lone datagram goes out right away, and the
+	datagrams that come in while an NTB is on the bus are aggregated.
+	
+	Buffers are handed over between the interrupt and the main loop with
+	aiOutLen and iInSendLen, a buffer is only touched by one side at a time.
+*/
+
+#include <string.h>			// memcpy
+
+#include "type.h"
+#include "debug.h"
+
+#include "usbapi.h"
+#include "usbhw_lpc.h"		// USBHwEPConfig
+
+#include "ncm.h"
+
+#define MAX_PACKET_SIZE		64
+
+#define LE_WORD(x)			((x)&0xFF),((x)>>8)
+#define LE_DWORD(x)			LE_WORD((x)&0xFFFF),LE_WORD((x)>>16)
+
+// NTB structures
+#define NTH16_SIGNATURE		0x484D434E	// "NCMH"
+#define NDP16_SIGNATURE		0x304D434E	// "NCM0", no CRC
+#define NTH16_SIZE			12
+#define NDP16_HEADER		8
+#define NDP16_ENTRY			4
+#define NCM_ALIGN			4			// NDP and datagram alignment
+#define NCM_ALIGN_UP(x)		(((x) + NCM_ALIGN - 1) & ~(NCM_ALIGN - 1))
+#define NCM_MIN_NTB_SIZE	2048		// smallest dwNtbInMaxSize allowed
+
+// class requests
+#define SET_ETHERNET_PACKET_FILTER	0x43
+#define GET_NTB_PARAMETERS			0x80
+#define GET_NTB_FORMAT				0x83
+#define SET_NTB_FORMAT				0x84
+#define GET_NTB_INPUT_SIZE			0x85
+#define SET_NTB_INPUT_SIZE			0x86
+
+// notifications
+#define NETWORK_CONNECTION			0x00
+#define CONNECTION_SPEED_CHANGE		0x2A
+#define NCM_BITRATE					12000000	// full speed
+
+enum {
+	eNotifyNone,
+	eNotifySpeed,
+	eNotifyConnect
+};
+
+
+static const U8 abNtbParameters[] = {
+	LE_WORD(28),				// wLength
+	LE_WORD(0x0001),			// bmNtbFormatsSupported = NTB16
+	LE_DWORD(NCM_NTB_SIZE),		// dwNtbInMaxSize
+	LE_WORD(NCM_ALIGN),			// wNdpInDivisor
+	LE_WORD(0),					// wNdpInPayloadRemainder
+	LE_WORD(NCM_ALIGN),			// wNdpInAlignment
+	LE_WORD(0),					// wReserved
+	LE_DWORD(NCM_NTB_SIZE),		// dwNtbOutMaxSize
+	LE_WORD(NCM_ALIGN),			// wNdpOutDivisor
+	LE_WORD(0),					// wNdpOutPayloadRemainder
+	LE_WORD(NCM_ALIGN),			// wNdpOutAlignment
+	LE_WORD(0)					// wNtbOutMaxDatagrams = no limit
+};
+
+static TFnNcmRecv	*_pfnRecv;
+static U8			bDataAlt;			// alternate setting of the data interface
+static U8			bNotify;			// next notification
+static volatile U32	dwInMaxSize;		// dwNtbInMaxSize, may be lowered by the host
+static volatile BOOL fReset;			// NcmPoll resets its state
+
+// OUT NTBs
+static U8			aabOutNtb[2][NCM_NTB_SIZE] __attribute__ ((aligned(4)));
+static volatile int	aiOutLen[2];		// length of a received NTB, 0 = free
+static int			iOutFill;			// interrupt: buffer being received
+static int			iOutPos;			// interrupt: bytes received so far
+static BOOL			fOutDiscard;		// interrupt: NTB too long, drop it
+static volatile BOOL fOutBlocked;		// a packet waits in the endpoint
+static volatile U32	dwOutDropped;		// interrupt: NTBs dropped
+static int			iOutParse;			// main loop: buffer being parsed
+static int			iNdpPos;			// main loop: current NDP, -1 = NTH not parsed
+static int			iNdpEntry;			// main loop: next datagram of the NDP
+
+// IN NTBs
+static U8			aabInNtb[2][NCM_NTB_SIZE] __attribute__ ((aligned(4)));
+static int			iInFill;			// main loop: buffer being built
+static int			iInPos;				// main loop: end of the last datagram
+static int			iInCount;			// main loop: datagrams in it
+static U16			awInIndex[NCM_MAX_DATAGRAMS];
+static U16			awInLen[NCM_MAX_DATAGRAMS];
+static U16			wInSequence;
+static U8 * volatile pbInSend;			// NTB handed to the interrupt
+static volatile int	iInSendLen;			// its length, 0 = pipe idle
+static int			iInSendPos;			// interrupt: bytes written
+
+static TNcmStats	Stats;				// main loop only
+
+
+static U16 GetLE16(const U8 *pb)
+{
+	return pb[0] | (pb[1] << 8);
+}
+
+
+static U32 GetLE32(const U8 *pb)
+{
+	return pb[0] | (pb[1] << 8) | (pb[2] << 16) | ((U32)pb[3] << 24);
+}
+
+
+static void PutLE16(U8 *pb, U16 w)
+{
+	pb[0] = w & 0xFF;
+	pb[1] = w >> 8;
+}
+
+
+static void PutLE32(U8 *pb, U32 dw)
+{
+	pb[0] = dw & 0xFF;
+	pb[1] = (dw >> 8) & 0xFF;
+	pb[2] = (dw >> 16) & 0xFF;
+	pb[3] = dw >> 24;
+}
+
+
+/**
+	Local function to send the next pending notification, the interrupt
+	endpoint holds one at a time
+ */
+static void NcmNotify(void)
+{
+	U8	abBuf[16];
+	int	iLen;
+	
+	if ((bNotify == eNotifyNone) || (USBHwEPGetFreeBuffers(NCM_INT_IN_EP) == 0)) {
+		return;
+	}
+	
+	abBuf[0] = 0xA1;				// bmRequestType
+	PutLE16(&abBuf[4], NCM_COMM_IF);	// wIndex
+	if (bNotify == eNotifySpeed) {
+		abBuf[1] = CONNECTION_SPEED_CHANGE;
+		PutLE16(&abBuf[2], 0);
+		PutLE16(&abBuf[6], 8);
+		PutLE32(&abBuf[8], NCM_BITRATE);	// DLBitRate
+		PutLE32(&abBuf[12], NCM_BITRATE);	// ULBitRate
+		iLen = 16;
+		bNotify = eNotifyConnect;
+	}
+	else {
+		abBuf[1] = NETWORK_CONNECTION;
+		PutLE16(&abBuf[2], 1);				// connected
+		PutLE16(&abBuf[6], 0);
+		iLen = 8;
+		bNotify = eNotifyNone;
+	}
+	USBHwEPWrite(NCM_INT_IN_EP, abBuf, iLen);
+}
+
+
+/**
+	Interrupt IN endpoint handler, sends the next notification
+		
+	@param [in] bEP
+	@param [in] bEPStatus
+ */
+void NcmIntIn(U8 bEP, U8 bEPStatus)
+{
+	NcmNotify();
+}
+
+
+/**
+	Local function to select an alternate setting of the data interface.
+	Both settings start from a clean state, setting 1 enables the bulk
+	endpoints and reports the connection to the host.
+ */
+static void NcmSetDataAlt(U8 bAlt)
+{
+	bDataAlt = bAlt;
+	
+	// reset the interrupt side, NcmPoll resets its own
+	iOutFill = 0;
+	iOutPos = 0;
+	fOutDiscard = FALSE;
+	fOutBlocked = FALSE;
+	aiOutLen[0] = 0;
+	aiOutLen[1] = 0;
+	iInSendLen = 0;
+	fReset = TRUE;
+	
+	bNotify = eNotifyNone;
+	if (bAlt == 1) {
+		USBHwEPConfig(NCM_BULK_OUT_EP, MAX_PACKET_SIZE);
+		USBHwEPConfig(NCM_BULK_IN_EP, MAX_PACKET_SIZE);
+		bNotify = eNotifySpeed;
+		NcmNotify();
+	}
+}
+
+
+/**
+	Standard request handler for the alternate settings of the data
+	interface, to be installed with USBRegisterCustomReqHandler
+		
+	@param [in] pSetup
+	@param [out] piLen
+	@param [out] ppbData
+	
+	@return TRUE if the request was handled
+ */
+BOOL NcmHandleStdRequest(TSetupPacket *pSetup, int *piLen, U8 **ppbData)
+{
+	if ((REQTYPE_GET_RECIP(pSetup->bmRequestType) != REQTYPE_RECIP_INTERFACE) ||
+		(pSetup->wIndex != NCM_DATA_IF)) {
+		return FALSE;
+	}
+	
+	switch (pSetup->bRequest) {
+	
+	case REQ_GET_INTERFACE:
+		(*ppbData)[0] = bDataAlt;
+		*piLen = 1;
+		break;
+		
+	case REQ_SET_INTERFACE:
+		if (pSetup->wValue > 1) {
+			return FALSE;
+		}
+		NcmSetDataAlt(pSetup->wValue);
+		*piLen = 0;
+		break;
+		
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/**
+	NCM class request handler
+		
+	@param [in] pSetup
+	@param [in,out] piLen
+	@param [in,out] ppbData
+	
+	@return TRUE if the request was handled
+ */
+BOOL NcmHandleClassRequest(TSetupPacket *pSetup, int *piLen, U8 **ppbData)
+{
+	U8	*pbData = *ppbData;
+	U32	dwSize;
+	
+	switch (pSetup->bRequest) {
+	
+	case SET_ETHERNET_PACKET_FILTER:
+		// everything goes to the receive callback anyway
+		*piLen = 0;
+		break;
+		
+	case GET_NTB_PARAMETERS:
+		*ppbData = (U8 *)abNtbParameters;
+		*piLen = sizeof(abNtbParameters);
+		break;
+		
+	case GET_NTB_FORMAT:
+		PutLE16(pbData, 0);		// NTB16
+		*piLen = 2;
+		break;
+		
+	case SET_NTB_FORMAT:
+		if (pSetup->wValue != 0) {
+			return FALSE;
+		}
+		*piLen = 0;
+		break;
+		
+	case GET_NTB_INPUT_SIZE:
+		PutLE32(pbData, dwInMaxSize);
+		*piLen = 4;
+		break;
+		
+	case SET_NTB_INPUT_SIZE:
+		// dwNtbInMaxSize, optionally followed by wNtbInMaxDatagrams
+		dwSize = GetLE32(pbData);
+		if (dwSize < NCM_MIN_NTB_SIZE) {
+			return FALSE;
+		}
+		dwInMaxSize = MIN(dwSize, NCM_NTB_SIZE);
+		break;
+		
+	default:
+		DBG("NCM req %02X not supported\n", pSetup->bRequest);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/**
+	Bulk OUT handler, collects an NTB
+		
+	@param [in] bEP
+	@param [in] bEPStatus
+ */
+void NcmBulkOut(U8 bEP, U8 bEPStatus)
+{
+	int iLen;
+	
+	if ((bEPStatus & EP_STATUS_DATA) == 0) {
+		// no packet, e.g. raised again after it was read
+		return;
+	}
+	if (aiOutLen[iOutFill] != 0) {
+		// both buffers wait for NcmPoll, which raises the interrupt again
+		fOutBlocked = TRUE;
+		return;
+	}
+	fOutBlocked = FALSE;
+	
+	if (fOutDiscard) {
+		iLen = USBHwEPRead(bEP, NULL, 0);
+	}
+	else {
+		iLen = USBHwEPRead(bEP, &aabOutNtb[iOutFill][iOutPos], NCM_NTB_SIZE - iOutPos);
+		if (iLen > (NCM_NTB_SIZE - iOutPos)) {
+			// longer than announced in dwNtbOutMaxSize
+			fOutDiscard = TRUE;
+		}
+		else if (iLen > 0) {
+			iOutPos += iLen;
+		}
+	}
+	
+	// an NTB ends with a short packet, or when it has the maximum size
+	if ((iLen < MAX_PACKET_SIZE) || (!fOutDiscard && (iOutPos == NCM_NTB_SIZE))) {
+		if (fOutDiscard) {
+			dwOutDropped++;
+		}
+		else if (iOutPos > 0) {
+			aiOutLen[iOutFill] = iOutPos;
+			iOutFill ^= 1;
+		}
+		iOutPos = 0;
+		fOutDiscard = FALSE;
+	}
+}
+
+
+/**
+	Bulk IN handler, keeps both packet buffers filled from the NTB handed
+	over by NcmPoll
+		
+	@param [in] bEP
+	@param [in] bEPStatus
+ */
+void NcmBulkIn(U8 bEP, U8 bEPStatus)
+{
+	int iFree, iLen;
+	
+	for (iFree = USBHwEPGetFreeBuffers(bEP); (iFree > 0) && (iInSendLen != 0); iFree--) {
+		// a zero length packet follows a full last packet
+		iLen = MIN(iInSendLen - iInSendPos, MAX_PACKET_SIZE);
+		USBHwEPWrite(bEP, pbInSend + iInSendPos, iLen);
+		iInSendPos += iLen;
+		
+		// done after a short packet, or when the NTB has the maximum size
+		if ((iLen < MAX_PACKET_SIZE) || (iInSendPos == (int)dwInMaxSize)) {
+			iInSendLen = 0;
+		}
+	}
+}
+
+
+/**
+	Local function to close the IN NTB being filled and hand it over to
+	NcmBulkIn, if the bulk IN pipe is idle
+	
+	@return TRUE if the NTB was handed over or empty
+ */
+static BOOL NcmFlush(void)
+{
+	U8	*pb;
+	int	i, iNdp, iLen;
+	
+	if (iInCount == 0) {
+		return TRUE;
+	}
+	if (iInSendLen != 0) {
+		return FALSE;
+	}
+	
+	// NDP16 after the datagrams
+	pb = aabInNtb[iInFill];
+	iNdp = NCM_ALIGN_UP(iInPos);
+	iLen = NDP16_HEADER + (iInCount + 1) * NDP16_ENTRY;
+	PutLE32(&pb[iNdp], NDP16_SIGNATURE);
+	PutLE16(&pb[iNdp + 4], iLen);
+	PutLE16(&pb[iNdp + 6], 0);					// wNextNdpIndex
+	for (i = 0; i < iInCount; i++) {
+		PutLE16(&pb[iNdp + NDP16_HEADER + i * NDP16_ENTRY], awInIndex[i]);
+		PutLE16(&pb[iNdp + NDP16_HEADER + i * NDP16_ENTRY + 2], awInLen[i]);
+	}
+	PutLE32(&pb[iNdp + NDP16_HEADER + i * NDP16_ENTRY], 0);	// end of table
+	iLen += iNdp;
+	
+	// NTH16
+	PutLE32(&pb[0], NTH16_SIGNATURE);
+	PutLE16(&pb[4], NTH16_SIZE);
+	PutLE16(&pb[6], wInSequence++);
+	PutLE16(&pb[8], iLen);						// wBlockLength
+	PutLE16(&pb[10], iNdp);						// wNdpIndex
+	
+	Stats.dwNtbIn++;
+	Stats.dwDatagramsIn += iInCount;
+	
+	// hand over, data first
+	pbInSend = pb;
+	iInSendPos = 0;
+	COMPILER_BARRIER();
+	iInSendLen = iLen;
+	USBHwEPRaiseInt(NCM_BULK_IN_EP);
+	
+	// and fill the other buffer
+	iInFill ^= 1;
+	iInPos = NTH16_SIZE;
+	iInCount = 0;
+	return TRUE;
+}
+
+
+/**
+	Gets room for a datagram in the IN NTB being filled. Build the
+	datagram there and queue it with NcmSendDatagram.
+	
+	@param [in] iLen	Length of the datagram
+	
+	@return pointer to the datagram, or NULL if iLen is over
+			NCM_MAX_DATAGRAM or there is no room now
+ */
+U8 *NcmAllocDatagram(int iLen)
+{
+	int iPos;
+	
+	if ((iLen <= 0) || (iLen > NCM_MAX_DATAGRAM) || (bDataAlt != 1)) {
+		return NULL;
+	}
+	
+	// the NDP, with an entry for this datagram and the terminator, must
+	// fit after it
+	iPos = NCM_ALIGN_UP(iInPos);
+	if ((iInCount == NCM_MAX_DATAGRAMS) ||
+		((NCM_ALIGN_UP(iPos + iLen) + NDP16_HEADER + (iInCount + 2) * NDP16_ENTRY) > (int)dwInMaxSize)) {
+		if (!NcmFlush()) {
+			return NULL;
+		}
+		iPos = NCM_ALIGN_UP(iInPos);
+	}
+	return &aabInNtb[iInFill][iPos];
+}
+
+
+/**
+	Queues the datagram built in the room got from NcmAllocDatagram
+	
+	@param [in] iLen	Length of the datagram, at most the length passed
+						to NcmAllocDatagram
+ */
+void NcmSendDatagram(int iLen)
+{
+	int iPos;
+	
+	iPos = NCM_ALIGN_UP(iInPos);
+	awInIndex[iInCount] = iPos;
+	awInLen[iInCount] = iLen;
+	iInCount++;
+	iInPos = iPos + iLen;
+}
+
+
+/**
+	Local function to pass the datagrams of the received NTBs to the
+	receive callback
+ */
+static void NcmParse(void)
+{
+	U8	*pb, *pbNdp;
+	int	iLen, iNdpLen, iIndex, iDgLen, iNext;
+	
+	while ((iLen = aiOutLen[iOutParse]) != 0) {
+		COMPILER_BARRIER();
+		pb = aabOutNtb[iOutParse];
+		
+		if (iNdpPos < 0) {
+			// new NTB, check NTH16
+			if ((iLen < NTH16_SIZE) || (GetLE32(&pb[0]) != NTH16_SIGNATURE) ||
+				(GetLE16(&pb[4]) != NTH16_SIZE) || (GetLE16(&pb[8]) > iLen)) {
+				Stats.dwErrors++;
+				iNdpPos = 0;
+			}
+			else {
+				Stats.dwNtbOut++;
+				iLen = GetLE16(&pb[8]);
+				iNdpPos = GetLE16(&pb[10]);
+				iNdpEntry = 0;
+			}
+		}
+		else {
+			iLen = GetLE16(&pb[8]);
+		}
+		
+		// walk the NDPs, each one further into the NTB
+		while (iNdpPos != 0) {
+			pbNdp = &pb[iNdpPos];
+			if ((iNdpPos + NDP16_HEADER > iLen) || (GetLE32(&pbNdp[0]) != NDP16_SIGNATURE)) {
+				Stats.dwErrors++;
+				break;
+			}
+			iNdpLen = GetLE16(&pbNdp[4]);
+			if ((iNdpLen < NDP16_HEADER + 2 * NDP16_ENTRY) || (iNdpPos + iNdpLen > iLen)) {
+				Stats.dwErrors++;
+				break;
+			}
+			
+			for (; NDP16_HEADER + (iNdpEntry + 1) * NDP16_ENTRY <= iNdpLen; iNdpEntry++) {
+				iIndex = GetLE16(&pbNdp[NDP16_HEADER + iNdpEntry * NDP16_ENTRY]);
+				iDgLen = GetLE16(&pbNdp[NDP16_HEADER + iNdpEntry * NDP16_ENTRY + 2]);
+				if ((iIndex == 0) || (iDgLen == 0)) {
+					// end of table
+					break;
+				}
+				if ((iIndex + iDgLen > iLen) || (iDgLen < 14) || (iDgLen > NCM_MAX_DATAGRAM)) {
+					Stats.dwErrors++;
+					continue;
+				}
+				if (!_pfnRecv(&pb[iIndex], iDgLen)) {
+					// try again on the next poll
+					return;
+				}
+				Stats.dwDatagramsOut++;
+			}
+			
+			iNext = GetLE16(&pbNdp[6]);
+			iNdpPos = (iNext > iNdpPos) ? iNext : 0;
+			iNdpEntry = 0;
+		}
+		
+		// done with this NTB
+		iNdpPos = -1;
+		COMPILER_BARRIER();
+		aiOutLen[iOutParse] = 0;
+		iOutParse ^= 1;
+		if (fOutBlocked) {
+			// continue with the packet waiting in the endpoint
+			USBHwEPRaiseInt(NCM_BULK_OUT_EP);
+		}
+	}
+}
+
+
+/**
+	Main loop part of the NCM function, passes received datagrams to the
+	receive callback and sends the datagrams collected so far when the
+	bulk IN pipe is idle
+ */
+void NcmPoll(void)
+{
+	if (fReset) {
+		fReset = FALSE;
+		iOutParse = 0;
+		iNdpPos = -1;
+		iInFill = 0;
+		iInPos = NTH16_SIZE;
+		iInCount = 0;
+		wInSequence = 0;
+	}
+	
+	NcmParse();
+	NcmFlush();
+}
+
+
+/**
+	Gets the NCM statistics
+	
+	@param [out] pStats
+ */
+void NcmGetStats(TNcmStats *pStats)
+{
+	*pStats = Stats;
+	pStats->dwErrors += dwOutDropped;
+}
+
+
+/**
+	Initialises the NCM function
+	
+	@param [in] pfnRecv		Receive callback, called from NcmPoll
+ */
+void NcmInit(TFnNcmRecv *pfnRecv)
+{
+	_pfnRecv = pfnRecv;
+	dwInMaxSize = NCM_NTB_SIZE;
+	dwOutDropped = 0;
+	memset(&Stats, 0, sizeof(Stats));
+	NcmSetDataAlt(0);
+	NcmPoll();
+}
@@ -0,0 +1,70 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "type.h"
+#include "usbstruct.h"		// for TSetupPacket
+
+#define NCM_INT_IN_EP		0x81
+#define NCM_BULK_OUT_EP		0x05
+#define NCM_BULK_IN_EP		0x82
+
+#define NCM_COMM_IF			0		/**< communication class interface */
+#define NCM_DATA_IF			1		/**< data class interface, NTBs on alternate setting 1 */
+
+#define NCM_NTB_SIZE		2048	/**< dwNtbInMaxSize and dwNtbOutMaxSize */
+#define NCM_MAX_DATAGRAM	1514	/**< Ethernet frame without FCS */
+#ifndef NCM_MAX_DATAGRAMS
+#define NCM_MAX_DATAGRAMS	32		/**< datagrams per IN NTB */
+#endif
+
+/**
+	Receive callback, called from NcmPoll for every datagram (Ethernet
+	frame) from the host. Returns FALSE if it cannot take the datagram
+	now, it is offered again on the next NcmPoll.
+ */
+typedef BOOL (TFnNcmRecv)(U8 *pbFrame, int iLen);
+
+/** NCM statistics */
+typedef struct {
+	U32		dwNtbOut;		/**< NTBs received */
+	U32		dwDatagramsOut;	/**< datagrams received */
+	U32		dwNtbIn;		/**< NTBs sent */
+	U32		dwDatagramsIn;	/**< datagrams sent */
+	U32		dwErrors;		/**< malformed NTBs or datagrams dropped */
+} TNcmStats;
+
+void NcmInit(TFnNcmRecv *pfnRecv);
+BOOL NcmHandleClassRequest(TSetupPacket *pSetup, int *piLen, U8 **ppbData);
+BOOL NcmHandleStdRequest(TSetupPacket *pSetup, int *piLen, U8 **ppbData);
+void NcmIntIn(U8 bEP, U8 bEPStatus);
+void NcmBulkOut(U8 bEP, U8 bEPStatus);
+void NcmBulkIn(U8 bEP, U8 bEPStatus);
+void NcmPoll(void);
+
+U8  *NcmAllocDatagram(int iLen);
+void NcmSendDatagram(int iLen);
+void NcmGetStats(TNcmStats *pStats);
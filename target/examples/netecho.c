@@ -0,0 +1,254 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+	Minimal network stack for the NCM example
+	
+	It answers ARP requests and ICMP echo requests (ping) for its IP
+	address and echoes UDP datagrams sent to its echo port. Everything
+	else is dropped. Replies are built straight in the NTB being sent,
+	swapping addresses does not change the IP and UDP checksums and the
+	ICMP checksum is updated incrementally (RFC 1624).
+*/
+
+#include <string.h>			// memcpy
+
+#include "type.h"
+#include "debug.h"
+
+#include "ncm.h"
+#include "netecho.h"
+
+// Ethernet
+#define ETH_DST			0
+#define ETH_SRC			6
+#define ETH_TYPE		12
+#define ETH_HEADER		14
+#define ETH_MIN_FRAME	60			// without FCS
+#define ETHTYPE_IP		0x0800
+#define ETHTYPE_ARP		0x0806
+
+// ARP, from the start of the frame
+#define ARP_OPER		(ETH_HEADER + 6)
+#define ARP_SHA			(ETH_HEADER + 8)
+#define ARP_SPA			(ETH_HEADER + 14)
+#define ARP_THA			(ETH_HEADER + 18)
+#define ARP_TPA			(ETH_HEADER + 24)
+#define ARP_SIZE		28
+#define ARP_REQUEST		1
+#define ARP_REPLY		2
+
+// IPv4, from the start of the frame
+#define IP_VER_IHL		(ETH_HEADER + 0)
+#define IP_LEN			(ETH_HEADER + 2)
+#define IP_FLAGS_FRAG	(ETH_HEADER + 6)
+#define IP_PROTO		(ETH_HEADER + 9)
+#define IP_SRC			(ETH_HEADER + 12)
+#define IP_DST			(ETH_HEADER + 16)
+#define IP_HEADER		20
+#define IPPROTO_ICMP	1
+#define IPPROTO_UDP		17
+
+// ICMP and UDP, from the start of the IP payload
+#define ICMP_TYPE		0
+#define ICMP_SUM		2
+#define ICMP_ECHO_REPLY		0
+#define ICMP_ECHO_REQUEST	8
+#define UDP_SRC_PORT	0
+#define UDP_DST_PORT	2
+
+static U8	abMac[6];
+static U8	abIp[4];
+
+
+static U16 GetBE16(const U8 *pb)
+{
+	return (pb[0] << 8) | pb[1];
+}
+
+
+static void PutBE16(U8 *pb, U16 w)
+{
+	pb[0] = w >> 8;
+	pb[1] = w & 0xFF;
+}
+
+
+static void Swap(U8 *pb1, U8 *pb2, int iLen)
+{
+	U8	b;
+	int	i;
+	
+	for (i = 0; i < iLen; i++) {
+		b = pb1[i];
+		pb1[i] = pb2[i];
+		pb2[i] = b;
+	}
+}
+
+
+/**
+	Local function to answer an ARP request for our address
+	
+	@return FALSE if there is no room for the reply now
+ */
+static BOOL HandleArp(U8 *pbFrame, int iLen)
+{
+	U8	*pb;
+	
+	if ((iLen < ETH_HEADER + ARP_SIZE) || (GetBE16(&pbFrame[ARP_OPER]) != ARP_REQUEST) ||
+		(memcmp(&pbFrame[ARP_TPA], abIp, 4) != 0)) {
+		return TRUE;
+	}
+	
+	if ((pb = NcmAllocDatagram(ETH_MIN_FRAME)) == NULL) {
+		return FALSE;
+	}
+	memset(pb, 0, ETH_MIN_FRAME);
+	memcpy(&pb[ETH_DST], &pbFrame[ETH_SRC], 6);
+	memcpy(&pb[ETH_SRC], abMac, 6);
+	// htype, ptype, hlen, plen as in the request
+	memcpy(&pb[ETH_TYPE], &pbFrame[ETH_TYPE], 8);
+	PutBE16(&pb[ARP_OPER], ARP_REPLY);
+	memcpy(&pb[ARP_SHA], abMac, 6);
+	memcpy(&pb[ARP_SPA], abIp, 4);
+	memcpy(&pb[ARP_THA], &pbFrame[ARP_SHA], 10);	// sender hardware and protocol address
+	NcmSendDatagram(ETH_MIN_FRAME);
+	return TRUE;
+}
+
+
+/**
+	Local function to answer ICMP echo requests and UDP echo datagrams
+	
+	@return FALSE if there is no room for the reply now
+ */
+static BOOL HandleIp(U8 *pbFrame, int iLen)
+{
+	U8	*pb, *pbPayload;
+	U32	dwSum;
+	int	iHdrLen;
+	
+	if ((iLen < ETH_HEADER + IP_HEADER) || ((pbFrame[IP_VER_IHL] >> 4) != 4) ||
+		(memcmp(&pbFrame[IP_DST], abIp, 4) != 0) ||
+		((GetBE16(&pbFrame[IP_FLAGS_FRAG]) & 0x3FFF) != 0)) {
+		// not for us, or a fragment
+		return TRUE;
+	}
+	iHdrLen = (pbFrame[IP_VER_IHL] & 0x0F) * 4;
+	// drop Ethernet padding
+	iLen = MIN(iLen, ETH_HEADER + GetBE16(&pbFrame[IP_LEN]));
+	if ((iHdrLen < IP_HEADER) || (iLen < ETH_HEADER + iHdrLen + 8) ||
+		(iLen > NCM_MAX_DATAGRAM)) {
+		// malformed, or the reply would never fit
+		return TRUE;
+	}
+	pbPayload = &pbFrame[ETH_HEADER + iHdrLen];
+	
+	switch (pbFrame[IP_PROTO]) {
+	
+	case IPPROTO_ICMP:
+		if (pbPayload[ICMP_TYPE] != ICMP_ECHO_REQUEST) {
+			return TRUE;
+		}
+		break;
+		
+	case IPPROTO_UDP:
+		if (GetBE16(&pbPayload[UDP_DST_PORT]) != NETECHO_UDP_PORT) {
+			return TRUE;
+		}
+		break;
+		
+	default:
+		return TRUE;
+	}
+	
+	if ((pb = NcmAllocDatagram(MAX(iLen, ETH_MIN_FRAME))) == NULL) {
+		return FALSE;
+	}
+	memcpy(pb, pbFrame, iLen);
+	if (iLen < ETH_MIN_FRAME) {
+		memset(&pb[iLen], 0, ETH_MIN_FRAME - iLen);
+	}
+	Swap(&pb[ETH_DST], &pb[ETH_SRC], 6);
+	Swap(&pb[IP_SRC], &pb[IP_DST], 4);
+	pbPayload = &pb[ETH_HEADER + iHdrLen];
+	
+	if (pb[IP_PROTO] == IPPROTO_ICMP) {
+		// type 8 -> 0 in the high byte of the first word, HC' = ~(~HC + ~m + m')
+		pbPayload[ICMP_TYPE] = ICMP_ECHO_REPLY;
+		dwSum = (U16)~GetBE16(&pbPayload[ICMP_SUM]) + (U16)~(ICMP_ECHO_REQUEST << 8) +
+				(ICMP_ECHO_REPLY << 8);
+		dwSum = (dwSum & 0xFFFF) + (dwSum >> 16);
+		dwSum = (dwSum & 0xFFFF) + (dwSum >> 16);
+		PutBE16(&pbPayload[ICMP_SUM], ~dwSum);
+	}
+	else {
+		Swap(&pbPayload[UDP_SRC_PORT], &pbPayload[UDP_DST_PORT], 2);
+	}
+	NcmSendDatagram(MAX(iLen, ETH_MIN_FRAME));
+	return TRUE;
+}
+
+
+/**
+	Handles a frame received from the network, can be installed as the
+	NCM receive callback
+	
+	@param [in] pbFrame		Ethernet frame, without FCS
+	@param [in] iLen		Length of the frame
+	
+	@return FALSE if a reply could not be queued now, the frame has to be
+			offered again later
+ */
+BOOL NetEchoFrame(U8 *pbFrame, int iLen)
+{
+	if ((iLen < ETH_HEADER) ||
+		(((pbFrame[ETH_DST] & 1) == 0) && (memcmp(&pbFrame[ETH_DST], abMac, 6) != 0))) {
+		// not for us
+		return TRUE;
+	}
+	
+	switch (GetBE16(&pbFrame[ETH_TYPE])) {
+	case ETHTYPE_ARP:	return HandleArp(pbFrame, iLen);
+	case ETHTYPE_IP:	return HandleIp(pbFrame, iLen);
+	default:			return TRUE;
+	}
+}
+
+
+/**
+	Initialises the echo stack
+	
+	@param [in] pbMac	Our Ethernet address
+	@param [in] pbIp	Our IPv4 address
+ */
+void NetEchoInit(const U8 *pbMac, const U8 *pbIp)
+{
+	memcpy(abMac, pbMac, 6);
+	memcpy(abIp, pbIp, 4);
+}
@@ -25,6 +25,8 @@
 	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <string.h>			// memcpy
+
 #include "type.h"
 #include "debug.h"
 
@@ -61,6 +63,7 @@
 #define CMD_SET_BLOCKLEN			16
 #define CMD_READ_SINGLE_BLOCK		17
 #define CMD_READ_MULTIPLE_BLOCK		18
+#define CMD_SET_WR_BLK_ERASE_COUNT	23			// ACMD23
 #define CMD_WRITE_BLOCK				24
 #define CMD_WRITE_MULTIPLE_BLOCK	25
 #define CMD_PROGRAM_CSD				27
@@ -92,6 +95,13 @@
 #define NAC			1024		// actually much more complex, TODO
 #define NWR			1			// (bytes) time between write response and data block
 
+#define SD_POLL_BYTES	16		// bytes polled per SDPoll call while the card is busy
+
+// clocks
+#define SD_INIT_HZ		400000
+#define SD_DEFAULT_HZ	25000000
+#define SD_HS_HZ		50000000
+
 
 typedef enum {
 	eCardUnknown,
@@ -102,6 +112,28 @@ typedef enum {
 
 static ECardType eCardType;
 
+// card registers, read once by SDInit
+static U8 abCSD[16];
+static U8 abCID[16];
+
+// state of the block transfer driven by SDPoll
+typedef enum {
+	eXferIdle,
+	eXferReadToken,		// waiting for the data token of the next block
+#ifdef SPI_DMA
+	eXferReadData,		// DMA is receiving a block
+	eXferWriteData,		// DMA is sending a block
+#endif
+	eXferWriteBusy,		// card is programming the block just sent
+	eXferStopBusy		// card is finishing a multiple block write
+} EXferState;
+
+static EXferState	eXferState;
+static U8			*pbXferData;	// data of the next block
+static int			iXferLeft;		// blocks still to transfer
+static BOOL			fXferMulti;		// multiple block command
+static int			iXferWait;		// bytes polled while waiting for a token
+
 
 // returns an R1 error code
 static U8 SDWaitResp(int iTimeout)
@@ -136,10 +168,23 @@ static U32 SDExtraResp(int iLen)
 	return ulResp;
 }
 
+// writes a command frame
+static void SDSendCommand(U8 bCmd, U32 ulParam)
+{
+	U8	abBuf[6];
+
+	abBuf[0] = bCmd | 0x40;
+	abBuf[1] = ulParam >> 24;
+	abBuf[2] = ulParam >> 16;
+	abBuf[3] = ulParam >> 8;
+	abBuf[4] = ulParam >> 0;
+	abBuf[5] = (bCmd == CMD_SEND_IF_COND) ? 0x87 : 0x95;
+	SPITransfer(6, abBuf, NULL);
+}
+
 // returns an R1 error code
 static U8 SDCommand(U8 bCmd, U32 ulParam)
 {
-	U8	abBuf[6];
 	U8	bResp;
 	
 	// check if card is busy
@@ -150,13 +195,7 @@ static U8 SDCommand(U8 bCmd, U32 ulParam)
 	}
 	
 	// write command
-	abBuf[0] = bCmd | 0x40;
-	abBuf[1] = ulParam >> 24;
-	abBuf[2] = ulParam >> 16;
-	abBuf[3] = ulParam >> 8;
-	abBuf[4] = ulParam >> 0;
-	abBuf[5] = (bCmd == CMD_SEND_IF_COND) ? 0x87 : 0x95;
-	SPITransfer(6, abBuf, NULL);
+	SDSendCommand(bCmd, ulParam);
 	
 	// wait for response
 	return SDWaitResp(NCR);
@@ -202,51 +241,97 @@ static BOOL SDReadDataToken(U8 bType, U8 *pbData, int iLen)
 }
 
 
-static BOOL SDWriteDataToken(U8 bType, const U8 *pbData, int iLen)
+// gets len bits of a 128 bit register (CSD, CID), starting at bit offset downwards
+U32 SDGetBits(const U8 *buf, int offset, int len)
 {
-	U8	bResp;
+	U32		mask, data;
+	int		bytepos, bitpos;
+	int		shift;
+	
+	offset = 127 - offset;
+	bytepos = offset / 8;
+	bitpos = offset % 8;
+	mask = (1 << len) - 1;
+
+	data = 0;
+	for (shift = -(len + bitpos); shift < 0; shift += 8) {
+		data = (data << 8) | buf[bytepos++];
+	}
+	return (data >> shift) & mask;
+}
 
-	// NWR
-	SPITransfer(1, NULL, NULL);
 
-	// data token
-	SPITransfer(1, &bType, NULL);
-	if (iLen != 0) {
-		// send data
-	SPITransfer(iLen, pbData, NULL);
-	// (fake) CRC
-	SPITransfer(2, NULL, NULL);
-	// get data response
-	SPITransfer(1, NULL, &bResp);
-	if ((bResp & 0x1F) != 5) {
-		DBG("Received data response error (0x%02X)!\n", bResp);
+// reads the CSD or CID register
+static BOOL SDReadRegister(U8 bCmd, U8 *pbData)
+{
+	U8	bResp;
+
+	// write command
+	if ((bResp = SDCommand(bCmd, 0)) != 0) {
+		DBG("CMD%d failed (0x%02X)!\n", bCmd, bResp);
 		return FALSE;
 	}
-	}
-	
-	// wait while busy
-	do {
-		SPITransfer(1, NULL, &bResp);
-	} while (bResp != 0xFF);
 	
+	// wait for data token
+	if (!SDReadDataToken(TOKEN_START_BLOCK, pbData, 16)) {
+		DBG("SDReadDataToken failed!\n");
+		return FALSE;
+	}
 	return TRUE;
 }
 
 
+// maximum clock of the card, from the TRAN_SPEED field of the CSD
+static int SDGetTranSpeed(void)
+{
+	// time values times 10, units divided by 10
+	static const U8 abValue[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+	static const int aiUnit[4] = {10000, 100000, 1000000, 10000000};
+	U8	bTranSpeed;
+
+	bTranSpeed = SDGetBits(abCSD, 103, 8);
+	if (((bTranSpeed & 7) > 3) || ((bTranSpeed >> 3) == 0)) {
+		DBG("Invalid TRAN_SPEED 0x%02X\n", bTranSpeed);
+		return SD_DEFAULT_HZ;
+	}
+	return abValue[(bTranSpeed >> 3) & 0x0F] * aiUnit[bTranSpeed & 7];
+}
+
+
+// switches the card to high speed (CMD6), returns TRUE if it did
+static BOOL SDSwitchHighSpeed(void)
+{
+	U8	abStatus[64];
+	U8	bResp;
+
+	// mode 1 (switch), function 1 (high speed) in group 1
+	if ((bResp = SDCommand(CMD_SWITCH_FUNC, 0x80FFFFF1)) != 0) {
+		DBG("CMD_SWITCH_FUNC failed (0x%02X)!\n", bResp);
+		return FALSE;
+	}
+	if (!SDReadDataToken(TOKEN_START_BLOCK, abStatus, sizeof(abStatus))) {
+		return FALSE;
+	}
+	// selected function of group 1 is in bits 379:376
+	return ((abStatus[16] & 0x0F) == 1);
+}
+
+
 BOOL SDInit(void)
 {
-	int i;
+	int i, iCardHz, iHz;
 	U8	bResp;
 	U32	ulOCR;
 	U32 ulData;
 
 	eCardType = eCardUnknown;
+	eXferState = eXferIdle;
 
 	// init SPI subsystem
 	SPIInit();
 
 	// set low SPI speed
-	SPISetSpeed(400000);
+	SPISetSpeed(SD_INIT_HZ);
 
 	// send at least 74 clocks with no chip select
 	SPITick(10);
@@ -294,8 +379,21 @@ BOOL SDInit(void)
 		eCardType = eCardSDV1;
 	}
 	
-	// set high SPI speed
-	SPISetSpeed(25000000);
+	// the card registers do not change, read them once
+	if (!SDReadRegister(CMD_SEND_CSD, abCSD) || !SDReadRegister(CMD_SEND_CID, abCID)) {
+		return FALSE;
+	}
+	
+	// high speed needs command class 10 (switch), which V1 cards lack
+	iCardHz = SDGetTranSpeed();
+	if ((iCardHz < SD_HS_HZ) && (eCardType != eCardSDV1) &&
+		(SDGetBits(abCSD, 95, 12) & (1 << 10)) && SDSwitchHighSpeed()) {
+		iCardHz = SD_HS_HZ;
+	}
+	
+	// fastest clock the card and the SPI port allow
+	iHz = SPISetSpeed(iCardHz);
+	DBG("SD card up to %d kHz, SPI at %d kHz\n", iCardHz / 1000, iHz / 1000);
 
 	return TRUE;
 }
@@ -307,91 +405,316 @@ static U32 SDBlock2Addr(U32 ulBlock)
 }
 
 
-BOOL SDReadBlock(U8 *pbData, U32 ulBlock)
+// ends a multiple block read, returns an R1 error code
+static U8 SDStopTransmission(void)
 {
-	U32	ulAddr;
-	U8	bResp;
+	U8	bResp, bBusy;
+
+	// the card is still sending data, so no busy check here
+	SDSendCommand(CMD_STOP_TRANSMISSION, 0);
+
+	// skip stuff byte
+	SPITransfer(1, NULL, NULL);
+	bResp = SDWaitResp(NCR);
 	
-	// calculate card address
-	ulAddr = SDBlock2Addr(ulBlock);
+	// wait while busy (R1b)
+	do {
+		SPITransfer(1, NULL, &bBusy);
+	} while (bBusy != 0xFF);
 	
-	// write command
-	if ((bResp = SDCommand(CMD_READ_SINGLE_BLOCK, ulAddr)) != 0) {
-		DBG("CMD_READ_SINGLE_BLOCK failed (0x%02X)!\n", bResp);
+	return bResp;
+}
+
+
+// sends the stop token that ends a multiple block write
+static void SDSendStopToken(void)
+{
+	U8	bToken = TOKEN_STOP_TRAN;
+
+	// NWR
+	SPITransfer(1, NULL, NULL);
+	SPITransfer(1, &bToken, NULL);
+	// the card signals busy one byte later
+	SPITransfer(1, NULL, NULL);
+}
+
+
+// ends a data block that was sent, checks the data response
+static BOOL SDEndBlock(void)
+{
+	U8	bResp;
+
+	// (fake) CRC
+	SPITransfer(2, NULL, NULL);
+	// get data response
+	SPITransfer(1, NULL, &bResp);
+	if ((bResp & 0x1F) != 5) {
+		DBG("Received data response error (0x%02X)!\n", bResp);
 		return FALSE;
 	}
 	
-	// read data token
-	if (!SDReadDataToken(TOKEN_START_BLOCK, pbData, SD_BLOCK_SIZE)) {
-		DBG("SDReadDataToken failed!\n");
-		return FALSE;
-	}
+	pbXferData += SD_BLOCK_SIZE;
+	iXferLeft--;
+	eXferState = eXferWriteBusy;
+	return TRUE;
+}
+
+
+// sends the next data block of a write transfer
+static BOOL SDSendBlock(void)
+{
+	U8	bToken;
+
+	bToken = fXferMulti ? TOKEN_START_MULT_BLOCK : TOKEN_START_BLOCK;
 	
+	// NWR
+	SPITransfer(1, NULL, NULL);
+	// data token and data
+	SPITransfer(1, &bToken, NULL);
+#ifdef SPI_DMA
+	// SDPoll ends the block when the DMA is done
+	SPIStartDMA(SD_BLOCK_SIZE, pbXferData, NULL);
+	eXferState = eXferWriteData;
 	return TRUE;
+#else
+	SPITransfer(SD_BLOCK_SIZE, pbXferData, NULL);
+	return SDEndBlock();
+#endif
 }
 
 
+// ends a failed transfer
+static void SDAbort(void)
+{
+	U8	bBusy;
 
-BOOL SDWriteBlock(const U8 *pbData, U32 ulBlock)
+	if (fXferMulti) {
+		if (eXferState == eXferReadToken) {
+			SDStopTransmission();
+		}
+		else {
+			SDSendStopToken();
+			do {
+				SPITransfer(1, NULL, &bBusy);
+			} while (bBusy != 0xFF);
+		}
+	}
+	eXferState = eXferIdle;
+}
+
+
+// starts reading iCount consecutive blocks, SDPoll does the rest
+BOOL SDStartRead(U8 *pbData, U32 ulBlock, int iCount)
 {
-	U32	ulAddr;
-	U8	bResp;
+	U8	bCmd, bResp;
 	
-	// calculate card address
-	ulAddr = SDBlock2Addr(ulBlock);
+	ASSERT(eXferState == eXferIdle);
 	
-	// write command
-	if ((bResp = SDCommand(CMD_WRITE_BLOCK, ulAddr)) != 0) {
-		DBG("CMD_WRITE_BLOCK failed (0x%02X)!\n", bResp);
+	fXferMulti = (iCount > 1);
+	bCmd = fXferMulti ? CMD_READ_MULTIPLE_BLOCK : CMD_READ_SINGLE_BLOCK;
+	if ((bResp = SDCommand(bCmd, SDBlock2Addr(ulBlock))) != 0) {
+		DBG("CMD%d failed (0x%02X)!\n", bCmd, bResp);
 		return FALSE;
 	}
 	
-	// write data token
-	if (!SDWriteDataToken(TOKEN_START_BLOCK, pbData, SD_BLOCK_SIZE)) {
-		DBG("SDWriteDataToken failed!\n");
+	pbXferData = pbData;
+	iXferLeft = iCount;
+	iXferWait = 0;
+	eXferState = eXferReadToken;
+	return TRUE;
+}
+
+
+// starts writing iCount consecutive blocks and sends the first one, SDPoll
+// does the rest. The block count of a multiple block write is announced
+// with ACMD23 so the card can pre-erase.
+BOOL SDStartWrite(const U8 *pbData, U32 ulBlock, int iCount)
+{
+	U8	bCmd, bResp;
+	
+	ASSERT(eXferState == eXferIdle);
+	
+	fXferMulti = (iCount > 1);
+	if (fXferMulti) {
+		// pre-erase, only a hint so failures are ignored (MMC does not know it)
+		SDCommand(CMD_APP_CMD, 0);
+		SDCommand(CMD_SET_WR_BLK_ERASE_COUNT, iCount);
+	}
+	
+	bCmd = fXferMulti ? CMD_WRITE_MULTIPLE_BLOCK : CMD_WRITE_BLOCK;
+	if ((bResp = SDCommand(bCmd, SDBlock2Addr(ulBlock))) != 0) {
+		DBG("CMD%d failed (0x%02X)!\n", bCmd, bResp);
 		return FALSE;
 	}
 	
+	pbXferData = (U8 *)pbData;
+	iXferLeft = iCount;
+	if (!SDSendBlock()) {
+		SDAbort();
+		return FALSE;
+	}
 	return TRUE;
 }
 
 
-BOOL SDReadCSD(U8 *pbCSD)
+// advances the transfer started with SDStartRead or SDStartWrite, without
+// waiting for the card. Returns SD_BUSY, SD_DONE or SD_ERROR.
+int SDPoll(void)
 {
 	U8	bResp;
+	int	i;
 
-	// write command
-	if ((bResp = SDCommand(CMD_SEND_CSD, 0)) != 0) {
-		DBG("CMD_SEND_CSD failed (0x%02X)!\n", bResp);
-		return FALSE;
-	}
+	switch (eXferState) {
 	
-	// wait for data token
-	if (!SDReadDataToken(TOKEN_START_BLOCK, pbCSD, 16)) {
-		DBG("SDReadDataToken failed!\n");
-		return FALSE;
+	case eXferIdle:
+		return SD_DONE;
+	
+	case eXferReadToken:
+		// look for the data token
+		bResp = 0xFF;
+		for (i = 0; (i < SD_POLL_BYTES) && (bResp == 0xFF); i++) {
+			SPITransfer(1, NULL, &bResp);
+		}
+		if (bResp == 0xFF) {
+			iXferWait += SD_POLL_BYTES;
+			if (iXferWait < NAC) {
+				return SD_BUSY;
+			}
+			DBG("Timeout waiting for data token!\n");
+			SDAbort();
+			return SD_ERROR;
+		}
+		if (bResp != TOKEN_START_BLOCK) {
+			DBG("Expected start block token, got %X instead!\n", bResp);
+			SDAbort();
+			return SD_ERROR;
+		}
+		
+#ifdef SPI_DMA
+		// let the DMA read the data
+		SPIStartDMA(SD_BLOCK_SIZE, NULL, pbXferData);
+		eXferState = eXferReadData;
+		return SD_BUSY;
+	
+	case eXferReadData:
+		if (!SPIIsDMADone()) {
+			return SD_BUSY;
+		}
+#else
+		// read data
+		SPITransfer(SD_BLOCK_SIZE, NULL, pbXferData);
+#endif
+		// skip CRC
+		SPITransfer(2, NULL, NULL);
+		pbXferData += SD_BLOCK_SIZE;
+		iXferWait = 0;
+		if (--iXferLeft > 0) {
+			eXferState = eXferReadToken;
+			return SD_BUSY;
+		}
+		
+		eXferState = eXferIdle;
+		if (fXferMulti && ((bResp = SDStopTransmission()) != 0)) {
+			DBG("CMD_STOP_TRANSMISSION failed (0x%02X)!\n", bResp);
+			return SD_ERROR;
+		}
+		return SD_DONE;
+	
+#ifdef SPI_DMA
+	case eXferWriteData:
+		if (!SPIIsDMADone()) {
+			return SD_BUSY;
+		}
+		if (!SDEndBlock()) {
+			SDAbort();
+			return SD_ERROR;
+		}
+		return SD_BUSY;
+#endif
+	
+	case eXferWriteBusy:
+	case eXferStopBusy:
+		// wait while busy
+		bResp = 0x00;
+		for (i = 0; (i < SD_POLL_BYTES) && (bResp != 0xFF); i++) {
+			SPITransfer(1, NULL, &bResp);
+		}
+		if (bResp != 0xFF) {
+			return SD_BUSY;
+		}
+		
+		if (iXferLeft > 0) {
+			if (!SDSendBlock()) {
+				SDAbort();
+				return SD_ERROR;
+			}
+			return SD_BUSY;
+		}
+		if (fXferMulti && (eXferState == eXferWriteBusy)) {
+			// stop the transfer, the card is busy programming afterwards
+			SDSendStopToken();
+			eXferState = eXferStopBusy;
+			return SD_BUSY;
+		}
+		eXferState = eXferIdle;
+		return SD_DONE;
 	}
+	return SD_ERROR;
+}
+
+
+// waits until the transfer in progress is done
+static BOOL SDWait(void)
+{
+	int iRes;
 	
+	do {
+		iRes = SDPoll();
+	} while (iRes == SD_BUSY);
+	return (iRes == SD_DONE);
+}
+
+
+BOOL SDReadBlock(U8 *pbData, U32 ulBlock)
+{
+	return SDReadBlocks(pbData, ulBlock, 1);
+}
+
+
+BOOL SDWriteBlock(const U8 *pbData, U32 ulBlock)
+{
+	return SDWriteBlocks(pbData, ulBlock, 1);
+}
+
+
+// reads iCount consecutive blocks, with one READ_MULTIPLE_BLOCK command
+// if there is more than one
+BOOL SDReadBlocks(U8 *pbData, U32 ulBlock, int iCount)
+{
+	return SDStartRead(pbData, ulBlock, iCount) && SDWait();
+}
+
+
+// writes iCount consecutive blocks, with one WRITE_MULTIPLE_BLOCK command
+// if there is more than one
+BOOL SDWriteBlocks(const U8 *pbData, U32 ulBlock, int iCount)
+{
+	return SDStartWrite(pbData, ulBlock, iCount) && SDWait();
+}
+
+
+// returns the CSD read by SDInit
+BOOL SDReadCSD(U8 *pbCSD)
+{
+	memcpy(pbCSD, abCSD, sizeof(abCSD));
 	return TRUE;
 }
 	
 	
+// returns the CID read by SDInit
 BOOL SDReadCID(U8 *pbCID)
 {
-	U8	bResp;
-
-	// write command
-	if ((bResp = SDCommand(CMD_SEND_CID, 0)) != 0) {
-		DBG("CMD_SEND_CID failed (0x%02X)!\n", bResp);
-		return FALSE;
-	}
-	
-	// wait for data token
-	if (!SDReadDataToken(TOKEN_START_BLOCK, pbCID, 16)) {
-		DBG("SDReadDataToken failed!\n");
-		return FALSE;
-	}
-
+	memcpy(pbCID, abCID, sizeof(abCID));
 	return TRUE;
 }
 	
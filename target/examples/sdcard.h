@@ -27,11 +27,23 @@
 
 #include "type.h"
 
+// return values of SDPoll
+#define SD_BUSY		0
+#define SD_DONE		1
+#define SD_ERROR	2
+
 BOOL SDInit(void);
 BOOL SDReadCSD(U8 *pbCSD);
 BOOL SDReadCID(U8 *pbCID);
 BOOL SDReadOCR(U32 *pulOCR);
+U32  SDGetBits(const U8 *buf, int offset, int len);
 
 BOOL SDReadBlock(U8 *pbData, U32 ulBlock);
 BOOL SDWriteBlock(const U8 *pbData, U32 ulBlock);
+BOOL SDReadBlocks(U8 *pbData, U32 ulBlock, int iCount);
+BOOL SDWriteBlocks(const U8 *pbData, U32 ulBlock, int iCount);
+
+BOOL SDStartRead(U8 *pbData, U32 ulBlock, int iCount);
+BOOL SDStartWrite(const U8 *pbData, U32 ulBlock, int iCount);
+int  SDPoll(void);
 
@@ -25,9 +25,31 @@
 	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/*
+	Ring buffer of VCOM_FIFO_SIZE bytes, a power of two so indexes wrap
+	with a mask. One byte stays unused to tell a full FIFO from an empty
+	one. The block functions copy with at most two memcpy calls, one up
+	to the end of the buffer and one from its start.
+	
+	The FIFO is lock free for one producer and one consumer, e.g. an
+	interrupt handler and the main loop. The producer (fifo_put*) only
+	writes head, the consumer (fifo_get*, fifo_peek, fifo_skip) only
+	writes tail, and an index is only written after the data it covers:
+	* the producer fills the buffer, then publishes head,
+	* the consumer reads head, then the data, then releases it with tail.
+	COMPILER_BARRIER marks these points. Neither side has to disable
+	interrupts.
+*/
+
+#include <string.h>			// memcpy
+
 #include "type.h"
 #include "serial_fifo.h"
 
+#if (VCOM_FIFO_SIZE & VCOM_FIFO_MASK) != 0
+#error "VCOM_FIFO_SIZE must be a power of 2"
+#endif
+
 void fifo_init(fifo_t *fifo, U8 *buf)
 {
 	fifo->head = 0;
@@ -38,16 +60,19 @@ void fifo_init(fifo_t *fifo, U8 *buf)
 
 BOOL fifo_put(fifo_t *fifo, U8 c)
 {
-	int next;
+	int head, next;
 	
 	// check if FIFO has room
-	next = (fifo->head + 1) % VCOM_FIFO_SIZE;
+	head = fifo->head;
+	next = (head + 1) & VCOM_FIFO_MASK;
 	if (next == fifo->tail) {
 		// full
 		return FALSE;
 	}
 	
-	fifo->buf[fifo->head] = c;
+	fifo->buf[head] = c;
+	// data first, then the index that makes it visible
+	COMPILER_BARRIER();
 	fifo->head = next;
 	
 	return TRUE;
@@ -56,25 +81,30 @@ BOOL fifo_put(fifo_t *fifo, U8 c)
 
 BOOL fifo_get(fifo_t *fifo, U8 *pc)
 {
-	int next;
+	int tail;
 	
 	// check if FIFO has data
-	if (fifo->head == fifo->tail) {
+	tail = fifo->tail;
+	if (tail == fifo->head) {
 		return FALSE;
 	}
 	
-	next = (fifo->tail + 1) % VCOM_FIFO_SIZE;
-	
-	*pc = fifo->buf[fifo->tail];
-	fifo->tail = next;
+	// read the data only after seeing the index
+	COMPILER_BARRIER();
+	*pc = fifo->buf[tail];
+	// done with the data before the slot is released
+	COMPILER_BARRIER();
+	fifo->tail = (tail + 1) & VCOM_FIFO_MASK;
 
 	return TRUE;
 }
 
 
+// may be called by producer and consumer, the other side can only make
+// the result grow (producer) or shrink (consumer) meanwhile
 int fifo_avail(fifo_t *fifo)
 {
-	return (VCOM_FIFO_SIZE + fifo->head - fifo->tail) % VCOM_FIFO_SIZE;
+	return (fifo->head - fifo->tail) & VCOM_FIFO_MASK;
 }
 
 
@@ -83,3 +113,60 @@ int fifo_free(fifo_t *fifo)
 	return (VCOM_FIFO_SIZE - 1 - fifo_avail(fifo));
 }
 
+
+// puts up to iLen bytes, returns the number of bytes put
+int fifo_put_block(fifo_t *fifo, const U8 *pbData, int iLen)
+{
+	int head, iSpan;
+	
+	head = fifo->head;
+	iLen = MIN(iLen, fifo_free(fifo));
+	iSpan = MIN(iLen, VCOM_FIFO_SIZE - head);
+	memcpy(fifo->buf + head, pbData, iSpan);
+	memcpy(fifo->buf, pbData + iSpan, iLen - iSpan);
+	COMPILER_BARRIER();
+	fifo->head = (head + iLen) & VCOM_FIFO_MASK;
+	
+	return iLen;
+}
+
+
+// gets up to iLen bytes, returns the number of bytes got
+int fifo_get_block(fifo_t *fifo, U8 *pbData, int iLen)
+{
+	int tail, iSpan;
+	
+	tail = fifo->tail;
+	iLen = MIN(iLen, fifo_avail(fifo));
+	COMPILER_BARRIER();
+	iSpan = MIN(iLen, VCOM_FIFO_SIZE - tail);
+	memcpy(pbData, fifo->buf + tail, iSpan);
+	memcpy(pbData + iSpan, fifo->buf, iLen - iSpan);
+	COMPILER_BARRIER();
+	fifo->tail = (tail + iLen) & VCOM_FIFO_MASK;
+	
+	return iLen;
+}
+
+
+// returns the number of bytes that can be read in one piece at *ppbData,
+// fifo_skip removes them when they are used
+int fifo_peek(fifo_t *fifo, U8 **ppbData)
+{
+	int tail, iLen;
+	
+	tail = fifo->tail;
+	iLen = MIN(fifo_avail(fifo), VCOM_FIFO_SIZE - tail);
+	COMPILER_BARRIER();
+	*ppbData = fifo->buf + tail;
+	return iLen;
+}
+
+
+// removes iLen bytes, at most what fifo_avail returns
+void fifo_skip(fifo_t *fifo, int iLen)
+{
+	COMPILER_BARRIER();
+	fifo->tail = (fifo->tail + iLen) & VCOM_FIFO_MASK;
+}
+
@@ -25,14 +25,20 @@
 	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef SERIAL_FIFO_H
+#define SERIAL_FIFO_H
+
 #include "type.h"
 
-#define VCOM_FIFO_SIZE	128
+// must be a power of 2, 512 holds over 5 ms of data at 921600 baud
+#define VCOM_FIFO_SIZE	512
+#define VCOM_FIFO_MASK	(VCOM_FIFO_SIZE - 1)
 
+/** Single producer, single consumer FIFO, see serial_fifo.c */
 typedef struct {
-	int		head;
-	int 	tail;
-	U8		*buf;
+	volatile int	head;	/**< written by the producer only */
+	volatile int	tail;	/**< written by the consumer only */
+	U8				*buf;
 } fifo_t;
 
 void fifo_init(fifo_t *fifo, U8 *buf);
@@ -40,3 +46,10 @@ BOOL fifo_put(fifo_t *fifo, U8 c);
 BOOL fifo_get(fifo_t *fifo, U8 *pc);
 int  fifo_avail(fifo_t *fifo);
 int	 fifo_free(fifo_t *fifo);
+
+int  fifo_put_block(fifo_t *fifo, const U8 *pbData, int iLen);
+int  fifo_get_block(fifo_t *fifo, U8 *pbData, int iLen);
+int  fifo_peek(fifo_t *fifo, U8 **ppbData);
+void fifo_skip(fifo_t *fifo, int iLen);
+
+#endif /* SERIAL_FIFO_H */
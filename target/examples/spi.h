@@ -28,8 +28,15 @@
 #include "type.h"
 
 void	SPIInit(void);
-void	SPISetSpeed(int iFrequency);
+int		SPISetSpeed(int iFrequency);
 
 void	SPITransfer(int iCount, U8 *pbTxData, U8 *pbRxData);
 void	SPITick(int iCount);
 
+#ifdef SPI_DMA
+#define SPI_DMA_MAX		512		// maximum size of a DMA transfer
+
+void	SPIStartDMA(int iCount, const U8 *pbTxData, U8 *pbRxData);
+BOOL	SPIIsDMADone(void);
+#endif
+
@@ -0,0 +1,362 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers	
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, 
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+	USB-CDC to UART bridge on UART1
+	
+	The UART interrupt moves data between the UART FIFOs and two VCOM
+	FIFOs, up to a UART FIFO (16 bytes) at a time:
+	* pToUart is filled by the USB bulk OUT handler and emptied into the
+	  transmitter when its FIFO is empty,
+	* pFromUart is filled from the receiver at its trigger level or
+	  character time-out, and emptied by the USB bulk IN handler.
+	The USB and UART interrupts are both IRQs, which do not nest, so the
+	USB handlers can call BridgeKick to start the transmitter or resume
+	the receiver without further locking. BridgeKick must not be called
+	from the main loop.
+	
+	RTS/CTS flow control is done by the UART: it drops RTS when its
+	receive FIFO reaches the trigger level and holds the transmitter while
+	CTS is inactive. When pFromUart is full, the receive interrupt is
+	disabled and the data stays in the UART (holding off the sender with
+	RTS) until BridgeKick finds room again.
+*/
+
+#include "type.h"
+#include "debug.h"
+
+#ifdef LPC214x
+#include "lpc214x.h"
+#endif
+#ifdef LPC23xx
+#include "lpc23xx.h"
+#endif
+
+#include "hal.h"
+#include "uart_bridge.h"
+
+// UART1 pins (P0.x), all function 1
+#ifdef LPC23xx
+#define UART_TXD_PIN	15
+#define UART_RXD_PIN	16
+#define UART_CTS_PIN	17
+#define UART_RTS_PIN	22
+#else
+#define UART_TXD_PIN	8
+#define UART_RXD_PIN	9
+#define UART_RTS_PIN	10
+#define UART_CTS_PIN	11
+#endif
+
+#define UART_VIC_CHAN	7
+#define UART_VECT_NUM	1		// vectored slot on the LPC214x, after USB
+
+#ifdef LPC23xx
+// PCONP bits
+#define PCUART1			(1 << 4)
+#endif
+
+// U1IER
+#define IER_RBR			(1 << 0)	// receive data available and character time-out
+#define IER_THRE		(1 << 1)
+
+// U1IIR
+#define IIR_NONE		(1 << 0)	// no interrupt pending
+#define IIR_ID_MASK		0x0E
+#define IIR_THRE		0x02
+#define IIR_RDA			0x04
+#define IIR_CTI			0x0C
+
+// U1FCR
+#define FCR_ENABLE		(1 << 0)
+#define FCR_RX_RESET	(1 << 1)
+#define FCR_TX_RESET	(1 << 2)
+#define FCR_RX_TRIG_8	(2 << 6)
+
+// U1LCR
+#define LCR_STOP2		(1 << 2)
+#define LCR_PARITY		(1 << 3)
+#define LCR_DLAB		(1 << 7)
+
+// U1LSR
+#define LSR_RDR			(1 << 0)
+#define LSR_OE			(1 << 1)
+
+// U1MCR
+#define MCR_RTSEN		(1 << 6)
+#define MCR_CTSEN		(1 << 7)
+
+static fifo_t			*pTxFifo;		// USB -> UART
+static fifo_t			*pRxFifo;		// UART -> USB
+static TFnBridgeHandler	*_pfnHandler;
+
+// only touched from interrupts
+static BOOL				fTxBusy;		// transmit FIFO not yet empty
+static BOOL				fRxHeld;		// receive interrupt off for lack of room
+static volatile U32		dwOverruns;		// receive overruns
+
+static void BridgeIntHandler(void) __attribute__ ((interrupt("IRQ")));
+
+
+/**
+	Refills the empty transmit FIFO
+ */
+static void BridgeTx(void)
+{
+	U8	*pbData;
+	int	i, iLen, iRoom;
+	
+	// straight from the VCOM FIFO, in two parts when it wraps
+	iRoom = UART_FIFO_SIZE;
+	while ((iRoom > 0) && ((iLen = fifo_peek(pTxFifo, &pbData)) > 0)) {
+		iLen = MIN(iLen, iRoom);
+		for (i = 0; i < iLen; i++) {
+			U1THR = pbData[i];
+		}
+		fifo_skip(pTxFifo, iLen);
+		iRoom -= iLen;
+	}
+	
+	fTxBusy = (iRoom < UART_FIFO_SIZE);
+	if (fTxBusy && (_pfnHandler != NULL)) {
+		_pfnHandler();
+	}
+}
+
+
+/**
+	Empties the receive FIFO, as far as there is room for it
+ */
+static void BridgeRx(void)
+{
+	U8	abBuf[UART_FIFO_SIZE];
+	U32	dwLSR;
+	int	iLen, iRoom;
+	
+	iRoom = MIN(fifo_free(pRxFifo), UART_FIFO_SIZE);
+	if (iRoom == 0) {
+		// leave the data in the UART until BridgeKick finds room
+		U1IER &= ~IER_RBR;
+		fRxHeld = TRUE;
+		return;
+	}
+	
+	for (iLen = 0; iLen < iRoom; iLen++) {
+		dwLSR = U1LSR;
+		if (dwLSR & LSR_OE) {
+			dwOverruns++;
+		}
+		if ((dwLSR & LSR_RDR) == 0) {
+			break;
+		}
+		abBuf[iLen] = U1RBR;
+	}
+	fifo_put_block(pRxFifo, abBuf, iLen);
+}
+
+
+/**
+	UART1 interrupt handler
+ */
+static void BridgeIntHandler(void)
+{
+	U32	dwIIR;
+	
+	while (((dwIIR = U1IIR) & IIR_NONE) == 0) {
+		switch (dwIIR & IIR_ID_MASK) {
+		
+		case IIR_RDA:
+		case IIR_CTI:
+			BridgeRx();
+			break;
+			
+		case IIR_THRE:
+			BridgeTx();
+			break;
+			
+		default:
+			// line status, cleared by reading it
+			dwIIR = U1LSR;
+			break;
+		}
+	}
+	
+	VICVectAddr = 0x00;    // dummy write to VIC to signal end of ISR
+}
+
+
+/**
+	Starts the transmitter if it is idle and resumes the receiver if it
+	was held. Call it from a USB interrupt handler after filling pToUart
+	or emptying pFromUart.
+ */
+void BridgeKick(void)
+{
+	if (!fTxBusy) {
+		// the interrupt continues once the UART has taken this
+		BridgeTx();
+	}
+	if (fRxHeld && (fifo_free(pRxFifo) >= UART_FIFO_SIZE)) {
+		fRxHeld = FALSE;
+		U1IER |= IER_RBR;
+	}
+}
+
+
+/**
+	Sets baud rate and character format, as in the CDC line coding
+	
+	The baud rate is PCLK / (16 * DL * (1 + DivAddVal / MulVal)), this
+	searches the divider DL and the fractional divider DivAddVal / MulVal
+	that come closest to dwBaud.
+	
+	@param [in] dwBaud			baud rate
+	@param [in] bCharFormat		0 = 1 stop bit, 1 = 1.5 stop bits (5 data bits),
+								2 = 2 stop bits (6 to 8 data bits)
+	@param [in] bParityType		0 = none, 1 = odd, 2 = even, 3 = mark, 4 = space
+	@param [in] bDataBits		5 to 8
+	
+	@return the actual baud rate, or 0 if the line coding is not supported
+ */
+int BridgeSetLineCoding(U32 dwBaud, U8 bCharFormat, U8 bParityType, U8 bDataBits)
+{
+	U32	dwPclk, dwDiv, dwActual, dwErr, dwBestErr;
+	int	iMul, iAdd, iBestDiv, iBestMul, iBestAdd, iBestBaud;
+	U8	bLCR;
+	
+	if ((bCharFormat > 2) || (bParityType > 4) ||
+		(bDataBits < 5) || (bDataBits > 8)) {
+		return 0;
+	}
+	// the UART does 1.5 stop bits with 5 data bits only, 2 with 6 to 8 only
+	if ((bCharFormat != 0) && ((bCharFormat == 1) != (bDataBits == 5))) {
+		return 0;
+	}
+	dwPclk = HalSysGetPCLK();
+	// the fastest rate with DL = 1, also keeps the divider search in 32 bits
+	if ((dwBaud == 0) || (dwBaud > dwPclk / 16)) {
+		return 0;
+	}
+	
+	dwBestErr = 0xFFFFFFFF;
+	iBestDiv = iBestMul = iBestAdd = iBestBaud = 0;
+	for (iMul = 1; iMul <= 15; iMul++) {
+		for (iAdd = 0; iAdd < iMul; iAdd++) {
+			// DL rounded to nearest, at least 3 with the fractional divider
+			dwDiv = (dwPclk * iMul + 8 * dwBaud * (iMul + iAdd)) /
+					(16 * dwBaud * (iMul + iAdd));
+			if ((dwDiv < ((iAdd == 0) ? 1 : 3)) || (dwDiv > 0xFFFF)) {
+				continue;
+			}
+			dwActual = (dwPclk * iMul) / (16 * dwDiv * (iMul + iAdd));
+			dwErr = (dwActual > dwBaud) ? (dwActual - dwBaud) : (dwBaud - dwActual);
+			if (dwErr < dwBestErr) {
+				dwBestErr = dwErr;
+				iBestDiv = dwDiv;
+				iBestMul = iMul;
+				iBestAdd = iAdd;
+				iBestBaud = dwActual;
+			}
+		}
+	}
+	if (iBestDiv == 0) {
+		return 0;
+	}
+	
+	bLCR = bDataBits - 5;
+	if (bCharFormat != 0) {
+		bLCR |= LCR_STOP2;
+	}
+	if (bParityType != 0) {
+		bLCR |= LCR_PARITY | ((bParityType - 1) << 4);
+	}
+	
+	U1LCR = LCR_DLAB | bLCR;
+	U1DLL = iBestDiv & 0xFF;
+	U1DLM = iBestDiv >> 8;
+	U1FDR = (iBestMul << 4) | iBestAdd;
+	U1LCR = bLCR;
+	
+	return iBestBaud;
+}
+
+
+/**
+	Returns the number of receive overruns so far, these should not
+	happen with RTS/CTS flow control
+ */
+U32 BridgeGetOverruns(void)
+{
+	return dwOverruns;
+}
+
+
+/**
+	Initialises UART1 and its interrupt, at 115200 baud, 8N1
+	
+	@param [in] pToUart		FIFO with data to send out on the UART
+	@param [in] pFromUart	FIFO for data received on the UART
+	@param [in] pfnHandler	called from the UART interrupt after it took
+							data from pToUart, may be NULL
+ */
+void BridgeInit(fifo_t *pToUart, fifo_t *pFromUart, TFnBridgeHandler *pfnHandler)
+{
+	pTxFifo = pToUart;
+	pRxFifo = pFromUart;
+	_pfnHandler = pfnHandler;
+	fTxBusy = FALSE;
+	fRxHeld = FALSE;
+	dwOverruns = 0;
+	
+	// power up UART1
+	PCONP |= PCUART1;
+#ifdef LPC23xx
+	// UART1 runs on cclk, like UART0
+	PCLKSEL0 = (PCLKSEL0 & ~(3 << 8)) | (1 << 8);
+#endif
+	HalPinSelect(UART_TXD_PIN, 1);
+	HalPinSelect(UART_RXD_PIN, 1);
+	HalPinSelect(UART_RTS_PIN, 1);
+	HalPinSelect(UART_CTS_PIN, 1);
+	
+	// enable and clear the FIFOs, receive interrupt at 8 bytes, which
+	// leaves 8 bytes for the sender to react to RTS
+	U1FCR = FCR_ENABLE | FCR_RX_RESET | FCR_TX_RESET | FCR_RX_TRIG_8;
+	U1MCR = MCR_RTSEN | MCR_CTSEN;
+	BridgeSetLineCoding(115200, 0, 0, 8);
+	U1IER = IER_RBR | IER_THRE;
+	
+#ifdef LPC214x
+	(*(&VICVectCntl0+UART_VECT_NUM)) = 0x20 | UART_VIC_CHAN;
+	(*(&VICVectAddr0+UART_VECT_NUM)) = (int)BridgeIntHandler;
+#else
+	VICVectCntl7 = 0x02;
+	VICVectAddr7 = (int)BridgeIntHandler;
+#endif
+	VICIntSelect &= ~(1 << UART_VIC_CHAN);
+	VICIntEnable |= (1 << UART_VIC_CHAN);
+}
@@ -53,6 +53,20 @@
 #define U0LCR		*(volatile unsigned int *)0xE000C00C
 #define U0LSR		*(volatile unsigned int *)0xE000C014
 
+/* UART1, with modem control (auto RTS/CTS) and fractional divider */
+#define U1RBR		*(volatile unsigned int *)0xE0010000
+#define U1THR		*(volatile unsigned int *)0xE0010000
+#define U1DLL		*(volatile unsigned int *)0xE0010000
+#define U1DLM		*(volatile unsigned int *)0xE0010004
+#define U1IER		*(volatile unsigned int *)0xE0010004
+#define U1IIR		*(volatile unsigned int *)0xE0010008
+#define U1FCR		*(volatile unsigned int *)0xE0010008
+#define U1LCR		*(volatile unsigned int *)0xE001000C
+#define U1MCR		*(volatile unsigned int *)0xE0010010
+#define U1LSR		*(volatile unsigned int *)0xE0010014
+#define U1MSR		*(volatile unsigned int *)0xE0010018
+#define U1FDR		*(volatile unsigned int *)0xE0010028
+
 /* SPI0 (Serial Peripheral Interface 0) */
 #define S0SPCR			*(volatile unsigned int *)0xE0020000
 #define S0SPSR			*(volatile unsigned int *)0xE0020004
@@ -0,0 +1,177 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+	Block device on a memory mapped image file, for running the mass
+	storage layers natively on the host.
+
+	The image is mapped shared, so whatever the simulated device writes
+	ends up in the file and an existing disk image can be served to the
+	benchmark. Requests are done with plain memory copies as soon as they
+	are started, so the benchmark measures the protocol overhead without
+	any storage latency.
+*/
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "type.h"
+#include "blockdev.h"
+#include "blockdev_file.h"
+
+#define BLOCKSIZE	512
+
+static U8	*pbImage = NULL;
+static U32	dwImageSize;
+
+
+/**
+	Maps an image file, creating or growing it as needed
+
+	@param [in]	pszName		File name
+	@param [in]	dwSize		Minimum size in bytes, 0 to use the file as is
+
+	@return TRUE if the image was mapped
+ */
+BOOL BlockDevFileOpen(const char *pszName, U32 dwSize)
+{
+	struct stat	st;
+	void		*pMap;
+	int			fd;
+
+	BlockDevFileClose();
+
+	fd = open(pszName, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return FALSE;
+	}
+	if ((fstat(fd, &st) < 0) ||
+		(((U32)st.st_size < dwSize) && (ftruncate(fd, dwSize) < 0))) {
+		close(fd);
+		return FALSE;
+	}
+	dwSize = MAX(dwSize, (U32)st.st_size) & ~(BLOCKSIZE - 1);
+	if (dwSize == 0) {
+		close(fd);
+		return FALSE;
+	}
+
+	pMap = mmap(NULL, dwSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// the mapping stays valid after closing the file
+	close(fd);
+	if (pMap == MAP_FAILED) {
+		return FALSE;
+	}
+	pbImage = pMap;
+	dwImageSize = dwSize;
+	return TRUE;
+}
+
+
+/**
+	Unmaps the image file
+ */
+void BlockDevFileClose(void)
+{
+	if (pbImage != NULL) {
+		munmap(pbImage, dwImageSize);
+		pbImage = NULL;
+	}
+}
+
+
+/**
+	Gets the mapped image, so a test can look at the disk contents
+
+	@return pointer to the image, or NULL if no image is open
+ */
+U8 *BlockDevFileData(void)
+{
+	return pbImage;
+}
+
+
+/**
+	Local function to check a block range against the image
+
+	@param [in]	dwBlock		First block
+	@param [in]	iCount		Number of blocks
+
+	@return TRUE if the range is inside the image
+ */
+static BOOL CheckRange(U32 dwBlock, int iCount)
+{
+	U32 dwBlocks;
+
+	dwBlocks = dwImageSize / BLOCKSIZE;
+	return (pbImage != NULL) && (iCount >= 0) && (dwBlock < dwBlocks) &&
+		((U32)iCount <= (dwBlocks - dwBlock));
+}
+
+
+BOOL BlockDevInit(void)
+{
+	return (pbImage != NULL);
+}
+
+
+BOOL BlockDevStart(TBlockDevReq *pReq)
+{
+	U8 *pbDisk;
+
+	if (!CheckRange(pReq->dwBlock, pReq->iCount)) {
+		return FALSE;
+	}
+	pbDisk = pbImage + pReq->dwBlock * BLOCKSIZE;
+	if (pReq->fWrite) {
+		memcpy(pbDisk, pReq->pbBuf, pReq->iCount * BLOCKSIZE);
+	}
+	else {
+		memcpy(pReq->pbBuf, pbDisk, pReq->iCount * BLOCKSIZE);
+	}
+	return TRUE;
+}
+
+
+int BlockDevContinue(void)
+{
+	return BLOCKDEV_DONE;
+}
+
+
+BOOL BlockDevGetSize(U32 *pdwDriveSize)
+{
+	if (pbImage == NULL) {
+		return FALSE;
+	}
+	*pdwDriveSize = dwImageSize;
+	return TRUE;
+}
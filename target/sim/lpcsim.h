@@ -0,0 +1,146 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+	Register definitions for the simulated LPC USB controller
+
+	Used instead of lpc214x.h when the stack is compiled natively with
+	-DLPCSIM. Every register access goes through SimReg(), which lets
+	the model in usbsim.c react to reads and writes and account the
+	number of bus cycles spent by the stack.
+*/
+
+/* register indices */
+enum {
+	SIM_USBIntSt,
+
+	SIM_USBDevIntSt,
+	SIM_USBDevIntEn,
+	SIM_USBDevIntClr,
+	SIM_USBDevIntSet,
+	SIM_USBDevIntPri,
+
+	SIM_USBEpIntSt,
+	SIM_USBEpIntEn,
+	SIM_USBEpIntClr,
+	SIM_USBEpIntSet,
+	SIM_USBEpIntPri,
+
+	SIM_USBReEp,
+	SIM_USBEpInd,
+	SIM_USBMaxPSize,
+
+	SIM_USBRxData,
+	SIM_USBRxPLen,
+	SIM_USBTxData,
+	SIM_USBTxPLen,
+	SIM_USBCtrl,
+
+	SIM_USBCmdCode,
+	SIM_USBCmdData,
+
+	SIM_USBDMARSt,
+	SIM_USBDMARClr,
+	SIM_USBDMARSet,
+	SIM_USBUDCAH,
+	SIM_USBEpDMASt,
+	SIM_USBEpDMAEn,
+	SIM_USBEpDMADis,
+	SIM_USBDMAIntSt,
+	SIM_USBDMAIntEn,
+	SIM_USBEoTIntSt,
+	SIM_USBEoTIntClr,
+	SIM_USBEoTIntSet,
+	SIM_USBNDDRIntSt,
+	SIM_USBNDDRIntClr,
+	SIM_USBNDDRIntSet,
+	SIM_USBSysErrIntSt,
+	SIM_USBSysErrIntClr,
+	SIM_USBSysErrIntSet,
+
+	SIM_NUM_REGS
+};
+
+volatile U32 *SimReg(int iReg);
+void SimCpuCycles(int iCycles);
+
+/**
+	Charges the CPU cycles of instructions that do not access a register,
+	e.g. the memory side of a FIFO copy loop. These are invisible to
+	SimReg(), so the stack reports them where the code paths differ.
+ */
+#define SIM_CPU_CYCLES(n)	SimCpuCycles(n)
+
+/* USB register definitions */
+#define USBIntSt		(*SimReg(SIM_USBIntSt))
+
+#define USBDevIntSt		(*SimReg(SIM_USBDevIntSt))
+#define USBDevIntEn		(*SimReg(SIM_USBDevIntEn))
+#define USBDevIntClr	(*SimReg(SIM_USBDevIntClr))
+#define USBDevIntSet	(*SimReg(SIM_USBDevIntSet))
+#define USBDevIntPri	(*SimReg(SIM_USBDevIntPri))
+
+#define USBEpIntSt		(*SimReg(SIM_USBEpIntSt))
+#define USBEpIntEn		(*SimReg(SIM_USBEpIntEn))
+#define USBEpIntClr		(*SimReg(SIM_USBEpIntClr))
+#define USBEpIntSet		(*SimReg(SIM_USBEpIntSet))
+#define USBEpIntPri		(*SimReg(SIM_USBEpIntPri))
+
+#define USBReEp			(*SimReg(SIM_USBReEp))
+#define USBEpInd		(*SimReg(SIM_USBEpInd))
+#define USBMaxPSize		(*SimReg(SIM_USBMaxPSize))
+
+#define USBRxData		(*SimReg(SIM_USBRxData))
+#define USBRxPLen		(*SimReg(SIM_USBRxPLen))
+#define USBTxData		(*SimReg(SIM_USBTxData))
+#define USBTxPLen		(*SimReg(SIM_USBTxPLen))
+#define USBCtrl			(*SimReg(SIM_USBCtrl))
+
+#define USBCmdCode		(*SimReg(SIM_USBCmdCode))
+#define USBCmdData		(*SimReg(SIM_USBCmdData))
+
+/* USB DMA registers */
+#define USBDMARSt		(*SimReg(SIM_USBDMARSt))
+#define USBDMARClr		(*SimReg(SIM_USBDMARClr))
+#define USBDMARSet		(*SimReg(SIM_USBDMARSet))
+#define USBUDCAH		(*SimReg(SIM_USBUDCAH))
+#define USBEpDMASt		(*SimReg(SIM_USBEpDMASt))
+#define USBEpDMAEn		(*SimReg(SIM_USBEpDMAEn))
+#define USBEpDMADis		(*SimReg(SIM_USBEpDMADis))
+#define USBDMAIntSt		(*SimReg(SIM_USBDMAIntSt))
+#define USBDMAIntEn		(*SimReg(SIM_USBDMAIntEn))
+#define USBEoTIntSt		(*SimReg(SIM_USBEoTIntSt))
+#define USBEoTIntClr	(*SimReg(SIM_USBEoTIntClr))
+#define USBEoTIntSet	(*SimReg(SIM_USBEoTIntSet))
+#define USBNDDRIntSt	(*SimReg(SIM_USBNDDRIntSt))
+#define USBNDDRIntClr	(*SimReg(SIM_USBNDDRIntClr))
+#define USBNDDRIntSet	(*SimReg(SIM_USBNDDRIntSet))
+#define USBSysErrIntSt	(*SimReg(SIM_USBSysErrIntSt))
+#define USBSysErrIntClr	(*SimReg(SIM_USBSysErrIntClr))
+#define USBSysErrIntSet	(*SimReg(SIM_USBSysErrIntSet))
+
@@ -0,0 +1,422 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+	Mass storage benchmark, runs the bulk-only transport and SCSI layers
+	of the msc example on the simulated controller.
+
+	The block device is an image file mapped into memory (blockdev_file.c),
+	so the numbers show the protocol overhead without storage latency.
+	The simulated host enumerates the device and then replays command
+	block wrappers:
+	* tur		TEST UNIT READY, no data stage
+	* read1		READ(10) of one block at a random address
+	* read		READ(10) of MSC_XFER_BLOCKS consecutive blocks
+	* write		WRITE(10) of MSC_XFER_BLOCKS consecutive blocks
+
+	Data read back is checked against the block number stamped into every
+	block of the image, and every command must return a good status.
+
+	For every scenario the number of commands and kB per second on the
+	simulated 60 MHz part, the CPU cycles and interrupts per command and
+	the host throughput of the simulation are printed.
+
+	Usage: mscbench [scenario] [count] [image]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "type.h"
+#include "usbapi.h"
+#include "usbsim.h"
+#include "simhost.h"
+
+#include "msc_bot.h"
+#include "msc_scsi.h"
+#include "blockdev.h"
+#include "blockcache.h"
+#include "blockdev_file.h"
+
+
+#define MAX_PACKET_SIZE	64
+#define BLOCKSIZE		512
+
+#define IMAGE_NAME		"mscbench.img"
+#define IMAGE_SIZE		(16 * 1024 * 1024)
+#define MSC_XFER_BLOCKS	64
+
+#define CBW_SIGNATURE	0x43425355
+#define CSW_SIGNATURE	0x53425355
+#define CBW_SIZE		31
+#define CSW_SIZE		13
+
+#define LE_WORD(x)		((x)&0xFF),((x)>>8)
+
+
+static const U8 abDescriptors[] = {
+
+// device descriptor
+	0x12,
+	DESC_DEVICE,
+	LE_WORD(0x0200),		// bcdUSB
+	0x00,					// bDeviceClass
+	0x00,					// bDeviceSubClass
+	0x00,					// bDeviceProtocol
+	MAX_PACKET_SIZE0,		// bMaxPacketSize
+	LE_WORD(0xFFFF),		// idVendor
+	LE_WORD(0x0003),		// idProduct
+	LE_WORD(0x0100),		// bcdDevice
+	0x01,					// iManufacturer
+	0x02,					// iProduct
+	0x03,					// iSerialNumber
+	0x01,					// bNumConfigurations
+
+// configuration descriptor
+	0x09,
+	DESC_CONFIGURATION,
+	LE_WORD(32),			// wTotalLength
+	0x01,					// bNumInterfaces
+	0x01,					// bConfigurationValue
+	0x00,					// iConfiguration
+	0xC0,					// bmAttributes
+	0x32,					// bMaxPower
+
+// interface
+	0x09,
+	DESC_INTERFACE,
+	0x00,					// bInterfaceNumber
+	0x00,					// bAlternateSetting
+	0x02,					// bNumEndPoints
+	0x08,					// bInterfaceClass = mass storage
+	0x06,					// bInterfaceSubClass = transparent SCSI
+	0x50,					// bInterfaceProtocol = BOT
+	0x00,					// iInterface
+// EP
+	0x07,
+	DESC_ENDPOINT,
+	MSC_BULK_IN_EP,			// bEndpointAddress
+	0x02,					// bmAttributes = bulk
+	LE_WORD(MAX_PACKET_SIZE),// wMaxPacketSize
+	0x00,					// bInterval
+// EP
+	0x07,
+	DESC_ENDPOINT,
+	MSC_BULK_OUT_EP,		// bEndpointAddress
+	0x02,					// bmAttributes = bulk
+	LE_WORD(MAX_PACKET_SIZE),// wMaxPacketSize
+	0x00,					// bInterval
+
+// string descriptors
+	0x04,
+	DESC_STRING,
+	LE_WORD(0x0409),
+
+	0x0E,
+	DESC_STRING,
+	'L', 0, 'P', 0, 'C', 0, 'U', 0, 'S', 0, 'B', 0,
+
+	0x10,
+	DESC_STRING,
+	'M', 0, 's', 0, 'c', 0, 'B', 0, 'e', 0, 'n', 0, 'c', 0,
+
+	0x12,
+	DESC_STRING,
+	'D', 0, 'E', 0, 'A', 0, 'D', 0, 'C', 0, '0', 0, 'D', 0, 'E', 0,
+
+// terminating zero
+	0
+};
+
+
+static U8	abData[MSC_XFER_BLOCKS * BLOCKSIZE];
+static U32	dwTag;
+static U32	dwNumBlocks;
+static U32	dwNextLBA;
+
+
+/* device side */
+
+static void DeviceMainLoop(void)
+{
+	USBHwProcessEvents();
+	MSCBotPoll();
+}
+
+
+/* host side */
+
+static void PutLE32(U8 *pb, U32 dw)
+{
+	pb[0] = dw & 0xFF;
+	pb[1] = (dw >> 8) & 0xFF;
+	pb[2] = (dw >> 16) & 0xFF;
+	pb[3] = dw >> 24;
+}
+
+
+static U32 GetLE32(const U8 *pb)
+{
+	return pb[0] | (pb[1] << 8) | (pb[2] << 16) | ((U32)pb[3] << 24);
+}
+
+
+/**
+	Runs one bulk-only transport command: CBW, data stage and CSW
+
+	@param [in]		pbCDB		Command block
+	@param [in]		iCDBLen		Length of the command block
+	@param [in]		fIn			TRUE for a data IN stage
+	@param [in,out]	pbData		Data buffer
+	@param [in]		iLen		Length of the data stage
+
+	@return TRUE if the command completed with a good status
+ */
+static BOOL HostCommand(const U8 *pbCDB, int iCDBLen, BOOL fIn, U8 *pbData, int iLen)
+{
+	U8	abCBW[CBW_SIZE], abCSW[CSW_SIZE];
+	int	iDone, iRes;
+
+	memset(abCBW, 0, sizeof(abCBW));
+	PutLE32(&abCBW[0], CBW_SIGNATURE);
+	PutLE32(&abCBW[4], ++dwTag);
+	PutLE32(&abCBW[8], iLen);
+	abCBW[12] = fIn ? 0x80 : 0x00;
+	abCBW[13] = 0;
+	abCBW[14] = iCDBLen;
+	memcpy(&abCBW[15], pbCDB, iCDBLen);
+	if (HostOut(MSC_BULK_OUT_EP, abCBW, CBW_SIZE) != CBW_SIZE) {
+		printf("CBW not accepted\n");
+		return FALSE;
+	}
+
+	for (iDone = 0; iDone < iLen; iDone += iRes) {
+		if (fIn) {
+			iRes = HostIn(MSC_BULK_IN_EP, pbData + iDone, MIN(MAX_PACKET_SIZE, iLen - iDone));
+		}
+		else {
+			iRes = HostOut(MSC_BULK_OUT_EP, pbData + iDone, MIN(MAX_PACKET_SIZE, iLen - iDone));
+		}
+		if (iRes <= 0) {
+			printf("data stage failed after %d bytes (%d)\n", iDone, iRes);
+			return FALSE;
+		}
+	}
+
+	if (HostIn(MSC_BULK_IN_EP, abCSW, CSW_SIZE) != CSW_SIZE) {
+		printf("no CSW\n");
+		return FALSE;
+	}
+	if ((GetLE32(&abCSW[0]) != CSW_SIGNATURE) || (GetLE32(&abCSW[4]) != dwTag) ||
+		(abCSW[12] != 0)) {
+		printf("bad CSW, status %d\n", abCSW[12]);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+static BOOL HostReadWrite(BOOL fRead, U32 dwLBA, int iBlocks)
+{
+	U8 abCDB[10];
+
+	memset(abCDB, 0, sizeof(abCDB));
+	abCDB[0] = fRead ? 0x28 : 0x2A;
+	abCDB[2] = (dwLBA >> 24) & 0xFF;
+	abCDB[3] = (dwLBA >> 16) & 0xFF;
+	abCDB[4] = (dwLBA >> 8) & 0xFF;
+	abCDB[5] = dwLBA & 0xFF;
+	abCDB[7] = (iBlocks >> 8) & 0xFF;
+	abCDB[8] = iBlocks & 0xFF;
+	return HostCommand(abCDB, sizeof(abCDB), fRead, abData, iBlocks * BLOCKSIZE);
+}
+
+
+/**
+	Stamps blocks with their block number, every word of a block holds
+	the block number plus the word index
+ */
+static void StampBlocks(U8 *pbBuf, U32 dwLBA, int iBlocks)
+{
+	U32	*pdw;
+	int	i;
+
+	pdw = (U32 *)pbBuf;
+	for (i = 0; i < iBlocks * (BLOCKSIZE / 4); i++) {
+		pdw[i] = dwLBA + (i / (BLOCKSIZE / 4)) + (i % (BLOCKSIZE / 4));
+	}
+}
+
+
+static BOOL CheckBlocks(const U8 *pbBuf, U32 dwLBA, int iBlocks)
+{
+	static U8 abExpect[MSC_XFER_BLOCKS * BLOCKSIZE];
+
+	StampBlocks(abExpect, dwLBA, iBlocks);
+	if (memcmp(pbBuf, abExpect, iBlocks * BLOCKSIZE) != 0) {
+		printf("data mismatch at block %u\n", (unsigned)dwLBA);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/* scenarios */
+
+static int ScenarioTUR(int iCount)
+{
+	static const U8 abCDB[6] = {0x00, 0, 0, 0, 0, 0};
+	int i;
+
+	for (i = 0; i < iCount; i++) {
+		if (!HostCommand(abCDB, sizeof(abCDB), FALSE, NULL, 0)) {
+			break;
+		}
+	}
+	return i;
+}
+
+
+static int ScenarioRead1(int iCount)
+{
+	U32	dwLBA;
+	int	i;
+
+	srand(1);
+	for (i = 0; i < iCount; i++) {
+		dwLBA = rand() % dwNumBlocks;
+		if (!HostReadWrite(TRUE, dwLBA, 1) || !CheckBlocks(abData, dwLBA, 1)) {
+			break;
+		}
+	}
+	return i;
+}
+
+
+static int ScenarioRead(int iCount)
+{
+	int i;
+
+	for (i = 0; i < iCount; i++) {
+		if (!HostReadWrite(TRUE, dwNextLBA, MSC_XFER_BLOCKS) ||
+			!CheckBlocks(abData, dwNextLBA, MSC_XFER_BLOCKS)) {
+			break;
+		}
+		dwNextLBA = (dwNextLBA + MSC_XFER_BLOCKS) % (dwNumBlocks - MSC_XFER_BLOCKS);
+	}
+	return i;
+}
+
+
+static int ScenarioWrite(int iCount)
+{
+	U32	dwLBA;
+	int	i;
+
+	dwLBA = 0;
+	for (i = 0; i < iCount; i++) {
+		StampBlocks(abData, dwLBA, MSC_XFER_BLOCKS);
+		if (!HostReadWrite(FALSE, dwLBA, MSC_XFER_BLOCKS)) {
+			break;
+		}
+		if (!CheckBlocks(BlockDevFileData() + dwLBA * BLOCKSIZE, dwLBA, MSC_XFER_BLOCKS)) {
+			break;
+		}
+		dwLBA = (dwLBA + MSC_XFER_BLOCKS) % (dwNumBlocks - MSC_XFER_BLOCKS);
+	}
+	return i;
+}
+
+
+static const TSimScenario aScenarios[] = {
+	{"tur",		ScenarioTUR,	10000,	"cmd",	0},
+	{"read1",	ScenarioRead1,	10000,	"cmd",	BLOCKSIZE},
+	{"read",	ScenarioRead,	1000,	"cmd",	MSC_XFER_BLOCKS * BLOCKSIZE},
+	{"write",	ScenarioWrite,	1000,	"cmd",	MSC_XFER_BLOCKS * BLOCKSIZE},
+	{NULL,		NULL,			0,		NULL,	0}
+};
+
+
+int main(int argc, char *argv[])
+{
+	const char	*pszName = NULL;
+	const char	*pszImage = IMAGE_NAME;
+	U32			dwSize, dwLBA;
+	int			iCount = 0;
+
+	if (argc > 1) {
+		pszName = argv[1];
+	}
+	if (argc > 2) {
+		iCount = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		pszImage = argv[3];
+	}
+
+	if (!BlockDevFileOpen(pszImage, IMAGE_SIZE) || !BlockDevGetSize(&dwSize)) {
+		printf("cannot map image %s\n", pszImage);
+		return 1;
+	}
+	dwNumBlocks = dwSize / BLOCKSIZE;
+	if (dwNumBlocks < 2 * MSC_XFER_BLOCKS) {
+		printf("image %s is too small\n", pszImage);
+		return 1;
+	}
+	// stamp the image so reads can be checked
+	for (dwLBA = 0; dwLBA < dwNumBlocks; dwLBA++) {
+		StampBlocks(BlockDevFileData() + dwLBA * BLOCKSIZE, dwLBA, 1);
+	}
+
+	SimInit();
+
+	BlockDevInit();
+	BlockCacheInit();
+
+	// initialise stack like the msc example does
+	USBInit();
+	USBHwNakIntEnable(INACK_BI);
+	USBRegisterDescriptors(abDescriptors);
+	USBHwRegisterEPIntHandler(MSC_BULK_IN_EP, MSCBotBulkIn);
+	USBHwRegisterEPIntHandler(MSC_BULK_OUT_EP, MSCBotBulkOut);
+	USBHwSetDeferred(TRUE);
+	SimHostSetDevice(USBHwISR, DeviceMainLoop);
+	USBHwConnect(TRUE);
+
+	if (HostEnumerate() != 10) {
+		printf("enumeration failed\n");
+		return 1;
+	}
+
+	SimRunScenarios(aScenarios, pszName, iCount);
+
+	BlockCacheFlush();
+	BlockDevFileClose();
+	return 0;
+}
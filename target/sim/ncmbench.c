@@ -0,0 +1,633 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+	CDC-NCM benchmark, runs the NCM function and the echo stack of the
+	ncm example on the simulated controller.
+
+	The simulated host enumerates the device, selects the NTB alternate
+	setting, checks the NTB parameters and the connection notifications,
+	resolves the device address with ARP and then sends echo requests,
+	packed in NTBs of one or more frames:
+	* ping1		one 60 byte ICMP echo request per NTB
+	* ping8		8 of them per NTB
+	* ping24	24 of them per NTB
+	* udp		one 1514 byte UDP echo datagram per NTB
+
+	Every reply is checked against its request.
+
+	For every scenario the number of frames echoed and kB per second (of
+	frames, one way) on the simulated 60 MHz part, the CPU cycles and
+	interrupts per frame, the IN NTBs per frame and the host throughput of
+	the simulation are printed, so the per frame cost with and without
+	aggregation can be compared.
+
+	Usage: ncmbench [scenario] [count]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "type.h"
+#include "usbapi.h"
+#include "usbsim.h"
+#include "simhost.h"
+
+#include "ncm.h"
+#include "netecho.h"
+
+
+#define MAX_PACKET_SIZE	64
+
+#define LE_WORD(x)		((x)&0xFF),((x)>>8)
+
+#define NTH16_SIGNATURE	0x484D434E
+#define NDP16_SIGNATURE	0x304D434E
+#define MAX_FRAMES		32
+#define SMALL_FRAME		60
+#define LARGE_FRAME		1514
+
+#define GET_NTB_PARAMETERS	0x80
+
+
+static const U8 abDescriptors[] = {
+
+// device descriptor
+	0x12,
+	DESC_DEVICE,
+	LE_WORD(0x0200),		// bcdUSB
+	0x02,					// bDeviceClass
+	0x00,					// bDeviceSubClass
+	0x00,					// bDeviceProtocol
+	MAX_PACKET_SIZE0,		// bMaxPacketSize
+	LE_WORD(0xFFFF),		// idVendor
+	LE_WORD(0x0006),		// idProduct
+	LE_WORD(0x0100),		// bcdDevice
+	0x01,					// iManufacturer
+	0x02,					// iProduct
+	0x03,					// iSerialNumber
+	0x01,					// bNumConfigurations
+
+// configuration descriptor, functional descriptors left out
+	0x09,
+	DESC_CONFIGURATION,
+	LE_WORD(57),			// wTotalLength
+	0x02,					// bNumInterfaces
+	0x01,					// bConfigurationValue
+	0x00,					// iConfiguration
+	0xC0,					// bmAttributes
+	0x32,					// bMaxPower
+// communication class interface
+	0x09,
+	DESC_INTERFACE,
+	NCM_COMM_IF,			// bInterfaceNumber
+	0x00,					// bAlternateSetting
+	0x01,					// bNumEndPoints
+	0x02,					// bInterfaceClass = communication
+	0x0D,					// bInterfaceSubClass = NCM
+	0x00,					// bInterfaceProtocol
+	0x00,					// iInterface
+// notification EP
+	0x07,
+	DESC_ENDPOINT,
+	NCM_INT_IN_EP,			// bEndpointAddress
+	0x03,					// bmAttributes = intr
+	LE_WORD(16),			// wMaxPacketSize
+	0x0A,					// bInterval
+// data class interface, no endpoints
+	0x09,
+	DESC_INTERFACE,
+	NCM_DATA_IF,			// bInterfaceNumber
+	0x00,					// bAlternateSetting
+	0x00,					// bNumEndPoints
+	0x0A,					// bInterfaceClass = data
+	0x00,					// bInterfaceSubClass
+	0x01,					// bInterfaceProtocol = NTB
+	0x00,					// iInterface
+// data class interface, NTBs
+	0x09,
+	DESC_INTERFACE,
+	NCM_DATA_IF,			// bInterfaceNumber
+	0x01,					// bAlternateSetting
+	0x02,					// bNumEndPoints
+	0x0A,					// bInterfaceClass = data
+	0x00,					// bInterfaceSubClass
+	0x01,					// bInterfaceProtocol = NTB
+	0x00,					// iInterface
+// EP
+	0x07,
+	DESC_ENDPOINT,
+	NCM_BULK_OUT_EP,		// bEndpointAddress
+	0x02,					// bmAttributes = bulk
+	LE_WORD(MAX_PACKET_SIZE),// wMaxPacketSize
+	0x00,					// bInterval
+// EP
+	0x07,
+	DESC_ENDPOINT,
+	NCM_BULK_IN_EP,			// bEndpointAddress
+	0x02,					// bmAttributes = bulk
+	LE_WORD(MAX_PACKET_SIZE),// wMaxPacketSize
+	0x00,					// bInterval
+
+// string descriptors
+	0x04,
+	DESC_STRING,
+	LE_WORD(0x0409),
+
+	0x0E,
+	DESC_STRING,
+	'L', 0, 'P', 0, 'C', 0, 'U', 0, 'S', 0, 'B', 0,
+
+	0x10,
+	DESC_STRING,
+	'N', 0, 'c', 0, 'm', 0, 'B', 0, 'e', 0, 'n', 0, 'c', 0,
+
+	0x12,
+	DESC_STRING,
+	'D', 0, 'E', 0, 'A', 0, 'D', 0, 'C', 0, '0', 0, 'D', 0, 'E', 0,
+
+// terminating zero
+	0
+};
+
+
+static const U8 abDevMac[6] = {0x02, 0x4C, 0x50, 0x43, 0x00, 0x01};
+static const U8 abDevIp[4] = {192, 168, 7, 2};
+static const U8 abHostMac[6] = {0x02, 0x4C, 0x50, 0x43, 0x00, 0x02};
+static const U8 abHostIp[4] = {192, 168, 7, 1};
+
+static U8	aabFrame[MAX_FRAMES][LARGE_FRAME];	/* requests of one NTB */
+static int	aiFrameLen[MAX_FRAMES];
+static BOOL	afAnswered[MAX_FRAMES];
+static U8	abNtb[NCM_NTB_SIZE];
+static U16	wSequence;
+static U16	wIdent;
+static U32	dwNtbIn;
+
+
+/* host side */
+
+static U16 GetLE16(const U8 *pb)
+{
+	return pb[0] | (pb[1] << 8);
+}
+
+
+static U32 GetLE32(const U8 *pb)
+{
+	return pb[0] | (pb[1] << 8) | (pb[2] << 16) | ((U32)pb[3] << 24);
+}
+
+
+static void PutLE16(U8 *pb, U16 w)
+{
+	pb[0] = w & 0xFF;
+	pb[1] = w >> 8;
+}
+
+
+static void PutLE32(U8 *pb, U32 dw)
+{
+	PutLE16(pb, dw & 0xFFFF);
+	PutLE16(pb + 2, dw >> 16);
+}
+
+
+static void PutBE16(U8 *pb, U16 w)
+{
+	pb[0] = w >> 8;
+	pb[1] = w & 0xFF;
+}
+
+
+static U16 Checksum(const U8 *pb, int iLen)
+{
+	U32	dwSum = 0;
+	int	i;
+
+	for (i = 0; i + 1 < iLen; i += 2) {
+		dwSum += (pb[i] << 8) | pb[i + 1];
+	}
+	if (iLen & 1) {
+		dwSum += pb[iLen - 1] << 8;
+	}
+	while (dwSum >> 16) {
+		dwSum = (dwSum & 0xFFFF) + (dwSum >> 16);
+	}
+	return ~dwSum;
+}
+
+
+/**
+	Sends the frames in aabFrame as one NTB, NDP16 right after the NTH16
+	like the Linux cdc_ncm driver does
+
+	@return TRUE if the device took the whole NTB
+ */
+static BOOL HostSendNtb(int iFrames)
+{
+	int	i, iPos, iLen, iRes;
+
+	// NTH16, NDP16 and datagrams, aligned to 4
+	iPos = 12 + 8 + 4 * (iFrames + 1);
+	PutLE32(&abNtb[12], NDP16_SIGNATURE);
+	PutLE16(&abNtb[16], 8 + 4 * (iFrames + 1));
+	PutLE16(&abNtb[18], 0);
+	for (i = 0; i < iFrames; i++) {
+		iPos = (iPos + 3) & ~3;
+		memcpy(&abNtb[iPos], aabFrame[i], aiFrameLen[i]);
+		PutLE16(&abNtb[20 + 4 * i], iPos);
+		PutLE16(&abNtb[22 + 4 * i], aiFrameLen[i]);
+		iPos += aiFrameLen[i];
+	}
+	PutLE32(&abNtb[20 + 4 * i], 0);
+	PutLE32(&abNtb[0], NTH16_SIGNATURE);
+	PutLE16(&abNtb[4], 12);
+	PutLE16(&abNtb[6], wSequence++);
+	PutLE16(&abNtb[8], iPos);
+	PutLE16(&abNtb[10], 12);
+
+	// a full last packet needs a zero length packet, unless the NTB has
+	// the maximum size
+	for (i = 0; i < iPos; i += iLen) {
+		iLen = MIN(MAX_PACKET_SIZE, iPos - i);
+		if ((iRes = HostOut(NCM_BULK_OUT_EP, &abNtb[i], iLen)) != iLen) {
+			printf("NTB not accepted at %d bytes (%d)\n", i, iRes);
+			return FALSE;
+		}
+	}
+	if (((iPos % MAX_PACKET_SIZE) == 0) && (iPos < NCM_NTB_SIZE)) {
+		return HostOut(NCM_BULK_OUT_EP, NULL, 0) == 0;
+	}
+	return TRUE;
+}
+
+
+/**
+	Receives one NTB into abNtb and checks its headers
+
+	@return number of datagrams, or -1
+ */
+static int HostReceiveNtb(void)
+{
+	int	iPos, iLen, iNdp, iCount;
+
+	for (iPos = 0; iPos < NCM_NTB_SIZE; iPos += iLen) {
+		iLen = HostIn(NCM_BULK_IN_EP, &abNtb[iPos], MAX_PACKET_SIZE);
+		if (iLen < 0) {
+			printf("no NTB (%d)\n", iLen);
+			return -1;
+		}
+		if (iLen < MAX_PACKET_SIZE) {
+			iPos += iLen;
+			break;
+		}
+	}
+	dwNtbIn++;
+
+	if ((iPos < 12) || (GetLE32(&abNtb[0]) != NTH16_SIGNATURE) || (GetLE16(&abNtb[8]) != iPos)) {
+		printf("bad NTH16\n");
+		return -1;
+	}
+	iNdp = GetLE16(&abNtb[10]);
+	if ((iNdp & 3) || (iNdp + 16 > iPos) || (GetLE32(&abNtb[iNdp]) != NDP16_SIGNATURE) ||
+		(GetLE16(&abNtb[iNdp + 6]) != 0)) {
+		printf("bad NDP16\n");
+		return -1;
+	}
+	for (iCount = 0; GetLE16(&abNtb[iNdp + 8 + 4 * iCount]) != 0; iCount++) {
+		if ((GetLE16(&abNtb[iNdp + 8 + 4 * iCount]) & 3) ||
+			(GetLE16(&abNtb[iNdp + 8 + 4 * iCount]) + GetLE16(&abNtb[iNdp + 10 + 4 * iCount]) > iPos)) {
+			printf("bad datagram pointer\n");
+			return -1;
+		}
+	}
+	return iCount;
+}
+
+
+static const U8 *GetDatagram(int i, int *piLen)
+{
+	int iNdp = GetLE16(&abNtb[10]);
+
+	*piLen = GetLE16(&abNtb[iNdp + 10 + 4 * i]);
+	return &abNtb[GetLE16(&abNtb[iNdp + 8 + 4 * i])];
+}
+
+
+/**
+	Builds an ICMP echo request or UDP echo datagram of iLen bytes in
+	aabFrame[i]
+ */
+static void MakeRequest(int i, BOOL fUdp, int iLen)
+{
+	U8	*pb = aabFrame[i];
+	int	j;
+
+	memcpy(&pb[0], abDevMac, 6);
+	memcpy(&pb[6], abHostMac, 6);
+	PutBE16(&pb[12], 0x0800);
+	// IPv4 header
+	pb[14] = 0x45;
+	pb[15] = 0;
+	PutBE16(&pb[16], iLen - 14);
+	PutBE16(&pb[18], ++wIdent);
+	PutBE16(&pb[20], 0);
+	pb[22] = 64;
+	pb[23] = fUdp ? 17 : 1;
+	PutBE16(&pb[24], 0);
+	memcpy(&pb[26], abHostIp, 4);
+	memcpy(&pb[30], abDevIp, 4);
+	PutBE16(&pb[24], Checksum(&pb[14], 20));
+	// payload
+	for (j = 42; j < iLen; j++) {
+		pb[j] = j + wIdent;
+	}
+	if (fUdp) {
+		PutBE16(&pb[34], 1024 + i);
+		PutBE16(&pb[36], NETECHO_UDP_PORT);
+		PutBE16(&pb[38], iLen - 34);
+		PutBE16(&pb[40], 0);			// no checksum
+	}
+	else {
+		pb[34] = 8;
+		pb[35] = 0;
+		PutBE16(&pb[36], 0);
+		PutBE16(&pb[38], 0x4C50);
+		PutBE16(&pb[40], wIdent);
+		PutBE16(&pb[36], Checksum(&pb[34], iLen - 34));
+	}
+	aiFrameLen[i] = iLen;
+}
+
+
+/**
+	Checks a reply against the request it answers
+
+	@return index of the request, or -1
+ */
+static int CheckReply(const U8 *pb, int iLen, int iFrames)
+{
+	const U8	*pbReq;
+	int			i;
+
+	for (i = 0; i < iFrames; i++) {
+		pbReq = aabFrame[i];
+		if (!afAnswered[i] && (iLen == aiFrameLen[i]) && (pb[19] == pbReq[19]) &&
+			(pb[18] == pbReq[18])) {
+			break;
+		}
+	}
+	if (i == iFrames) {
+		printf("unexpected reply\n");
+		return -1;
+	}
+	if ((memcmp(&pb[0], abHostMac, 6) != 0) || (memcmp(&pb[6], abDevMac, 6) != 0) ||
+		(memcmp(&pb[26], abDevIp, 4) != 0) || (memcmp(&pb[30], abHostIp, 4) != 0) ||
+		(Checksum(&pb[14], 20) != 0) || (memcmp(&pb[42], &pbReq[42], iLen - 42) != 0)) {
+		printf("bad reply\n");
+		return -1;
+	}
+	if (pbReq[23] == 17) {
+		if ((pb[34] != pbReq[36]) || (pb[35] != pbReq[37]) ||
+			(pb[36] != pbReq[34]) || (pb[37] != pbReq[35])) {
+			printf("bad UDP reply\n");
+			return -1;
+		}
+	}
+	else if ((pb[34] != 0) || (Checksum(&pb[34], iLen - 34) != 0)) {
+		printf("bad ICMP reply\n");
+		return -1;
+	}
+	afAnswered[i] = TRUE;
+	return i;
+}
+
+
+/**
+	Sends iFrames requests in one NTB and collects the replies
+
+	@return TRUE if every request was answered
+ */
+static BOOL HostEcho(int iFrames, BOOL fUdp, int iLen)
+{
+	const U8	*pb;
+	int			i, iCount, iReplies, iDgLen;
+
+	for (i = 0; i < iFrames; i++) {
+		MakeRequest(i, fUdp, iLen);
+		afAnswered[i] = FALSE;
+	}
+	if (!HostSendNtb(iFrames)) {
+		return FALSE;
+	}
+	for (iReplies = 0; iReplies < iFrames; iReplies += iCount) {
+		if ((iCount = HostReceiveNtb()) <= 0) {
+			return FALSE;
+		}
+		for (i = 0; i < iCount; i++) {
+			pb = GetDatagram(i, &iDgLen);
+			if (CheckReply(pb, iDgLen, iFrames) < 0) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+
+static BOOL HostArp(void)
+{
+	U8			*pb = aabFrame[0];
+	const U8	*pbReply;
+	int			iLen;
+
+	memset(pb, 0, SMALL_FRAME);
+	memset(&pb[0], 0xFF, 6);
+	memcpy(&pb[6], abHostMac, 6);
+	PutBE16(&pb[12], 0x0806);
+	PutBE16(&pb[14], 1);
+	PutBE16(&pb[16], 0x0800);
+	pb[18] = 6;
+	pb[19] = 4;
+	PutBE16(&pb[20], 1);
+	memcpy(&pb[22], abHostMac, 6);
+	memcpy(&pb[28], abHostIp, 4);
+	memcpy(&pb[38], abDevIp, 4);
+	aiFrameLen[0] = SMALL_FRAME;
+
+	if (!HostSendNtb(1) || (HostReceiveNtb() != 1)) {
+		return FALSE;
+	}
+	pbReply = GetDatagram(0, &iLen);
+	return (iLen == SMALL_FRAME) && (GetLE16(&pbReply[20]) == 0x0200) &&
+		   (memcmp(&pbReply[0], abHostMac, 6) == 0) &&
+		   (memcmp(&pbReply[22], abDevMac, 6) == 0) &&
+		   (memcmp(&pbReply[28], abDevIp, 4) == 0) &&
+		   (memcmp(&pbReply[32], abHostMac, 6) == 0);
+}
+
+
+/**
+	Selects the NTB alternate setting and checks the NTB parameters and
+	the speed and connection notifications
+ */
+static BOOL HostStartNcm(void)
+{
+	U8	abBuf[32];
+
+	if ((HostControl(0x01, REQ_SET_INTERFACE, 1, NCM_DATA_IF, 0, NULL) < 0) ||
+		(HostControl(0xA1, GET_NTB_PARAMETERS, 0, NCM_COMM_IF, 28, abBuf) != 28) ||
+		(GetLE16(&abBuf[2]) != 1) || (GetLE32(&abBuf[4]) != NCM_NTB_SIZE) ||
+		(GetLE32(&abBuf[16]) != NCM_NTB_SIZE)) {
+		printf("no NTB parameters\n");
+		return FALSE;
+	}
+	if ((HostIn(NCM_INT_IN_EP, abBuf, 16) != 16) || (abBuf[1] != 0x2A) ||
+		(HostIn(NCM_INT_IN_EP, abBuf, 16) != 8) || (abBuf[1] != 0x00) || (abBuf[2] != 1)) {
+		printf("no connection notification\n");
+		return FALSE;
+	}
+	if (!HostArp()) {
+		printf("no ARP reply\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/* scenarios, return the number of frames echoed */
+
+static int PrintNtbs(const char *pszName, U32 dwNtbStart, int iDone)
+{
+	if (iDone > 0) {
+		printf("%s: %.2f IN NTBs per frame\n", pszName,
+			(double)(dwNtbIn - dwNtbStart) / iDone);
+	}
+	return iDone;
+}
+
+
+static int ScenarioPing(const char *pszName, int iCount, int iPerNtb)
+{
+	U32	dwNtbStart = dwNtbIn;
+	int	i;
+
+	for (i = 0; i < iCount; i += iPerNtb) {
+		if (!HostEcho(iPerNtb, FALSE, SMALL_FRAME)) {
+			break;
+		}
+	}
+	return PrintNtbs(pszName, dwNtbStart, i);
+}
+
+
+static int ScenarioPing1(int iCount)
+{
+	return ScenarioPing("ping1", iCount, 1);
+}
+
+
+static int ScenarioPing8(int iCount)
+{
+	return ScenarioPing("ping8", iCount, 8);
+}
+
+
+static int ScenarioPing24(int iCount)
+{
+	return ScenarioPing("ping24", iCount, 24);
+}
+
+
+static int ScenarioUdp(int iCount)
+{
+	U32	dwNtbStart = dwNtbIn;
+	int	i;
+
+	for (i = 0; i < iCount; i++) {
+		if (!HostEcho(1, TRUE, LARGE_FRAME)) {
+			break;
+		}
+	}
+	return PrintNtbs("udp", dwNtbStart, i);
+}
+
+
+static const TSimScenario aScenarios[] = {
+	{"ping1",	ScenarioPing1,	10000,	"frm",	SMALL_FRAME},
+	{"ping8",	ScenarioPing8,	40000,	"frm",	SMALL_FRAME},
+	{"ping24",	ScenarioPing24,	48000,	"frm",	SMALL_FRAME},
+	{"udp",		ScenarioUdp,	2000,	"frm",	LARGE_FRAME},
+	{NULL,		NULL,			0,		NULL,	0}
+};
+
+
+int main(int argc, char *argv[])
+{
+	const char	*pszName = NULL;
+	int			iCount = 0;
+	TNcmStats	Stats;
+
+	if (argc > 1) {
+		pszName = argv[1];
+	}
+	if (argc > 2) {
+		iCount = atoi(argv[2]);
+	}
+
+	SimInit();
+
+	// initialise stack like the ncm example does
+	USBInit();
+	USBRegisterDescriptors(abDescriptors);
+	USBRegisterRequestHandler(REQTYPE_TYPE_CLASS, NcmHandleClassRequest, abNtb);
+	USBRegisterCustomReqHandler(NcmHandleStdRequest);
+	USBHwRegisterEPIntHandler(NCM_INT_IN_EP, NcmIntIn);
+	USBHwRegisterEPIntHandler(NCM_BULK_IN_EP, NcmBulkIn);
+	USBHwRegisterEPIntHandler(NCM_BULK_OUT_EP, NcmBulkOut);
+	NetEchoInit(abDevMac, abDevIp);
+	NcmInit(NetEchoFrame);
+	SimHostSetDevice(USBHwISR, NcmPoll);
+	USBHwConnect(TRUE);
+
+	if ((HostEnumerate() != 10) || !HostStartNcm()) {
+		printf("enumeration failed\n");
+		return 1;
+	}
+
+	SimRunScenarios(aScenarios, pszName, iCount);
+
+	NcmGetStats(&Stats);
+	if (Stats.dwErrors != 0) {
+		printf("%u NCM errors\n", (unsigned)Stats.dwErrors);
+		return 1;
+	}
+	return 0;
+}
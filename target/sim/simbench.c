@@ -0,0 +1,743 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+	Traffic replay benchmark for the USB stack running on the simulated
+	controller.
+
+	A loopback style device (bulk and isochronous endpoints) is set up with
+	the regular stack API, after which the simulated host replays a number
+	of traffic scenarios against it:
+	* enum		repeated enumeration (control transfers)
+	* bulkout	bulk OUT packets, read in the endpoint interrupt
+	* bulkin	bulk IN packets, written in the endpoint interrupt
+	* bulkin-db	bulk IN, keeping both packet buffers of the endpoint filled
+	* bulkout-u, bulkin-u
+				same as bulkout/bulkin with a buffer that is not word aligned,
+				the data is checked in both directions
+	* dmaout, dmain
+				bulk packets moved by the DMA engine, in transfers
+				submitted with USBHwEPSubmit
+	* isoc		isochronous IN/OUT through the DMA engine, descriptors
+				re-armed from the frame interrupt
+	* isoc-busy	same, with the interrupt held off 3 out of every 7 frames
+	* isocring	isochronous IN/OUT streaming with usbisoc.c, with the
+				interrupt held off like isoc-busy
+	* enum-d, bulkout-d
+				enumeration and bulk OUT with deferred event processing,
+				handlers called from the main loop
+	* slowout, slowout-d
+				bulk OUT with a handler taking 0.5 ms per packet, handled
+				in the interrupt or deferred, the longest interrupt is
+				printed
+	* isr1, isr2, isr6
+				endpoint interrupts on 1, 2 or 6 endpoints at once,
+				measures interrupt service time
+	* fastint	an interrupt endpoint routed to EP_FAST next to slow
+				deferred bulk OUT traffic, the longest interrupt is
+				printed
+
+	For every scenario the number of packets per second on the simulated
+	60 MHz part, the CPU cycles spent in the stack per packet and the
+	number of packets per second the simulation runs at on the host are
+	printed.
+
+	Usage: simbench [scenario] [count]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "type.h"
+#include "usbapi.h"
+#include "usbsim.h"
+#include "simhost.h"
+
+
+#define BULK_IN_EP		0x82
+#define BULK_OUT_EP		0x05
+#define ISOC_IN_EP		0x83
+#define ISOC_OUT_EP		0x06
+#define FAST_EP			0x81
+
+#define MAX_PACKET_SIZE	64
+#define ISOC_PACKET_SIZE	128
+#define ISOC_FRAMES		8
+#define ISOC_RING_FRAMES	2
+#define ISOC_RING_DESCS	4
+#define BUSY_FRAMES		3
+#define BUSY_PERIOD		7
+#define SLOW_CYCLES		(SIM_CPU_HZ / 2000)
+#define DMA_XFER_SIZE	4096
+
+#define LE_WORD(x)		((x)&0xFF),((x)>>8)
+
+#define EP2IDX(bEP)		((((bEP)&0xF)<<1)|(((bEP)&0x80)>>7))
+
+
+static const U8 abDescriptors[] = {
+
+/* Device descriptor */
+	0x12,
+	DESC_DEVICE,
+	LE_WORD(0x0200),		// bcdUSB
+	0xFF,					// bDeviceClass
+	0x00,					// bDeviceSubClass
+	0x00,					// bDeviceProtocol
+	MAX_PACKET_SIZE0,		// bMaxPacketSize
+	LE_WORD(0xFFFF),		// idVendor
+	LE_WORD(0x0005),		// idProduct
+	LE_WORD(0x0100),		// bcdDevice
+	0x01,					// iManufacturer
+	0x02,					// iProduct
+	0x03,					// iSerialNumber
+	0x01,					// bNumConfigurations
+
+// configuration
+	0x09,
+	DESC_CONFIGURATION,
+	LE_WORD(0x2E),			// wTotalLength
+	0x01,					// bNumInterfaces
+	0x01,					// bConfigurationValue
+	0x00,					// iConfiguration
+	0x80,					// bmAttributes
+	0x32,					// bMaxPower
+
+// interface
+	0x09,
+	DESC_INTERFACE,
+	0x00,					// bInterfaceNumber
+	0x00,					// bAlternateSetting
+	0x04,					// bNumEndPoints
+	0xFF,					// bInterfaceClass
+	0x00,					// bInterfaceSubClass
+	0x00,					// bInterfaceProtocol
+	0x00,					// iInterface
+
+// bulk in
+	0x07,
+	DESC_ENDPOINT,
+	BULK_IN_EP,				// bEndpointAddress
+	0x02,					// bmAttributes = BULK
+	LE_WORD(MAX_PACKET_SIZE),// wMaxPacketSize
+	0,						// bInterval
+
+// bulk out
+	0x07,
+	DESC_ENDPOINT,
+	BULK_OUT_EP,			// bEndpointAddress
+	0x02,					// bmAttributes = BULK
+	LE_WORD(MAX_PACKET_SIZE),// wMaxPacketSize
+	0,						// bInterval
+
+// isoc in
+	0x07,
+	DESC_ENDPOINT,
+	ISOC_IN_EP,				// bEndpointAddress
+	0x01,					// bmAttributes = ISOC
+	LE_WORD(ISOC_PACKET_SIZE),// wMaxPacketSize
+	1,						// bInterval
+
+// isoc out
+	0x07,
+	DESC_ENDPOINT,
+	ISOC_OUT_EP,			// bEndpointAddress
+	0x01,					// bmAttributes = ISOC
+	LE_WORD(ISOC_PACKET_SIZE),// wMaxPacketSize
+	1,						// bInterval
+
+// string descriptors
+	0x04,
+	DESC_STRING,
+	LE_WORD(0x0409),
+
+	0x0E,
+	DESC_STRING,
+	'L', 0, 'P', 0, 'C', 0, 'U', 0, 'S', 0, 'B', 0,
+
+	0x10,
+	DESC_STRING,
+	'S', 0, 'i', 0, 'm', 0, 'B', 0, 'e', 0, 'n', 0, 'c', 0,
+
+	0x12,
+	DESC_STRING,
+	'D', 0, 'E', 0, 'A', 0, 'D', 0, 'C', 0, '0', 0, 'D', 0, 'E', 0,
+
+	// terminator
+	0
+};
+
+
+/* device side state */
+static U8	abBulkBuf[MAX_PACKET_SIZE + 4] __attribute__ ((aligned(4)));
+static U8	*pbBulkBuf = abBulkBuf;
+static U8	abBulkPattern[MAX_PACKET_SIZE];
+static U32	dwBulkErrors;
+static int	iBulkInLeft;
+static BOOL	fBulkInDouble = FALSE;
+static U32	dwBulkOutBytes;
+static int	iDmaXfersLeft;
+static U32	dwDmaBytes;
+
+/* DMA structures must be reachable by the DMA engine */
+__attribute__ ((section(".usbdma"), aligned(128))) volatile U32 adwUDCA[32];
+__attribute__ ((section(".usbdma"), aligned(4))) volatile U32 adwIsoInDD[5];
+__attribute__ ((section(".usbdma"), aligned(4))) volatile U32 adwIsoOutDD[5];
+__attribute__ ((section(".usbdma"), aligned(4))) U32 adwIsoInSizes[ISOC_FRAMES];
+__attribute__ ((section(".usbdma"), aligned(4))) U32 adwIsoOutSizes[ISOC_FRAMES];
+__attribute__ ((section(".usbdma"), aligned(4))) U8 abIsoInBuf[ISOC_FRAMES * ISOC_PACKET_SIZE];
+__attribute__ ((section(".usbdma"), aligned(4))) U8 abIsoOutBuf[ISOC_FRAMES * ISOC_PACKET_SIZE];
+__attribute__ ((section(".usbdma"), aligned(4))) U8 abDmaBuf[DMA_XFER_SIZE];
+__attribute__ ((section(".usbdma"), aligned(4))) U8 abIsoRingIn[ISOC_RING_DESCS * ISOC_RING_FRAMES * ISOC_PACKET_SIZE];
+__attribute__ ((section(".usbdma"), aligned(4))) U8 abIsoRingOut[ISOC_RING_DESCS * ISOC_RING_FRAMES * ISOC_PACKET_SIZE];
+static U32	dwIsoOutBytes;
+static U8	bIsoInSeq;
+static BOOL	fDeferred = FALSE;
+static int	iSlowCycles = 0;
+static BOOL	fFastISR = FALSE;
+static int	iFastServiced;
+
+
+static void BulkOut(U8 bEP, U8 bEPStatus)
+{
+	int iLen;
+
+	iLen = USBHwEPRead(bEP, pbBulkBuf, MAX_PACKET_SIZE);
+	if (iLen > 0) {
+		dwBulkOutBytes += iLen;
+		if (memcmp(pbBulkBuf, abBulkPattern, iLen) != 0) {
+			dwBulkErrors++;
+		}
+	}
+	// e.g. writing to a storage device
+	SimCpuCycles(iSlowCycles);
+}
+
+
+static void BulkIn(U8 bEP, U8 bEPStatus)
+{
+	int iFree;
+
+	iFree = fBulkInDouble ? USBHwEPGetFreeBuffers(bEP) : 1;
+	for (; (iFree > 0) && (iBulkInLeft > 0); iFree--) {
+		USBHwEPWrite(bEP, pbBulkBuf, MAX_PACKET_SIZE);
+		iBulkInLeft--;
+	}
+}
+
+
+static void DmaDone(U8 bEP, int iLen)
+{
+	if (iLen > 0) {
+		dwDmaBytes += iLen;
+	}
+	if (--iDmaXfersLeft > 0) {
+		USBHwEPSubmit(bEP, abDmaBuf, DMA_XFER_SIZE, DmaDone);
+	}
+}
+
+
+static void IsoArm(U8 bEP, volatile U32 *pdwDD, U8 *pbBuf, U32 *pdwSizes)
+{
+	USBInitializeISOCFrameArray(pdwSizes, ISOC_FRAMES, 0, ISOC_PACKET_SIZE);
+	USBSetupDMADescriptor(pdwDD, NULL, 1, ISOC_PACKET_SIZE, ISOC_FRAMES, pbBuf, pdwSizes);
+	USBSetHeadDDForDMA(bEP, adwUDCA, pdwDD);
+	USBEnableDMAForEndpoint(bEP);
+}
+
+
+static void IsoFrame(U16 wFrame)
+{
+	// re-arm descriptors that have been retired
+	if (adwIsoInDD[3] & 1) {
+		IsoArm(ISOC_IN_EP, adwIsoInDD, abIsoInBuf, adwIsoInSizes);
+	}
+	if (adwIsoOutDD[3] & 1) {
+		IsoArm(ISOC_OUT_EP, adwIsoOutDD, abIsoOutBuf, adwIsoOutSizes);
+	}
+}
+
+
+static void IsoRingIn(U8 bEP, U8 *pbBuf, U32 *pdwFrames, int iFrames)
+{
+	int i;
+
+	for (i = 0; i < iFrames; i++) {
+		pbBuf[i * ISOC_PACKET_SIZE] = bIsoInSeq++;
+	}
+}
+
+
+static void IsoRingOut(U8 bEP, U8 *pbBuf, U32 *pdwFrames, int iFrames)
+{
+	int i;
+
+	for (i = 0; i < iFrames; i++) {
+		dwIsoOutBytes += ISOC_FRAME_LEN(pdwFrames[i]);
+	}
+}
+
+
+static void DummyEPHandler(U8 bEP, U8 bEPStatus)
+{
+}
+
+
+static void FastEPHandler(U8 bEP, U8 bEPStatus)
+{
+	iFastServiced++;
+}
+
+
+/* device side */
+
+static void DeviceISR(void)
+{
+	if (fFastISR) {
+		USBHwFastISR();
+	}
+	USBHwISR();
+}
+
+
+static void DeviceMainLoop(void)
+{
+	if (fDeferred) {
+		USBHwProcessEvents();
+	}
+}
+
+
+/* scenarios */
+
+static int ScenarioEnum(int iCount)
+{
+	int i, iTransfers = 0;
+
+	for (i = 0; i < iCount; i++) {
+		iTransfers += HostEnumerate();
+	}
+	return iTransfers;
+}
+
+
+static int ScenarioBulkOut(int iCount)
+{
+	U8	abData[MAX_PACKET_SIZE];
+	int	i, iPackets = 0;
+
+	memcpy(abData, abBulkPattern, sizeof(abData));
+	dwBulkOutBytes = 0;
+	dwBulkErrors = 0;
+	for (i = 0; i < iCount; i++) {
+		if (HostOut(BULK_OUT_EP, abData, sizeof(abData)) == MAX_PACKET_SIZE) {
+			iPackets++;
+		}
+	}
+	if (dwBulkOutBytes != (U32)iPackets * MAX_PACKET_SIZE) {
+		printf("bulkout: device received %u bytes, expected %u\n",
+			(unsigned)dwBulkOutBytes, (unsigned)(iPackets * MAX_PACKET_SIZE));
+	}
+	if (dwBulkErrors != 0) {
+		printf("bulkout: %u packets received corrupted\n", (unsigned)dwBulkErrors);
+	}
+	return iPackets;
+}
+
+
+static int ScenarioDeferred(int (*pfnScenario)(int iCount), int iCount)
+{
+	int iDone;
+
+	fDeferred = TRUE;
+	USBHwSetDeferred(TRUE);
+	iDone = pfnScenario(iCount);
+	USBHwSetDeferred(FALSE);
+	fDeferred = FALSE;
+	return iDone;
+}
+
+
+static int ScenarioEnumDeferred(int iCount)
+{
+	return ScenarioDeferred(ScenarioEnum, iCount);
+}
+
+
+static int ScenarioBulkOutDeferred(int iCount)
+{
+	return ScenarioDeferred(ScenarioBulkOut, iCount);
+}
+
+
+static int ScenarioSlowOutRun(const char *pszName, int iCount, BOOL fDefer)
+{
+	TSimStats	Stats;
+	int			iDone;
+
+	SimClearIsrMax();
+	iSlowCycles = SLOW_CYCLES;
+	iDone = fDefer ? ScenarioBulkOutDeferred(iCount) : ScenarioBulkOut(iCount);
+	iSlowCycles = 0;
+	SimGetStats(&Stats);
+	printf("%s: longest interrupt %llu cycles\n", pszName, Stats.qwIsrMax);
+	return iDone;
+}
+
+
+static int ScenarioSlowOut(int iCount)
+{
+	return ScenarioSlowOutRun("slowout", iCount, FALSE);
+}
+
+
+static int ScenarioSlowOutDeferred(int iCount)
+{
+	return ScenarioSlowOutRun("slowout-d", iCount, TRUE);
+}
+
+
+static int ScenarioBulkIn(int iCount)
+{
+	U8	abData[MAX_PACKET_SIZE];
+	int	i, iPackets = 0;
+
+	// prime the endpoint, the interrupt handler keeps it filled
+	memcpy(pbBulkBuf, abBulkPattern, MAX_PACKET_SIZE);
+	iBulkInLeft = iCount - 1;
+	USBHwEPWrite(BULK_IN_EP, pbBulkBuf, MAX_PACKET_SIZE);
+	for (i = 0; i < iCount; i++) {
+		if ((HostIn(BULK_IN_EP, abData, sizeof(abData)) == MAX_PACKET_SIZE) &&
+			(memcmp(abData, abBulkPattern, MAX_PACKET_SIZE) == 0)) {
+			iPackets++;
+		}
+	}
+	return iPackets;
+}
+
+
+static int ScenarioBulkInDouble(int iCount)
+{
+	int iPackets;
+
+	fBulkInDouble = TRUE;
+	iPackets = ScenarioBulkIn(iCount);
+	fBulkInDouble = FALSE;
+	return iPackets;
+}
+
+
+static int ScenarioDma(int iCount, U8 bEP)
+{
+	U8	abData[MAX_PACKET_SIZE];
+	int	i, iPackets = 0, iLen;
+	int	iPerXfer = DMA_XFER_SIZE / MAX_PACKET_SIZE;
+
+	memset(abData, 0x5A, sizeof(abData));
+	iDmaXfersLeft = iCount / iPerXfer;
+	dwDmaBytes = 0;
+	if (!USBHwEPSubmit(bEP, abDmaBuf, DMA_XFER_SIZE, DmaDone)) {
+		return 0;
+	}
+	for (i = 0; i < iCount - (iCount % iPerXfer); i++) {
+		if (bEP & 0x80) {
+			iLen = HostIn(bEP, abData, sizeof(abData));
+		}
+		else {
+			iLen = HostOut(bEP, abData, sizeof(abData));
+		}
+		if (iLen == MAX_PACKET_SIZE) {
+			iPackets++;
+		}
+	}
+	if (dwDmaBytes != (U32)iPackets * MAX_PACKET_SIZE) {
+		printf("dma: %u bytes completed, expected %u\n",
+			(unsigned)dwDmaBytes, (unsigned)(iPackets * MAX_PACKET_SIZE));
+	}
+	return iPackets;
+}
+
+
+static int ScenarioBulkOutUnaligned(int iCount)
+{
+	int iPackets;
+
+	pbBulkBuf = abBulkBuf + 1;
+	iPackets = ScenarioBulkOut(iCount);
+	pbBulkBuf = abBulkBuf;
+	return iPackets;
+}
+
+
+static int ScenarioBulkInUnaligned(int iCount)
+{
+	int iPackets;
+
+	pbBulkBuf = abBulkBuf + 1;
+	iPackets = ScenarioBulkIn(iCount);
+	pbBulkBuf = abBulkBuf;
+	return iPackets;
+}
+
+
+static int ScenarioDmaOut(int iCount)
+{
+	return ScenarioDma(iCount, BULK_OUT_EP);
+}
+
+
+static int ScenarioDmaIn(int iCount)
+{
+	return ScenarioDma(iCount, BULK_IN_EP);
+}
+
+
+/*
+	Runs isochronous traffic, the interrupt is held off for iBusy frames
+	out of every BUSY_PERIOD to model other work with interrupts disabled
+ */
+static void IsoTraffic(int iCount, int iBusy)
+{
+	int i;
+
+	SimHostIsoStream(ISOC_IN_EP, ISOC_PACKET_SIZE);
+	SimHostIsoStream(ISOC_OUT_EP, ISOC_PACKET_SIZE);
+	for (i = 0; i < iCount; i++) {
+		SimHostIdle(SIM_FRAME_CYCLES);
+		if ((i % BUSY_PERIOD) >= iBusy) {
+			SimHostRunDevice();
+		}
+	}
+	SimHostIsoStream(ISOC_IN_EP, 0);
+	SimHostIsoStream(ISOC_OUT_EP, 0);
+	SimHostRunDevice();
+}
+
+
+static int IsoMissed(const char *pszName, TSimStats *pStart)
+{
+	TSimStats Stats;
+
+	SimGetStats(&Stats);
+	if (Stats.dwIsoMissed != pStart->dwIsoMissed) {
+		printf("%s: %u packets missed\n", pszName,
+			(unsigned)(Stats.dwIsoMissed - pStart->dwIsoMissed));
+	}
+	return (Stats.dwIsoIn - pStart->dwIsoIn) + (Stats.dwIsoOut - pStart->dwIsoOut);
+}
+
+
+static int ScenarioIsocLegacy(const char *pszName, int iCount, int iBusy)
+{
+	TSimStats Start;
+
+	SimGetStats(&Start);
+	USBInitializeUSBDMA(adwUDCA);
+	IsoArm(ISOC_IN_EP, adwIsoInDD, abIsoInBuf, adwIsoInSizes);
+	IsoArm(ISOC_OUT_EP, adwIsoOutDD, abIsoOutBuf, adwIsoOutSizes);
+	USBHwRegisterFrameHandler(IsoFrame);
+
+	IsoTraffic(iCount, iBusy);
+
+	USBDisableDMAForEndpoint(ISOC_IN_EP);
+	USBDisableDMAForEndpoint(ISOC_OUT_EP);
+	USBHwRegisterFrameHandler(NULL);
+
+	return IsoMissed(pszName, &Start);
+}
+
+
+static int ScenarioIsoc(int iCount)
+{
+	return ScenarioIsocLegacy("isoc", iCount, 0);
+}
+
+
+static int ScenarioIsocBusy(int iCount)
+{
+	return ScenarioIsocLegacy("isoc-busy", iCount, BUSY_FRAMES);
+}
+
+
+static int ScenarioIsocRing(int iCount)
+{
+	TSimStats	Start;
+	TIsocStats	InStats, OutStats;
+
+	SimGetStats(&Start);
+	dwIsoOutBytes = 0;
+	USBIsocStart(ISOC_IN_EP, abIsoRingIn, ISOC_PACKET_SIZE,
+				 ISOC_RING_FRAMES, ISOC_RING_DESCS, IsoRingIn);
+	USBIsocStart(ISOC_OUT_EP, abIsoRingOut, ISOC_PACKET_SIZE,
+				 ISOC_RING_FRAMES, ISOC_RING_DESCS, IsoRingOut);
+
+	IsoTraffic(iCount, BUSY_FRAMES);
+
+	USBIsocGetStats(ISOC_IN_EP, &InStats);
+	USBIsocGetStats(ISOC_OUT_EP, &OutStats);
+	USBIsocStop(ISOC_IN_EP);
+	USBIsocStop(ISOC_OUT_EP);
+
+	if (InStats.dwLate || OutStats.dwLate) {
+		printf("isocring: late %u/%u, missed %u/%u frames (in/out)\n",
+			(unsigned)InStats.dwLate, (unsigned)OutStats.dwLate,
+			(unsigned)InStats.dwMissed, (unsigned)OutStats.dwMissed);
+	}
+	return IsoMissed("isocring", &Start);
+}
+
+
+static int ScenarioISR(int iCount, int iEndpoints)
+{
+	static const U8 abEPs[] = {0x01, 0x81, 0x04, 0x84, 0x07, 0x87};
+	U32	dwMask = 0;
+	int	i;
+
+	for (i = 0; i < iEndpoints; i++) {
+		USBHwRegisterEPIntHandler(abEPs[i], DummyEPHandler);
+		dwMask |= (1 << EP2IDX(abEPs[i]));
+	}
+	for (i = 0; i < iCount; i++) {
+		SimHostEPInt(dwMask);
+		SimHostRunDevice();
+	}
+	for (i = 0; i < iEndpoints; i++) {
+		USBHwRegisterEPIntHandler(abEPs[i], NULL);
+	}
+	return iCount;
+}
+
+
+static int ScenarioISR1(int iCount)
+{
+	return ScenarioISR(iCount, 1);
+}
+
+
+static int ScenarioISR2(int iCount)
+{
+	return ScenarioISR(iCount, 2);
+}
+
+
+static int ScenarioISR6(int iCount)
+{
+	return ScenarioISR(iCount, 6);
+}
+
+
+static int ScenarioFastInt(int iCount)
+{
+	TSimStats	Stats;
+	int			i;
+
+	USBHwRegisterEPIntHandler(FAST_EP, FastEPHandler);
+	USBHwEPSetFast(FAST_EP, TRUE);
+	fFastISR = TRUE;
+	iFastServiced = 0;
+	SimClearIsrMax();
+	iSlowCycles = SLOW_CYCLES;
+
+	for (i = 0; i < iCount; i++) {
+		SimHostEPInt(1 << EP2IDX(FAST_EP));
+		ScenarioBulkOutDeferred(1);
+	}
+
+	iSlowCycles = 0;
+	fFastISR = FALSE;
+	USBHwEPSetFast(FAST_EP, FALSE);
+	USBHwRegisterEPIntHandler(FAST_EP, NULL);
+	SimGetStats(&Stats);
+	printf("fastint: %d fast endpoint interrupts serviced, longest interrupt %llu cycles\n",
+		iFastServiced, Stats.qwIsrMax);
+	return iFastServiced;
+}
+
+
+static const TSimScenario aScenarios[] = {
+	{"enum",	ScenarioEnum,		1000,	"xfer",	0},
+	{"bulkout",	ScenarioBulkOut,	100000,	"pkt",	0},
+	{"bulkin",	ScenarioBulkIn,		100000,	"pkt",	0},
+	{"bulkin-db",	ScenarioBulkInDouble,	100000,	"pkt",	0},
+	{"bulkout-u",	ScenarioBulkOutUnaligned,	100000,	"pkt",	0},
+	{"bulkin-u",	ScenarioBulkInUnaligned,	100000,	"pkt",	0},
+	{"dmaout",	ScenarioDmaOut,		100000,	"pkt",	0},
+	{"dmain",	ScenarioDmaIn,		100000,	"pkt",	0},
+	{"isoc",	ScenarioIsoc,		10000,	"pkt",	0},
+	{"isoc-busy",	ScenarioIsocBusy,	10000,	"pkt",	0},
+	{"isocring",	ScenarioIsocRing,	10000,	"pkt",	0},
+	{"enum-d",	ScenarioEnumDeferred,	1000,	"xfer",	0},
+	{"bulkout-d",	ScenarioBulkOutDeferred,	100000,	"pkt",	0},
+	{"slowout",	ScenarioSlowOut,	1000,	"pkt",	0},
+	{"slowout-d",	ScenarioSlowOutDeferred,	1000,	"pkt",	0},
+	{"isr1",	ScenarioISR1,		100000,	"irq",	0},
+	{"isr2",	ScenarioISR2,		100000,	"irq",	0},
+	{"isr6",	ScenarioISR6,		100000,	"irq",	0},
+	{"fastint",	ScenarioFastInt,	1000,	"irq",	0},
+	{NULL,		NULL,				0,		NULL,	0}
+};
+
+
+int main(int argc, char *argv[])
+{
+	const char	*pszName = NULL;
+	int			i, iCount = 0;
+
+	if (argc > 1) {
+		pszName = argv[1];
+	}
+	if (argc > 2) {
+		iCount = atoi(argv[2]);
+	}
+
+	// not a repeating byte, so misplaced bytes are noticed
+	for (i = 0; i < MAX_PACKET_SIZE; i++) {
+		abBulkPattern[i] = i * 7 + 1;
+	}
+
+	SimInit();
+
+	// initialise stack
+	USBInit();
+	USBRegisterDescriptors(abDescriptors);
+	USBHwRegisterEPIntHandler(BULK_IN_EP, BulkIn);
+	USBHwRegisterEPIntHandler(BULK_OUT_EP, BulkOut);
+	SimHostSetDevice(DeviceISR, DeviceMainLoop);
+	USBHwConnect(TRUE);
+
+	// enumerate once so all endpoints are configured
+	if (HostEnumerate() != 10) {
+		printf("enumeration failed\n");
+		return 1;
+	}
+
+	SimRunScenarios(aScenarios, pszName, iCount);
+	return 0;
+}
+
@@ -0,0 +1,263 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+	Host side harness shared by the benchmarks, see simhost.h
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "type.h"
+#include "usbapi.h"
+#include "usbsim.h"
+#include "simhost.h"
+
+
+/** interrupts serviced at most per host transaction */
+#define MAX_ISR_RUNS	16
+/** NAKed attempts before a transaction is given up */
+#define MAX_RETRIES		1000
+
+
+static TFnSimDevice	*_pfnISR = USBHwISR;
+static TFnSimDevice	*_pfnPoll = NULL;
+
+
+/**
+	Sets the device side code run after every host transaction
+
+	@param [in]	pfnISR		Interrupt handler
+	@param [in]	pfnPoll		Main loop poll, can be NULL
+ */
+void SimHostSetDevice(TFnSimDevice *pfnISR, TFnSimDevice *pfnPoll)
+{
+	_pfnISR = pfnISR;
+	_pfnPoll = pfnPoll;
+}
+
+
+/**
+	Runs the device side: the interrupt handler while an interrupt is
+	requested, with the main loop polled in between and once more at the
+	end, as it also runs when there is no interrupt
+ */
+void SimHostRunDevice(void)
+{
+	int i;
+
+	for (i = 0; (i < MAX_ISR_RUNS) && SimIntPending(); i++) {
+		SimRunISR(_pfnISR);
+		if (_pfnPoll != NULL) {
+			_pfnPoll();
+		}
+	}
+	if (_pfnPoll != NULL) {
+		_pfnPoll();
+	}
+}
+
+
+/**
+	Reads a packet from an IN endpoint, retrying while it is NAKed
+
+	@return packet length, or SIM_NAK/SIM_STALL
+ */
+int HostIn(U8 bEP, U8 *pbData, int iMaxLen)
+{
+	int i, iLen;
+
+	for (i = 0; i < MAX_RETRIES; i++) {
+		iLen = SimHostIn(bEP, pbData, iMaxLen);
+		SimHostRunDevice();
+		if (iLen != SIM_NAK) {
+			return iLen;
+		}
+	}
+	return SIM_NAK;
+}
+
+
+/**
+	Sends a packet to an OUT endpoint, retrying while it is NAKed
+
+	@return packet length, or SIM_NAK/SIM_STALL
+ */
+int HostOut(U8 bEP, U8 *pbData, int iLen)
+{
+	int i, iRes;
+
+	for (i = 0; i < MAX_RETRIES; i++) {
+		iRes = SimHostOut(bEP, pbData, iLen);
+		SimHostRunDevice();
+		if (iRes != SIM_NAK) {
+			return iRes;
+		}
+	}
+	return SIM_NAK;
+}
+
+
+/**
+	Runs a control transfer on endpoint 0
+
+	@return number of bytes in the data stage, or <0 on error
+ */
+int HostControl(U8 bmRequestType, U8 bRequest, U16 wValue, U16 wIndex,
+				U16 wLength, U8 *pbData)
+{
+	U8	abSetup[8];
+	int	iLen, iDone;
+
+	abSetup[0] = bmRequestType;
+	abSetup[1] = bRequest;
+	abSetup[2] = wValue & 0xFF;
+	abSetup[3] = wValue >> 8;
+	abSetup[4] = wIndex & 0xFF;
+	abSetup[5] = wIndex >> 8;
+	abSetup[6] = wLength & 0xFF;
+	abSetup[7] = wLength >> 8;
+
+	SimHostSetup(abSetup);
+	SimHostRunDevice();
+
+	iDone = 0;
+	if ((bmRequestType & 0x80) && (wLength > 0)) {
+		// data IN stage, status OUT stage
+		do {
+			iLen = HostIn(0x80, pbData + iDone, wLength - iDone);
+			if (iLen < 0) {
+				return iLen;
+			}
+			iDone += iLen;
+		} while ((iLen == MAX_PACKET_SIZE0) && (iDone < wLength));
+		return (HostOut(0x00, NULL, 0) < 0) ? -1 : iDone;
+	}
+
+	// status IN stage
+	iLen = HostIn(0x80, NULL, 0);
+	return (iLen < 0) ? iLen : 0;
+}
+
+
+/**
+	Resets and enumerates the device like a host does: device and
+	configuration descriptors, string descriptors 0 to 3, configuration 1
+
+	@return number of successful control transfers, 10 if all went well
+ */
+int HostEnumerate(void)
+{
+	U8	abBuf[256];
+	int	i, iTransfers = 0;
+
+	SimHostReset();
+	SimHostRunDevice();
+
+	iTransfers += HostControl(0x80, REQ_GET_DESCRIPTOR, DESC_DEVICE << 8, 0, 64, abBuf) >= 0;
+	iTransfers += HostControl(0x00, REQ_SET_ADDRESS, 1, 0, 0, NULL) >= 0;
+	iTransfers += HostControl(0x80, REQ_GET_DESCRIPTOR, DESC_DEVICE << 8, 0, 18, abBuf) >= 0;
+	iTransfers += HostControl(0x80, REQ_GET_DESCRIPTOR, DESC_CONFIGURATION << 8, 0, 9, abBuf) >= 0;
+	iTransfers += HostControl(0x80, REQ_GET_DESCRIPTOR, DESC_CONFIGURATION << 8, 0, 255, abBuf) >= 0;
+	for (i = 0; i < 4; i++) {
+		iTransfers += HostControl(0x80, REQ_GET_DESCRIPTOR, (DESC_STRING << 8) | i, 0x0409, 255, abBuf) >= 0;
+	}
+	iTransfers += HostControl(0x00, REQ_SET_CONFIGURATION, 1, 0, 0, NULL) >= 0;
+	return iTransfers;
+}
+
+
+static double WallTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+	Runs a scenario and prints the units per second on the simulated
+	part, the CPU cycles and interrupts per unit and the host throughput
+	of the simulation, plus kB/s on the part for data scenarios
+ */
+static void RunScenario(const TSimScenario *pScenario, int iCount)
+{
+	TSimStats	Start, End;
+	double		dStart, dWall, dSim;
+	SIMTIME		qwElapsed;
+	const char	*pszUnit = pScenario->pszUnit;
+	int			iDone;
+
+	SimGetStats(&Start);
+	dStart = WallTime();
+	iDone = pScenario->pfnRun(iCount);
+	dWall = WallTime() - dStart;
+	SimGetStats(&End);
+
+	qwElapsed = MAX(End.qwCpu - Start.qwCpu, End.qwBus - Start.qwBus);
+	dSim = (double)qwElapsed / SIM_CPU_HZ;
+	if (iDone == 0) {
+		printf("%-9s no %s completed\n", pScenario->pszName, pszUnit);
+		return;
+	}
+	printf("%-9s %8d %-4s %10.0f %s/s", pScenario->pszName, iDone, pszUnit,
+		iDone / dSim, pszUnit);
+	if (pScenario->iBytes > 0) {
+		printf(" %6.0f kB/s", (double)iDone * pScenario->iBytes / 1024 / dSim);
+	}
+	printf("  %7llu cycles/%s  %5.2f irq/%s",
+		(End.qwBusy - Start.qwBusy) / iDone, pszUnit,
+		(double)(End.dwInterrupts - Start.dwInterrupts) / iDone, pszUnit);
+	if (pScenario->iBytes > 0) {
+		printf("  %8.1f MB/s host\n", (double)iDone * pScenario->iBytes / 1e6 / dWall);
+	}
+	else {
+		printf("  %10.0f %s/s host\n", iDone / dWall, pszUnit);
+	}
+}
+
+
+/**
+	Runs the scenarios of a benchmark
+
+	@param [in]	pScenarios	Scenarios, terminated by an entry without name
+	@param [in]	pszName		Only run the scenario with this name, NULL for all
+	@param [in]	iCount		Number of units, 0 for the default of the scenario
+ */
+void SimRunScenarios(const TSimScenario *pScenarios, const char *pszName, int iCount)
+{
+	const TSimScenario *pScenario;
+
+	for (pScenario = pScenarios; pScenario->pszName != NULL; pScenario++) {
+		if ((pszName == NULL) || (strcmp(pszName, pScenario->pszName) == 0)) {
+			RunScenario(pScenario, (iCount > 0) ? iCount : pScenario->iCount);
+		}
+	}
+}
@@ -0,0 +1,65 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+	Host side harness shared by the benchmarks
+
+	Issues host transactions on the simulated controller and runs the
+	device side after every one of them: the interrupt handler for as
+	long as the controller requests an interrupt, and the poll function
+	that stands in for the main loop of the device.
+*/
+
+#ifndef SIMHOST_H
+#define SIMHOST_H
+
+/** device side code, an interrupt handler or a main loop poll */
+typedef void (TFnSimDevice)(void);
+
+/** benchmark scenario */
+typedef struct {
+	const char	*pszName;
+	int			(*pfnRun)(int iCount);	/**< returns the number of units done */
+	int			iCount;		/**< default number of units */
+	const char	*pszUnit;	/**< what is counted, e.g. "pkt" */
+	int			iBytes;		/**< data bytes per unit, 0 if not counted */
+} TSimScenario;
+
+void	SimHostSetDevice(TFnSimDevice *pfnISR, TFnSimDevice *pfnPoll);
+void	SimHostRunDevice(void);
+
+int		HostIn(U8 bEP, U8 *pbData, int iMaxLen);
+int		HostOut(U8 bEP, U8 *pbData, int iLen);
+int		HostControl(U8 bmRequestType, U8 bRequest, U16 wValue, U16 wIndex,
+					U16 wLength, U8 *pbData);
+int		HostEnumerate(void);
+
+void	SimRunScenarios(const TSimScenario *pScenarios, const char *pszName, int iCount);
+
+#endif /* SIMHOST_H */
+
@@ -0,0 +1,1214 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/** @file
+	Simulated LPC214x USB device controller
+
+	Models the parts of the controller used by the stack: the register
+	interface, the serial interface engine (SIE) command protocol, the
+	(double buffered) endpoint buffers, endpoint interrupt routing and
+	the UDCA/DMA descriptor engine for bulk and isochronous endpoints.
+
+	Register writes are seen through SimReg(): the stack stores into the
+	register slot returned for the last access, the model picks up the
+	stored value on the next access (or on any host side call). Only
+	USBCtrl is both read and written with side effects on writes; it is
+	returned with a marker bit set that a write from the stack clears.
+ */
+
+#include <string.h>
+
+#include "type.h"
+#include "lpcsim.h"
+#include "usbhw_lpc.h"
+#include "usbsim.h"
+
+
+#define SIM_CYCLES_REG		4		/**< VPB register access */
+#define SIM_CYCLES_SIE		48		/**< SIE command or data phase */
+#define SIM_CYCLES_RLZ		64		/**< endpoint realisation */
+#define SIM_CYCLES_IRQ		30		/**< IRQ entry, VIC dispatch and exit */
+#define SIM_CYCLES_BIT		(SIM_CPU_HZ / 12000000)	/**< full speed bit time */
+
+#define SIM_BYTES_DATA		14		/**< token, sync, PID, CRC, handshake, gaps */
+#define SIM_BYTES_NAK		8		/**< token + NAK handshake */
+
+#define SIM_MAX_PACKET		1023
+#define SIM_CTRL_MARKER		(1UL << 31)	/**< USBCtrl write detection */
+#define SIM_INTST_MARKER	(1UL << 30)	/**< USBIntSt write detection */
+
+/** endpoint types of the LPC214x logical endpoints */
+#define EPT_CTRL	0
+#define EPT_INT		1
+#define EPT_BULK	2
+#define EPT_ISO		3
+
+static const U8 abEPType[16] = {
+	EPT_CTRL, EPT_INT, EPT_BULK, EPT_ISO, EPT_INT, EPT_BULK, EPT_ISO, EPT_INT,
+	EPT_BULK, EPT_ISO, EPT_INT, EPT_BULK, EPT_ISO, EPT_INT, EPT_BULK, EPT_BULK
+};
+
+/** DMA descriptor status codes */
+#define DD_STATUS_BUSY		1
+#define DD_STATUS_NORMAL	2
+#define DD_STATUS_UNDERRUN	3
+
+#define EP2IDX(bEP)	((((bEP)&0xF)<<1)|(((bEP)&0x80)>>7))
+
+#define ADDR2PTR(dw)	((U32 *)(unsigned long)(dw))
+
+/** state of one physical endpoint */
+typedef struct {
+	int		iMaxPSize;
+	int		iNumBufs;		/**< 2 for double buffered endpoints */
+	int		iHead;			/**< oldest filled buffer */
+	int		iCount;			/**< number of filled buffers */
+	int		aiLen[2];
+	SIMTIME	aqwTime[2];		/**< time a buffer was filled (IN) or freed (OUT) */
+	U8		aabBuf[2][SIM_MAX_PACKET + 4];
+	BOOL	fStall;
+	BOOL	fDisabled;
+	BOOL	fSetup;
+	BOOL	fOverwritten;
+	BOOL	fNaked;
+	int		iIsoLen;		/**< length of host isochronous stream, 0 if none */
+	U32		*pdwDD;			/**< DD being serviced by the DMA engine */
+	SIMTIME	qwDmaTime;		/**< time the DMA was (re)enabled */
+} TSimEP;
+
+static U32		adwReg[SIM_NUM_REGS];
+static int		iPendingReg;
+
+static TSimEP	aEP[32];
+
+static TSimStats	Stats;
+static SIMTIME	qwNextFrame;
+static SIMTIME	qwIntTime;
+static BOOL		fIntTimeValid;
+static BOOL		fIntEnabled;		/**< EN_USB_INTS in USBIntSt */
+
+/* SIE state */
+static U8		bCmd;
+static int		iCmdReads;
+static int		iSelIdx;
+static U8		bClearStatus;
+static U32		dwSieBits;
+static SIMTIME	qwSieDone;
+static SIMTIME	qwRlzDone;
+static BOOL		fRlzPending;
+
+/* device state */
+static U8		bDevStatus;
+static U8		bMode;
+static U8		bAddress;
+static BOOL		fConfigured;
+static U16		wFrame;
+
+/* slave mode transfer state */
+static int		iRxIdx;
+static int		iRxPos;
+static int		iTxIdx;
+static int		iTxSlot;
+static int		iTxLen;
+static int		iTxPos;
+static BOOL		fTxBusy;
+
+
+/**
+	Advances the CPU clock and completes timed SIE operations
+ */
+static void SimTick(int iCycles)
+{
+	Stats.qwCpu += iCycles;
+	Stats.qwBusy += iCycles;
+
+	if (dwSieBits && (Stats.qwCpu >= qwSieDone)) {
+		adwReg[SIM_USBDevIntSt] |= dwSieBits;
+		dwSieBits = 0;
+	}
+	if (fRlzPending && (Stats.qwCpu >= qwRlzDone)) {
+		adwReg[SIM_USBDevIntSt] |= EP_RLZED;
+		fRlzPending = FALSE;
+	}
+}
+
+
+/**
+	Notes that an interrupt became pending at time qwTime
+ */
+static void SimIntAt(SIMTIME qwTime)
+{
+	if (!fIntTimeValid || (qwTime < qwIntTime)) {
+		qwIntTime = qwTime;
+		fIntTimeValid = TRUE;
+	}
+}
+
+
+/**
+	Schedules completion of an SIE command phase
+ */
+static void SimSieDone(U32 dwBits)
+{
+	Stats.dwSieCmds++;
+	dwSieBits |= dwBits;
+	qwSieDone = Stats.qwCpu + SIM_CYCLES_SIE;
+}
+
+
+/**
+	Raises an endpoint interrupt, routed to EP_FAST or EP_SLOW
+ */
+static void SimEPInt(int idx, SIMTIME qwTime)
+{
+	U32 dwBit = (1UL << idx);
+
+	if ((adwReg[SIM_USBEpDMASt] & dwBit) || !(adwReg[SIM_USBEpIntEn] & dwBit)) {
+		return;
+	}
+	adwReg[SIM_USBEpIntSt] |= dwBit;
+	adwReg[SIM_USBDevIntSt] |= (adwReg[SIM_USBEpIntPri] & dwBit) ? EP_FAST : EP_SLOW;
+	SimIntAt(qwTime);
+}
+
+
+/**
+	Returns the contents of the Select Endpoint status byte
+ */
+static U8 SimEPStatus(int idx, BOOL fClear)
+{
+	TSimEP	*pEP = &aEP[idx];
+	U8		bStat = 0;
+	int		i, iSlot;
+
+	for (i = 0; i < pEP->iCount; i++) {
+		iSlot = (pEP->iHead + i) % pEP->iNumBufs;
+		bStat |= (iSlot == 0) ? EPSTAT_B1FULL : EPSTAT_B2FULL;
+	}
+	if (idx & 1) {
+		// IN: FE is the AND of the buffer full flags
+		if (pEP->iCount == pEP->iNumBufs) {
+			bStat |= EPSTAT_FE;
+		}
+	}
+	else {
+		// OUT: FE is the OR of the buffer full flags
+		if (pEP->iCount > 0) {
+			bStat |= EPSTAT_FE;
+		}
+	}
+	if (pEP->iNumBufs == 1) {
+		bStat &= ~EPSTAT_B2FULL;
+	}
+	bStat |= (pEP->fStall ? EPSTAT_ST : 0) |
+			 (pEP->fSetup ? EPSTAT_STP : 0) |
+			 (pEP->fOverwritten ? EPSTAT_PO : 0) |
+			 (pEP->fNaked ? EPSTAT_EPN : 0);
+
+	if (fClear) {
+		adwReg[SIM_USBEpIntSt] &= ~(1UL << idx);
+		pEP->fNaked = FALSE;
+		pEP->fOverwritten = FALSE;
+		pEP->fSetup = FALSE;
+	}
+	return bStat;
+}
+
+
+/**
+	Empties the buffers of an endpoint
+ */
+static void SimEPFlush(TSimEP *pEP)
+{
+	pEP->iHead = 0;
+	pEP->iCount = 0;
+	pEP->aqwTime[0] = pEP->aqwTime[1] = 0;
+}
+
+
+/**
+	Realises an endpoint with the given maximum packet size
+ */
+static void SimEPRealize(int idx, int iMaxPSize)
+{
+	TSimEP *pEP = &aEP[idx];
+
+	pEP->iMaxPSize = iMaxPSize & SIM_MAX_PACKET;
+	pEP->iNumBufs = ((abEPType[idx / 2] == EPT_BULK) || (abEPType[idx / 2] == EPT_ISO)) ? 2 : 1;
+	SimEPFlush(pEP);
+	qwRlzDone = Stats.qwCpu + SIM_CYCLES_RLZ;
+	fRlzPending = TRUE;
+}
+
+
+/*************************************************************************
+	DMA engine
+**************************************************************************/
+
+/**
+	Gets the DD the DMA engine works on for an endpoint, raising the
+	new DD request interrupt if there is none.
+ */
+static U32 *SimDD(int idx)
+{
+	TSimEP	*pEP = &aEP[idx];
+	U32		*pdwUDCA = ADDR2PTR(adwReg[SIM_USBUDCAH]);
+
+	if ((pEP->pdwDD == NULL) && (pdwUDCA != NULL)) {
+		pEP->pdwDD = ADDR2PTR(pdwUDCA[idx]);
+	}
+	if ((pEP->pdwDD == NULL) || (pEP->pdwDD[3] & 1)) {
+		pEP->pdwDD = NULL;
+		adwReg[SIM_USBNDDRIntSt] |= (1UL << idx);
+		return NULL;
+	}
+	if (((pEP->pdwDD[3] >> 1) & 0xF) == 0) {
+		pEP->pdwDD[3] = (pEP->pdwDD[3] & ~0x1E) | (DD_STATUS_BUSY << 1);
+	}
+	return pEP->pdwDD;
+}
+
+
+/**
+	Retires the current DD of an endpoint and moves on to the next one
+ */
+static void SimDDRetire(int idx, int iStatus, SIMTIME qwTime)
+{
+	TSimEP	*pEP = &aEP[idx];
+	U32		*pdwDD = pEP->pdwDD;
+	U32		*pdwUDCA = ADDR2PTR(adwReg[SIM_USBUDCAH]);
+
+	pdwDD[3] = (pdwDD[3] & 0xFFFF0000) | (iStatus << 1) | 1;
+	adwReg[SIM_USBEoTIntSt] |= (1UL << idx);
+	SimIntAt(qwTime);
+
+	pEP->pdwDD = NULL;
+	if (pdwDD[1] & (1 << 2)) {
+		pdwUDCA[idx] = pdwDD[0];
+	}
+}
+
+
+/**
+	Moves received packets from an OUT endpoint buffer into memory
+ */
+static void SimDMAOut(int idx, SIMTIME qwTime)
+{
+	TSimEP	*pEP = &aEP[idx];
+	U32		*pdwDD;
+	U8		*pbDst;
+	int		iLen, iCount, iTotal;
+
+	while ((pEP->iCount > 0) && ((pdwDD = SimDD(idx)) != NULL)) {
+		iTotal = pdwDD[1] >> 16;
+		iCount = pdwDD[3] >> 16;
+		iLen = MIN(pEP->aiLen[pEP->iHead], iTotal - iCount);
+		pbDst = (U8 *)ADDR2PTR(pdwDD[2]);
+		memcpy(pbDst, pEP->aabBuf[pEP->iHead], iLen);
+		Stats.dwDmaBytes += iLen;
+		// the engine moves the buffer pointer forward, like the chip
+		pdwDD[2] += iLen;
+		iCount += iLen;
+		pdwDD[3] = (pdwDD[3] & 0xFFFF) | (iCount << 16);
+
+		pEP->aqwTime[pEP->iHead] = qwTime;
+		pEP->iHead = (pEP->iHead + 1) % pEP->iNumBufs;
+		pEP->iCount--;
+
+		if (iCount >= iTotal) {
+			SimDDRetire(idx, DD_STATUS_NORMAL, qwTime);
+		}
+		else if (iLen < pEP->iMaxPSize) {
+			SimDDRetire(idx, DD_STATUS_UNDERRUN, qwTime);
+		}
+	}
+}
+
+
+/**
+	Fills free IN endpoint buffers from memory
+ */
+static void SimDMAIn(int idx)
+{
+	TSimEP	*pEP = &aEP[idx];
+	U32		*pdwDD;
+	int		iLen, iCount, iTotal, iSlot;
+
+	while ((pEP->iCount < pEP->iNumBufs) && ((pdwDD = SimDD(idx)) != NULL)) {
+		iTotal = pdwDD[1] >> 16;
+		iCount = pdwDD[3] >> 16;
+		iLen = MIN(pEP->iMaxPSize, iTotal - iCount);
+		iSlot = (pEP->iHead + pEP->iCount) % pEP->iNumBufs;
+		memcpy(pEP->aabBuf[iSlot], ADDR2PTR(pdwDD[2]), iLen);
+		pdwDD[2] += iLen;
+		Stats.dwDmaBytes += iLen;
+		pEP->aiLen[iSlot] = iLen;
+		pEP->aqwTime[iSlot] = MAX(pEP->aqwTime[iSlot], pEP->qwDmaTime);
+		pEP->iCount++;
+		iCount += iLen;
+		pdwDD[3] = (pdwDD[3] & 0xFFFF) | (iCount << 16);
+		if (iCount >= iTotal) {
+			SimDDRetire(idx, DD_STATUS_NORMAL, pEP->aqwTime[iSlot]);
+		}
+	}
+}
+
+
+/**
+	Services one frame of an isochronous endpoint
+ */
+static void SimIsoFrame(int idx)
+{
+	TSimEP	*pEP = &aEP[idx];
+	U32		*pdwDD, *pdwPktSize;
+	U8		*pbBuf;
+	int		i, iLen, iCount, iSlot;
+
+	if (adwReg[SIM_USBEpDMASt] & (1UL << idx)) {
+		pdwDD = SimDD(idx);
+		if (pdwDD == NULL) {
+			Stats.dwIsoMissed++;
+			return;
+		}
+		iCount = pdwDD[3] >> 16;
+		pdwPktSize = ADDR2PTR(pdwDD[4]);
+		pbBuf = (U8 *)ADDR2PTR(pdwDD[2]);
+		if (idx & 1) {
+			iLen = MIN((int)(pdwPktSize[0] & 0x3FF), pEP->iIsoLen);
+			Stats.dwIsoIn++;
+		}
+		else {
+			iLen = MIN(pEP->iIsoLen, pEP->iMaxPSize);
+			for (i = 0; i < iLen; i++) {
+				pbBuf[i] = (wFrame + i) & 0xFF;
+			}
+			pdwPktSize[0] = (wFrame << 16) | (1 << 15) | iLen;
+			Stats.dwIsoOut++;
+		}
+		// buffer and packet size pointers move forward, like on the chip
+		pdwDD[2] += iLen;
+		pdwDD[4] += 4;
+		Stats.dwDmaBytes += iLen;
+		iCount++;
+		pdwDD[3] = (pdwDD[3] & 0xFFFF) | (iCount << 16);
+		if (iCount >= (int)(pdwDD[1] >> 16)) {
+			SimDDRetire(idx, DD_STATUS_NORMAL, Stats.qwBus);
+		}
+		return;
+	}
+
+	// slave mode, the CPU services the buffers from the frame interrupt
+	if (idx & 1) {
+		if (pEP->iCount == 0) {
+			Stats.dwIsoMissed++;
+			return;
+		}
+		pEP->aqwTime[pEP->iHead] = Stats.qwBus;
+		pEP->iHead = (pEP->iHead + 1) % pEP->iNumBufs;
+		pEP->iCount--;
+		Stats.dwIsoIn++;
+	}
+	else {
+		if (pEP->iCount == pEP->iNumBufs) {
+			// no handshake on isochronous pipes, the oldest packet is lost
+			pEP->iHead = (pEP->iHead + 1) % pEP->iNumBufs;
+			pEP->iCount--;
+			Stats.dwIsoMissed++;
+		}
+		iSlot = (pEP->iHead + pEP->iCount) % pEP->iNumBufs;
+		iLen = MIN(pEP->iIsoLen, pEP->iMaxPSize);
+		for (i = 0; i < iLen; i++) {
+			pEP->aabBuf[iSlot][i] = (wFrame + i) & 0xFF;
+		}
+		pEP->aiLen[iSlot] = iLen;
+		pEP->iCount++;
+		Stats.dwIsoOut++;
+	}
+}
+
+
+/**
+	Starts a new USB frame
+ */
+static void SimFrame(void)
+{
+	int idx;
+
+	wFrame = (wFrame + 1) & 0x7FF;
+	adwReg[SIM_USBDevIntSt] |= FRAME;
+	SimIntAt(Stats.qwBus);
+
+	for (idx = 0; idx < 32; idx++) {
+		if (aEP[idx].iIsoLen && (adwReg[SIM_USBReEp] & (1UL << idx))) {
+			SimIsoFrame(idx);
+		}
+	}
+}
+
+
+/**
+	Advances the bus clock, generating start-of-frames on the way
+ */
+static void SimBusAdvance(SIMTIME qwCycles)
+{
+	SIMTIME qwEnd = Stats.qwBus + qwCycles;
+
+	while (qwNextFrame <= qwEnd) {
+		Stats.qwBus = qwNextFrame;
+		qwNextFrame += SIM_FRAME_CYCLES;
+		SimFrame();
+	}
+	Stats.qwBus = qwEnd;
+}
+
+
+/**
+	Lets the bus idle (NAKing) until qwTime
+ */
+static void SimBusWait(SIMTIME qwTime)
+{
+	SIMTIME qwNak = SIM_BYTES_NAK * 8 * SIM_CYCLES_BIT;
+	SIMTIME qwNaks;
+
+	if (qwTime > Stats.qwBus) {
+		qwNaks = (qwTime - Stats.qwBus + qwNak - 1) / qwNak;
+		Stats.dwNaks += qwNaks;
+		SimBusAdvance(qwNaks * qwNak);
+	}
+}
+
+
+/**
+	Handles a NAKed transaction
+ */
+static int SimNak(int idx)
+{
+	static const U8 abInakIn[4] = {INAK_CI, INAK_II, INAK_BI, 0};
+	static const U8 abInakOut[4] = {INAK_CO, INAK_IO, INAK_BO, 0};
+	U8 bMask;
+
+	Stats.dwNaks++;
+	SimBusAdvance(SIM_BYTES_NAK * 8 * SIM_CYCLES_BIT);
+
+	bMask = (idx & 1) ? abInakIn[abEPType[idx / 2]] : abInakOut[abEPType[idx / 2]];
+	if (bMode & bMask) {
+		aEP[idx].fNaked = TRUE;
+		SimEPInt(idx, Stats.qwBus);
+	}
+	return SIM_NAK;
+}
+
+
+/*************************************************************************
+	SIE command engine
+**************************************************************************/
+
+static void SimSieCommand(U8 bCode)
+{
+	TSimEP *pEP;
+
+	if (bCode < 0x20) {
+		iSelIdx = bCode;
+		return;
+	}
+	if ((bCode & 0xE0) == 0x40) {
+		// select/clear or set status, depends on next phase
+		iSelIdx = bCode & 0x1F;
+		return;
+	}
+
+	pEP = &aEP[iSelIdx];
+	switch (bCode) {
+
+	case CMD_EP_CLEAR_BUFFER:
+		bClearStatus = pEP->fOverwritten ? 1 : 0;
+		if (pEP->iCount > 0) {
+			pEP->aqwTime[pEP->iHead] = Stats.qwCpu;
+			pEP->iHead = (pEP->iHead + 1) % pEP->iNumBufs;
+			pEP->iCount--;
+		}
+		break;
+
+	case CMD_EP_VALIDATE_BUFFER:
+		if ((iSelIdx == iTxIdx) && fTxBusy) {
+			fTxBusy = FALSE;
+			pEP->aiLen[iTxSlot] = iTxLen;
+			pEP->aqwTime[iTxSlot] = Stats.qwCpu;
+			if (pEP->iCount < pEP->iNumBufs) {
+				pEP->iCount++;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+static void SimSieWrite(U8 bCode, U8 bData)
+{
+	TSimEP *pEP;
+
+	if ((bCode & 0xE0) == 0x40) {
+		pEP = &aEP[bCode & 0x1F];
+		pEP->fStall = (bData & EP_ST) ? TRUE : FALSE;
+		pEP->fDisabled = (bData & EP_DA) ? TRUE : FALSE;
+		return;
+	}
+
+	switch (bCode) {
+	case CMD_DEV_SET_ADDRESS:	bAddress = bData & 0x7F;	break;
+	case CMD_DEV_CONFIG:		fConfigured = bData & CONF_DEVICE;	break;
+	case CMD_DEV_SET_MODE:		bMode = bData;				break;
+	case CMD_DEV_STATUS:
+		bDevStatus = (bDevStatus & ~CON) | (bData & CON);
+		break;
+	default:
+		break;
+	}
+}
+
+
+static U8 SimSieRead(U8 bCode)
+{
+	U8 bData;
+
+	if (bCode < 0x20) {
+		return SimEPStatus(bCode, FALSE);
+	}
+	if ((bCode & 0xE0) == 0x40) {
+		return SimEPStatus(bCode & 0x1F, TRUE);
+	}
+
+	switch (bCode) {
+	case CMD_DEV_READ_CUR_FRAME_NR:
+		bData = (iCmdReads++ == 0) ? (wFrame & 0xFF) : (wFrame >> 8);
+		break;
+	case CMD_DEV_STATUS:
+		bData = bDevStatus;
+		bDevStatus &= ~(CON_CH | SUS_CH | RST);
+		break;
+	case CMD_EP_CLEAR_BUFFER:
+		bData = bClearStatus;
+		break;
+	default:
+		bData = 0;
+		break;
+	}
+	return bData;
+}
+
+
+static void SimSie(U32 dwCode)
+{
+	U8 bPhase = (dwCode >> 8) & 0xFF;
+	U8 bData = (dwCode >> 16) & 0xFF;
+
+	switch (bPhase) {
+	case 0x05:
+		bCmd = bData;
+		iCmdReads = 0;
+		SimSieCommand(bCmd);
+		SimSieDone(CCEMTY);
+		break;
+	case 0x01:
+		SimSieWrite(bCmd, bData);
+		SimSieDone(CCEMTY);
+		break;
+	case 0x02:
+		adwReg[SIM_USBCmdData] = SimSieRead(bCmd);
+		SimSieDone(CDFULL);
+		break;
+	default:
+		break;
+	}
+}
+
+
+/*************************************************************************
+	Register interface
+**************************************************************************/
+
+static void SimTxDone(void)
+{
+	fTxBusy = TRUE;
+	adwReg[SIM_USBCtrl] &= ~WR_EN;
+	adwReg[SIM_USBDevIntSt] |= TxENDPKT;
+}
+
+
+static void SimCtrlWrite(U32 dwValue)
+{
+	TSimEP	*pEP;
+	int		iLog = (dwValue >> 2) & 0xF;
+
+	if (dwValue & RD_EN) {
+		iRxIdx = iLog * 2;
+		iRxPos = 0;
+		pEP = &aEP[iRxIdx];
+		if (pEP->iCount > 0) {
+			adwReg[SIM_USBRxPLen] = PKT_RDY | DV | pEP->aiLen[pEP->iHead];
+			if (pEP->aiLen[pEP->iHead] == 0) {
+				adwReg[SIM_USBCtrl] &= ~RD_EN;
+				adwReg[SIM_USBDevIntSt] |= RxENDPKT;
+			}
+		}
+		else {
+			adwReg[SIM_USBRxPLen] = PKT_RDY;
+		}
+	}
+	if (dwValue & WR_EN) {
+		iTxIdx = iLog * 2 + 1;
+		pEP = &aEP[iTxIdx];
+		iTxSlot = (pEP->iHead + MIN(pEP->iCount, pEP->iNumBufs - 1)) % pEP->iNumBufs;
+		if (pEP->iCount == pEP->iNumBufs) {
+			pEP->fOverwritten = TRUE;
+		}
+		iTxLen = 0;
+		iTxPos = 0;
+		fTxBusy = FALSE;
+	}
+}
+
+
+static U32 SimRxData(void)
+{
+	TSimEP	*pEP = &aEP[iRxIdx];
+	U8		*pb = &pEP->aabBuf[pEP->iHead][iRxPos];
+	U32		dwData;
+
+	dwData = pb[0] | (pb[1] << 8) | (pb[2] << 16) | ((U32)pb[3] << 24);
+	iRxPos += 4;
+	if (iRxPos >= pEP->aiLen[pEP->iHead]) {
+		adwReg[SIM_USBCtrl] &= ~RD_EN;
+		adwReg[SIM_USBDevIntSt] |= RxENDPKT;
+	}
+	return dwData;
+}
+
+
+static void SimWrite(int iReg, U32 dwValue)
+{
+	TSimEP	*pEP;
+	U8		*pb;
+	int		idx;
+
+	switch (iReg) {
+
+	case SIM_USBIntSt:
+		// only the master interrupt enable is writable
+		fIntEnabled = (dwValue & EN_USB_BITS) != 0;
+		break;
+
+	case SIM_USBDevIntClr:
+		adwReg[SIM_USBDevIntSt] &= ~dwValue;
+		break;
+
+	case SIM_USBDevIntSet:
+		adwReg[SIM_USBDevIntSt] |= dwValue;
+		SimIntAt(Stats.qwCpu);
+		break;
+
+	case SIM_USBEpIntClr:
+		for (idx = 0; idx < 32; idx++) {
+			if (dwValue & (1UL << idx)) {
+				adwReg[SIM_USBCmdData] = SimEPStatus(idx, TRUE);
+			}
+		}
+		SimSieDone(CDFULL);
+		break;
+
+	case SIM_USBEpIntSet:
+		for (idx = 0; idx < 32; idx++) {
+			if (dwValue & (1UL << idx)) {
+				adwReg[SIM_USBEpIntSt] |= (1UL << idx);
+				adwReg[SIM_USBDevIntSt] |=
+					(adwReg[SIM_USBEpIntPri] & (1UL << idx)) ? EP_FAST : EP_SLOW;
+			}
+		}
+		SimIntAt(Stats.qwCpu);
+		break;
+
+	case SIM_USBMaxPSize:
+		idx = adwReg[SIM_USBEpInd] & 0x1F;
+		if (adwReg[SIM_USBReEp] & (1UL << idx)) {
+			SimEPRealize(idx, dwValue);
+		}
+		break;
+
+	case SIM_USBTxPLen:
+		iTxLen = dwValue & PKT_LNGTH_MASK;
+		iTxPos = 0;
+		if (iTxLen == 0) {
+			SimTxDone();
+		}
+		break;
+
+	case SIM_USBTxData:
+		if (adwReg[SIM_USBCtrl] & WR_EN) {
+			pb = &aEP[iTxIdx].aabBuf[iTxSlot][iTxPos];
+			pb[0] = dwValue;
+			pb[1] = dwValue >> 8;
+			pb[2] = dwValue >> 16;
+			pb[3] = dwValue >> 24;
+			iTxPos += 4;
+			if (iTxPos >= iTxLen) {
+				SimTxDone();
+			}
+		}
+		break;
+
+	case SIM_USBCtrl:
+		SimCtrlWrite(dwValue);
+		break;
+
+	case SIM_USBCmdCode:
+		SimSie(dwValue);
+		break;
+
+	case SIM_USBEpDMAEn:
+		adwReg[SIM_USBEpDMASt] |= dwValue;
+		for (idx = 0; idx < 32; idx++) {
+			if (dwValue & (1UL << idx)) {
+				pEP = &aEP[idx];
+				pEP->qwDmaTime = Stats.qwCpu;
+				if ((idx & 1) == 0) {
+					SimDMAOut(idx, Stats.qwCpu);
+				}
+			}
+		}
+		break;
+
+	case SIM_USBEpDMADis:
+		adwReg[SIM_USBEpDMASt] &= ~dwValue;
+		// the descriptor is fetched from the UDCA again on re-enable
+		for (idx = 0; idx < 32; idx++) {
+			if (dwValue & (1UL << idx)) {
+				aEP[idx].pdwDD = NULL;
+			}
+		}
+		break;
+
+	case SIM_USBDMARClr:	adwReg[SIM_USBDMARSt] &= ~dwValue;		break;
+	case SIM_USBDMARSet:	adwReg[SIM_USBDMARSt] |= dwValue;		break;
+	case SIM_USBEoTIntClr:	adwReg[SIM_USBEoTIntSt] &= ~dwValue;	break;
+	case SIM_USBEoTIntSet:	adwReg[SIM_USBEoTIntSt] |= dwValue;		break;
+	case SIM_USBNDDRIntClr:	adwReg[SIM_USBNDDRIntSt] &= ~dwValue;	break;
+	case SIM_USBNDDRIntSet:	adwReg[SIM_USBNDDRIntSt] |= dwValue;	break;
+	case SIM_USBSysErrIntClr:	adwReg[SIM_USBSysErrIntSt] &= ~dwValue;	break;
+	case SIM_USBSysErrIntSet:	adwReg[SIM_USBSysErrIntSt] |= dwValue;	break;
+
+	default:
+		break;
+	}
+}
+
+
+/**
+	Processes the register write made since the last register access
+ */
+static void SimFlush(void)
+{
+	int iReg = iPendingReg;
+
+	if (iReg < 0) {
+		return;
+	}
+	iPendingReg = -1;
+
+	if (iReg == SIM_USBCtrl) {
+		if (adwReg[iReg] & SIM_CTRL_MARKER) {
+			// only read
+			adwReg[iReg] &= ~SIM_CTRL_MARKER;
+			return;
+		}
+	}
+	if (iReg == SIM_USBIntSt) {
+		if (adwReg[iReg] & SIM_INTST_MARKER) {
+			// only read
+			return;
+		}
+	}
+	SimWrite(iReg, adwReg[iReg]);
+}
+
+
+static U32 SimDMAIntSt(void)
+{
+	return (adwReg[SIM_USBEoTIntSt] ? 1 : 0) |
+		   (adwReg[SIM_USBNDDRIntSt] ? 2 : 0) |
+		   (adwReg[SIM_USBSysErrIntSt] ? 4 : 0);
+}
+
+
+/**
+	Returns a pointer to a controller register, called for every
+	register access made by the stack.
+ */
+volatile U32 *SimReg(int iReg)
+{
+	SimFlush();
+	SimTick(SIM_CYCLES_REG);
+	Stats.dwRegAccess++;
+
+	switch (iReg) {
+
+	case SIM_USBRxData:
+		adwReg[iReg] = SimRxData();
+		break;
+
+	case SIM_USBDMAIntSt:
+		adwReg[iReg] = SimDMAIntSt();
+		break;
+
+	case SIM_USBIntSt:
+		adwReg[iReg] = ((adwReg[SIM_USBDevIntSt] & ~adwReg[SIM_USBDevIntPri]) ? USB_INT_REQ_LP : 0) |
+					   ((adwReg[SIM_USBDevIntSt] & adwReg[SIM_USBDevIntPri]) ? USB_INT_REQ_HP : 0) |
+					   (SimDMAIntSt() ? USB_INT_REQ_DMA : 0) |
+					   (fIntEnabled ? EN_USB_BITS : 0) | SIM_INTST_MARKER;
+		iPendingReg = iReg;
+		break;
+
+	case SIM_USBCtrl:
+		adwReg[iReg] |= SIM_CTRL_MARKER;
+		iPendingReg = iReg;
+		break;
+
+	case SIM_USBDevIntClr:
+	case SIM_USBDevIntSet:
+	case SIM_USBEpIntClr:
+	case SIM_USBEpIntSet:
+	case SIM_USBMaxPSize:
+	case SIM_USBTxData:
+	case SIM_USBTxPLen:
+	case SIM_USBCmdCode:
+	case SIM_USBDMARClr:
+	case SIM_USBDMARSet:
+	case SIM_USBEpDMAEn:
+	case SIM_USBEpDMADis:
+	case SIM_USBEoTIntClr:
+	case SIM_USBEoTIntSet:
+	case SIM_USBNDDRIntClr:
+	case SIM_USBNDDRIntSet:
+	case SIM_USBSysErrIntClr:
+	case SIM_USBSysErrIntSet:
+		// write-only
+		iPendingReg = iReg;
+		break;
+
+	default:
+		break;
+	}
+	return &adwReg[iReg];
+}
+
+
+/*************************************************************************
+	Host side
+**************************************************************************/
+
+/**
+	Resets the simulated controller to its power-on state
+ */
+void SimInit(void)
+{
+	memset(adwReg, 0, sizeof(adwReg));
+	memset(aEP, 0, sizeof(aEP));
+	memset(&Stats, 0, sizeof(Stats));
+	iPendingReg = -1;
+	qwNextFrame = SIM_FRAME_CYCLES;
+	fIntTimeValid = FALSE;
+	fIntEnabled = TRUE;
+	dwSieBits = 0;
+	fRlzPending = FALSE;
+	bDevStatus = 0;
+	bMode = 0;
+	bAddress = 0;
+	fConfigured = FALSE;
+	wFrame = 0;
+	fTxBusy = FALSE;
+	adwReg[SIM_USBReEp] = 3;
+	SimEPRealize(0, 8);
+	SimEPRealize(1, 8);
+	fRlzPending = FALSE;
+}
+
+
+void SimGetStats(TSimStats *pStats)
+{
+	SimFlush();
+	*pStats = Stats;
+}
+
+
+/**
+	Restarts measuring the longest interrupt service
+ */
+void SimClearIsrMax(void)
+{
+	Stats.qwIsrMax = 0;
+}
+
+
+/**
+	Adds CPU cycles spent outside the stack (application processing)
+ */
+void SimCpuCycles(int iCycles)
+{
+	Stats.qwCpu += iCycles;
+	Stats.qwBusy += iCycles;
+}
+
+
+/**
+	Checks if the controller requests an interrupt
+ */
+BOOL SimIntPending(void)
+{
+	SimFlush();
+	return fIntEnabled &&
+		   (((adwReg[SIM_USBDevIntSt] & adwReg[SIM_USBDevIntEn]) != 0) ||
+			((SimDMAIntSt() & adwReg[SIM_USBDMAIntEn]) != 0));
+}
+
+
+/**
+	Runs an interrupt service routine, the CPU clock is first moved to
+	the time the interrupt was raised.
+ */
+void SimRunISR(void (*pfnISR)(void))
+{
+	SIMTIME qwStart;
+
+	SimFlush();
+	if (fIntTimeValid && (Stats.qwCpu < qwIntTime)) {
+		Stats.qwCpu = qwIntTime;
+	}
+	qwStart = Stats.qwCpu;
+	SimTick(SIM_CYCLES_IRQ / 2);
+	Stats.dwInterrupts++;
+
+	pfnISR();
+
+	SimFlush();
+	SimTick(SIM_CYCLES_IRQ - SIM_CYCLES_IRQ / 2);
+	Stats.qwIsrMax = MAX(Stats.qwIsrMax, Stats.qwCpu - qwStart);
+	if (!SimIntPending()) {
+		fIntTimeValid = FALSE;
+	}
+}
+
+
+/**
+	Signals a bus reset
+ */
+void SimHostReset(void)
+{
+	int idx;
+
+	SimFlush();
+	SimBusAdvance(10 * SIM_FRAME_CYCLES);
+	for (idx = 0; idx < 32; idx++) {
+		SimEPFlush(&aEP[idx]);
+		aEP[idx].fStall = FALSE;
+		aEP[idx].pdwDD = NULL;
+	}
+	adwReg[SIM_USBReEp] = 3;
+	bAddress = 0;
+	fConfigured = FALSE;
+	bDevStatus |= RST;
+	adwReg[SIM_USBDevIntSt] |= DEV_STAT;
+	SimIntAt(Stats.qwBus);
+}
+
+
+/**
+	Lets the bus run without traffic
+ */
+void SimHostIdle(SIMTIME qwCycles)
+{
+	SimFlush();
+	SimBusAdvance(qwCycles);
+}
+
+
+/**
+	Sets up a host isochronous stream for an endpoint
+
+	@param [in] bEP		Endpoint number
+	@param [in] iLen	Bytes sent (OUT) or requested (IN) every frame,
+						0 to stop the stream
+ */
+void SimHostIsoStream(U8 bEP, int iLen)
+{
+	aEP[EP2IDX(bEP)].iIsoLen = iLen;
+}
+
+
+/**
+	Raises endpoint interrupts without any bus traffic, like a write
+	to USBEpIntSet would.
+
+	@param [in] dwMask	Bitmap of endpoint indices
+ */
+void SimHostEPInt(U32 dwMask)
+{
+	SimFlush();
+	SimWrite(SIM_USBEpIntSet, dwMask);
+	SimIntAt(Stats.qwCpu);
+}
+
+
+/**
+	Sends a SETUP packet to the control endpoint
+
+	@return 8, the number of bytes sent
+ */
+int SimHostSetup(U8 *pbSetup)
+{
+	TSimEP *pEP = &aEP[0];
+
+	SimFlush();
+	SimBusAdvance((8 + SIM_BYTES_DATA) * 8 * SIM_CYCLES_BIT);
+
+	// a SETUP is always accepted and aborts the previous transfer
+	if (pEP->iCount > 0) {
+		pEP->fOverwritten = TRUE;
+	}
+	SimEPFlush(pEP);
+	memcpy(pEP->aabBuf[0], pbSetup, 8);
+	pEP->aiLen[0] = 8;
+	pEP->iCount = 1;
+	pEP->fSetup = TRUE;
+	pEP->fStall = FALSE;
+	SimEPFlush(&aEP[1]);
+	aEP[1].fStall = FALSE;
+
+	Stats.dwPktOut++;
+	SimEPInt(0, Stats.qwBus);
+	return 8;
+}
+
+
+/**
+	Sends an OUT packet
+
+	@return number of bytes sent, SIM_NAK or SIM_STALL
+ */
+int SimHostOut(U8 bEP, U8 *pbData, int iLen)
+{
+	int		idx = EP2IDX(bEP);
+	TSimEP	*pEP = &aEP[idx];
+	int		iSlot;
+
+	SimFlush();
+	if (!(adwReg[SIM_USBReEp] & (1UL << idx)) || pEP->fDisabled) {
+		return SIM_NAK;
+	}
+	if (pEP->fStall) {
+		SimBusAdvance(SIM_BYTES_NAK * 8 * SIM_CYCLES_BIT);
+		return SIM_STALL;
+	}
+	if (pEP->iCount == pEP->iNumBufs) {
+		return SimNak(idx);
+	}
+
+	// wait until the CPU has freed the buffer
+	iSlot = (pEP->iHead + pEP->iCount) % pEP->iNumBufs;
+	SimBusWait(pEP->aqwTime[iSlot]);
+
+	SimBusAdvance((iLen + SIM_BYTES_DATA) * 8 * SIM_CYCLES_BIT);
+	iLen = MIN(iLen, pEP->iMaxPSize);
+	if (iLen > 0) {
+		memcpy(pEP->aabBuf[iSlot], pbData, iLen);
+	}
+	pEP->aiLen[iSlot] = iLen;
+	pEP->iCount++;
+	pEP->fSetup = FALSE;
+	Stats.dwPktOut++;
+
+	if (adwReg[SIM_USBEpDMASt] & (1UL << idx)) {
+		SimDMAOut(idx, Stats.qwBus);
+	}
+	else {
+		SimEPInt(idx, Stats.qwBus);
+	}
+	return iLen;
+}
+
+
+/**
+	Requests an IN packet
+
+	@return number of bytes received, SIM_NAK or SIM_STALL
+ */
+int SimHostIn(U8 bEP, U8 *pbData, int iMaxLen)
+{
+	int		idx = EP2IDX(bEP);
+	TSimEP	*pEP = &aEP[idx];
+	int		iLen, iSlot;
+
+	SimFlush();
+	if (!(adwReg[SIM_USBReEp] & (1UL << idx)) || pEP->fDisabled) {
+		return SIM_NAK;
+	}
+	if (pEP->fStall) {
+		SimBusAdvance(SIM_BYTES_NAK * 8 * SIM_CYCLES_BIT);
+		return SIM_STALL;
+	}
+	if (adwReg[SIM_USBEpDMASt] & (1UL << idx)) {
+		SimDMAIn(idx);
+	}
+	if (pEP->iCount == 0) {
+		return SimNak(idx);
+	}
+
+	// wait until the CPU has filled the buffer
+	iSlot = pEP->iHead;
+	SimBusWait(pEP->aqwTime[iSlot]);
+
+	iLen = pEP->aiLen[iSlot];
+	SimBusAdvance((iLen + SIM_BYTES_DATA) * 8 * SIM_CYCLES_BIT);
+	if (pbData != NULL) {
+		memcpy(pbData, pEP->aabBuf[iSlot], MIN(iLen, iMaxLen));
+	}
+	pEP->aqwTime[iSlot] = Stats.qwBus;
+	pEP->iHead = (pEP->iHead + 1) % pEP->iNumBufs;
+	pEP->iCount--;
+	Stats.dwPktIn++;
+
+	if (adwReg[SIM_USBEpDMASt] & (1UL << idx)) {
+		SimDMAIn(idx);
+	}
+	else {
+		SimEPInt(idx, Stats.qwBus);
+	}
+	return iLen;
+}
+
@@ -0,0 +1,91 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+	Host side interface of the simulated LPC USB controller.
+
+	The model keeps two clocks, both counted in CPU cycles:
+	* the CPU clock advances with every register access made by the stack
+	  and with the interrupt entry/exit overhead,
+	* the bus clock advances with every transaction issued by the host.
+	A packet handed to the stack becomes visible to the CPU when the bus
+	transaction that carried it has finished, and a buffer filled or freed
+	by the stack becomes visible to the host when the CPU got to it. This
+	lets CPU processing and bus transfers overlap like they do on the chip.
+*/
+
+#ifndef USBSIM_H
+#define USBSIM_H
+
+/** simulated CPU clock */
+#define SIM_CPU_HZ			60000000
+/** CPU cycles per USB frame */
+#define SIM_FRAME_CYCLES	(SIM_CPU_HZ / 1000)
+
+/** return values of the host transaction functions */
+#define SIM_NAK				-1
+#define SIM_STALL			-2
+
+typedef unsigned long long	SIMTIME;
+
+/** simulation statistics */
+typedef struct {
+	SIMTIME	qwCpu;			/**< CPU clock */
+	SIMTIME	qwBusy;			/**< CPU cycles spent in the stack */
+	SIMTIME	qwBus;			/**< bus clock */
+	SIMTIME	qwIsrMax;		/**< longest interrupt service, incl. entry/exit */
+	U32		dwRegAccess;	/**< number of register accesses */
+	U32		dwSieCmds;		/**< number of SIE command/data phases */
+	U32		dwInterrupts;	/**< number of interrupt service calls */
+	U32		dwPktOut;		/**< OUT/SETUP packets accepted */
+	U32		dwPktIn;		/**< IN packets delivered */
+	U32		dwNaks;			/**< NAKed transactions (incl. retries) */
+	U32		dwIsoOut;		/**< isochronous OUT packets delivered */
+	U32		dwIsoIn;		/**< isochronous IN packets delivered */
+	U32		dwIsoMissed;	/**< isochronous packets lost */
+	U32		dwDmaBytes;		/**< bytes moved by the DMA engine */
+} TSimStats;
+
+void	SimInit(void);
+void	SimGetStats(TSimStats *pStats);
+void	SimClearIsrMax(void);
+
+BOOL	SimIntPending(void);
+void	SimRunISR(void (*pfnISR)(void));
+void	SimCpuCycles(int iCycles);
+
+void	SimHostReset(void);
+void	SimHostIdle(SIMTIME qwCycles);
+int		SimHostSetup(U8 *pbSetup);
+int		SimHostOut(U8 bEP, U8 *pbData, int iLen);
+int		SimHostIn(U8 bEP, U8 *pbData, int iMaxLen);
+void	SimHostIsoStream(U8 bEP, int iLen);
+void	SimHostEPInt(U32 dwMask);
+
+#endif /* USBSIM_H */
+
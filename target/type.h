@@ -53,6 +53,9 @@ typedef int					BOOL;	/**< #TRUE or #FALSE */
 #define MIN(x,y)	((x)<(y)?(x):(y))	/**< MIN */
 #define MAX(x,y)	((x)>(y)?(x):(y))	/**< MAX */
 
+/** keeps the compiler from moving memory accesses across this point */
+#define COMPILER_BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+
 
 #endif /* _TYPE_H_ */
 
@@ -55,6 +55,11 @@
 #define DEV_STATUS_SUSPEND		(1<<2)	/**< device entered suspend state */
 #define DEV_STATUS_RESET		(1<<4)	/**< device just got reset */
 
+// DMA events sent through callback
+#define DMA_STATUS_EOT			(1<<0)	/**< a descriptor was retired */
+#define DMA_STATUS_NDDR			(1<<1)	/**< no valid descriptor available */
+#define DMA_STATUS_ERROR		(1<<2)	/**< DMA system error */
+
 // interrupt bits for NACK events in USBHwNakIntEnable
 // (these bits conveniently coincide with the LPC214x USB controller bit)
 #define INACK_CI		(1<<1)			/**< interrupt on NACK for control in */
@@ -65,13 +70,19 @@
 #define INACK_BO		(1<<6)			/**< interrupt on NACK for bulk out */
 
 void USBHwISR			(void);
+void USBHwFastISR		(void);
+void USBHwEPSetFast		(U8 bEP, BOOL fFast);
+void USBHwSetDeferred	(BOOL fDeferred);
+BOOL USBHwProcessEvents	(void);
 void USBHwNakIntEnable	(U8 bIntBits);
 void USBHwConnect		(BOOL fConnect);
 
 // endpoint operations
 int  USBHwEPRead		(U8 bEP, U8 *pbBuf, int iMaxLen);
 int	 USBHwEPWrite		(U8 bEP, U8 *pbBuf, int iLen);
+int  USBHwEPGetFreeBuffers	(U8 bEP);
 void USBHwEPStall		(U8 bEP, BOOL fStall);
+void USBHwEPRaiseInt	(U8 bEP);
 int  USBHwISOCEPRead    (const U8 bEP, U8 *pbBuf, const int iMaxLen);
 
 /** Endpoint interrupt handler callback */
@@ -82,10 +93,21 @@ void USBHwRegisterEPIntHandler	(U8 bEP, TFnEPIntHandler *pfnHandler);
 typedef void (TFnDevIntHandler)	(U8 bDevStatus);
 void USBHwRegisterDevIntHandler	(TFnDevIntHandler *pfnHandler);
 
-/** Frame event handler callback */
+/** Frame event handler callback, gets the 11-bit frame number */
 typedef void (TFnFrameHandler)(U16 wFrame);
 void USBHwRegisterFrameHandler(TFnFrameHandler *pfnHandler);
 
+/** DMA transfer completion callback */
+typedef void (TFnTransferDone)(U8 bEP, int iLen);
+BOOL USBHwEPSubmit		(U8 bEP, U8 *pbBuf, int iLen, TFnTransferDone *pfnDone);
+void USBHwEPCancel		(U8 bEP);
+
+/** DMA event handler callback */
+typedef void (TFnDMAIntHandler)(U8 bEP, U8 bDMAStatus);
+void USBHwRegisterDMAIntHandler(U8 bEP, TFnDMAIntHandler *pfnHandler);
+void USBHwEPStartDMA	(U8 bEP, volatile U32 *pdwDD);
+U16  USBHwGetFrameNumber(void);
+
 
 /*************************************************************************
 	USB application interface
@@ -126,12 +148,47 @@ void USBSetupDMADescriptor(
 		U32 *isocPacketSizeMemoryAddress );
 
 void USBInitializeISOCFrameArray(U32 isocFrameArr[], const U32 numElements, const U16 startFrameNumber, const U16 defaultFrameLength);
-void USBInitializeUSBDMA(volatile U32* udcaHeadArray[32]);
-void USBSetHeadDDForDMA(const U8 bEp, volatile U32* udcaHeadArray[32], volatile const U32 *dmaDescriptorPtr);
+void USBInitializeUSBDMA(volatile U32 udcaHeadArray[32]);
+void USBSetHeadDDForDMA(const U8 bEp, volatile U32 udcaHeadArray[32], volatile const U32 *dmaDescriptorPtr);
 
 void USBEnableDMAForEndpoint(const U8 bEndpointNumber) ;
 void USBDisableDMAForEndpoint(const U8 bEndpointNumber);
 
+/** DMA memory pool */
+#ifndef USB_DMA_BUF_SIZE
+#define USB_DMA_BUF_SIZE	512		/**< size of a DMA data buffer */
+#endif
+#ifndef USB_DMA_BUF_ALIGN
+#define USB_DMA_BUF_ALIGN	4		/**< alignment of a DMA data buffer */
+#endif
+
+volatile U32 *USBDMAAllocDD(void);
+void USBDMAFreeDD(volatile U32 *pdwDD);
+U8   *USBDMAAllocBuf(void);
+void USBDMAFreeBuf(U8 *pbBuf);
+void USBDMAChainDD(volatile U32 *pdwDD, volatile U32 *pdwNext);
+volatile U32 *USBDMANextDD(volatile U32 *pdwDD);
+void USBDMAFreeChain(volatile U32 *pdwDD);
+
+/** Isochronous streaming */
+#define ISOC_FRAME_VALID	(1<<15)				/**< frame array entry valid */
+#define ISOC_FRAME_LEN(x)	((x)&0x3FF)			/**< frame array entry length */
+
+/** Isochronous descriptor callback */
+typedef void (TFnIsocHandler)(U8 bEP, U8 *pbBuf, U32 *pdwFrames, int iFrames);
+
+/** Isochronous stream statistics */
+typedef struct {
+	U32	dwDone;			/**< descriptors completed */
+	U32	dwLate;			/**< times the ring ran out of descriptors */
+	U32	dwMissed;		/**< frames missed while out of descriptors */
+} TIsocStats;
+
+BOOL USBIsocStart(U8 bEP, U8 *pbBuf, int iFrameSize, int iFrames, int iDescs,
+				  TFnIsocHandler *pfnHandler);
+void USBIsocStop(U8 bEP);
+BOOL USBIsocGetStats(U8 bEP, TIsocStats *pStats);
+
 
 
 
@@ -0,0 +1,215 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/** @file
+	USB DMA memory pool
+
+	The USB DMA engine can only access USB RAM (the .usbdma section).
+	This module carves two pools out of it:
+	* DMA descriptor slots, large enough for an isochronous descriptor
+	  (5 words) and word aligned,
+	* data buffers of USB_DMA_BUF_SIZE bytes, aligned to USB_DMA_BUF_ALIGN.
+
+	Both pools hand out never-used slots from the top first and then
+	recycle freed slots through a free list, so allocation and release
+	are O(1) and the pools need no initialisation.
+
+	The pools are not protected against concurrent use, callers in main
+	context must make sure the USB interrupt does not allocate or free at
+	the same time. USBHwEPSubmit and USBHwEPCancel take care of this.
+
+	The pool sizes can be changed from the compiler command line.
+ */
+
+#include "type.h"
+#include "debug.h"
+
+#include "usbapi.h"
+#include "usbhw_lpc.h"
+
+
+#ifndef USB_DMA_NUM_DD
+#define USB_DMA_NUM_DD		16		/**< number of DMA descriptor slots */
+#endif
+#ifndef USB_DMA_NUM_BUF
+#define USB_DMA_NUM_BUF		4		/**< number of data buffers */
+#endif
+
+#define DD_SLOT_WORDS		5		/**< words in a descriptor slot */
+
+
+/** descriptor slots */
+static volatile U32	_aadwDD[USB_DMA_NUM_DD][DD_SLOT_WORDS]
+	__attribute__ ((section(".usbdma"), aligned(4)));
+/** data buffers */
+static U8			_aabBuf[USB_DMA_NUM_BUF][USB_DMA_BUF_SIZE]
+	__attribute__ ((section(".usbdma"), aligned(USB_DMA_BUF_ALIGN)));
+
+/** number of descriptor slots handed out at least once */
+static int			_iDDUsed = 0;
+/** free list of descriptor slots, linked through the first word */
+static volatile U32	*_pdwDDFree = NULL;
+
+/** number of buffers handed out at least once */
+static int			_iBufUsed = 0;
+/** free list of buffers, linked through the first word */
+static U8			*_pbBufFree = NULL;
+
+
+/**
+	Allocates a DMA descriptor slot
+
+	@return pointer to a word aligned descriptor of 5 words in USB RAM,
+	or NULL if the pool is exhausted
+ */
+volatile U32 *USBDMAAllocDD(void)
+{
+	volatile U32 *pdwDD;
+
+	if (_pdwDDFree != NULL) {
+		pdwDD = _pdwDDFree;
+		_pdwDDFree = (volatile U32 *)pdwDD[0];
+	}
+	else if (_iDDUsed < USB_DMA_NUM_DD) {
+		pdwDD = _aadwDD[_iDDUsed++];
+	}
+	else {
+		DBG("DMA descriptor pool exhausted\n");
+		return NULL;
+	}
+	// not serviced, not retired
+	pdwDD[3] = 0;
+	return pdwDD;
+}
+
+
+/**
+	Returns a DMA descriptor slot to the pool
+
+	@param [in] pdwDD	Descriptor, as returned by USBDMAAllocDD
+ */
+void USBDMAFreeDD(volatile U32 *pdwDD)
+{
+	ASSERT((pdwDD >= _aadwDD[0]) && (pdwDD <= _aadwDD[USB_DMA_NUM_DD - 1]));
+
+	pdwDD[0] = (U32)_pdwDDFree;
+	_pdwDDFree = pdwDD;
+}
+
+
+/**
+	Allocates a DMA data buffer
+
+	@return pointer to USB_DMA_BUF_SIZE bytes in USB RAM, aligned to
+	USB_DMA_BUF_ALIGN, or NULL if the pool is exhausted
+ */
+U8 *USBDMAAllocBuf(void)
+{
+	U8 *pbBuf;
+
+	if (_pbBufFree != NULL) {
+		pbBuf = _pbBufFree;
+		_pbBufFree = *(U8 **)pbBuf;
+	}
+	else if (_iBufUsed < USB_DMA_NUM_BUF) {
+		pbBuf = _aabBuf[_iBufUsed++];
+	}
+	else {
+		DBG("DMA buffer pool exhausted\n");
+		return NULL;
+	}
+	return pbBuf;
+}
+
+
+/**
+	Returns a DMA data buffer to the pool
+
+	@param [in] pbBuf	Buffer, as returned by USBDMAAllocBuf
+ */
+void USBDMAFreeBuf(U8 *pbBuf)
+{
+	ASSERT((pbBuf >= _aabBuf[0]) && (pbBuf <= _aabBuf[USB_DMA_NUM_BUF - 1]));
+
+	*(U8 **)pbBuf = _pbBufFree;
+	_pbBufFree = pbBuf;
+}
+
+
+/**
+	Links a DMA descriptor to the next one in a chain
+
+	Sets the Next_DD_Pointer and the next DD valid bit, or clears the
+	next DD valid bit if pdwNext is NULL.
+
+	@param [in] pdwDD	Descriptor
+	@param [in] pdwNext	Next descriptor in the chain, or NULL to end the chain
+ */
+void USBDMAChainDD(volatile U32 *pdwDD, volatile U32 *pdwNext)
+{
+	pdwDD[0] = (U32)pdwNext;
+	if (pdwNext != NULL) {
+		pdwDD[1] |= DD_NEXT_VALID;
+	}
+	else {
+		pdwDD[1] &= ~DD_NEXT_VALID;
+	}
+}
+
+
+/**
+	Gets the next descriptor in a chain
+
+	@param [in] pdwDD	Descriptor
+
+	@return the next descriptor, or NULL if this is the last one
+ */
+volatile U32 *USBDMANextDD(volatile U32 *pdwDD)
+{
+	return (pdwDD[1] & DD_NEXT_VALID) ? (volatile U32 *)pdwDD[0] : NULL;
+}
+
+
+/**
+	Returns all descriptors of a chain to the pool
+
+	The chain must not be circular.
+
+	@param [in] pdwDD	First descriptor of the chain
+ */
+void USBDMAFreeChain(volatile U32 *pdwDD)
+{
+	volatile U32 *pdwNext;
+
+	while (pdwDD != NULL) {
+		pdwNext = USBDMANextDD(pdwDD);
+		USBDMAFreeDD(pdwDD);
+		pdwDD = pdwNext;
+	}
+}
+
@@ -39,9 +39,21 @@
 #ifdef LPC23xx
 #include "lpc23xx.h"
 #endif
+#ifdef LPCSIM
+#include "lpcsim.h"
+#endif
 #include "usbhw_lpc.h"
 #include "usbapi.h"
 
+#ifndef SIM_CPU_CYCLES
+#define SIM_CPU_CYCLES(n)   /**< instruction cost hint for the simulator */
+#endif
+
+/** ARM7TDMI cycles per word of the FIFO copy loops, besides the register access */
+#define CYCLES_WORD_ALIGNED 3   /**< LDR/STR of the buffer word */
+#define CYCLES_WORD_BYTES   20  /**< 4 LDRB, 3 ORR with shift, pointer and loop */
+#define CYCLES_BYTE_LOOP    10  /**< per byte: STRB, shift, index and bound checks */
+
 
 #ifdef DEBUG
 // comment out the following line if you don't want to use debug LEDs
@@ -71,12 +83,134 @@ static TFnEPIntHandler  *_apfnEPIntHandlers[16];
 /** Installed frame interrupt handlers */
 static TFnFrameHandler  *_pfnFrameHandler = NULL;
 
+/** Maximum packet size of each realised endpoint */
+static U16              _awMaxPSize[32];
+
+/** UDCA, used when the application did not install its own */
+static volatile U32     _adwUDCA[32] __attribute__ ((section(".usbdma"), aligned(128)));
+/** Currently installed UDCA */
+static volatile U32     *_pdwUDCA = NULL;
+/** Completion callbacks of submitted transfers */
+static TFnTransferDone  *_apfnTransferDone[32];
+/** Descriptor chains of submitted transfers */
+static volatile U32     *_apdwDDChain[32];
+/** Endpoints with a submitted transfer */
+static U32              _dwDMAEPs = 0;
+/** Endpoints whose slave mode interrupt was turned off for a transfer */
+static U32              _dwDMAIntRestore = 0;
+/** Installed DMA event handlers */
+static TFnDMAIntHandler *_apfnDMAIntHandlers[32];
+/** Endpoints with a DMA event handler */
+static U32              _dwDMAHandlerEPs = 0;
+
+#ifndef USB_EVENT_QUEUE_SIZE
+#define USB_EVENT_QUEUE_SIZE    16      /**< deferred event queue size, power of 2 */
+#endif
+
+/** deferred event types */
+#define EVT_FRAME       0       /**< frame interrupt */
+#define EVT_DEV         1       /**< device status change */
+#define EVT_EP          2       /**< endpoint interrupts, data is the endpoint mask */
+
+/** Events are deferred to USBHwProcessEvents */
+static BOOL             _fDeferred = FALSE;
+/** Deferred event queue, written by the ISR only */
+static U8               _abEvType[USB_EVENT_QUEUE_SIZE];
+static U32              _adwEvData[USB_EVENT_QUEUE_SIZE];
+/** Queue write index, written by the ISR only */
+static volatile U32     _dwEvHead = 0;
+/** Queue read index, written by USBHwProcessEvents only */
+static volatile U32     _dwEvTail = 0;
+/** A frame event is queued, set by the ISR, cleared by USBHwProcessEvents */
+static volatile BOOL    _fEvFrame = FALSE;
+/** The queue overflowed, set by the ISR, cleared by USBHwProcessEvents */
+static volatile BOOL    _fEvOverflow = FALSE;
+/** Queue index and endpoint mask of the last queued endpoint event */
+static U32              _dwEvEPIdx = 0;
+static U32              _dwEvEPMask = 0;
+
+/** Endpoints routed to the fast interrupt */
+static U32              _dwFastEPs = 0;
+/** Nesting depth of SIE command and FIFO sequences in progress */
+static volatile int     _iSIEBusy = 0;
+/** Fast endpoint service postponed until the SIE is free */
+static volatile BOOL    _fFastPending = FALSE;
+
+/** bit position lookup for an isolated bit multiplied by 0x077CB531
+    (de Bruijn sequence), the ARM7TDMI has no count leading zeros */
+static const U8 abBitPos[32] = {
+     0,  1, 28,  2, 29, 14, 24,  3, 30, 22, 20, 15, 25, 17,  4,  8,
+    31, 27, 13, 23, 21, 19, 16,  7, 26, 12, 18,  6, 11,  5, 10,  9
+};
+
 /** convert from endpoint address to endpoint index */
 #define EP2IDX(bEP) ((((bEP)&0xF)<<1)|(((bEP)&0x80)>>7))
 /** convert from endpoint index to endpoint address */
 #define IDX2EP(idx) ((((idx)<<7)&0x80)|(((idx)>>1)&0xF))
+/** physical endpoints with two packet buffers (logical 2,3,5,6,8,9,11,12,14,15) */
+#define EP_DOUBLE_BUF   0xF3CF3CF0
+
+
+
+static void USBHwEPIntHandler(U32 dwEpIntSt);
+
+
+/**
+    Local function to claim the SIE and endpoint FIFOs for a sequence of
+    accesses that must not be interleaved with the fast interrupt
+ */
+static void USBHwSIELock(void)
+{
+    _iSIEBusy++;
+    COMPILER_BARRIER();
+}
+
+
+/**
+    Local function to release the SIE, fast endpoint interrupts that came
+    in meanwhile are serviced right away.
+ */
+static void USBHwSIEUnlock(void)
+{
+    COMPILER_BARRIER();
+    while ((--_iSIEBusy == 0) && _fFastPending) {
+        _iSIEBusy++;
+        _fFastPending = FALSE;
+        USBHwEPIntHandler(USBEpIntSt & _dwFastEPs);
+    }
+}
 
 
+/**
+    Local function to keep the USB interrupt out while state shared with
+    the interrupt handler is changed, using the master enable of the USB
+    block. Can be nested and used from the interrupt handler itself.
+
+    @return the previous enable state, for USBHwIntRestore
+ */
+static U32 USBHwIntDisable(void)
+{
+    U32 dwEnabled;
+
+    dwEnabled = USBIntSt & EN_USB_BITS;
+    // the other bits are read-only
+    USBIntSt = 0;
+    COMPILER_BARRIER();
+    return dwEnabled;
+}
+
+
+/**
+    Local function to restore the USB interrupt enable state
+
+    @param [in] dwEnabled   State returned by USBHwIntDisable
+ */
+static void USBHwIntRestore(U32 dwEnabled)
+{
+    COMPILER_BARRIER();
+    USBIntSt = dwEnabled;
+}
+
 
 /**
     Local function to wait for a device interrupt (and clear it)
@@ -99,11 +233,13 @@ static void Wait4DevInt(U32 dwIntr)
  */
 static void USBHwCmd(U8 bCmd)
 {
+    USBHwSIELock();
     // clear CDFULL/CCEMTY
     USBDevIntClr = CDFULL | CCEMTY;
     // write command code
     USBCmdCode = 0x00000500 | (bCmd << 16);
     Wait4DevInt(CCEMTY);
+    USBHwSIEUnlock();
 }
 
 
@@ -115,12 +251,14 @@ static void USBHwCmd(U8 bCmd)
  */
 static void USBHwCmdWrite(U8 bCmd, U16 bData)
 {
+    USBHwSIELock();
     // write command code
     USBHwCmd(bCmd);
 
     // write command data
     USBCmdCode = 0x00000100 | (bData << 16);
     Wait4DevInt(CCEMTY);
+    USBHwSIEUnlock();
 }
 
 
@@ -133,13 +271,40 @@ static void USBHwCmdWrite(U8 bCmd, U16 bData)
  */
 static U8 USBHwCmdRead(U8 bCmd)
 {
+    U8 bData;
+
+    USBHwSIELock();
     // write command code
     USBHwCmd(bCmd);
     
     // get data
     USBCmdCode = 0x00000200 | (bCmd << 16);
     Wait4DevInt(CDFULL);
-    return USBCmdData;
+    bData = USBCmdData;
+    USBHwSIEUnlock();
+    return bData;
+}
+
+
+/**
+    Local function to send a command to the USB protocol engine and read
+    two bytes of data, without letting the fast interrupt in between
+        
+    @param [in] bCmd        Command to send
+
+    @return the data, first byte in the low half
+ */
+static U16 USBHwCmdRead16(U8 bCmd)
+{
+    U16 wData;
+
+    USBHwSIELock();
+    wData = USBHwCmdRead(bCmd);
+    USBCmdCode = 0x00000200 | (bCmd << 16);
+    Wait4DevInt(CDFULL);
+    wData |= USBCmdData << 8;
+    USBHwSIEUnlock();
+    return wData;
 }
 
 
@@ -156,6 +321,7 @@ static U8 USBHwCmdRead(U8 bCmd)
  */
 static void USBHwEPRealize(int idx, U16 wMaxPSize)
 {
+    _awMaxPSize[idx] = wMaxPSize;
     USBReEp |= (1 << idx);
     USBEpInd = idx;
     USBMaxPSize = wMaxPSize;
@@ -320,6 +486,46 @@ U8  USBHwEPGetStatus(U8 bEP)
 }
 
 
+/**
+    Gets the number of empty packet buffers of an endpoint.
+    
+    Bulk and isochronous endpoints have two packet buffers, the others one.
+    For an IN endpoint this is the number of packets that can be written
+    with USBHwEPWrite without waiting, for an OUT endpoint the number of
+    packets the host can send before it gets NAKed.
+    
+    @param [in] bEP     Endpoint number
+    @return Number of empty buffers (0, 1 or 2)
+ */
+int USBHwEPGetFreeBuffers(U8 bEP)
+{
+    int idx = EP2IDX(bEP);
+    U8  bStat;
+
+    bStat = USBHwCmdRead(CMD_EP_SELECT | idx);
+    if ((EP_DOUBLE_BUF & (1 << idx)) == 0) {
+        return (bStat & EPSTAT_FE) ? 0 : 1;
+    }
+    return 2 - ((bStat & EPSTAT_B1FULL) ? 1 : 0) - ((bStat & EPSTAT_B2FULL) ? 1 : 0);
+}
+
+
+/**
+    Raises the interrupt of an endpoint from software, so its handler is
+    called again from the USB interrupt.
+    
+    This lets an OUT endpoint handler leave a packet in the endpoint when
+    there is no room for it (the host gets NAKed meanwhile), and continue
+    when room is made. It may be called outside the interrupt.
+    
+    @param [in] bEP     Endpoint number
+ */
+void USBHwEPRaiseInt(U8 bEP)
+{
+    USBEpIntSet = (1 << EP2IDX(bEP));
+}
+
+
 /**
     Sets the stalled property of an endpoint
         
@@ -334,6 +540,126 @@ void USBHwEPStall(U8 bEP, BOOL fStall)
 }
 
 
+/**
+    Local function to copy a packet into the TX FIFO of the endpoint
+    selected in USBCtrl.
+    
+    Word aligned buffers are copied a word at a time, with the loop
+    unrolled for a full 64-byte packet. A trailing partial word and
+    unaligned buffers are assembled from bytes. The FIFO takes a word
+    on every write, so WR_EN is not polled in between.
+    
+    @param [in] pbBuf   Packet data
+    @param [in] iLen    Packet length
+ */
+static void USBHwFifoWrite(U8 *pbBuf, int iLen)
+{
+    U32 *pdwBuf;
+    int iWords;
+    
+    iWords = iLen / 4;
+    if (((U32)pbBuf & 3) == 0) {
+        SIM_CPU_CYCLES(iWords * CYCLES_WORD_ALIGNED);
+        pdwBuf = (U32 *)pbBuf;
+        while (iWords >= 16) {
+            USBTxData = pdwBuf[0];  USBTxData = pdwBuf[1];
+            USBTxData = pdwBuf[2];  USBTxData = pdwBuf[3];
+            USBTxData = pdwBuf[4];  USBTxData = pdwBuf[5];
+            USBTxData = pdwBuf[6];  USBTxData = pdwBuf[7];
+            USBTxData = pdwBuf[8];  USBTxData = pdwBuf[9];
+            USBTxData = pdwBuf[10]; USBTxData = pdwBuf[11];
+            USBTxData = pdwBuf[12]; USBTxData = pdwBuf[13];
+            USBTxData = pdwBuf[14]; USBTxData = pdwBuf[15];
+            pdwBuf += 16;
+            iWords -= 16;
+        }
+        while (iWords-- > 0) {
+            USBTxData = *pdwBuf++;
+        }
+        pbBuf = (U8 *)pdwBuf;
+    }
+    else {
+        SIM_CPU_CYCLES(iWords * CYCLES_WORD_BYTES);
+        while (iWords-- > 0) {
+            USBTxData = (pbBuf[3] << 24) | (pbBuf[2] << 16) | (pbBuf[1] << 8) | pbBuf[0];
+            pbBuf += 4;
+        }
+    }
+    
+    // tail
+    switch (iLen & 3) {
+    case 1: USBTxData = pbBuf[0];                                       break;
+    case 2: USBTxData = (pbBuf[1] << 8) | pbBuf[0];                     break;
+    case 3: USBTxData = (pbBuf[2] << 16) | (pbBuf[1] << 8) | pbBuf[0];  break;
+    }
+}
+
+
+/**
+    Local function to copy a packet from the RX FIFO of the endpoint
+    selected in USBCtrl.
+    
+    All words of the packet are read from the FIFO, bytes beyond iMaxLen
+    are discarded. Word aligned buffers large enough for the complete
+    packet are filled a word at a time, with the loop unrolled for a full
+    64-byte packet.
+    
+    @param [out] pbBuf  Packet data, can be NULL to discard the packet
+    @param [in] dwLen   Packet length
+    @param [in] iMaxLen Size of pbBuf
+ */
+static void USBHwFifoRead(U8 *pbBuf, U32 dwLen, int iMaxLen)
+{
+    U32 *pdwBuf;
+    U32 dwData;
+    int i, iWords;
+    
+    iWords = dwLen / 4;
+    if ((pbBuf != NULL) && (((U32)pbBuf & 3) == 0) && ((U32)iMaxLen >= dwLen)) {
+        SIM_CPU_CYCLES(iWords * CYCLES_WORD_ALIGNED);
+        pdwBuf = (U32 *)pbBuf;
+        while (iWords >= 16) {
+            pdwBuf[0] = USBRxData;  pdwBuf[1] = USBRxData;
+            pdwBuf[2] = USBRxData;  pdwBuf[3] = USBRxData;
+            pdwBuf[4] = USBRxData;  pdwBuf[5] = USBRxData;
+            pdwBuf[6] = USBRxData;  pdwBuf[7] = USBRxData;
+            pdwBuf[8] = USBRxData;  pdwBuf[9] = USBRxData;
+            pdwBuf[10] = USBRxData; pdwBuf[11] = USBRxData;
+            pdwBuf[12] = USBRxData; pdwBuf[13] = USBRxData;
+            pdwBuf[14] = USBRxData; pdwBuf[15] = USBRxData;
+            pdwBuf += 16;
+            iWords -= 16;
+        }
+        while (iWords-- > 0) {
+            *pdwBuf++ = USBRxData;
+        }
+        // tail
+        if (dwLen & 3) {
+            dwData = USBRxData;
+            pbBuf = (U8 *)pdwBuf;
+            for (i = 0; i < (int)(dwLen & 3); i++) {
+                pbBuf[i] = dwData & 0xFF;
+                dwData >>= 8;
+            }
+        }
+        return;
+    }
+    
+    // unaligned or truncated
+    SIM_CPU_CYCLES(dwLen * CYCLES_BYTE_LOOP);
+    dwData = 0;
+    for (i = 0; i < (int)dwLen; i++) {
+        if ((i % 4) == 0) {
+            dwData = USBRxData;
+        }
+        if ((pbBuf != NULL) && (i < iMaxLen)) {
+            pbBuf[i] = dwData & 0xFF;
+        }
+        dwData >>= 8;
+    }
+}
+
+
 /**
     Writes data to an endpoint buffer
         
@@ -349,6 +675,8 @@ int USBHwEPWrite(U8 bEP, U8 *pbBuf, int iLen)
     
     idx = EP2IDX(bEP);
     
+    USBHwSIELock();
+
     // set write enable for specific endpoint
     USBCtrl = WR_EN | ((bEP & 0xF) << 2);
     
@@ -356,10 +684,7 @@ int USBHwEPWrite(U8 bEP, U8 *pbBuf, int iLen)
     USBTxPLen = iLen;
     
     // write data
-    while (USBCtrl & WR_EN) {
-        USBTxData = (pbBuf[3] << 24) | (pbBuf[2] << 16) | (pbBuf[1] << 8) | pbBuf[0];
-        pbBuf += 4;
-    }
+    USBHwFifoWrite(pbBuf, iLen);
 
     USBCtrl = 0;
 
@@ -367,6 +692,7 @@ int USBHwEPWrite(U8 bEP, U8 *pbBuf, int iLen)
     USBHwCmd(CMD_EP_SELECT | idx);
     USBHwCmd(CMD_EP_VALIDATE_BUFFER);
     
+    USBHwSIEUnlock();
     return iLen;
 }
 
@@ -383,11 +709,13 @@ int USBHwEPWrite(U8 bEP, U8 *pbBuf, int iLen)
  */
 int USBHwEPRead(U8 bEP, U8 *pbBuf, int iMaxLen)
 {
-    int i, idx;
-    U32 dwData, dwLen;
+    int idx;
+    U32 dwLen;
     
     idx = EP2IDX(bEP);
     
+    USBHwSIELock();
+
     // set read enable bit for specific endpoint
     USBCtrl = RD_EN | ((bEP & 0xF) << 2);
     
@@ -398,6 +726,7 @@ int USBHwEPRead(U8 bEP, U8 *pbBuf, int iMaxLen)
     
     // packet valid?
     if ((dwLen & DV) == 0) {
+        USBHwSIEUnlock();
         return -1;
     }
     
@@ -405,16 +734,7 @@ int USBHwEPRead(U8 bEP, U8 *pbBuf, int iMaxLen)
     dwLen &= PKT_LNGTH_MASK;
     
     // get data
-    dwData = 0;
-    for (i = 0; i < dwLen; i++) {
-        if ((i % 4) == 0) {
-            dwData = USBRxData;
-        }
-        if ((pbBuf != NULL) && (i < iMaxLen)) {
-            pbBuf[i] = dwData & 0xFF;
-        }
-        dwData >>= 8;
-    }
+    USBHwFifoRead(pbBuf, dwLen, iMaxLen);
 
     // make sure RD_EN is clear
     USBCtrl = 0;
@@ -423,6 +743,7 @@ int USBHwEPRead(U8 bEP, U8 *pbBuf, int iMaxLen)
     USBHwCmd(CMD_EP_SELECT | idx);
     USBHwCmd(CMD_EP_CLEAR_BUFFER);
     
+    USBHwSIEUnlock();
     return dwLen;
 }
 
@@ -431,11 +752,13 @@ int USBHwEPRead(U8 bEP, U8 *pbBuf, int iMaxLen)
 
 int USBHwISOCEPRead(const U8 bEP, U8 *pbBuf, const int iMaxLen)
 {
-    int i, idx,q;
-    U32 dwData, dwLen;
+    int idx;
+    U32 dwLen;
 
     idx = EP2IDX(bEP);
 
+    USBHwSIELock();
+
     // set read enable bit for specific endpoint
     USBCtrl = RD_EN | ((bEP & 0xF) << 2);
     
@@ -448,12 +771,14 @@ int USBHwISOCEPRead(const U8 bEP, U8 *pbBuf, const int iMaxLen)
     dwLen = USBRxPLen;
     if( (dwLen & PKT_RDY) == 0 ) {
         USBCtrl = 0;// make sure RD_EN is clear
+        USBHwSIEUnlock();
         return(-1);
     }
 
     // packet valid?
     if ((dwLen & DV) == 0) {
         USBCtrl = 0;// make sure RD_EN is clear
+        USBHwSIEUnlock();
         return -1;
     }
 
@@ -461,16 +786,7 @@ int USBHwISOCEPRead(const U8 bEP, U8 *pbBuf, const int iMaxLen)
     dwLen &= PKT_LNGTH_MASK;
 
     // get data
-    dwData = 0;
-    for (i = 0; i < dwLen; i++) {
-        if ((i % 4) == 0) {
-            dwData = USBRxData;
-        }
-        if ((pbBuf != NULL) && (i < iMaxLen)) {
-            pbBuf[i] = dwData & 0xFF;
-        }
-        dwData >>= 8;
-    }
+    USBHwFifoRead(pbBuf, dwLen, iMaxLen);
 
     // make sure RD_EN is clear
     USBCtrl = 0;
@@ -479,6 +795,7 @@ int USBHwISOCEPRead(const U8 bEP, U8 *pbBuf, const int iMaxLen)
     USBHwCmd(CMD_EP_SELECT | idx);
     USBHwCmd(CMD_EP_CLEAR_BUFFER);
 
+    USBHwSIEUnlock();
     return dwLen;
 }
 
@@ -498,34 +815,617 @@ void USBHwConfigDevice(BOOL fConfigured)
 }
 
 
+/**
+    Local function to enable the DMA interrupts needed by the submitted
+    transfers and the installed DMA event handlers
+ */
+static void USBHwDMAIntUpdate(void)
+{
+    U32 dwEn = 0;
+
+    if ((_dwDMAEPs | _dwDMAHandlerEPs) != 0) {
+        dwEn = DMA_EOT | DMA_ERR;
+    }
+    if (_dwDMAHandlerEPs != 0) {
+        dwEn |= DMA_NDDR;
+    }
+    USBDMAIntEn = dwEn;
+}
+
+
+/**
+    Registers a DMA event handler for an endpoint
+    
+    The handler is called from the interrupt handler with the DMA events
+    of the endpoint (see DMA_STATUS_xxx). It is meant for code that manages
+    its own descriptors, like the isochronous streaming in usbisoc.c.
+    
+    @param [in] bEP         Endpoint number
+    @param [in] pfnHandler  Callback function, NULL to unregister
+ */
+void USBHwRegisterDMAIntHandler(U8 bEP, TFnDMAIntHandler *pfnHandler)
+{
+    int idx = EP2IDX(bEP);
+
+    _apfnDMAIntHandlers[idx] = pfnHandler;
+    if (pfnHandler != NULL) {
+        // discard events left over from earlier use of the endpoint
+        USBEoTIntClr = (1 << idx);
+        USBNDDRIntClr = (1 << idx);
+        USBSysErrIntClr = (1 << idx);
+        _dwDMAHandlerEPs |= (1 << idx);
+    }
+    else {
+        _dwDMAHandlerEPs &= ~(1 << idx);
+    }
+    USBHwDMAIntUpdate();
+}
+
+
+/**
+    Hands a descriptor chain to the DMA engine and enables DMA on an
+    endpoint. A UDCA is installed if the application did not install one.
+    
+    @param [in] bEP     Endpoint number
+    @param [in] pdwDD   First descriptor of the chain, in USB RAM
+ */
+void USBHwEPStartDMA(U8 bEP, volatile U32 *pdwDD)
+{
+    if (_pdwUDCA == NULL) {
+        USBInitializeUSBDMA(_adwUDCA);
+    }
+    USBSetHeadDDForDMA(bEP, _pdwUDCA, pdwDD);
+    USBEnableDMAForEndpoint(bEP);
+}
+
+
+/**
+    Local function to finish a submitted DMA transfer
+    
+    @param [in] idx     Endpoint index
+    @param [in] iLen    Number of bytes transferred, <0 in case of error
+ */
+static void USBHwDMADone(int idx, int iLen)
+{
+    U32 dwBit = (1 << idx);
+    TFnTransferDone *pfnDone;
+
+    USBEpDMADis = dwBit;
+    _dwDMAEPs &= ~dwBit;
+    USBHwDMAIntUpdate();
+    if (_dwDMAIntRestore & dwBit) {
+        _dwDMAIntRestore &= ~dwBit;
+        USBEpIntEn |= dwBit;
+    }
+
+    USBDMAFreeChain(_apdwDDChain[idx]);
+    _apdwDDChain[idx] = NULL;
+
+    pfnDone = _apfnTransferDone[idx];
+    _apfnTransferDone[idx] = NULL;
+    if (pfnDone != NULL) {
+        pfnDone(IDX2EP(idx), iLen);
+    }
+}
+
+
+/**
+    Local function to handle DMA end-of-transfer, new DD request and
+    system error interrupts.
+    
+    Endpoints with a DMA event handler get their events passed on.
+    A submitted transfer is complete when its last descriptor is retired,
+    or when a descriptor retires with a status other than normal completion
+    (e.g. a short packet on an OUT endpoint). DMA interrupts are only
+    enabled while transfers are in progress or handlers are installed;
+    events of other endpoints are acknowledged and ignored.
+ */
+static void USBHwDMAISR(void)
+{
+    U32 dwEoT, dwErr, dwNDDR, dwPending, dwIntBit, dwStat;
+    volatile U32 *pdwDD;
+    int i, iLen;
+    BOOL fDone;
+    U8 bStat;
+
+    dwEoT = USBEoTIntSt;
+    dwErr = USBSysErrIntSt;
+    dwNDDR = (_dwDMAHandlerEPs != 0) ? USBNDDRIntSt : 0;
+    if ((dwEoT | dwErr | dwNDDR) == 0) {
+        return;
+    }
+    USBEoTIntClr = dwEoT;
+    USBSysErrIntClr = dwErr;
+    if (dwNDDR != 0) {
+        USBNDDRIntClr = dwNDDR;
+    }
+
+    // endpoints with their own handler
+    dwPending = (dwEoT | dwErr | dwNDDR) & _dwDMAHandlerEPs;
+    while (dwPending != 0) {
+        dwIntBit = dwPending & -dwPending;
+        dwPending ^= dwIntBit;
+        i = abBitPos[(U32)(dwIntBit * 0x077CB531U) >> 27];
+        bStat = ((dwEoT & dwIntBit) ? DMA_STATUS_EOT : 0) |
+                ((dwNDDR & dwIntBit) ? DMA_STATUS_NDDR : 0) |
+                ((dwErr & dwIntBit) ? DMA_STATUS_ERROR : 0);
+        _apfnDMAIntHandlers[i](IDX2EP(i), bStat);
+    }
+
+    // submitted transfers
+    dwPending = (dwEoT | dwErr) & _dwDMAEPs;
+    while (dwPending != 0) {
+        dwIntBit = dwPending & -dwPending;
+        dwPending ^= dwIntBit;
+        i = abBitPos[(U32)(dwIntBit * 0x077CB531U) >> 27];
+
+        if (dwErr & dwIntBit) {
+            USBHwDMADone(i, -1);
+            continue;
+        }
+
+        // add up the descriptors retired so far
+        iLen = 0;
+        fDone = TRUE;
+        for (pdwDD = _apdwDDChain[i]; pdwDD != NULL; pdwDD = USBDMANextDD(pdwDD)) {
+            dwStat = pdwDD[3];
+            if ((dwStat & DD_RETIRED) == 0) {
+                fDone = FALSE;
+                break;
+            }
+            iLen += DD_COUNT(dwStat);
+            if (DD_STATUS(dwStat) == DD_STATUS_UNDERRUN) {
+                break;
+            }
+            if (DD_STATUS(dwStat) != DD_STATUS_NORMAL) {
+                iLen = -1;
+                break;
+            }
+        }
+        if (fDone) {
+            USBHwDMADone(i, iLen);
+        }
+    }
+}
+
+
+/**
+    Submits a bulk or interrupt transfer to the DMA engine
+    
+    The buffer is described by a chain of DMA descriptors taken from the
+    USB DMA pool (see usbdma.c), the endpoint
+    is switched to DMA mode and pfnDone is called from the interrupt
+    handler when the whole transfer has completed, when a short packet
+    ended an OUT transfer or when the DMA engine reported an error.
+    While the transfer is in progress, no endpoint interrupts are
+    generated for the endpoint.
+    
+    Can be called from main context or from the interrupt handler, the
+    USB interrupt is held off while the descriptor pool and the DMA state
+    are updated.
+    
+    @param [in] bEP     Endpoint number
+    @param [in] pbBuf   Data buffer, must be word aligned and in memory
+                        accessible by the USB DMA engine (USB RAM, see .usbdma)
+    @param [in] iLen    Number of bytes to transfer
+    @param [in] pfnDone Completion callback, receives the number of bytes
+                        transferred or <0 in case of error
+    
+    @return TRUE if the transfer was submitted
+ */
+BOOL USBHwEPSubmit(U8 bEP, U8 *pbBuf, int iLen, TFnTransferDone *pfnDone)
+{
+    int idx, iMaxDD, iChunk;
+    U32 dwBit, dwIntEn;
+    U16 wMaxPSize;
+    volatile U32 *pdwDD, *pdwPrev;
+
+    idx = EP2IDX(bEP);
+    dwBit = (1 << idx);
+    wMaxPSize = _awMaxPSize[idx];
+
+    ASSERT(idx >= 2);
+    ASSERT(((U32)pbBuf & 3) == 0);
+
+    if ((wMaxPSize == 0) || (iLen <= 0)) {
+        return FALSE;
+    }
+
+    dwIntEn = USBHwIntDisable();
+    if (_dwDMAEPs & dwBit) {
+        USBHwIntRestore(dwIntEn);
+        return FALSE;
+    }
+
+    // build descriptor chain, a descriptor covers a whole number of
+    // packets, up to 64k
+    iMaxDD = (0xFFFF / wMaxPSize) * wMaxPSize;
+    _apdwDDChain[idx] = NULL;
+    pdwPrev = NULL;
+    while (iLen > 0) {
+        pdwDD = USBDMAAllocDD();
+        if (pdwDD == NULL) {
+            USBDMAFreeChain(_apdwDDChain[idx]);
+            _apdwDDChain[idx] = NULL;
+            USBHwIntRestore(dwIntEn);
+            return FALSE;
+        }
+        iChunk = MIN(iLen, iMaxDD);
+        USBSetupDMADescriptor(pdwDD, NULL, 0, wMaxPSize, iChunk, pbBuf, NULL);
+        if (pdwPrev == NULL) {
+            _apdwDDChain[idx] = pdwDD;
+        }
+        else {
+            USBDMAChainDD(pdwPrev, pdwDD);
+        }
+        pdwPrev = pdwDD;
+        pbBuf += iChunk;
+        iLen -= iChunk;
+    }
+    _apfnTransferDone[idx] = pfnDone;
+    _dwDMAEPs |= dwBit;
+
+    // slave mode interrupts would keep the DMA engine from being triggered
+    if (USBEpIntEn & dwBit) {
+        _dwDMAIntRestore |= dwBit;
+        USBEpIntEn &= ~dwBit;
+    }
+
+    USBHwDMAIntUpdate();
+    USBHwEPStartDMA(bEP, _apdwDDChain[idx]);
+    USBHwIntRestore(dwIntEn);
+
+    return TRUE;
+}
+
+
+/**
+    Cancels a transfer submitted with USBHwEPSubmit, the completion
+    callback is not called. Like USBHwEPSubmit, this can be called from
+    main context.
+    
+    @param [in] bEP     Endpoint number
+ */
+void USBHwEPCancel(U8 bEP)
+{
+    int idx = EP2IDX(bEP);
+    U32 dwIntEn;
+
+    dwIntEn = USBHwIntDisable();
+    _apfnTransferDone[idx] = NULL;
+    if (_dwDMAEPs & (1 << idx)) {
+        USBHwDMADone(idx, -1);
+    }
+    USBHwIntRestore(dwIntEn);
+}
+
+
+/**
+    Reads the current USB frame number
+    
+    @return the 11-bit number of the last received SOF
+ */
+U16 USBHwGetFrameNumber(void)
+{
+    return USBHwCmdRead16(CMD_DEV_READ_CUR_FRAME_NR) & 0x7FF;
+}
+
+
+/**
+    Local function to handle the device status interrupt
+ */
+static void USBHwDevStatHandler(void)
+{
+    U8  bDevStat, bStat;
+
+    bDevStat = USBHwCmdRead(CMD_DEV_STATUS);
+    if (bDevStat & (CON_CH | SUS_CH | RST)) {
+        // convert device status into something HW independent
+        bStat = ((bDevStat & CON) ? DEV_STATUS_CONNECT : 0) |
+                ((bDevStat & SUS) ? DEV_STATUS_SUSPEND : 0) |
+                ((bDevStat & RST) ? DEV_STATUS_RESET : 0);
+        // call handler
+        if (_pfnDevIntHandler != NULL) {
+DEBUG_LED_ON(8);        
+            _pfnDevIntHandler(bStat);
+DEBUG_LED_OFF(8);       
+        }
+    }
+}
+
+
+/**
+    Local function to handle endpoint interrupts
+    
+    Pending endpoints are serviced in order of endpoint index.
+    
+    @param [in] dwEpIntSt   Endpoints to service
+ */
+static void USBHwEPIntHandler(U32 dwEpIntSt)
+{
+    U32 dwIntBit;
+    U8  bEPStat, bStat;
+    int i;
+
+    // walk only the set bits
+    while (dwEpIntSt != 0) {
+        // lowest pending endpoint first
+        dwIntBit = dwEpIntSt & -dwEpIntSt;
+        dwEpIntSt ^= dwIntBit;
+        i = abBitPos[(U32)(dwIntBit * 0x077CB531U) >> 27];
+        // clear int (and retrieve status)
+        USBHwSIELock();
+        USBEpIntClr = dwIntBit;
+        Wait4DevInt(CDFULL);
+        bEPStat = USBCmdData;
+        USBHwSIEUnlock();
+        // convert EP pipe stat into something HW independent
+        bStat = ((bEPStat & EPSTAT_FE) ? EP_STATUS_DATA : 0) |
+                ((bEPStat & EPSTAT_ST) ? EP_STATUS_STALLED : 0) |
+                ((bEPStat & EPSTAT_STP) ? EP_STATUS_SETUP : 0) |
+                ((bEPStat & EPSTAT_EPN) ? EP_STATUS_NACKED : 0) |
+                ((bEPStat & EPSTAT_PO) ? EP_STATUS_ERROR : 0);
+        // call handler
+        if (_apfnEPIntHandlers[i / 2] != NULL) {
+DEBUG_LED_ON(10);       
+            _apfnEPIntHandlers[i / 2](IDX2EP(i), bStat);
+DEBUG_LED_OFF(10);
+            // Both buffers of an OUT endpoint can fill up behind a single
+            // interrupt, more so in deferred mode. If the handler took one
+            // packet, raise the interrupt again for the other one.
+            if (((i & 1) == 0) &&
+                ((bEPStat & (EPSTAT_B1FULL | EPSTAT_B2FULL)) == (EPSTAT_B1FULL | EPSTAT_B2FULL))) {
+                bEPStat = USBHwCmdRead(CMD_EP_SELECT | i);
+                if ((bEPStat & (EPSTAT_B1FULL | EPSTAT_B2FULL)) != (EPSTAT_B1FULL | EPSTAT_B2FULL)) {
+                    USBEpIntSet = dwIntBit;
+                }
+            }
+        }
+    }
+}
+
+
+/**
+    Local function to queue an event for USBHwProcessEvents
+    
+    @param [in] bType   Event type
+    @param [in] dwData  Event data
+    
+    @return FALSE if the queue is full
+ */
+static BOOL USBHwQueueEvent(U8 bType, U32 dwData)
+{
+    U32 dwHead = _dwEvHead;
+
+    if ((dwHead - _dwEvTail) >= USB_EVENT_QUEUE_SIZE) {
+        _fEvOverflow = TRUE;
+        return FALSE;
+    }
+    _abEvType[dwHead & (USB_EVENT_QUEUE_SIZE - 1)] = bType;
+    _adwEvData[dwHead & (USB_EVENT_QUEUE_SIZE - 1)] = dwData;
+    // publish the entry only after it has been written
+    COMPILER_BARRIER();
+    _dwEvHead = dwHead + 1;
+    return TRUE;
+}
+
+
+/**
+    Local function to record device interrupts in deferred mode
+    
+    Only interrupt status registers are touched here: issuing SIE commands
+    would interfere with the SIE commands of a handler running in the
+    main loop. Endpoint interrupts are left pending in USBEpIntSt, they
+    are cleared (and their status read) by USBHwProcessEvents.
+    
+    @param [in] dwStatus    Device interrupt status
+ */
+static void USBHwDeferEvents(U32 dwStatus)
+{
+    U32 dwEpIntSt;
+
+    dwStatus &= (FRAME | DEV_STAT | EP_SLOW);
+    if (dwStatus == 0) {
+        return;
+    }
+    USBDevIntClr = dwStatus;
+
+    if (dwStatus & DEV_STAT) {
+        USBHwQueueEvent(EVT_DEV, 0);
+    }
+    if (dwStatus & EP_SLOW) {
+        // endpoints covered by a queued event that was not picked up yet
+        // (e.g. repeated NAK interrupts) need no new event
+        dwEpIntSt = USBEpIntSt & ~_dwFastEPs;
+        if (((dwEpIntSt & ~_dwEvEPMask) != 0) ||
+            ((_dwEvEPIdx - _dwEvTail) >= (_dwEvHead - _dwEvTail))) {
+            if (USBHwQueueEvent(EVT_EP, dwEpIntSt)) {
+                _dwEvEPIdx = _dwEvHead - 1;
+                _dwEvEPMask = dwEpIntSt;
+            }
+        }
+    }
+    // frame events are not queued again while one is pending
+    if ((dwStatus & FRAME) && (_pfnFrameHandler != NULL) && !_fEvFrame) {
+        if (USBHwQueueEvent(EVT_FRAME, 0)) {
+            _fEvFrame = TRUE;
+        }
+    }
+}
+
+
+/**
+    Enables or disables deferred event processing
+    
+    In deferred mode, USBHwISR only records frame, device status and
+    endpoint events in a queue; the registered frame, device and endpoint
+    handlers are called from USBHwProcessEvents in the main loop instead.
+    This keeps the interrupt short while handlers do slow work, like
+    accessing a storage device. DMA completion handlers are still called
+    from the interrupt.
+    
+    Events still queued when leaving deferred mode are handled by the next
+    USBHwProcessEvents call.
+    
+    @param [in] fDeferred   TRUE to defer event processing
+ */
+void USBHwSetDeferred(BOOL fDeferred)
+{
+    _fDeferred = fDeferred;
+}
+
+
+/**
+    Processes the events queued by USBHwISR in deferred mode
+    
+    Must be called regularly from the main loop, and not from interrupt
+    context. If the queue overflowed, all device and endpoint interrupt
+    sources are polled, so no event is lost.
+    
+    @return TRUE if any events were processed
+ */
+BOOL USBHwProcessEvents(void)
+{
+    U32 dwTail, dwData;
+    U8  bType;
+    BOOL fProcessed = FALSE;
+
+    dwTail = _dwEvTail;
+    while (dwTail != _dwEvHead) {
+        // read the entry only after seeing the head move
+        COMPILER_BARRIER();
+        bType = _abEvType[dwTail & (USB_EVENT_QUEUE_SIZE - 1)];
+        dwData = _adwEvData[dwTail & (USB_EVENT_QUEUE_SIZE - 1)];
+        // release the entry before its interrupts are cleared, so the
+        // ISR queues a new event for anything arriving from then on
+        COMPILER_BARRIER();
+        _dwEvTail = ++dwTail;
+        COMPILER_BARRIER();
+        fProcessed = TRUE;
+
+        switch (bType) {
+        case EVT_FRAME:
+            _fEvFrame = FALSE;
+            if (_pfnFrameHandler != NULL) {
+                _pfnFrameHandler(USBHwGetFrameNumber());
+            }
+            break;
+        case EVT_DEV:
+            USBHwDevStatHandler();
+            break;
+        case EVT_EP:
+            // endpoints may have been serviced by an earlier event already
+            USBHwEPIntHandler(dwData & USBEpIntSt);
+            break;
+        }
+    }
+
+    if (_fEvOverflow) {
+        _fEvOverflow = FALSE;
+        USBHwDevStatHandler();
+        USBHwEPIntHandler(USBEpIntSt & ~_dwFastEPs);
+        fProcessed = TRUE;
+    }
+    return fProcessed;
+}
+
+
+/**
+    Routes the interrupt of an endpoint to the fast interrupt (EP_FAST)
+    
+    The handlers of fast endpoints are called from USBHwFastISR. This is
+    meant for a few isochronous or interrupt endpoints that need short
+    service latency while bulk traffic keeps the slow interrupt busy.
+    
+    @param [in] bEP     Endpoint number
+    @param [in] fFast   TRUE to route to EP_FAST, FALSE to route to EP_SLOW
+ */
+void USBHwEPSetFast(U8 bEP, BOOL fFast)
+{
+    U32 dwBit = (1 << EP2IDX(bEP));
+
+    if (fFast) {
+        _dwFastEPs |= dwBit;
+    }
+    else {
+        _dwFastEPs &= ~dwBit;
+    }
+    USBEpIntPri = _dwFastEPs;
+    if (_dwFastEPs != 0) {
+        USBDevIntEn |= EP_FAST;
+    }
+}
+
+
+/**
+    USB fast interrupt handler
+    
+    Services the endpoints marked with USBHwEPSetFast. EP_FAST is routed to
+    the high priority USB interrupt request (USB_INT_REQ_HP), which shares
+    VIC channel 22 with the other USB interrupts. Call this first from the
+    regular USB interrupt handler, before USBHwISR. The channel cannot be
+    attached to FIQ, the slow events would then end up in FIQ as well and
+    are never acknowledged there. Latency is best when combined with
+    deferred processing of the slow events (USBHwSetDeferred).
+    
+    If the fast interrupt hits while an SIE command or FIFO access of the
+    rest of the stack is in progress, the endpoints are serviced as soon
+    as that access is complete.
+ */
+void USBHwFastISR(void)
+{
+    if ((USBDevIntSt & EP_FAST) == 0) {
+        return;
+    }
+    USBDevIntClr = EP_FAST;
+
+    if (_iSIEBusy != 0) {
+        _fFastPending = TRUE;
+        return;
+    }
+    _iSIEBusy++;
+    USBHwEPIntHandler(USBEpIntSt & _dwFastEPs);
+    _iSIEBusy--;
+}
+
+
 /**
     USB interrupt handler
         
-    @todo Get all 11 bits of frame number instead of just 8
-
-    Endpoint interrupts are mapped to the slow interrupt
+    Endpoint interrupts are mapped to the slow interrupt, except for the
+    endpoints marked fast with USBHwEPSetFast which are serviced by
+    USBHwFastISR. Pending endpoints are serviced in order of endpoint index.
+    In deferred mode (see USBHwSetDeferred), events are only recorded.
  */
 void USBHwISR(void)
 {
     U32 dwStatus;
-    U32 dwIntBit;
-    U8  bEPStat, bDevStat, bStat;
-    int i;
     U16 wFrame;
 
 // LED9 monitors total time in interrupt routine
 DEBUG_LED_ON(9);
 
+    // DMA interrupts
+    if ((_dwDMAEPs | _dwDMAHandlerEPs) != 0) {
+        USBHwDMAISR();
+    }
+
     // handle device interrupts
     dwStatus = USBDevIntSt;
     
+    if (_fDeferred) {
+        USBHwDeferEvents(dwStatus);
+DEBUG_LED_OFF(9);
+        return;
+    }
+    
     // frame interrupt
     if (dwStatus & FRAME) {
         // clear int
         USBDevIntClr = FRAME;
         // call handler
         if (_pfnFrameHandler != NULL) {
-            wFrame = USBHwCmdRead(CMD_DEV_READ_CUR_FRAME_NR);
+            wFrame = USBHwGetFrameNumber();
             _pfnFrameHandler(wFrame);
         }
     }
@@ -537,47 +1437,16 @@ DEBUG_LED_ON(9);
             LPC2148 User manual revision 2, 25 july 2006.
         */
         USBDevIntClr = DEV_STAT;
-        bDevStat = USBHwCmdRead(CMD_DEV_STATUS);
-        if (bDevStat & (CON_CH | SUS_CH | RST)) {
-            // convert device status into something HW independent
-            bStat = ((bDevStat & CON) ? DEV_STATUS_CONNECT : 0) |
-                    ((bDevStat & SUS) ? DEV_STATUS_SUSPEND : 0) |
-                    ((bDevStat & RST) ? DEV_STATUS_RESET : 0);
-            // call handler
-            if (_pfnDevIntHandler != NULL) {
-DEBUG_LED_ON(8);        
-                _pfnDevIntHandler(bStat);
-DEBUG_LED_OFF(8);       
-            }
-        }
+        USBHwDevStatHandler();
     }
     
     // endpoint interrupt
     if (dwStatus & EP_SLOW) {
         // clear EP_SLOW
         USBDevIntClr = EP_SLOW;
-        // check all endpoints
-        for (i = 0; i < 32; i++) {
-            dwIntBit = (1 << i);
-            if (USBEpIntSt & dwIntBit) {
-                // clear int (and retrieve status)
-                USBEpIntClr = dwIntBit;
-                Wait4DevInt(CDFULL);
-                bEPStat = USBCmdData;
-                // convert EP pipe stat into something HW independent
-                bStat = ((bEPStat & EPSTAT_FE) ? EP_STATUS_DATA : 0) |
-                        ((bEPStat & EPSTAT_ST) ? EP_STATUS_STALLED : 0) |
-                        ((bEPStat & EPSTAT_STP) ? EP_STATUS_SETUP : 0) |
-                        ((bEPStat & EPSTAT_EPN) ? EP_STATUS_NACKED : 0) |
-                        ((bEPStat & EPSTAT_PO) ? EP_STATUS_ERROR : 0);
-                // call handler
-                if (_apfnEPIntHandlers[i / 2] != NULL) {
-DEBUG_LED_ON(10);       
-                    _apfnEPIntHandlers[i / 2](IDX2EP(i), bStat);
-DEBUG_LED_OFF(10);
-                }
-            }
-        }
+        // take a snapshot of the pending endpoints.
+        // Interrupts arriving meanwhile set EP_SLOW again.
+        USBHwEPIntHandler(USBEpIntSt & ~_dwFastEPs);
     }
     
 DEBUG_LED_OFF(9);       
@@ -669,7 +1538,7 @@ BOOL USBHwInit(void)
     // disable/clear all interrupts for now
     USBDevIntEn = 0;
     USBDevIntClr = 0xFFFFFFFF;
-    USBDevIntPri = 0;
+    USBDevIntPri = EP_FAST;     // fast endpoints on the high priority request
 
     USBEpIntEn = 0;
     USBEpIntClr = 0xFFFFFFFF;
@@ -787,7 +1656,7 @@ void USBInitializeISOCFrameArray(U32 isocFrameArr[], const U32 numElements, cons
 
     @return 
  */
-void USBSetHeadDDForDMA(const U8 bEp, volatile U32* udcaHeadArray[32], volatile const U32 *dmaDescriptorPtr) {
+void USBSetHeadDDForDMA(const U8 bEp, volatile U32 udcaHeadArray[32], volatile const U32 *dmaDescriptorPtr) {
 	udcaHeadArray[EP2IDX(bEp)] = (U32) dmaDescriptorPtr;
 }
 
@@ -798,13 +1667,14 @@ void USBSetHeadDDForDMA(const U8 bEp, volatile U32* udcaHeadArray[32], volatile
 
     @return 
  */
-void USBInitializeUSBDMA(volatile U32* udcaHeadArray[32]) {
+void USBInitializeUSBDMA(volatile U32 udcaHeadArray[32]) {
 	//set following 32 pointers to be null
 	int i;
 	for(i = 0; i < 32; i++ ) {
-		udcaHeadArray[i] = NULL;
+		udcaHeadArray[i] = 0;
 	}
 	USBUDCAH = (U32) udcaHeadArray;
+	_pdwUDCA = udcaHeadArray;
 }
 
 
@@ -64,6 +64,28 @@
 #define WR_EN						(1<<1)
 #define LOG_ENDPOINT				(1<<2)
 
+/* USBDMAIntSt/USBDMAIntEn bits */
+#define DMA_EOT						(1<<0)
+#define DMA_NDDR					(1<<1)
+#define DMA_ERR						(1<<2)
+
+/* DMA descriptor control word (DD[1]) */
+#define DD_NEXT_VALID				(1<<2)
+#define DD_ISO						(1<<4)
+#define DD_MPS_SHIFT				5
+#define DD_LEN_SHIFT				16
+
+/* DMA descriptor status word (DD[3]) */
+#define DD_RETIRED					(1<<0)
+#define DD_STATUS(x)				(((x)>>1)&0xF)
+#define DD_STATUS_NOT_SERVICED		0
+#define DD_STATUS_BEING_SERVICED	1
+#define DD_STATUS_NORMAL			2
+#define DD_STATUS_UNDERRUN			3
+#define DD_STATUS_OVERRUN			8
+#define DD_STATUS_SYSTEM_ERROR		9
+#define DD_COUNT(x)					((x)>>16)
+
 /* protocol engine command codes */
 	/* device commands */
 #define CMD_DEV_SET_ADDRESS			0xD0
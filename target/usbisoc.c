@@ -0,0 +1,322 @@
+/*
+	LPCUSB, an USB device driver for LPC microcontrollers
+	Copyright (C) 2006 Bertrik Sikken (bertrik@sikken.nl)
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+	3. The name of the author may not be used to endorse or promote products
+	   derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+	IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+	OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+	IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+	INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+	NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+	DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+	THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+	THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/** @file
+	Continuous isochronous streaming through the DMA engine
+
+	A stream keeps a circular chain of DMA descriptors, each covering a
+	fixed number of frames. The DMA engine walks around the ring on its
+	own; every time a descriptor is retired, the application handler is
+	called to consume its data (OUT) or to produce new data (IN), after
+	which the descriptor is armed again. As long as the handler keeps up,
+	no frame is lost and there is no per-frame work for the CPU.
+
+	If the interrupt is held off for longer than the ring lasts, the
+	engine finds a retired descriptor and raises a new DD request. This is
+	counted as a late event, the frames lost until the ring is armed again
+	are counted as missed.
+
+	Descriptors come from the USB DMA pool, frame arrays are kept here.
+	The data buffer is supplied by the application and must be in USB RAM.
+ */
+
+#include "type.h"
+#include "debug.h"
+
+#include "usbapi.h"
+#include "usbhw_lpc.h"
+
+
+#ifndef USB_ISOC_NUM_STREAMS
+#define USB_ISOC_NUM_STREAMS	2	/**< number of concurrent streams */
+#endif
+#ifndef USB_ISOC_MAX_DESCS
+#define USB_ISOC_MAX_DESCS		4	/**< maximum descriptors in a ring */
+#endif
+#ifndef USB_ISOC_MAX_FRAMES
+#define USB_ISOC_MAX_FRAMES		8	/**< maximum frames per descriptor */
+#endif
+
+/** frame numbers are 11 bits wide */
+#define FRAME_MASK		0x7FF
+
+
+/** isochronous stream state */
+typedef struct {
+	U8				bEP;			/**< endpoint, 0 if the stream is unused */
+	U8				*pbBuf;			/**< data buffer */
+	int				iFrameSize;		/**< maximum bytes per frame */
+	int				iFrames;		/**< frames per descriptor */
+	int				iDescs;			/**< descriptors in the ring */
+	int				iNext;			/**< next descriptor to retire */
+	U16				wExpect;		/**< frame the engine services next */
+	TFnIsocHandler	*pfnHandler;	/**< application handler */
+	volatile U32	*apdwDD[USB_ISOC_MAX_DESCS];	/**< descriptor ring */
+	TIsocStats		Stats;			/**< statistics */
+} TIsocStream;
+
+static TIsocStream	_aStreams[USB_ISOC_NUM_STREAMS];
+
+/** frame arrays */
+static U32	_aadwFrames[USB_ISOC_NUM_STREAMS][USB_ISOC_MAX_DESCS * USB_ISOC_MAX_FRAMES]
+	__attribute__ ((section(".usbdma"), aligned(4)));
+
+
+/**
+	Local function to find the stream of an endpoint
+
+	@param [in] bEP		Endpoint number, 0 to find a free stream
+
+	@return stream index, or -1 if not found
+ */
+static int IsocFind(U8 bEP)
+{
+	int i;
+
+	for (i = 0; i < USB_ISOC_NUM_STREAMS; i++) {
+		if (_aStreams[i].bEP == bEP) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/**
+	Local function to get a descriptor of a stream ready for the engine
+
+	IN descriptors are offered to the application to be filled first,
+	the status word is cleared last so the engine never sees a half
+	prepared descriptor. The engine moves the buffer and packet size
+	pointers of a descriptor forward as packets complete, so they are
+	set again as well.
+
+	@param [in] iStream	Stream index
+	@param [in] iDesc	Descriptor index in the ring
+ */
+static void IsocArm(int iStream, int iDesc)
+{
+	TIsocStream	*pStream = &_aStreams[iStream];
+	U32			*pdwFrames;
+	U8			*pbBuf;
+	int			i;
+
+	pdwFrames = &_aadwFrames[iStream][iDesc * pStream->iFrames];
+	pbBuf = pStream->pbBuf + iDesc * pStream->iFrames * pStream->iFrameSize;
+	if (pStream->bEP & 0x80) {
+		for (i = 0; i < pStream->iFrames; i++) {
+			pdwFrames[i] = ISOC_FRAME_VALID | pStream->iFrameSize;
+		}
+		pStream->pfnHandler(pStream->bEP, pbBuf, pdwFrames, pStream->iFrames);
+	}
+	else {
+		for (i = 0; i < pStream->iFrames; i++) {
+			pdwFrames[i] = 0;
+		}
+	}
+	pStream->apdwDD[iDesc][2] = (U32)pbBuf;
+	pStream->apdwDD[iDesc][4] = (U32)pdwFrames;
+	pStream->apdwDD[iDesc][3] = 0;
+}
+
+
+/**
+	Local function to handle the DMA events of a stream
+
+	Retired descriptors are handed to the application and armed again,
+	in ring order.
+
+	@param [in] bEP			Endpoint number
+	@param [in] bDMAStat	DMA events
+ */
+static void IsocDMAIntHandler(U8 bEP, U8 bDMAStat)
+{
+	TIsocStream	*pStream;
+	int			iStream, iDesc, iMissed;
+	U8			*pbBuf;
+
+	iStream = IsocFind(bEP);
+	if (iStream < 0) {
+		return;
+	}
+	pStream = &_aStreams[iStream];
+
+	iDesc = pStream->iNext;
+	while (pStream->apdwDD[iDesc][3] & DD_RETIRED) {
+		if (!(bEP & 0x80)) {
+			pbBuf = pStream->pbBuf + iDesc * pStream->iFrames * pStream->iFrameSize;
+			pStream->pfnHandler(bEP, pbBuf, &_aadwFrames[iStream][iDesc * pStream->iFrames],
+								pStream->iFrames);
+		}
+		IsocArm(iStream, iDesc);
+		pStream->Stats.dwDone++;
+		pStream->wExpect = (pStream->wExpect + pStream->iFrames) & FRAME_MASK;
+		if (++iDesc == pStream->iDescs) {
+			iDesc = 0;
+		}
+	}
+	pStream->iNext = iDesc;
+
+	if (bDMAStat & DMA_STATUS_NDDR) {
+		// the engine ran into a retired descriptor, it restarts on the
+		// next frame now that the ring is armed again
+		iMissed = (USBHwGetFrameNumber() + 1 - pStream->wExpect) & FRAME_MASK;
+		if ((iMissed > 0) && (iMissed < (FRAME_MASK / 2))) {
+			pStream->Stats.dwLate++;
+			pStream->Stats.dwMissed += iMissed;
+			pStream->wExpect = (pStream->wExpect + iMissed) & FRAME_MASK;
+		}
+	}
+}
+
+
+/**
+	Starts continuous isochronous streaming on an endpoint
+
+	The data buffer holds iDescs * iFrames * iFrameSize bytes, each
+	descriptor uses its own part of it. The handler is called from the
+	interrupt handler with the data and the frame array of a descriptor:
+	* for an OUT endpoint after the descriptor was filled, the frame array
+	  holds the length of each received packet, packets follow each other
+	  in the buffer without gaps,
+	* for an IN endpoint before the descriptor is armed, the frame array
+	  holds the length of each packet to send (iFrameSize by default) and
+	  may be changed by the handler.
+	IN handlers are called for every descriptor before streaming starts.
+
+	@param [in] bEP			Isochronous endpoint
+	@param [in] pbBuf		Data buffer, word aligned in USB RAM
+	@param [in] iFrameSize	Maximum number of bytes per frame
+	@param [in] iFrames		Frames per descriptor, up to USB_ISOC_MAX_FRAMES
+	@param [in] iDescs		Descriptors in the ring, 2 to USB_ISOC_MAX_DESCS
+	@param [in] pfnHandler	Descriptor handler
+
+	@return TRUE if streaming was started
+ */
+BOOL USBIsocStart(U8 bEP, U8 *pbBuf, int iFrameSize, int iFrames, int iDescs,
+				  TFnIsocHandler *pfnHandler)
+{
+	TIsocStream	*pStream;
+	int			iStream, i;
+
+	ASSERT(((U32)pbBuf & 3) == 0);
+	ASSERT((iFrames > 0) && (iFrames <= USB_ISOC_MAX_FRAMES));
+	ASSERT((iDescs >= 2) && (iDescs <= USB_ISOC_MAX_DESCS));
+	ASSERT(pfnHandler != NULL);
+
+	if (IsocFind(bEP) >= 0) {
+		return FALSE;
+	}
+	iStream = IsocFind(0);
+	if (iStream < 0) {
+		DBG("No free isochronous stream\n");
+		return FALSE;
+	}
+	pStream = &_aStreams[iStream];
+	pStream->pbBuf = pbBuf;
+	pStream->iFrameSize = iFrameSize;
+	pStream->iFrames = iFrames;
+	pStream->iDescs = iDescs;
+	pStream->iNext = 0;
+	pStream->pfnHandler = pfnHandler;
+	pStream->Stats.dwDone = 0;
+	pStream->Stats.dwLate = 0;
+	pStream->Stats.dwMissed = 0;
+
+	// build the ring
+	for (i = 0; i < iDescs; i++) {
+		pStream->apdwDD[i] = USBDMAAllocDD();
+		if (pStream->apdwDD[i] == NULL) {
+			while (--i >= 0) {
+				USBDMAFreeDD(pStream->apdwDD[i]);
+			}
+			return FALSE;
+		}
+	}
+	pStream->bEP = bEP;
+	for (i = 0; i < iDescs; i++) {
+		USBSetupDMADescriptor(pStream->apdwDD[i], pStream->apdwDD[(i + 1) % iDescs],
+							  1, iFrameSize, iFrames,
+							  pbBuf + i * iFrames * iFrameSize,
+							  &_aadwFrames[iStream][i * iFrames]);
+		IsocArm(iStream, i);
+	}
+
+	pStream->wExpect = (USBHwGetFrameNumber() + 1) & FRAME_MASK;
+	USBHwRegisterDMAIntHandler(bEP, IsocDMAIntHandler);
+	USBHwEPStartDMA(bEP, pStream->apdwDD[0]);
+
+	return TRUE;
+}
+
+
+/**
+	Stops isochronous streaming on an endpoint
+
+	@param [in] bEP		Isochronous endpoint
+ */
+void USBIsocStop(U8 bEP)
+{
+	TIsocStream	*pStream;
+	int			iStream, i;
+
+	iStream = IsocFind(bEP);
+	if (iStream < 0) {
+		return;
+	}
+	pStream = &_aStreams[iStream];
+
+	USBDisableDMAForEndpoint(bEP);
+	USBHwRegisterDMAIntHandler(bEP, NULL);
+	for (i = 0; i < pStream->iDescs; i++) {
+		USBDMAFreeDD(pStream->apdwDD[i]);
+	}
+	pStream->bEP = 0;
+}
+
+
+/**
+	Gets the statistics of an isochronous stream
+
+	@param [in] bEP			Isochronous endpoint
+	@param [out] pStats		Statistics
+
+	@return TRUE if the endpoint is streaming
+ */
+BOOL USBIsocGetStats(U8 bEP, TIsocStats *pStats)
+{
+	int iStream;
+
+	iStream = IsocFind(bEP);
+	if (iStream < 0) {
+		return FALSE;
+	}
+	*pStats = _aStreams[iStream].Stats;
+	return TRUE;
+}
+
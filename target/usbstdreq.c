@@ -52,6 +52,14 @@
 
 #define MAX_DESC_HANDLERS	4		/**< device, interface, endpoint, other */
 
+#ifndef USB_MAX_DESC_INDEX
+#define USB_MAX_DESC_INDEX	48		/**< max number of indexed descriptors */
+#endif
+#ifndef USB_MAX_EP_INDEX
+#define USB_MAX_EP_INDEX	32		/**< max number of indexed endpoint descriptors */
+#endif
+#define NUM_INDEXED_TYPES	16		/**< descriptor types 0..15 are indexed */
+
 
 /* general descriptor field offsets */
 #define DESC_bLength					0	/**< length offset */
@@ -77,16 +85,166 @@ static TFnHandleRequest	*pfnHandleCustomReq = NULL;
 /** Pointer to registered descriptors */
 static const U8			*pabDescrip = NULL;
 
+/** Endpoint of a configuration/alternate setting, as found in the descriptors */
+typedef struct {
+	U8	bConfig;		/**< bConfigurationValue */
+	U8	bAltSetting;	/**< bAlternateSetting */
+	U8	bEP;			/**< bEndpointAddress */
+	U16	wMaxPktSize;	/**< wMaxPacketSize */
+} TEPIndex;
+
+/** TRUE if the descriptor index below describes pabDescrip */
+static BOOL				fIndexValid = FALSE;
+/** Start of each descriptor type in awDescOffset, entry n+1 is the end */
+static U8				abTypeStart[NUM_INDEXED_TYPES + 1];
+/** Offsets of the descriptors of types 0..15, grouped by type */
+static U16				awDescOffset[USB_MAX_DESC_INDEX];
+/** Endpoints, sorted by configuration and alternate setting */
+static TEPIndex			aEPIndex[USB_MAX_EP_INDEX];
+/** Number of entries in aEPIndex */
+static int				iNumEPs = 0;
+
+
+/**
+	Local function to build the descriptor index.
+	
+	Two passes over the descriptors: the first one counts the descriptors
+	of each type, the second one stores their offsets. Endpoint descriptors
+	are also collected with the configuration value and alternate setting
+	they belong to, sorted so all endpoints of one configuration/alternate
+	setting are adjacent.
+	If the descriptors do not fit, the index is marked invalid and lookups
+	fall back to walking the descriptors.
+ */
+static void USBBuildDescIndex(void)
+{
+	const U8	*pab;
+	U8			abCount[NUM_INDEXED_TYPES];
+	U8			bType, bCurConfig, bCurAltSetting;
+	int			i, iTotal;
+	U16			wOffset;
+
+	fIndexValid = FALSE;
+	iNumEPs = 0;
+
+	// count descriptors per type
+	for (i = 0; i < NUM_INDEXED_TYPES; i++) {
+		abCount[i] = 0;
+	}
+	iTotal = 0;
+	for (pab = pabDescrip; pab[DESC_bLength] != 0; pab += pab[DESC_bLength]) {
+		bType = pab[DESC_bDescriptorType];
+		if (bType < NUM_INDEXED_TYPES) {
+			if (++iTotal > USB_MAX_DESC_INDEX) {
+				DBG("Descriptor index full, using linear lookup\n");
+				return;
+			}
+			abCount[bType]++;
+		}
+	}
+
+	// start of each type
+	abTypeStart[0] = 0;
+	for (i = 0; i < NUM_INDEXED_TYPES; i++) {
+		abTypeStart[i + 1] = abTypeStart[i] + abCount[i];
+		abCount[i] = abTypeStart[i];
+	}
+
+	// store offsets and collect endpoints
+	bCurConfig = 0xFF;
+	bCurAltSetting = 0xFF;
+	for (pab = pabDescrip; pab[DESC_bLength] != 0; pab += pab[DESC_bLength]) {
+		bType = pab[DESC_bDescriptorType];
+		if (bType >= NUM_INDEXED_TYPES) {
+			continue;
+		}
+		wOffset = pab - pabDescrip;
+		awDescOffset[abCount[bType]++] = wOffset;
+
+		switch (bType) {
+
+		case DESC_CONFIGURATION:
+			bCurConfig = pab[CONF_DESC_bConfigurationValue];
+			break;
+
+		case DESC_INTERFACE:
+			bCurAltSetting = pab[INTF_DESC_bAlternateSetting];
+			break;
+
+		case DESC_ENDPOINT:
+			if (iNumEPs == USB_MAX_EP_INDEX) {
+				DBG("Endpoint index full, using linear lookup\n");
+				return;
+			}
+			// insert after the last entry of the same configuration/altsetting
+			for (i = iNumEPs; i > 0; i--) {
+				if ((aEPIndex[i - 1].bConfig < bCurConfig) ||
+					((aEPIndex[i - 1].bConfig == bCurConfig) &&
+					 (aEPIndex[i - 1].bAltSetting <= bCurAltSetting))) {
+					break;
+				}
+				aEPIndex[i] = aEPIndex[i - 1];
+			}
+			aEPIndex[i].bConfig = bCurConfig;
+			aEPIndex[i].bAltSetting = bCurAltSetting;
+			aEPIndex[i].bEP = pab[ENDP_DESC_bEndpointAddress];
+			aEPIndex[i].wMaxPktSize = (pab[ENDP_DESC_wMaxPacketSize]) |
+									  (pab[ENDP_DESC_wMaxPacketSize + 1] << 8);
+			iNumEPs++;
+			break;
+
+		default:
+			break;
+		}
+	}
+	fIndexValid = TRUE;
+}
+
 
 /**
 	Registers a pointer to a descriptor block containing all descriptors
 	for the device.
+	
+	An index of the descriptors is built here, so the descriptor block
+	must not change after registration.
 
 	@param [in]	pabDescriptors	The descriptor byte array
  */
 void USBRegisterDescriptors(const U8 *pabDescriptors)
 {
 	pabDescrip = pabDescriptors;
+	USBBuildDescIndex();
+}
+
+
+/**
+	Local function to find a descriptor by walking the descriptor block,
+	for descriptor types that are not indexed.
+	
+	@param [in]		bType		Descriptor type
+	@param [in]		bIndex		Descriptor index
+	
+	@return pointer to the descriptor, or NULL if not found
+ */
+static U8 *USBFindDescriptor(U8 bType, U8 bIndex)
+{
+	U8	*pab;
+	int iCurIndex;
+	
+	pab = (U8 *)pabDescrip;
+	iCurIndex = 0;
+	
+	while (pab[DESC_bLength] != 0) {
+		if (pab[DESC_bDescriptorType] == bType) {
+			if (iCurIndex == bIndex) {
+				return pab;
+			}
+			iCurIndex++;
+		}
+		// skip to next descriptor
+		pab += pab[DESC_bLength];
+	}
+	return NULL;
 }
 
 
@@ -105,41 +263,42 @@ BOOL USBGetDescriptor(U16 wTypeIndex, U16 wLangID, int *piLen, U8 **ppbData)
 {
 	U8	bType, bIndex;
 	U8	*pab;
-	int iCurIndex;
 	
 	ASSERT(pabDescrip != NULL);
 
 	bType = GET_DESC_TYPE(wTypeIndex);
 	bIndex = GET_DESC_INDEX(wTypeIndex);
 	
-	pab = (U8 *)pabDescrip;
-	iCurIndex = 0;
-	
-	while (pab[DESC_bLength] != 0) {
-		if (pab[DESC_bDescriptorType] == bType) {
-			if (iCurIndex == bIndex) {
-				// set data pointer
-				*ppbData = pab;
-				// get length from structure
-				if (bType == DESC_CONFIGURATION) {
-					// configuration descriptor is an exception, length is at offset 2 and 3
-					*piLen =	(pab[CONF_DESC_wTotalLength]) |
-								(pab[CONF_DESC_wTotalLength + 1] << 8);
-				}
-				else {
-					// normally length is at offset 0
-					*piLen = pab[DESC_bLength];
-				}
-				return TRUE;
-			}
-			iCurIndex++;
+	if (fIndexValid && (bType < NUM_INDEXED_TYPES)) {
+		// look up in index
+		pab = NULL;
+		if (bIndex < (abTypeStart[bType + 1] - abTypeStart[bType])) {
+			pab = (U8 *)pabDescrip + awDescOffset[abTypeStart[bType] + bIndex];
 		}
-		// skip to next descriptor
-		pab += pab[DESC_bLength];
 	}
-	// nothing found
-	DBG("Desc %x not found!\n", wTypeIndex);
-	return FALSE;
+	else {
+		pab = USBFindDescriptor(bType, bIndex);
+	}
+	
+	if (pab == NULL) {
+		// nothing found
+		DBG("Desc %x not found!\n", wTypeIndex);
+		return FALSE;
+	}
+
+	// set data pointer
+	*ppbData = pab;
+	// get length from structure
+	if (bType == DESC_CONFIGURATION) {
+		// configuration descriptor is an exception, length is at offset 2 and 3
+		*piLen =	(pab[CONF_DESC_wTotalLength]) |
+					(pab[CONF_DESC_wTotalLength + 1] << 8);
+	}
+	else {
+		// normally length is at offset 0
+		*piLen = pab[DESC_bLength];
+	}
+	return TRUE;
 }
 
 
@@ -161,6 +320,7 @@ static BOOL USBSetConfiguration(U8 bConfigIndex, U8 bAltSetting)
 	U8	bCurConfig, bCurAltSetting;
 	U8	bEP;
 	U16	wMaxPktSize;
+	int	i;
 	
 	ASSERT(pabDescrip != NULL);
 
@@ -168,6 +328,26 @@ static BOOL USBSetConfiguration(U8 bConfigIndex, U8 bAltSetting)
 		// unconfigure device
 		USBHwConfigDevice(FALSE);
 	}
+	else if (fIndexValid) {
+		// skip to the endpoints of this configuration/altsetting
+		for (i = 0; i < iNumEPs; i++) {
+			if ((aEPIndex[i].bConfig == bConfigIndex) &&
+				(aEPIndex[i].bAltSetting == bAltSetting)) {
+				break;
+			}
+		}
+		// and configure them
+		for (; i < iNumEPs; i++) {
+			if ((aEPIndex[i].bConfig != bConfigIndex) ||
+				(aEPIndex[i].bAltSetting != bAltSetting)) {
+				break;
+			}
+			USBHwEPConfig(aEPIndex[i].bEP, aEPIndex[i].wMaxPktSize);
+		}
+		
+		// configure device
+		USBHwConfigDevice(TRUE);
+	}
 	else {
 		// configure endpoints for this configuration/altsetting
 		pab = (U8 *)pabDescrip;